@@ -0,0 +1,269 @@
+// Frame Pacing
+// Caps the render loop by vsync, a target rate or an adaptive rate, and measures CPU busy time and jitter
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#pragma comment(lib, "winmm.lib")
+#endif
+
+#define FRAME_PACER_DEFAULT_RATE 60.0
+#define FRAME_PACER_DEFAULT_IDLE_RATE 10.0
+// Adaptive mode halves the rate after every this many seconds without change
+#define FRAME_PACER_IDLE_DELAY 0.5
+
+/**********************************************************************************\
+*
+* Call endFrame() right after SwapBuffers every frame; it waits until the next
+* frame is due. Waiting sleeps in 1 ms slices while the deadline is further away
+* than the measured sleep overshoot, then spins the rest, so the wake-up lands on
+* time without spinning for the whole frame.
+*
+* CPU busy = (work + spin) / wall time. Work is the time from the end of the last
+* wait to endFrame(), SwapBuffers included, so a driver that busy-waits for vsync
+* is counted as busy.
+*
+* With an event wait set (e.g. glfwWaitEventsTimeout), the 1 ms slices wait on
+* window events instead, and the frame starts as soon as the wait reports input.
+*
+\**********************************************************************************/
+
+namespace FramePacing
+{
+	typedef std::chrono::steady_clock Clock;
+
+	enum Mode
+	{
+		Unlimited,	// no waiting, swap interval 0
+		Vsync,		// the swap blocks, swap interval 1
+		Target,		// fixed target rate
+		Adaptive	// target rate while something changes, slowing down to the idle rate otherwise
+	};
+
+	inline const char * getModeName(Mode _mode)
+	{
+		switch (_mode)
+		{
+		case Unlimited: return "off";
+		case Vsync: return "vsync";
+		case Target: return "target";
+		default: return "adaptive";
+		}
+	}
+
+	inline bool parseMode(const std::string & _name, Mode & _mode)
+	{
+		for (int m = Unlimited; m <= Adaptive; m++)
+			if (_name == getModeName(Mode(m)))
+			{
+				_mode = Mode(m);
+				return true;
+			}
+		return false;
+	}
+
+	// Waits up to _timeout seconds for window events; true if input arrived
+	typedef std::function<bool(double _timeout)> EventWait;
+
+	class Pacer
+	{
+	private:
+		Mode mode;
+		EventWait eventWait;
+		double targetRate;
+		double idleRate;
+		double rate;
+
+		Clock::time_point frameStart;
+		Clock::time_point deadline;
+		Clock::time_point lastChange;
+
+		// running mean and variance of how long a 1 ms sleep really takes
+		double sleepMean;
+		double sleepVariance;
+
+		unsigned long long frames;
+		unsigned long long lateFrames;
+		unsigned long long wokenFrames;
+		double workTime;
+		double sleepTime;
+		double spinTime;
+		double frameTimeSum;
+		double frameTimeSquareSum;
+		double frameTimeMax;
+		double wakeErrorSum;
+		double wakeErrorMax;
+
+		static double seconds(Clock::duration _duration)
+		{
+			return std::chrono::duration<double>(_duration).count();
+		}
+
+		// Rate for the coming frame, 0 when the loop is not throttled here
+		double currentRate(bool _changed, Clock::time_point _now)
+		{
+			if (mode == Target) return targetRate;
+			if (mode != Adaptive) return 0.0;
+			if (_changed) lastChange = _now;
+			double halvings = std::floor(seconds(_now - lastChange) / FRAME_PACER_IDLE_DELAY);
+			return std::max(idleRate, targetRate / std::pow(2.0, std::min(halvings, 16.0)));
+		}
+
+		// False if the event wait cut the wait short
+		bool waitUntil(Clock::time_point _deadline)
+		{
+			Clock::time_point now = Clock::now();
+			while (seconds(_deadline - now) > sleepMean + std::sqrt(sleepVariance))
+			{
+				bool input = false;
+				if (eventWait)
+					input = eventWait(0.001);
+				else
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				Clock::time_point woke = Clock::now();
+				double slept = seconds(woke - now);
+				double diff = slept - sleepMean;
+				sleepMean += 0.05 * diff;
+				sleepVariance += 0.05 * (diff * diff - sleepVariance);
+				sleepTime += slept;
+				now = woke;
+				if (input) return false;
+			}
+			while (now < _deadline)
+				now = Clock::now();
+			return true;
+		}
+
+	public:
+		Pacer()
+			: mode(Adaptive)
+			, targetRate(FRAME_PACER_DEFAULT_RATE)
+			, idleRate(FRAME_PACER_DEFAULT_IDLE_RATE)
+			, rate(0.0)
+			, sleepMean(0.002)
+			, sleepVariance(0.0)
+		{
+#ifdef _WIN32
+			// 1 ms scheduler resolution instead of the default 15.6 ms
+			timeBeginPeriod(1);
+#endif
+			resetStatistics();
+			start();
+		}
+
+		~Pacer()
+		{
+#ifdef _WIN32
+			timeEndPeriod(1);
+#endif
+		}
+
+		void setMode(Mode _mode, double _targetRate = FRAME_PACER_DEFAULT_RATE, double _idleRate = FRAME_PACER_DEFAULT_IDLE_RATE)
+		{
+			mode = _mode;
+			targetRate = _targetRate > 0.0 ? _targetRate : FRAME_PACER_DEFAULT_RATE;
+			idleRate = std::min(_idleRate > 0.0 ? _idleRate : FRAME_PACER_DEFAULT_IDLE_RATE, targetRate);
+			start();
+		}
+
+		Mode getMode() const { return mode; }
+
+		// An empty wait sleeps without looking at events
+		void setEventWait(EventWait _wait) { eventWait = _wait; }
+
+		// For glfwSwapInterval; only vsync mode lets the swap block
+		int getSwapInterval() const { return mode == Vsync ? 1 : 0; }
+
+		// Rate the last frame was paced at, 0 when not throttled here
+		double getRate() const { return rate; }
+
+		void start()
+		{
+			frameStart = deadline = lastChange = Clock::now();
+		}
+
+		// _changed tells adaptive mode that this frame differed from the last one
+		void endFrame(bool _changed)
+		{
+			Clock::time_point now = Clock::now();
+			workTime += seconds(now - frameStart);
+			rate = currentRate(_changed, now);
+			if (rate > 0.0)
+			{
+				deadline += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate));
+				// a frame that overran its slot starts a new cadence rather than rushing to catch up
+				if (deadline < now)
+				{
+					deadline = now;
+					lateFrames++;
+				}
+				Clock::time_point spinStart = Clock::now();
+				double sleptBefore = sleepTime;
+				bool onTime = waitUntil(deadline);
+				now = Clock::now();
+				spinTime += seconds(now - spinStart) - (sleepTime - sleptBefore);
+				if (onTime)
+				{
+					double wakeError = seconds(now - deadline);
+					wakeErrorSum += wakeError;
+					wakeErrorMax = std::max(wakeErrorMax, wakeError);
+				}
+				else
+				{
+					// input starts the next frame now and a new cadence from it
+					deadline = now;
+					wokenFrames++;
+				}
+			}
+			else
+				deadline = now;
+
+			double frameTime = seconds(now - frameStart);
+			frameTimeSum += frameTime;
+			frameTimeSquareSum += frameTime * frameTime;
+			frameTimeMax = std::max(frameTimeMax, frameTime);
+			frames++;
+			frameStart = now;
+		}
+
+		void resetStatistics()
+		{
+			frames = 0;
+			lateFrames = 0;
+			wokenFrames = 0;
+			workTime = sleepTime = spinTime = 0.0;
+			frameTimeSum = frameTimeSquareSum = frameTimeMax = 0.0;
+			wakeErrorSum = wakeErrorMax = 0.0;
+		}
+
+		void report(std::ostream & out) const
+		{
+			if (frames == 0 || frameTimeSum <= 0.0) return;
+			double mean = frameTimeSum / frames;
+			double jitter = std::sqrt(std::max(0.0, frameTimeSquareSum / frames - mean * mean));
+			out << "Frame pacing (" << getModeName(mode);
+			if (mode == Target || mode == Adaptive) out << ", " << rate << " fps";
+			out << "): " << frames << " frames, " << frames / frameTimeSum << " fps, frame time "
+				<< mean * 1000.0 << " ms, jitter " << jitter * 1000.0 << " ms, max " << frameTimeMax * 1000.0 << " ms" << std::endl;
+			out << "Frame pacing: CPU busy " << (workTime + spinTime) / frameTimeSum * 100.0 << "% (work "
+				<< workTime / frameTimeSum * 100.0 << "%, spin " << spinTime / frameTimeSum * 100.0 << "%), sleep "
+				<< sleepTime / frameTimeSum * 100.0 << "%";
+			if (mode == Target || mode == Adaptive)
+				out << ", wake-up error " << wakeErrorSum / std::max(frames - wokenFrames, 1ULL) * 1e6 << " us avg " << wakeErrorMax * 1e6
+					<< " us max, " << lateFrames << " late frames, " << wokenFrames << " woken by input";
+			out << std::endl;
+		}
+	};
+}
@@ -0,0 +1,487 @@
+// Offscreen Rendering
+// Framebuffer target with asynchronous readback and a keyframed camera path, for headless batch rendering
+
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include "gl_env.h"
+
+#include <glm\glm.hpp>
+
+#define OFFSCREEN_READBACK_BUFFERS 2
+
+// The EGL values Context uses, under their own names so they never clash with <EGL/egl.h>
+#define OFFSCREEN_EGL_NONE 0x3038
+#define OFFSCREEN_EGL_EXTENSIONS 0x3055
+#define OFFSCREEN_EGL_SURFACE_TYPE 0x3033
+#define OFFSCREEN_EGL_PBUFFER_BIT 0x0001
+#define OFFSCREEN_EGL_RENDERABLE_TYPE 0x3040
+#define OFFSCREEN_EGL_OPENGL_BIT 0x0008
+#define OFFSCREEN_EGL_RED_SIZE 0x3024
+#define OFFSCREEN_EGL_GREEN_SIZE 0x3023
+#define OFFSCREEN_EGL_BLUE_SIZE 0x3022
+#define OFFSCREEN_EGL_WIDTH 0x3057
+#define OFFSCREEN_EGL_HEIGHT 0x3056
+#define OFFSCREEN_EGL_OPENGL_API 0x30A2
+#define OFFSCREEN_EGL_CONTEXT_MAJOR_VERSION 0x3098
+#define OFFSCREEN_EGL_CONTEXT_MINOR_VERSION 0x30FB
+#define OFFSCREEN_EGL_CONTEXT_OPENGL_PROFILE_MASK 0x30FD
+#define OFFSCREEN_EGL_CORE_PROFILE_BIT 0x0001
+#define OFFSCREEN_EGL_COMPATIBILITY_PROFILE_BIT 0x0002
+#define OFFSCREEN_EGL_PLATFORM_DEVICE_EXT 0x313F
+#define OFFSCREEN_EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+
+/**********************************************************************************\
+*
+* Headless frames are drawn into a framebuffer object, so the context needs no
+* window: Context creates one through EGL without GLFW or a display server. Where
+* no EGL with desktop OpenGL is installed, a hidden GLFW window is the fallback.
+*
+* capture() queues glReadPixels into a pixel buffer object and writes out the
+* frame queued OFFSCREEN_READBACK_BUFFERS - 1 frames earlier, so the GPU keeps
+* drawing while the previous image is copied and saved. Frames are binary PPM.
+*
+\**********************************************************************************/
+
+namespace Offscreen
+{
+	typedef std::chrono::steady_clock Clock;
+
+	struct CameraKey
+	{
+		float time;
+		glm::fvec3 position;
+		glm::fvec3 target;
+	};
+
+	// Camera keyframes sorted by time, Catmull-Rom interpolated and clamped at both ends
+	class CameraPath
+	{
+	private:
+		std::vector<CameraKey> key;
+
+		static glm::fvec3 catmullRom(const glm::fvec3 & p0, const glm::fvec3 & p1, const glm::fvec3 & p2, const glm::fvec3 & p3, float t)
+		{
+			float t2 = t * t, t3 = t2 * t;
+			return 0.5f * (2.0f * p1 + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+		}
+
+	public:
+		// Keys of seven numbers: time, position xyz, target xyz.
+		// Keys are separated by lines or ';', numbers by spaces or ','; '#' starts a comment.
+		bool parse(const std::string & _text)
+		{
+			key.clear();
+			std::string text = _text;
+			std::replace(text.begin(), text.end(), ';', '\n');
+			std::replace(text.begin(), text.end(), ',', ' ');
+			std::istringstream lines(text);
+			std::string line;
+			while (std::getline(lines, line))
+			{
+				line = line.substr(0, line.find('#'));
+				if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+				std::istringstream values(line);
+				CameraKey cur;
+				if (!(values >> cur.time >> cur.position.x >> cur.position.y >> cur.position.z >> cur.target.x >> cur.target.y >> cur.target.z))
+				{
+					std::cout << "Camera path: bad key \"" << line << "\"" << std::endl;
+					key.clear();
+					return false;
+				}
+				key.push_back(cur);
+			}
+			std::stable_sort(key.begin(), key.end(), [](const CameraKey & a, const CameraKey & b) { return a.time < b.time; });
+			return !key.empty();
+		}
+
+		// A file of keys, or the keys themselves when no such file exists
+		bool load(const std::string & _source)
+		{
+			std::ifstream file(_source);
+			if (!file.is_open()) return parse(_source);
+			std::stringstream text;
+			text << file.rdbuf();
+			return parse(text.str());
+		}
+
+		bool empty() const { return key.empty(); }
+		float getDuration() const { return key.empty() ? 0.0f : key.back().time; }
+
+		void sample(float _time, glm::fvec3 & _position, glm::fvec3 & _target) const
+		{
+			if (key.empty()) return;
+			unsigned int next = std::upper_bound(key.begin(), key.end(), _time,
+				[](float t, const CameraKey & k) { return t < k.time; }) - key.begin();
+			if (next == 0 || next == key.size())
+			{
+				const CameraKey & end = key[next == 0 ? 0 : key.size() - 1];
+				_position = end.position;
+				_target = end.target;
+				return;
+			}
+			const CameraKey & k0 = key[next > 1 ? next - 2 : 0];
+			const CameraKey & k1 = key[next - 1];
+			const CameraKey & k2 = key[next];
+			const CameraKey & k3 = key[std::min<unsigned int>(next + 1, key.size() - 1)];
+			float span = k2.time - k1.time;
+			float t = span > 0.0f ? (_time - k1.time) / span : 1.0f;
+			_position = catmullRom(k0.position, k1.position, k2.position, k3.position, t);
+			_target = catmullRom(k0.target, k1.target, k2.target, k3.target, t);
+		}
+	};
+
+	// Context without a window: EGL loaded at run time, so neither EGL headers nor an import library are needed.
+	// The display is the surfaceless platform (Mesa) or the first GPU device (EXT_platform_device), then the default one;
+	// the context is made current without a surface where EGL_KHR_surfaceless_context allows it, else on a 1x1 pbuffer.
+	class Context
+	{
+	private:
+		typedef void * EGLDisplay;
+		typedef void * EGLConfig;
+		typedef void * EGLContext;
+		typedef void * EGLSurface;
+		typedef void * EGLDeviceEXT;
+		typedef int EGLint;
+		typedef unsigned int EGLBoolean;
+		typedef void (*Proc)();
+
+		void * library;
+		EGLDisplay display;
+		EGLContext context;
+		EGLSurface surface;
+
+		EGLDisplay (*eglGetDisplay)(void *);
+		EGLBoolean (*eglInitialize)(EGLDisplay, EGLint *, EGLint *);
+		EGLBoolean (*eglTerminate)(EGLDisplay);
+		const char * (*eglQueryString)(EGLDisplay, EGLint);
+		EGLBoolean (*eglBindAPI)(unsigned int);
+		EGLBoolean (*eglChooseConfig)(EGLDisplay, const EGLint *, EGLConfig *, EGLint, EGLint *);
+		EGLContext (*eglCreateContext)(EGLDisplay, EGLConfig, EGLContext, const EGLint *);
+		EGLBoolean (*eglDestroyContext)(EGLDisplay, EGLContext);
+		EGLSurface (*eglCreatePbufferSurface)(EGLDisplay, EGLConfig, const EGLint *);
+		EGLBoolean (*eglDestroySurface)(EGLDisplay, EGLSurface);
+		EGLBoolean (*eglMakeCurrent)(EGLDisplay, EGLSurface, EGLSurface, EGLContext);
+
+		// One EGL per process, so the loader below can be a plain function for glad and friends
+		static Proc (*& procAddress())(const char *)
+		{
+			static Proc (*eglGetProcAddress)(const char *) = NULL;
+			return eglGetProcAddress;
+		}
+
+		void * symbol(const char * _name) const
+		{
+#ifdef _WIN32
+			return (void *)GetProcAddress((HMODULE)library, _name);
+#else
+			return dlsym(library, _name);
+#endif
+		}
+
+		template <class F>
+		bool load(F & _function, const char * _name) const
+		{
+			_function = (F)symbol(_name);
+			return _function != NULL;
+		}
+
+		static bool hasExtension(const char * _list, const char * _name)
+		{
+			if (!_list) return false;
+			size_t length = strlen(_name);
+			for (const char * found = strstr(_list, _name); found; found = strstr(found + length, _name))
+				if ((found == _list || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0'))
+					return true;
+			return false;
+		}
+
+		EGLDisplay openDisplay()
+		{
+			const char * clientExtension = eglQueryString(NULL, OFFSCREEN_EGL_EXTENSIONS);
+			EGLDisplay (*eglGetPlatformDisplayEXT)(unsigned int, void *, const EGLint *) =
+				(EGLDisplay (*)(unsigned int, void *, const EGLint *))procAddress()("eglGetPlatformDisplayEXT");
+			if (eglGetPlatformDisplayEXT)
+			{
+				EGLint major, minor;
+				if (hasExtension(clientExtension, "EGL_MESA_platform_surfaceless"))
+				{
+					EGLDisplay found = eglGetPlatformDisplayEXT(OFFSCREEN_EGL_PLATFORM_SURFACELESS_MESA, NULL, NULL);
+					if (found && eglInitialize(found, &major, &minor)) return found;
+				}
+				EGLBoolean (*eglQueryDevicesEXT)(EGLint, EGLDeviceEXT *, EGLint *) =
+					(EGLBoolean (*)(EGLint, EGLDeviceEXT *, EGLint *))procAddress()("eglQueryDevicesEXT");
+				EGLDeviceEXT device[8];
+				EGLint deviceNum = 0;
+				if (hasExtension(clientExtension, "EGL_EXT_platform_device") && eglQueryDevicesEXT && eglQueryDevicesEXT(8, device, &deviceNum))
+					for (int i = 0; i < deviceNum; i++)
+					{
+						EGLDisplay found = eglGetPlatformDisplayEXT(OFFSCREEN_EGL_PLATFORM_DEVICE_EXT, device[i], NULL);
+						if (found && eglInitialize(found, &major, &minor)) return found;
+					}
+			}
+			EGLint major, minor;
+			EGLDisplay found = eglGetDisplay(NULL);
+			return found && eglInitialize(found, &major, &minor) ? found : NULL;
+		}
+
+	public:
+		Context() : library(NULL), display(NULL), context(NULL), surface(NULL) {}
+		~Context() { destroy(); }
+
+		// Desktop OpenGL _major._minor, core or compatibility profile; false leaves nothing behind
+		bool create(int _major, int _minor, bool _core)
+		{
+			destroy();
+#ifdef _WIN32
+			library = (void *)LoadLibraryA("libEGL.dll");
+#else
+			library = dlopen("libEGL.so.1", RTLD_NOW | RTLD_LOCAL);
+#endif
+			if (!library) return false;
+			if (!load(procAddress(), "eglGetProcAddress") || !load(eglGetDisplay, "eglGetDisplay") || !load(eglInitialize, "eglInitialize")
+				|| !load(eglTerminate, "eglTerminate") || !load(eglQueryString, "eglQueryString") || !load(eglBindAPI, "eglBindAPI")
+				|| !load(eglChooseConfig, "eglChooseConfig") || !load(eglCreateContext, "eglCreateContext")
+				|| !load(eglDestroyContext, "eglDestroyContext") || !load(eglCreatePbufferSurface, "eglCreatePbufferSurface")
+				|| !load(eglDestroySurface, "eglDestroySurface") || !load(eglMakeCurrent, "eglMakeCurrent"))
+			{
+				destroy();
+				return false;
+			}
+
+			display = openDisplay();
+			if (!display || !eglBindAPI(OFFSCREEN_EGL_OPENGL_API))
+			{
+				destroy();
+				return false;
+			}
+			// Frames go to a framebuffer object, so the config only has to exist
+			const EGLint configAttribute[] = {
+				OFFSCREEN_EGL_SURFACE_TYPE, OFFSCREEN_EGL_PBUFFER_BIT,
+				OFFSCREEN_EGL_RENDERABLE_TYPE, OFFSCREEN_EGL_OPENGL_BIT,
+				OFFSCREEN_EGL_RED_SIZE, 8, OFFSCREEN_EGL_GREEN_SIZE, 8, OFFSCREEN_EGL_BLUE_SIZE, 8,
+				OFFSCREEN_EGL_NONE };
+			EGLConfig config;
+			EGLint configNum = 0;
+			const EGLint contextAttribute[] = {
+				OFFSCREEN_EGL_CONTEXT_MAJOR_VERSION, _major,
+				OFFSCREEN_EGL_CONTEXT_MINOR_VERSION, _minor,
+				OFFSCREEN_EGL_CONTEXT_OPENGL_PROFILE_MASK, _core ? OFFSCREEN_EGL_CORE_PROFILE_BIT : OFFSCREEN_EGL_COMPATIBILITY_PROFILE_BIT,
+				OFFSCREEN_EGL_NONE };
+			if (!eglChooseConfig(display, configAttribute, &config, 1, &configNum) || configNum == 0
+				|| !(context = eglCreateContext(display, config, NULL, contextAttribute)))
+			{
+				destroy();
+				return false;
+			}
+			if (!hasExtension(eglQueryString(display, OFFSCREEN_EGL_EXTENSIONS), "EGL_KHR_surfaceless_context"))
+			{
+				const EGLint surfaceAttribute[] = { OFFSCREEN_EGL_WIDTH, 1, OFFSCREEN_EGL_HEIGHT, 1, OFFSCREEN_EGL_NONE };
+				surface = eglCreatePbufferSurface(display, config, surfaceAttribute);
+			}
+			if (!eglMakeCurrent(display, surface, surface, context))
+			{
+				destroy();
+				return false;
+			}
+			return true;
+		}
+
+		bool isCreated() const { return context != NULL; }
+
+		// GL entry points of the current EGL context, for gladLoadGLLoader
+		static void * getProcAddress(const char * _name)
+		{
+			return procAddress() ? (void *)procAddress()(_name) : NULL;
+		}
+
+		void destroy()
+		{
+			if (display)
+			{
+				eglMakeCurrent(display, NULL, NULL, NULL);
+				if (surface) eglDestroySurface(display, surface);
+				if (context) eglDestroyContext(display, context);
+				eglTerminate(display);
+			}
+			display = context = surface = NULL;
+			if (library)
+			{
+#ifdef _WIN32
+				FreeLibrary((HMODULE)library);
+#else
+				dlclose(library);
+#endif
+			}
+			library = NULL;
+			procAddress() = NULL;
+		}
+	};
+
+	class Target
+	{
+	private:
+		GLuint framebuffer;
+		GLuint colorBuffer;
+		GLuint depthBuffer;
+		GLuint pixelBuffer[OFFSCREEN_READBACK_BUFFERS];
+		int width;
+		int height;
+		// printf pattern of the frame file names, given the frame index
+		std::string pattern;
+
+		unsigned long long queued;
+		unsigned long long written;
+		unsigned long long byteNum;
+		double mapTime;
+		double writeTime;
+		Clock::time_point startTime;
+		Clock::time_point endTime;
+
+		void writeOldest()
+		{
+			Clock::time_point mapStart = Clock::now();
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffer[written % OFFSCREEN_READBACK_BUFFERS]);
+			const unsigned char * pixels = (const unsigned char *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+			Clock::time_point writeStart = Clock::now();
+			mapTime += std::chrono::duration<double>(writeStart - mapStart).count();
+			if (pixels)
+			{
+				std::vector<char> filename(pattern.size() + 32);
+				snprintf(filename.data(), filename.size(), pattern.c_str(), int(written));
+				std::ofstream file(filename.data(), std::ios::binary);
+				if (file.is_open())
+				{
+					file << "P6\n" << width << " " << height << "\n255\n";
+					// GL rows run bottom-up, PPM rows top-down
+					for (int y = height - 1; y >= 0; y--)
+						file.write((const char *)pixels + y * width * 3, width * 3);
+					byteNum += width * height * 3;
+				}
+				else
+					std::cout << "Offscreen: cannot write " << filename.data() << std::endl;
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			writeTime += std::chrono::duration<double>(Clock::now() - writeStart).count();
+			written++;
+		}
+
+	public:
+		Target() : framebuffer(0), colorBuffer(0), depthBuffer(0), width(0), height(0)
+		{
+			std::fill(pixelBuffer, pixelBuffer + OFFSCREEN_READBACK_BUFFERS, 0);
+		}
+
+		bool create(int _width, int _height, const std::string & _pattern)
+		{
+			width = _width;
+			height = _height;
+			pattern = _pattern;
+
+			glGenRenderbuffers(1, &colorBuffer);
+			glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+			glGenRenderbuffers(1, &depthBuffer);
+			glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+			glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+			glGenFramebuffers(1, &framebuffer);
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+			GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			if (status != GL_FRAMEBUFFER_COMPLETE)
+			{
+				std::cout << "Offscreen: framebuffer incomplete (0x" << std::hex << status << std::dec << ")" << std::endl;
+				return false;
+			}
+
+			glGenBuffers(OFFSCREEN_READBACK_BUFFERS, pixelBuffer);
+			for (int i = 0; i < OFFSCREEN_READBACK_BUFFERS; i++)
+			{
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffer[i]);
+				glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 3, NULL, GL_STREAM_READ);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+			queued = written = byteNum = 0;
+			mapTime = writeTime = 0.0;
+			startTime = endTime = Clock::now();
+			return true;
+		}
+
+		int getWidth() const { return width; }
+		int getHeight() const { return height; }
+
+		void bind() const
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+			glViewport(0, 0, width, height);
+		}
+
+		// Queue the readback of the frame just drawn
+		void capture()
+		{
+			if (queued - written == OFFSCREEN_READBACK_BUFFERS)
+				writeOldest();
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+			glReadBuffer(GL_COLOR_ATTACHMENT0);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffer[queued % OFFSCREEN_READBACK_BUFFERS]);
+			glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			queued++;
+		}
+
+		// Write out every queued frame
+		void finish()
+		{
+			while (written < queued)
+				writeOldest();
+			endTime = Clock::now();
+		}
+
+		unsigned long long getFrameNum() const { return written; }
+
+		void report(std::ostream & out) const
+		{
+			double total = std::chrono::duration<double>(endTime - startTime).count();
+			if (written == 0 || total <= 0.0) return;
+			out << "Offscreen: " << written << " frames of " << width << "x" << height << " in " << total << " s, "
+				<< written / total << " frames/s, " << byteNum / total / (1024.0 * 1024.0) << " MB/s written" << std::endl;
+			out << "Offscreen: per frame " << (total - mapTime - writeTime) / written * 1000.0 << " ms render, "
+				<< mapTime / written * 1000.0 << " ms readback wait, " << writeTime / written * 1000.0 << " ms write" << std::endl;
+		}
+
+		void destroy()
+		{
+			glDeleteBuffers(OFFSCREEN_READBACK_BUFFERS, pixelBuffer);
+			glDeleteFramebuffers(1, &framebuffer);
+			glDeleteRenderbuffers(1, &colorBuffer);
+			glDeleteRenderbuffers(1, &depthBuffer);
+			framebuffer = colorBuffer = depthBuffer = 0;
+			std::fill(pixelBuffer, pixelBuffer + OFFSCREEN_READBACK_BUFFERS, 0);
+		}
+	};
+}
@@ -0,0 +1,250 @@
+// Program Binary Cache
+// Links programs from binaries stored on disk by an earlier run, compiling from source on a miss
+
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "gl_env.h"
+
+#define PROGRAM_CACHE_DIRECTORY "program_cache"
+#define PROGRAM_CACHE_MAGIC 0x31424750u	// "PGB1"
+
+/**********************************************************************************\
+*
+* A program is keyed by a 64-bit FNV-1a hash of the driver (vendor, renderer,
+* version) and every source string, defines included. build() first tries the
+* binary stored under that key; the driver may reject it (after an update, say),
+* in which case the program is compiled from source and the binary replaced.
+* Without GL_ARB_get_program_binary every program is compiled from source.
+*
+* begin() and finish() split build() for asynchronous compiles: begin() issues
+* the link without asking for its status, finish() is called once the link is
+* done (see GL_KHR_parallel_shader_compile) and stores the binary. The compile
+* time reported is the time spent in those two calls, not the frames between.
+*
+\**********************************************************************************/
+
+namespace ProgramCache
+{
+	typedef std::chrono::steady_clock Clock;
+
+	class Cache
+	{
+	private:
+		std::string directory;
+		bool enabled;
+		bool initialized;
+		bool supported;
+		std::string driver;
+
+		unsigned int loadNum;
+		unsigned int compileNum;
+		unsigned int rejectNum;
+		double loadTime;
+		double compileTime;
+
+		struct Link
+		{
+			unsigned long long key;
+			bool cached;
+			// seconds begin() took to issue the compile and link
+			double issueTime;
+		};
+		// programs begun but not finished
+		std::unordered_map<GLuint, Link> pending;
+
+		static unsigned long long hash(unsigned long long h, const std::string & _text)
+		{
+			for (int i = 0; i < _text.size(); i++)
+				h = (h ^ (unsigned char)_text[i]) * 1099511628211ull;
+			// separator, so that moving text between parts changes the key
+			return (h ^ 0xffu) * 1099511628211ull;
+		}
+
+		static std::string glString(GLenum _name)
+		{
+			const GLubyte * value = glGetString(_name);
+			return value ? std::string((const char *)value) : std::string();
+		}
+
+		void initialize()
+		{
+			initialized = true;
+			driver = glString(GL_VENDOR) + "|" + glString(GL_RENDERER) + "|" + glString(GL_VERSION);
+			GLint formatNum = 0;
+			if (glGetProgramBinary && glProgramBinary && glProgramParameteri)
+				glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatNum);
+			supported = formatNum > 0;
+			if (enabled && supported)
+			{
+#ifdef _WIN32
+				_mkdir(directory.c_str());
+#else
+				mkdir(directory.c_str(), 0755);
+#endif
+			}
+		}
+
+		std::string filename(unsigned long long _key) const
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "%016llx.bin", _key);
+			return directory + "/" + name;
+		}
+
+		GLuint loadBinary(unsigned long long _key)
+		{
+			std::ifstream file(filename(_key), std::ios::binary);
+			if (!file.is_open()) return 0;
+			unsigned int magic = 0, format = 0, length = 0;
+			unsigned long long key = 0;
+			file.read((char *)&magic, sizeof(magic));
+			file.read((char *)&key, sizeof(key));
+			file.read((char *)&format, sizeof(format));
+			file.read((char *)&length, sizeof(length));
+			if (!file || magic != PROGRAM_CACHE_MAGIC || key != _key || length == 0) return 0;
+			std::vector<char> binary(length);
+			if (!file.read(binary.data(), length)) return 0;
+
+			GLuint program = glCreateProgram();
+			glProgramBinary(program, format, binary.data(), length);
+			GLint linkStatus = GL_FALSE;
+			glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+			if (linkStatus == GL_FALSE)
+			{
+				glDeleteProgram(program);
+				rejectNum++;
+				return 0;
+			}
+			return program;
+		}
+
+		void storeBinary(unsigned long long _key, GLuint _program)
+		{
+			GLint length = 0;
+			glGetProgramiv(_program, GL_PROGRAM_BINARY_LENGTH, &length);
+			if (length <= 0) return;
+			std::vector<char> binary(length);
+			GLenum format = 0;
+			glGetProgramBinary(_program, length, &length, &format, binary.data());
+			std::ofstream file(filename(_key), std::ios::binary | std::ios::trunc);
+			if (!file.is_open()) return;
+			unsigned int magic = PROGRAM_CACHE_MAGIC, formatValue = format, lengthValue = length;
+			file.write((const char *)&magic, sizeof(magic));
+			file.write((const char *)&_key, sizeof(_key));
+			file.write((const char *)&formatValue, sizeof(formatValue));
+			file.write((const char *)&lengthValue, sizeof(lengthValue));
+			file.write(binary.data(), length);
+		}
+
+	public:
+		Cache(const std::string & _directory = PROGRAM_CACHE_DIRECTORY)
+			: directory(_directory)
+			, enabled(true)
+			, initialized(false)
+			, supported(false)
+			, loadNum(0)
+			, compileNum(0)
+			, rejectNum(0)
+			, loadTime(0.0)
+			, compileTime(0.0)
+		{
+		}
+
+		// Off: compile everything from source and leave the stored binaries alone
+		void setEnabled(bool _enabled) { enabled = _enabled; }
+
+		// Program for the given sources. _link attaches the compiled shaders to the
+		// program it is given and links it; it only runs when no usable binary is stored.
+		GLuint build(const std::vector<std::string> & _source, const std::function<void(GLuint)> & _link)
+		{
+			GLuint program = begin(_source, _link);
+			finish(program);
+			return program;
+		}
+
+		// Like build(), but a program that has to be linked is returned as soon as
+		// the link is issued and stays pending until finish()
+		GLuint begin(const std::vector<std::string> & _source, const std::function<void(GLuint)> & _link)
+		{
+			Clock::time_point start = Clock::now();
+			if (!initialized) initialize();
+			bool cached = enabled && supported;
+
+			unsigned long long key = hash(14695981039346656037ull, driver);
+			for (int i = 0; i < _source.size(); i++)
+				key = hash(key, _source[i]);
+
+			if (cached)
+			{
+				GLuint program = loadBinary(key);
+				if (program)
+				{
+					loadNum++;
+					loadTime += std::chrono::duration<double>(Clock::now() - start).count();
+					return program;
+				}
+			}
+
+			GLuint program = glCreateProgram();
+			if (cached)
+				glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			_link(program);
+			Link link = { key, cached, std::chrono::duration<double>(Clock::now() - start).count() };
+			pending[program] = link;
+			return program;
+		}
+
+		bool isPending(GLuint _program) const { return pending.count(_program) > 0; }
+
+		// Store the binary of a program begun by begin(); waits for its link if it is still running
+		void finish(GLuint _program)
+		{
+			std::unordered_map<GLuint, Link>::iterator it = pending.find(_program);
+			if (it == pending.end()) return;
+			Clock::time_point start = Clock::now();
+			GLint linkStatus = GL_FALSE;
+			glGetProgramiv(_program, GL_LINK_STATUS, &linkStatus);
+			if (it->second.cached && linkStatus == GL_TRUE)
+				storeBinary(it->second.key, _program);
+			compileNum++;
+			compileTime += it->second.issueTime + std::chrono::duration<double>(Clock::now() - start).count();
+			pending.erase(it);
+		}
+
+		void report(std::ostream & out) const
+		{
+			out << "Program cache: " << loadNum + compileNum << " programs in " << (loadTime + compileTime) * 1000.0 << " ms ("
+				<< (loadNum > 0 ? "warm" : "cold") << " start), " << loadNum << " loaded from binaries";
+			if (loadNum > 0) out << " (" << loadTime / loadNum * 1000.0 << " ms each)";
+			out << ", " << compileNum << " compiled";
+			if (compileNum > 0) out << " (" << compileTime / compileNum * 1000.0 << " ms each)";
+			out << ", " << rejectNum << " binaries rejected";
+			if (!enabled) out << ", cache off";
+			else if (initialized && !supported) out << ", program binaries unsupported";
+			out << std::endl;
+		}
+	};
+
+	// The cache the application's programs go through
+	inline Cache & shared()
+	{
+		static Cache cache;
+		return cache;
+	}
+}
@@ -0,0 +1,61 @@
+// Shader Features
+// Fields of a program permutation bitmask, injected into the sources as #defines
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**********************************************************************************\
+*
+* A shader family is compiled once per feature bitmask that is actually drawn
+* with. Each field of the mask becomes "#define name value", placed right after
+* the #version line, so the sources pick their paths with #if. The fields in use:
+*
+*   DIR_LIGHT, SPOT_LIGHT, POINT_LIGHT_NUM  lights of the MyCubes lighting shaders
+*   BONE_INFLUENCE_NUM                      bones blended per vertex (0 = generic)
+*   DIFFUSE_TEXTURE_MAPPING                 sample the diffuse map, else show uvs
+*
+\**********************************************************************************/
+
+struct ShaderFeature
+{
+	const char * name;
+	unsigned int shift;
+	unsigned int bits;
+
+	// Value of this field in a bitmask
+	unsigned int value(unsigned int _featureMask) const
+	{
+		return (_featureMask >> shift) & ((1u << bits) - 1);
+	}
+
+	// The bitmask with this field set to a value
+	unsigned int mask(unsigned int _value) const
+	{
+		return (_value & ((1u << bits) - 1)) << shift;
+	}
+
+	// "#define name value" lines for every field of a bitmask
+	static std::string defines(const std::vector<ShaderFeature> & _features, unsigned int _featureMask)
+	{
+		std::string result;
+		for (size_t i = 0; i < _features.size(); i++)
+			result += std::string("#define ") + _features[i].name + " " + std::to_string(_features[i].value(_featureMask)) + "\n";
+		return result;
+	}
+
+	// The source with the defines of a bitmask placed after its #version line
+	static std::string inject(const std::vector<ShaderFeature> & _features, const std::string & _code, unsigned int _featureMask)
+	{
+		if (_features.empty() || _code.empty())
+			return _code;
+		std::string defines = ShaderFeature::defines(_features, _featureMask);
+		if (_code.compare(0, 8, "#version") != 0)
+			return defines + _code;
+		size_t line = _code.find('\n');
+		if (line == std::string::npos)
+			return _code + "\n" + defines;
+		return _code.substr(0, line + 1) + defines + _code.substr(line + 1);
+	}
+};
@@ -0,0 +1,217 @@
+// Texture Arrays
+// Packs textures of the same format and size into the layers of GL_TEXTURE_2D_ARRAY objects
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "gl_env.h"
+
+/**********************************************************************************\
+*
+* Textures are added by their GL object once their uploads are complete; pack()
+* groups them by internal format, size and mip level count and copies every
+* level of each into a layer of one array per group with glCopyImageSubData,
+* on the GPU and without a round trip through client memory. Compressed
+* textures stay compressed. An array takes its wrap and filter state from the
+* first texture of its group.
+*
+* Arrays are used rather than an atlas: the layers keep their own mip chains,
+* need no gutters and still wrap with GL_REPEAT, which an atlas cannot do.
+* A draw picks its layer by an index the shader reads; objects whose textures
+* share an array draw with a single binding. The source textures are left alone
+* by pack(); releaseSources() deletes them afterwards, so that the texels are not
+* held in video memory twice, for callers that will never bind them again.
+* Without glCopyImageSubData (GL 4.3) pack() does nothing and returns false.
+*
+\**********************************************************************************/
+
+namespace TextureArray
+{
+	typedef std::chrono::steady_clock Clock;
+
+	class Packer
+	{
+	private:
+		struct Entry
+		{
+			GLuint tex;
+			unsigned int array;
+			int layer;
+		};
+
+		struct Array
+		{
+			GLenum format;
+			int width;
+			int height;
+			int levels;
+			bool compressed;
+			std::vector<GLuint> layerTex;
+			GLuint tex;
+		};
+
+		std::vector<Entry> entry;
+		std::vector<Array> array;
+		bool packed;
+		bool released;
+		unsigned long long byteNum;
+		double packTime;
+
+		// glTexStorage3D takes sized formats only
+		static GLenum sizedFormat(GLenum _format)
+		{
+			if (_format == GL_RGBA) return GL_RGBA8;
+			if (_format == GL_RGB) return GL_RGB8;
+			return _format;
+		}
+
+		static int levelWidth(const Array & _array, int _level) { return std::max(1, _array.width >> _level); }
+		static int levelHeight(const Array & _array, int _level) { return std::max(1, _array.height >> _level); }
+
+	public:
+		Packer()
+			: packed(false)
+			, released(false)
+			, byteNum(0)
+			, packTime(0.0)
+		{
+		}
+
+		// Slot of a complete 2D texture, the same for a texture added twice; -1 if it has no level 0
+		int add(GLuint _tex)
+		{
+			if (!_tex || packed) return -1;
+			for (int i = 0; i < entry.size(); i++)
+				if (entry[i].tex == _tex)
+					return i;
+
+			GLint format = 0, width = 0, height = 0, compressed = 0;
+			glBindTexture(GL_TEXTURE_2D, _tex);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+			int levels = 0;
+			if (width > 0 && height > 0)
+				while (true)
+				{
+					GLint levelWidth = 0;
+					glGetTexLevelParameteriv(GL_TEXTURE_2D, levels, GL_TEXTURE_WIDTH, &levelWidth);
+					if (levelWidth == 0) break;
+					levels++;
+					if (std::max(width >> (levels - 1), height >> (levels - 1)) <= 1) break;
+				}
+			glBindTexture(GL_TEXTURE_2D, 0);
+			if (levels == 0) return -1;
+
+			Entry cur = { _tex, 0, 0 };
+			for (cur.array = 0; cur.array < array.size(); cur.array++)
+			{
+				const Array & candidate = array[cur.array];
+				if (candidate.format == (GLenum)format && candidate.width == width && candidate.height == height && candidate.levels == levels)
+					break;
+			}
+			if (cur.array == array.size())
+			{
+				Array group = { (GLenum)format, width, height, levels, compressed != 0, std::vector<GLuint>(), 0 };
+				array.push_back(group);
+			}
+			cur.layer = array[cur.array].layerTex.size();
+			array[cur.array].layerTex.push_back(_tex);
+			entry.push_back(cur);
+			return entry.size() - 1;
+		}
+
+		// Build the arrays and copy the added textures into them; false if there is nothing to pack or no glCopyImageSubData
+		bool pack()
+		{
+			if (packed || entry.empty() || !glCopyImageSubData || !glTexStorage3D) return false;
+			Clock::time_point start = Clock::now();
+			for (int a = 0; a < array.size(); a++)
+			{
+				Array & cur = array[a];
+				GLint wrapS = GL_REPEAT, wrapT = GL_REPEAT, minFilter = GL_LINEAR, magFilter = GL_LINEAR;
+				glBindTexture(GL_TEXTURE_2D, cur.layerTex[0]);
+				glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, &wrapS);
+				glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, &wrapT);
+				glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, &minFilter);
+				glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, &magFilter);
+				for (int level = 0; level < cur.levels; level++)
+				{
+					GLint size = 0;
+					if (cur.compressed)
+						glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+					else
+						size = levelWidth(cur, level) * levelHeight(cur, level) * 4;
+					byteNum += (unsigned long long)size * cur.layerTex.size();
+				}
+				glBindTexture(GL_TEXTURE_2D, 0);
+
+				glGenTextures(1, &cur.tex);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, cur.tex);
+				glTexStorage3D(GL_TEXTURE_2D_ARRAY, cur.levels, sizedFormat(cur.format), cur.width, cur.height, cur.layerTex.size());
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrapS);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrapT);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, minFilter);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, magFilter);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+				for (int layer = 0; layer < cur.layerTex.size(); layer++)
+					for (int level = 0; level < cur.levels; level++)
+						glCopyImageSubData(cur.layerTex[layer], GL_TEXTURE_2D, level, 0, 0, 0,
+							cur.tex, GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+							levelWidth(cur, level), levelHeight(cur, level), 1);
+			}
+			packed = true;
+			packTime = std::chrono::duration<double>(Clock::now() - start).count();
+			return true;
+		}
+
+		// Delete the added 2D textures once their texels are in the arrays; their names must not be bound again
+		void releaseSources()
+		{
+			if (!packed || released) return;
+			for (int i = 0; i < entry.size(); i++)
+				glDeleteTextures(1, &entry[i].tex);
+			for (int a = 0; a < array.size(); a++)
+				array[a].layerTex.assign(array[a].layerTex.size(), 0);
+			released = true;
+		}
+
+		bool isPacked() const { return packed; }
+		bool isReleased() const { return released; }
+		unsigned int getTextureNum() const { return entry.size(); }
+		unsigned int getArrayNum() const { return packed ? array.size() : 0; }
+		unsigned long long getByteNum() const { return byteNum; }
+
+		// Array object and layer of a slot from add(), 0 and -1 before pack()
+		GLuint getArray(int _slot) const { return packed && _slot >= 0 && _slot < entry.size() ? array[entry[_slot].array].tex : 0; }
+		int getLayer(int _slot) const { return packed && _slot >= 0 && _slot < entry.size() ? entry[_slot].layer : -1; }
+
+		void report(std::ostream & out) const
+		{
+			if (!packed) return;
+			out << "Texture arrays: " << entry.size() << " textures packed into " << array.size() << " arrays (";
+			for (int a = 0; a < array.size(); a++)
+				out << (a ? ", " : "") << array[a].layerTex.size() << " x " << array[a].width << " x " << array[a].height
+					<< (array[a].compressed ? " compressed" : "");
+			out << "), " << byteNum / 1024.0 << " KB copied in " << packTime * 1000.0 << " ms"
+				<< (released ? ", sources released" : "") << std::endl;
+		}
+
+		void destroy()
+		{
+			for (int a = 0; a < array.size(); a++)
+				glDeleteTextures(1, &array[a].tex);
+			array.clear();
+			entry.clear();
+			packed = false;
+			released = false;
+			byteNum = 0;
+			packTime = 0.0;
+		}
+	};
+}
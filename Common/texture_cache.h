@@ -0,0 +1,954 @@
+// Compressed Texture Cache
+// Stores decoded images as block-compressed KTX files with their mip chain, memory-mapped and uploaded as-is on later runs
+
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "gl_env.h"
+#include "texture_stream.h"
+#include "texture_mipmap.h"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+#define TEXTURE_CACHE_DIRECTORY "texture_cache"
+// part of every key, so that a new encoder does not load files of the old one
+#define TEXTURE_CACHE_VERSION 2
+
+/**********************************************************************************\
+*
+* A texture is keyed by a 64-bit FNV-1a hash of its file name, size and
+* modification time (and the mip filter). On a miss the image is decoded by the
+* caller, its mip chain is filtered in linear light on the CPU (texture_mipmap.h)
+* and every level is encoded as BC1 (opaque images)
+* or BC3 (images with alpha), then written as a KTX 1.1 file. A Batch does
+* this on its workers, one image per worker and core, and uploads the result; load(), which runs on
+* the GL thread, uploads the RGBA8 chain and leaves the compression and the file
+* to the worker pool, for later runs. On a
+* hit the KTX file is memory-mapped and its levels go to the texture stream
+* (texture_stream.h), with no decoding at all; the mapping stays open until the
+* last level is uploaded.
+*
+* BC1 stores a 4x4 block in 8 bytes and BC3 in 16, against 64 bytes of RGBA8:
+* 8x and 4x less GPU memory. Without GL_EXT_texture_compression_s3tc, or with
+* the cache off, images are uploaded as RGBA8 with their CPU-built chain, or
+* with glGenerateMipmap when the filter is left to the driver.
+*
+\**********************************************************************************/
+
+namespace TextureCache
+{
+	typedef std::chrono::steady_clock Clock;
+
+	// Whether some texel of RGBA8 data is not fully opaque
+	inline bool translucent(const unsigned char * _rgba, size_t _texelNum)
+	{
+		for (size_t i = 0; i < _texelNum; i++)
+			if (_rgba[i * 4 + 3] != 255) return true;
+		return false;
+	}
+
+	// 8-bit RGBA texels, rows in the order glTexImage2D takes them
+	struct Image
+	{
+		int width;
+		int height;
+		// some texel is not fully opaque; selects BC3 over BC1
+		bool alpha;
+		std::vector<unsigned char> rgba;
+
+		Image() : width(0), height(0), alpha(false) {}
+
+		explicit Image(const TextureStream::Source & _source)
+			: width(_source.width), height(_source.height), alpha(false), rgba((size_t)_source.width * _source.height * 4)
+		{
+			TextureStream::convertRows(_source, 0, height, rgba.data());
+			// an alpha channel that is 255 throughout goes to BC1, at half the size
+			if (_source.alpha())
+				alpha = translucent(rgba.data(), (size_t)width * height);
+		}
+	};
+
+
+	inline unsigned short pack565(const float _color[3])
+	{
+		int r = std::min(31, std::max(0, int(_color[0] * 31.0f / 255.0f + 0.5f)));
+		int g = std::min(63, std::max(0, int(_color[1] * 63.0f / 255.0f + 0.5f)));
+		int b = std::min(31, std::max(0, int(_color[2] * 31.0f / 255.0f + 0.5f)));
+		return (unsigned short)((r << 11) | (g << 5) | b);
+	}
+
+	inline void unpack565(unsigned short _packed, int _color[3])
+	{
+		int r = (_packed >> 11) & 31, g = (_packed >> 5) & 63, b = _packed & 31;
+		_color[0] = (r << 3) | (r >> 2);
+		_color[1] = (g << 2) | (g >> 4);
+		_color[2] = (b << 3) | (b >> 2);
+	}
+
+	// BC1 color block: endpoints at the extremes of the colors along their principal axis
+	inline void encodeColorBlock(const unsigned char _texel[16][4], unsigned char * _out)
+	{
+		float mean[3] = { 0.0f, 0.0f, 0.0f };
+		for (int i = 0; i < 16; i++)
+			for (int c = 0; c < 3; c++)
+				mean[c] += _texel[i][c] / 16.0f;
+		float cov[3][3] = { { 0.0f } };
+		for (int i = 0; i < 16; i++)
+		{
+			float d[3] = { _texel[i][0] - mean[0], _texel[i][1] - mean[1], _texel[i][2] - mean[2] };
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 3; c++)
+					cov[r][c] += d[r] * d[c];
+		}
+		// power iteration; a flat block keeps the diagonal and collapses to one color anyway
+		float axis[3] = { 0.577f, 0.577f, 0.577f };
+		for (int iteration = 0; iteration < 8; iteration++)
+		{
+			float next[3];
+			for (int r = 0; r < 3; r++)
+				next[r] = cov[r][0] * axis[0] + cov[r][1] * axis[1] + cov[r][2] * axis[2];
+			float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+			if (length < 1e-6f) break;
+			for (int r = 0; r < 3; r++)
+				axis[r] = next[r] / length;
+		}
+		float minT = 1e9f, maxT = -1e9f;
+		for (int i = 0; i < 16; i++)
+		{
+			float t = (_texel[i][0] - mean[0]) * axis[0] + (_texel[i][1] - mean[1]) * axis[1] + (_texel[i][2] - mean[2]) * axis[2];
+			minT = std::min(minT, t);
+			maxT = std::max(maxT, t);
+		}
+		float high[3], low[3];
+		for (int c = 0; c < 3; c++)
+		{
+			high[c] = mean[c] + axis[c] * maxT;
+			low[c] = mean[c] + axis[c] * minT;
+		}
+		unsigned short color0 = pack565(high), color1 = pack565(low);
+		// color0 > color1 selects the four-color mode
+		if (color0 < color1) std::swap(color0, color1);
+
+		unsigned int indices = 0;
+		if (color0 != color1)
+		{
+			int palette[4][3];
+			unpack565(color0, palette[0]);
+			unpack565(color1, palette[1]);
+			for (int c = 0; c < 3; c++)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0, bestError = 1 << 30;
+				for (int p = 0; p < 4; p++)
+				{
+					int dr = _texel[i][0] - palette[p][0], dg = _texel[i][1] - palette[p][1], db = _texel[i][2] - palette[p][2];
+					int error = dr * dr + dg * dg + db * db;
+					if (error < bestError)
+					{
+						bestError = error;
+						best = p;
+					}
+				}
+				indices |= best << (2 * i);
+			}
+		}
+		_out[0] = color0 & 0xff;
+		_out[1] = color0 >> 8;
+		_out[2] = color1 & 0xff;
+		_out[3] = color1 >> 8;
+		for (int i = 0; i < 4; i++)
+			_out[4 + i] = (indices >> (8 * i)) & 0xff;
+	}
+
+	// BC3 alpha block: eight levels between the smallest and largest alpha
+	inline void encodeAlphaBlock(const unsigned char _texel[16][4], unsigned char * _out)
+	{
+		int alpha0 = 0, alpha1 = 255;
+		for (int i = 0; i < 16; i++)
+		{
+			alpha0 = std::max(alpha0, (int)_texel[i][3]);
+			alpha1 = std::min(alpha1, (int)_texel[i][3]);
+		}
+		unsigned long long indices = 0;
+		if (alpha0 > alpha1)
+		{
+			int palette[8] = { alpha0, alpha1 };
+			for (int p = 2; p < 8; p++)
+				palette[p] = ((8 - p) * alpha0 + (p - 1) * alpha1) / 7;
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0;
+				for (int p = 1; p < 8; p++)
+					if (std::abs(_texel[i][3] - palette[p]) < std::abs(_texel[i][3] - palette[best]))
+						best = p;
+				indices |= (unsigned long long)best << (3 * i);
+			}
+		}
+		_out[0] = (unsigned char)alpha0;
+		_out[1] = (unsigned char)alpha1;
+		for (int i = 0; i < 6; i++)
+			_out[2 + i] = (indices >> (8 * i)) & 0xff;
+	}
+
+	// One level as BC1 or BC3 (_alpha) blocks, block rows spread over _threadNum threads (0: all cores).
+	// Jobs on the worker pool pass 1: the pool already runs one job per core.
+	inline std::vector<unsigned char> encode(const unsigned char * _rgba, int _width, int _height, bool _alpha, int _threadNum = 0)
+	{
+		int blocksX = (_width + 3) / 4, blocksY = (_height + 3) / 4;
+		int blockSize = _alpha ? 16 : 8;
+		std::vector<unsigned char> blocks(blocksX * blocksY * blockSize);
+		if (_threadNum <= 0) _threadNum = std::thread::hardware_concurrency();
+		int threadNum = std::max(1, std::min(_threadNum, blocksY));
+		std::vector<std::thread> threads;
+		for (int t = 0; t < threadNum; t++)
+			threads.push_back(std::thread([&, t]()
+			{
+				unsigned char texel[16][4];
+				for (int by = t; by < blocksY; by += threadNum)
+					for (int bx = 0; bx < blocksX; bx++)
+					{
+						// blocks over the edge repeat the last row or column
+						for (int i = 0; i < 16; i++)
+						{
+							int x = std::min(bx * 4 + i % 4, _width - 1), y = std::min(by * 4 + i / 4, _height - 1);
+							memcpy(texel[i], &_rgba[((size_t)y * _width + x) * 4], 4);
+						}
+						unsigned char * out = &blocks[(by * blocksX + bx) * blockSize];
+						if (_alpha)
+						{
+							encodeAlphaBlock(texel, out);
+							encodeColorBlock(texel, out + 8);
+						}
+						else
+							encodeColorBlock(texel, out);
+					}
+			}));
+		for (int t = 0; t < threadNum; t++)
+			threads[t].join();
+		return blocks;
+	}
+
+	inline std::vector<unsigned char> encode(const Image & _image, int _threadNum = 0)
+	{
+		return encode(_image.rgba.data(), _image.width, _image.height, _image.alpha, _threadNum);
+	}
+
+	/**********************************************************************************\
+	*
+	* The threads texture work runs on off the GL thread: the decoding of a Batch,
+	* and the compression and file write of images loaded one at a time. Jobs run
+	* in the order they are queued, one per thread, on a thread per core started
+	* with the first job. The threads finish the jobs left when the pool goes.
+	*
+	\**********************************************************************************/
+
+	class WorkerPool
+	{
+	private:
+		std::vector<std::thread> threads;
+		std::deque<std::function<void()> > jobs;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable idle;
+		unsigned int busyNum;
+		bool stopping;
+
+		void work()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+				if (jobs.empty()) return;
+				std::function<void()> job = jobs.front();
+				jobs.pop_front();
+				busyNum++;
+				lock.unlock();
+				job();
+				lock.lock();
+				busyNum--;
+				if (jobs.empty() && busyNum == 0) idle.notify_all();
+			}
+		}
+
+	public:
+		WorkerPool() : busyNum(0), stopping(false) {}
+
+		~WorkerPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (int t = 0; t < threads.size(); t++)
+				threads[t].join();
+		}
+
+		int getThreadNum() const { return std::max(1u, std::thread::hardware_concurrency()); }
+
+		void run(const std::function<void()> & _job)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (threads.empty())
+				for (int t = 0; t < getThreadNum(); t++)
+					threads.push_back(std::thread(&WorkerPool::work, this));
+			jobs.push_back(_job);
+			wake.notify_one();
+		}
+
+		// Block until every job queued so far is done
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [this]() { return jobs.empty() && busyNum == 0; });
+		}
+	};
+
+	// The pool the cache and every Batch queue their work on
+	inline WorkerPool & workers()
+	{
+		static WorkerPool pool;
+		return pool;
+	}
+
+	// Read-only view of a whole file
+	class MappedFile
+	{
+	private:
+		const unsigned char * data;
+		size_t size;
+#ifdef _WIN32
+		HANDLE file;
+		HANDLE mapping;
+#endif
+
+	public:
+		MappedFile() : data(NULL), size(0)
+#ifdef _WIN32
+			, file(INVALID_HANDLE_VALUE), mapping(NULL)
+#endif
+		{}
+		~MappedFile() { close(); }
+
+		bool open(const std::string & _filename)
+		{
+			close();
+#ifdef _WIN32
+			file = CreateFileA(_filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) return false;
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) { close(); return false; }
+			size = (size_t)fileSize.QuadPart;
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping) data = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+			int fd = ::open(_filename.c_str(), O_RDONLY);
+			if (fd < 0) return false;
+			struct stat status;
+			if (fstat(fd, &status) == 0 && status.st_size > 0)
+			{
+				size = (size_t)status.st_size;
+				void * view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (view != MAP_FAILED) data = (const unsigned char *)view;
+			}
+			::close(fd);
+#endif
+			if (!data) close();
+			return data != NULL;
+		}
+
+		void close()
+		{
+#ifdef _WIN32
+			if (data) UnmapViewOfFile(data);
+			if (mapping) CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+			mapping = NULL;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (data) munmap((void *)data, size);
+#endif
+			data = NULL;
+			size = 0;
+		}
+
+		const unsigned char * getData() const { return data; }
+		size_t getSize() const { return size; }
+	};
+
+	class Cache
+	{
+	private:
+		std::string directory;
+		bool enabled;
+		TextureMipmap::Filter filter;
+		bool initialized;
+		bool supported;
+
+		unsigned int loadNum;
+		unsigned int encodeNum;
+		unsigned int rawNum;
+		double loadTime;
+		double decodeTime;
+		double encodeTime;
+		double rawTime;
+		unsigned long long gpuBytes;
+		unsigned long long rgbaBytes;
+		// written by the workers storing the images load() queued
+		mutable std::mutex storeMutex;
+		unsigned int storeNum;
+		double storeTime;
+
+		static const unsigned char * identifier()
+		{
+			static const unsigned char ktx[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+			return ktx;
+		}
+
+		static double seconds(Clock::duration _duration)
+		{
+			return std::chrono::duration<double>(_duration).count();
+		}
+
+		void initialize()
+		{
+			initialized = true;
+			GLint count = 0;
+			glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+			for (GLint i = 0; i < count && !supported; i++)
+			{
+				const char * name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+				supported = name && strcmp(name, "GL_EXT_texture_compression_s3tc") == 0;
+			}
+			if (enabled && supported)
+			{
+#ifdef _WIN32
+				_mkdir(directory.c_str());
+#else
+				mkdir(directory.c_str(), 0755);
+#endif
+			}
+		}
+
+		unsigned long long key(const std::string & _filename) const
+		{
+			struct stat status;
+			unsigned long long fileSize = 0, modified = 0;
+			if (stat(_filename.c_str(), &status) == 0)
+			{
+				fileSize = (unsigned long long)status.st_size;
+				modified = (unsigned long long)status.st_mtime;
+			}
+			char text[64];
+			snprintf(text, sizeof(text), "|%llu|%llu|%d|%s", fileSize, modified, TEXTURE_CACHE_VERSION, TextureMipmap::getFilterName(filter));
+			std::string source = _filename + text;
+			unsigned long long h = 14695981039346656037ull;
+			for (int i = 0; i < source.size(); i++)
+				h = (h ^ (unsigned char)source[i]) * 1099511628211ull;
+			return h;
+		}
+
+		std::string filename(unsigned long long _key) const
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "%016llx.ktx", _key);
+			return directory + "/" + name;
+		}
+
+		// Bytes of RGBA8 the image and its mip chain would take
+		static unsigned long long rgbaSize(int _width, int _height)
+		{
+			unsigned long long bytes = 0;
+			while (true)
+			{
+				bytes += (unsigned long long)_width * _height * 4;
+				if (_width == 1 && _height == 1) return bytes;
+				_width = std::max(1, _width / 2);
+				_height = std::max(1, _height / 2);
+			}
+		}
+
+		// Queue the levels of a mapped KTX file for upload; false if it is not one this cache wrote
+		bool upload(const std::shared_ptr<MappedFile> & _file, GLuint _tex, int & _width, int & _height)
+		{
+			const unsigned char * data = _file->getData();
+			size_t size = _file->getSize();
+			unsigned int header[13];
+			if (size < 12 + sizeof(header) || memcmp(data, identifier(), 12) != 0) return false;
+			memcpy(header, data + 12, sizeof(header));
+			GLenum internalFormat = header[4];
+			unsigned int width = header[6], height = header[7], levels = header[11], keyValueBytes = header[12];
+			if (header[0] != 0x04030201 || (internalFormat != GL_COMPRESSED_RGB_S3TC_DXT1_EXT && internalFormat != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+				|| width == 0 || height == 0 || levels == 0 || levels > 32)
+				return false;
+			size_t offset = 12 + sizeof(header) + keyValueBytes;
+
+			std::vector<TextureStream::Level> chain;
+			for (unsigned int level = 0; level < levels; level++)
+			{
+				unsigned int imageSize = 0;
+				if (offset + 4 > size) return false;
+				memcpy(&imageSize, data + offset, 4);
+				offset += 4;
+				if (offset + imageSize > size) return false;
+				TextureStream::Level entry = { (int)level, (int)std::max(1u, width >> level), (int)std::max(1u, height >> level), data + offset, imageSize };
+				chain.push_back(entry);
+				offset += (imageSize + 3) & ~3u;
+				gpuBytes += imageSize;
+			}
+			TextureStream::shared().uploadLevels(_tex, internalFormat, chain, _file);
+			_width = width;
+			_height = height;
+			rgbaBytes += rgbaSize(width, height);
+			return true;
+		}
+
+		// The image and the levels below it, built on the CPU with the cache's filter; takes the texels over
+		std::shared_ptr<std::vector<TextureMipmap::Level> > buildChain(Image & _image, int _threadNum) const
+		{
+			std::shared_ptr<std::vector<TextureMipmap::Level> > chain = std::make_shared<std::vector<TextureMipmap::Level> >(1);
+			TextureMipmap::Level & top = chain->front();
+			top.width = _image.width;
+			top.height = _image.height;
+			top.rgba.swap(_image.rgba);
+			// the driver cannot filter a compressed chain, so it falls back to the box filter
+			std::vector<TextureMipmap::Level> below = TextureMipmap::generate(top.rgba.data(), top.width, top.height, filter, _threadNum);
+			for (int i = 0; i < below.size(); i++)
+			{
+				chain->push_back(TextureMipmap::Level());
+				chain->back().width = below[i].width;
+				chain->back().height = below[i].height;
+				chain->back().rgba.swap(below[i].rgba);
+			}
+			return chain;
+		}
+
+		// Compress a mip chain, level 0 first, and write it as a KTX file. The file is written
+		// under another name and renamed, so a lookup never maps one that is half written.
+		static void store(const std::string & _filename, unsigned long long _key, const std::vector<TextureMipmap::Level> & _chain, bool _alpha, int _threadNum)
+		{
+			std::vector<std::vector<unsigned char> > levels;
+			for (int i = 0; i < _chain.size(); i++)
+				levels.push_back(encode(_chain[i].rgba.data(), _chain[i].width, _chain[i].height, _alpha, _threadNum));
+
+			std::string partial = _filename + ".part";
+			std::ofstream file(partial, std::ios::binary | std::ios::trunc);
+			if (!file.is_open()) return;
+			char keyValue[48];
+			int keyValueLength = snprintf(keyValue, sizeof(keyValue), "cache.key%c%016llx", 0, _key) + 1;
+			unsigned int keyValueBytes = 4 + ((keyValueLength + 3) & ~3);
+			unsigned int header[13] = {
+				0x04030201,	// endianness
+				0, 1, 0,	// type, type size, format: compressed
+				(unsigned int)(_alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT),
+				(unsigned int)(_alpha ? GL_RGBA : GL_RGB),
+				(unsigned int)_chain[0].width, (unsigned int)_chain[0].height, 0,
+				0, 1, (unsigned int)levels.size(),	// array elements, faces, mip levels
+				keyValueBytes
+			};
+			file.write((const char *)identifier(), 12);
+			file.write((const char *)header, sizeof(header));
+			unsigned int keyValueLengthField = keyValueLength;
+			file.write((const char *)&keyValueLengthField, 4);
+			std::vector<char> padded(keyValueBytes - 4, 0);
+			memcpy(padded.data(), keyValue, keyValueLength);
+			file.write(padded.data(), padded.size());
+			for (int i = 0; i < levels.size(); i++)
+			{
+				unsigned int imageSize = (unsigned int)levels[i].size();
+				file.write((const char *)&imageSize, 4);
+				// block data is a multiple of 8 bytes, so no mip padding is needed
+				file.write((const char *)levels[i].data(), imageSize);
+			}
+			file.close();
+			if (!file) return;
+			std::remove(_filename.c_str());
+			std::rename(partial.c_str(), _filename.c_str());
+		}
+
+	public:
+		Cache(const std::string & _directory = TEXTURE_CACHE_DIRECTORY)
+			: directory(_directory)
+			, enabled(true)
+			, filter(TextureMipmap::Kaiser)
+			, initialized(false)
+			, supported(false)
+			, loadNum(0)
+			, encodeNum(0)
+			, rawNum(0)
+			, loadTime(0.0)
+			, decodeTime(0.0)
+			, encodeTime(0.0)
+			, rawTime(0.0)
+			, gpuBytes(0)
+			, rgbaBytes(0)
+			, storeNum(0)
+			, storeTime(0.0)
+		{
+			// made first, so the pool is still there when the destructor waits for it
+			workers();
+		}
+
+		// The files queued by load() are written before the program ends
+		~Cache() { workers().wait(); }
+
+		// Off: decode every image and upload it as RGBA8, leaving the stored files alone
+		void setEnabled(bool _enabled) { enabled = _enabled; }
+
+		// How mip chains are built; changing it makes the stored files of the old filter misses
+		void setMipmapFilter(TextureMipmap::Filter _filter) { filter = _filter; }
+		TextureMipmap::Filter getMipmapFilter() const { return filter; }
+
+		// An image file decoded, and compressed into the cache when it is on, by prepare()
+		struct Prepared
+		{
+			unsigned long long key;
+			// the compressed copy was written; the source is only the fallback
+			bool stored;
+			TextureStream::Source source;
+			// RGBA8 levels from level 0 down, when the chain is built on the CPU; uploaded if not stored
+			std::shared_ptr<std::vector<TextureMipmap::Level> > chain;
+			double decodeTime;
+			// compression, or building the chain when it is not stored
+			double encodeTime;
+
+			Prepared() : key(0), stored(false), decodeTime(0.0), encodeTime(0.0) {}
+		};
+
+		// Texture for an image file, with its mip chain, queued on the texture stream. _decode
+		// fills the source and only runs when no compressed copy is stored; the copy for later
+		// runs is then made on the worker pool while this one uploads RGBA8. 0 if the image
+		// cannot be decoded.
+		GLuint load(const std::string & _filename, const std::function<bool(TextureStream::Source &)> & _decode, int & _width, int & _height)
+		{
+			GLuint tex = lookup(_filename, _width, _height);
+			if (tex) return tex;
+			Prepared prepared;
+			if (!prepare(_filename, _decode, prepared, 0, true)) return 0;
+			return finish(prepared, _width, _height);
+		}
+
+		// load() in three steps, so that decoding can move off the GL thread:
+		// lookup() on the GL thread, texture from the stored compressed copy or 0 on a miss
+		GLuint lookup(const std::string & _filename, int & _width, int & _height)
+		{
+			Clock::time_point start = Clock::now();
+			if (!initialized) initialize();
+			if (!enabled || !supported) return 0;
+			GLuint tex = 0;
+			glGenTextures(1, &tex);
+			std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+			if (file->open(filename(key(_filename))) && upload(file, tex, _width, _height))
+			{
+				loadNum++;
+				loadTime += seconds(Clock::now() - start);
+				return tex;
+			}
+			glDeleteTextures(1, &tex);
+			return 0;
+		}
+
+		// prepare() on any thread once lookup() has run: decode, then compress and store on
+		// _threadNum threads (0: all cores), or with _background queue that on the worker pool
+		// and keep the RGBA8 chain for finish(). false if the image cannot be decoded.
+		bool prepare(const std::string & _filename, const std::function<bool(TextureStream::Source &)> & _decode, Prepared & _prepared, int _threadNum = 0, bool _background = false)
+		{
+			Clock::time_point start = Clock::now();
+			_prepared.key = key(_filename);
+			TextureStream::Source & source = _prepared.source;
+			if (!_decode(source) || source.width <= 0 || source.height <= 0 || source.channels < 1 || source.channels > 4 || !source.pixels)
+			{
+				source.free();
+				return false;
+			}
+			Clock::time_point decoded = Clock::now();
+			_prepared.decodeTime = seconds(decoded - start);
+			bool caching = enabled && supported;
+			if (!caching && filter == TextureMipmap::Driver)
+				return true;
+			Image image(source);
+			source.free();
+			bool alpha = image.alpha;
+			_prepared.chain = buildChain(image, _threadNum);
+			if (caching && !_background)
+			{
+				store(filename(_prepared.key), _prepared.key, *_prepared.chain, alpha, _threadNum);
+				_prepared.stored = true;
+			}
+			else if (caching)
+			{
+				// the chain is only read from here on, by the worker and by the texture stream alike
+				std::string file = filename(_prepared.key);
+				unsigned long long key = _prepared.key;
+				std::shared_ptr<const std::vector<TextureMipmap::Level> > chain = _prepared.chain;
+				workers().run([this, file, key, chain, alpha]()
+				{
+					Clock::time_point start = Clock::now();
+					store(file, key, *chain, alpha, 1);
+					std::lock_guard<std::mutex> lock(storeMutex);
+					storeNum++;
+					storeTime += seconds(Clock::now() - start);
+				});
+			}
+			_prepared.encodeTime = seconds(Clock::now() - decoded);
+			return true;
+		}
+
+		// finish() on the GL thread: texture for a prepared image, queued on the texture stream
+		GLuint finish(Prepared & _prepared, int & _width, int & _height)
+		{
+			Clock::time_point start = Clock::now();
+			TextureStream::Source & source = _prepared.source;
+			decodeTime += _prepared.decodeTime;
+			GLuint tex = 0;
+			glGenTextures(1, &tex);
+			if (_prepared.stored)
+			{
+				std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+				if (file->open(filename(_prepared.key)) && upload(file, tex, _width, _height))
+				{
+					_prepared.chain.reset();
+					encodeNum++;
+					encodeTime += _prepared.encodeTime + seconds(Clock::now() - start);
+					return tex;
+				}
+			}
+
+			if (_prepared.chain)
+			{
+				// the CPU-built chain, kept alive by the stream until its last level is sent
+				std::vector<TextureMipmap::Level> & chain = *_prepared.chain;
+				std::vector<TextureStream::Level> levels;
+				for (int i = 0; i < chain.size(); i++)
+				{
+					TextureStream::Level entry = { i, chain[i].width, chain[i].height, chain[i].rgba.data(), chain[i].rgba.size() };
+					levels.push_back(entry);
+				}
+				_width = chain[0].width;
+				_height = chain[0].height;
+				gpuBytes += rgbaSize(_width, _height);
+				rgbaBytes += rgbaSize(_width, _height);
+				TextureStream::shared().uploadLevels(tex, GL_RGBA, levels, _prepared.chain);
+				_prepared.chain.reset();
+				rawNum++;
+				rawTime += _prepared.encodeTime + seconds(Clock::now() - start);
+				return tex;
+			}
+
+			// the stream converts the decoder's pixels and frees them once they are uploaded
+			_width = source.width;
+			_height = source.height;
+			gpuBytes += rgbaSize(source.width, source.height);
+			rgbaBytes += rgbaSize(source.width, source.height);
+			TextureStream::shared().uploadImage(tex, source);
+			rawNum++;
+			rawTime += seconds(Clock::now() - start);
+			return tex;
+		}
+
+		void report(std::ostream & out) const
+		{
+			unsigned int textureNum = loadNum + encodeNum + rawNum;
+			if (textureNum == 0) return;
+			out << "Texture cache: " << textureNum << " textures, " << loadNum << " mapped from compressed files";
+			if (loadNum > 0) out << " (" << loadTime / loadNum * 1000.0 << " ms each)";
+			out << ", " << encodeNum + rawNum << " decoded";
+			if (encodeNum + rawNum > 0) out << " (" << decodeTime / (encodeNum + rawNum) * 1000.0 << " ms each)";
+			if (encodeNum > 0) out << ", " << encodeNum << " compressed (" << encodeTime / encodeNum * 1000.0 << " ms each)";
+			if (rawNum > 0) out << ", " << rawNum << " queued as RGBA8 (" << rawTime / rawNum * 1000.0 << " ms each)";
+			{
+				std::lock_guard<std::mutex> lock(storeMutex);
+				if (storeNum > 0) out << ", " << storeNum << " compressed for later runs on the worker pool (" << storeTime / storeNum * 1000.0 << " ms each)";
+			}
+			if (!enabled) out << ", cache off";
+			else if (initialized && !supported) out << ", S3TC unsupported";
+			out << std::endl;
+			out << "Texture cache: GPU memory " << gpuBytes / 1024.0 << " KB, " << rgbaBytes / 1024.0 << " KB as RGBA8 ("
+				<< (gpuBytes > 0 ? double(rgbaBytes) / gpuBytes : 1.0) << "x smaller)" << std::endl;
+		}
+	};
+
+	// The cache the application's textures go through
+	inline Cache & shared()
+	{
+		static Cache cache;
+		return cache;
+	}
+
+	/**********************************************************************************\
+	*
+	* A Batch loads a set of images at once: compressed copies are looked up on the
+	* GL thread, the rest are decoded (and compressed into the cache) on the worker
+	* pool, and the GL thread queues each for upload as soon as its worker is done,
+	* in completion order. A file that appears twice is decoded once.
+	*
+	\**********************************************************************************/
+
+	class Batch
+	{
+	public:
+		// Called on the GL thread with the texture (0 if the image could not be decoded) and its size
+		typedef std::function<void(GLuint, int, int)> Done;
+
+	private:
+		struct Entry
+		{
+			std::string filename;
+			std::function<bool(TextureStream::Source &)> decode;
+			Done done;
+			Cache::Prepared prepared;
+			bool decoded;
+		};
+
+		std::vector<Entry> entries;
+
+		unsigned int lookupNum;
+		unsigned int decodeNum;
+		int threadNum;
+		double wallTime;
+		double workTime;
+
+	public:
+		Batch() : lookupNum(0), decodeNum(0), threadNum(0), wallTime(0.0), workTime(0.0) {}
+
+		void add(const std::string & _filename, const std::function<bool(TextureStream::Source &)> & _decode, const Done & _done)
+		{
+			Entry entry;
+			entry.filename = _filename;
+			entry.decode = _decode;
+			entry.done = _done;
+			entry.decoded = false;
+			entries.push_back(entry);
+		}
+
+		size_t size() const { return entries.size(); }
+
+		// Load every image added on the worker pool, each decoded, filtered and compressed whole by
+		// the worker that takes it; returns once all are queued for upload
+		void run(Cache & _cache = shared())
+		{
+			Clock::time_point start = Clock::now();
+			std::vector<int> work, repeated;
+			std::vector<std::string> seen;
+			for (int i = 0; i < entries.size(); i++)
+			{
+				int width = 0, height = 0;
+				if (std::find(seen.begin(), seen.end(), entries[i].filename) != seen.end())
+				{
+					repeated.push_back(i);
+					continue;
+				}
+				seen.push_back(entries[i].filename);
+				GLuint tex = _cache.lookup(entries[i].filename, width, height);
+				if (tex)
+				{
+					lookupNum++;
+					entries[i].done(tex, width, height);
+				}
+				else
+					work.push_back(i);
+			}
+
+			threadNum = std::max(1, std::min<int>(workers().getThreadNum(), (int)work.size()));
+			std::mutex mutex;
+			std::condition_variable ready;
+			std::vector<int> finished;
+			for (int w = 0; w < (int)work.size(); w++)
+			{
+				int index = work[w];
+				workers().run([&, index]()
+				{
+					Entry & entry = entries[index];
+					entry.decoded = _cache.prepare(entry.filename, entry.decode, entry.prepared, 1);
+					std::lock_guard<std::mutex> lock(mutex);
+					finished.push_back(index);
+					ready.notify_one();
+				});
+			}
+
+			// upload in the order the workers finish, while they go on with the rest
+			for (size_t handled = 0; handled < work.size(); handled++)
+			{
+				int index;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					ready.wait(lock, [&]() { return finished.size() > handled; });
+					index = finished[handled];
+				}
+				Entry & entry = entries[index];
+				int width = 0, height = 0;
+				GLuint tex = entry.decoded ? _cache.finish(entry.prepared, width, height) : 0;
+				if (entry.decoded)
+				{
+					decodeNum++;
+					workTime += entry.prepared.decodeTime + entry.prepared.encodeTime;
+				}
+				entry.done(tex, width, height);
+			}
+
+			// repeats find the compressed copy stored by the first, or decode again with the cache off
+			for (int i = 0; i < repeated.size(); i++)
+			{
+				Entry & entry = entries[repeated[i]];
+				int width = 0, height = 0;
+				GLuint tex = _cache.load(entry.filename, entry.decode, width, height);
+				entry.done(tex, width, height);
+			}
+			entries.clear();
+			wallTime += std::chrono::duration<double>(Clock::now() - start).count();
+		}
+
+		void report(std::ostream & out) const
+		{
+			if (lookupNum + decodeNum == 0) return;
+			out << "Texture batch: " << lookupNum + decodeNum << " textures in " << wallTime * 1000.0 << " ms, "
+				<< lookupNum << " from compressed files, " << decodeNum << " decoded";
+			if (decodeNum > 0)
+				out << " on " << threadNum << " threads (" << workTime * 1000.0 << " ms of decoding and compression, "
+					<< workTime / std::max(wallTime, 1e-9) << "x parallel)";
+			out << std::endl;
+		}
+	};
+}
@@ -0,0 +1,377 @@
+// Texture Mipmaps
+// Builds mip chains on the CPU, filtering in linear light rather than on the sRGB-encoded texels
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define TEXTURE_MIPMAP_SSE 1
+#endif
+
+#include "gl_env.h"
+
+// Kaiser window: radius in texels of the smaller level, and its shape
+#define TEXTURE_MIPMAP_KAISER_RADIUS 3.0
+#define TEXTURE_MIPMAP_KAISER_ALPHA 4.0
+// entries of the linear -> sRGB table
+#define TEXTURE_MIPMAP_ENCODE_SIZE 4096
+
+/**********************************************************************************\
+*
+* Texels are decoded from sRGB to linear floats through a 256-entry table, and
+* every level is filtered from the float level above it, so rounding does not
+* pile up down the chain. The filter is separable: a horizontal pass into a
+* scratch level, then a vertical one, both on rows spread over the cores, each
+* RGBA texel one SSE register. Levels are encoded back to 8-bit sRGB through a
+* 4096-entry table; alpha is filtered as it is, without the sRGB curve.
+*
+* Box averages the texels under each smaller texel (fractional weights for odd
+* sizes). Kaiser is a Kaiser-windowed sinc: sharper, at the cost of 12 taps per
+* axis instead of 2. Driver leaves the chain to glGenerateMipmap, which filters
+* the sRGB-encoded values directly and darkens high-contrast detail as the
+* levels get smaller.
+*
+\**********************************************************************************/
+
+namespace TextureMipmap
+{
+	typedef std::chrono::steady_clock Clock;
+
+	enum Filter
+	{
+		Driver,	// glGenerateMipmap
+		Box,	// box filter in linear light
+		Kaiser	// Kaiser-windowed sinc in linear light
+	};
+
+	inline const char * getFilterName(Filter _filter)
+	{
+		switch (_filter)
+		{
+		case Driver: return "gpu";
+		case Box: return "box";
+		default: return "kaiser";
+		}
+	}
+
+	inline bool parseFilter(const std::string & _name, Filter & _filter)
+	{
+		for (int f = Driver; f <= Kaiser; f++)
+			if (_name == getFilterName(Filter(f)))
+			{
+				_filter = Filter(f);
+				return true;
+			}
+		return false;
+	}
+
+	// One level, 8-bit sRGB RGBA texels
+	struct Level
+	{
+		int width;
+		int height;
+		std::vector<unsigned char> rgba;
+	};
+
+	// sRGB -> linear for each 8-bit value; built once, also when the first callers are worker threads
+	inline const float * decodeTable()
+	{
+		static const std::vector<float> table = []()
+		{
+			std::vector<float> values(256);
+			for (int i = 0; i < 256; i++)
+			{
+				double c = i / 255.0;
+				values[i] = (float)(c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+			}
+			return values;
+		}();
+		return table.data();
+	}
+
+	// linear -> 8-bit sRGB, indexed by linear * (TEXTURE_MIPMAP_ENCODE_SIZE - 1)
+	inline const unsigned char * encodeTable()
+	{
+		static const std::vector<unsigned char> table = []()
+		{
+			std::vector<unsigned char> values(TEXTURE_MIPMAP_ENCODE_SIZE);
+			for (int i = 0; i < TEXTURE_MIPMAP_ENCODE_SIZE; i++)
+			{
+				double l = i / double(TEXTURE_MIPMAP_ENCODE_SIZE - 1);
+				double c = l <= 0.0031308 ? l * 12.92 : 1.055 * std::pow(l, 1.0 / 2.4) - 0.055;
+				values[i] = (unsigned char)std::min(255.0, std::max(0.0, c * 255.0 + 0.5));
+			}
+			return values;
+		}();
+		return table.data();
+	}
+
+	inline double bessel0(double _x)
+	{
+		double sum = 1.0, term = 1.0;
+		for (int k = 1; k < 32; k++)
+		{
+			term *= (_x / (2.0 * k)) * (_x / (2.0 * k));
+			sum += term;
+		}
+		return sum;
+	}
+
+	// Filter weight at _x texels of the smaller level from its texel center
+	inline double kaiser(double _x)
+	{
+		double ratio = _x / TEXTURE_MIPMAP_KAISER_RADIUS;
+		if (ratio <= -1.0 || ratio >= 1.0) return 0.0;
+		const double pi = 3.14159265358979323846;
+		double sinc = std::fabs(_x) < 1e-9 ? 1.0 : std::sin(pi * _x) / (pi * _x);
+		return sinc * bessel0(TEXTURE_MIPMAP_KAISER_ALPHA * std::sqrt(1.0 - ratio * ratio)) / bessel0(TEXTURE_MIPMAP_KAISER_ALPHA);
+	}
+
+	// Taps of one axis: for output i, tapNum source indices and weights. Taps past the edge
+	// wrap around, as the textures repeat; clamping would weigh the edge texels too much.
+	struct Taps
+	{
+		int tapNum;
+		std::vector<int> index;
+		std::vector<float> weight;
+
+		Taps(int _from, int _to, Filter _filter)
+		{
+			double scale = double(_from) / _to;
+			double radius = _filter == Kaiser ? TEXTURE_MIPMAP_KAISER_RADIUS * scale : 0.5 * scale;
+			tapNum = (int)std::ceil(2.0 * radius) + 1;
+			index.resize(_to * tapNum);
+			weight.resize(_to * tapNum);
+			for (int i = 0; i < _to; i++)
+			{
+				double center = (i + 0.5) * scale;
+				int first = (int)std::floor(center - radius);
+				double sum = 0.0;
+				for (int t = 0; t < tapNum; t++)
+				{
+					int j = first + t;
+					double w;
+					if (_filter == Kaiser)
+						w = kaiser((j + 0.5 - center) / scale);
+					else
+						// overlap of source texel [j, j + 1] with the footprint of output i
+						w = std::max(0.0, std::min(j + 1.0, center + radius) - std::max(double(j), center - radius));
+					index[i * tapNum + t] = ((j % _from) + _from) % _from;
+					weight[i * tapNum + t] = (float)w;
+					sum += w;
+				}
+				for (int t = 0; t < tapNum; t++)
+					weight[i * tapNum + t] = (float)(weight[i * tapNum + t] / sum);
+			}
+		}
+	};
+
+	// Run _body(first, last) over [0, _count) split into bands, one per thread
+	template <typename Body>
+	inline void parallelRows(int _count, int _threadNum, const Body & _body)
+	{
+		int threadNum = std::max(1, std::min(_threadNum, _count / 16));
+		if (threadNum == 1)
+		{
+			_body(0, _count);
+			return;
+		}
+		std::vector<std::thread> threads;
+		for (int t = 0; t < threadNum; t++)
+			threads.push_back(std::thread([&, t]() { _body(_count * t / threadNum, _count * (t + 1) / threadNum); }));
+		for (int t = 0; t < threadNum; t++)
+			threads[t].join();
+	}
+
+	// Sum of _tapNum float RGBA texels of _row at _index, weighted
+	inline void filterTaps(const float * _row, const int * _index, const float * _weight, int _tapNum, int _stride, float * _out)
+	{
+#ifdef TEXTURE_MIPMAP_SSE
+		__m128 sum = _mm_setzero_ps();
+		for (int t = 0; t < _tapNum; t++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(_row + _index[t] * _stride), _mm_set1_ps(_weight[t])));
+		_mm_storeu_ps(_out, sum);
+#else
+		float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (int t = 0; t < _tapNum; t++)
+			for (int c = 0; c < 4; c++)
+				sum[c] += _row[_index[t] * _stride + c] * _weight[t];
+		for (int c = 0; c < 4; c++)
+			_out[c] = sum[c];
+#endif
+	}
+
+	// Next level of a float RGBA level
+	inline std::vector<float> reduce(const std::vector<float> & _level, int _width, int _height, int _toWidth, int _toHeight, Filter _filter, int _threadNum)
+	{
+		if (_filter == Box && _width == 2 * _toWidth && _height == 2 * _toHeight)
+		{
+			// even sizes: each texel is the mean of a 2x2 block, in one pass
+			std::vector<float> result((size_t)_toWidth * _toHeight * 4);
+			parallelRows(_toHeight, _threadNum, [&](int _first, int _last)
+			{
+				for (int y = _first; y < _last; y++)
+				{
+					const float * top = &_level[(size_t)2 * y * _width * 4];
+					const float * bottom = top + (size_t)_width * 4;
+					float * out = &result[(size_t)y * _toWidth * 4];
+					for (int x = 0; x < _toWidth; x++, top += 8, bottom += 8, out += 4)
+					{
+#ifdef TEXTURE_MIPMAP_SSE
+						__m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(top), _mm_loadu_ps(top + 4)), _mm_add_ps(_mm_loadu_ps(bottom), _mm_loadu_ps(bottom + 4)));
+						_mm_storeu_ps(out, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+#else
+						for (int c = 0; c < 4; c++)
+							out[c] = (top[c] + top[4 + c] + bottom[c] + bottom[4 + c]) * 0.25f;
+#endif
+					}
+				}
+			});
+			return result;
+		}
+
+		Taps across(_width, _toWidth, _filter), down(_height, _toHeight, _filter);
+		std::vector<float> scratch((size_t)_toWidth * _height * 4), result((size_t)_toWidth * _toHeight * 4);
+		parallelRows(_height, _threadNum, [&](int _first, int _last)
+		{
+			for (int y = _first; y < _last; y++)
+				for (int x = 0; x < _toWidth; x++)
+					filterTaps(&_level[(size_t)y * _width * 4], &across.index[x * across.tapNum], &across.weight[x * across.tapNum], across.tapNum, 4,
+						&scratch[((size_t)y * _toWidth + x) * 4]);
+		});
+		parallelRows(_toHeight, _threadNum, [&](int _first, int _last)
+		{
+			for (int y = _first; y < _last; y++)
+				for (int x = 0; x < _toWidth; x++)
+					filterTaps(&scratch[(size_t)x * 4], &down.index[y * down.tapNum], &down.weight[y * down.tapNum], down.tapNum, _toWidth * 4,
+						&result[((size_t)y * _toWidth + x) * 4]);
+		});
+		return result;
+	}
+
+	// The whole chain below level 0, from _width x _height down to 1 x 1; level 0 is not copied
+	inline std::vector<Level> generate(const unsigned char * _rgba, int _width, int _height, Filter _filter, int _threadNum = 0)
+	{
+		if (_threadNum <= 0) _threadNum = std::max(1u, std::thread::hardware_concurrency());
+		if (_filter == Driver) _filter = Box;
+		const float * decode = decodeTable();
+		const unsigned char * encode = encodeTable();
+
+		std::vector<float> level((size_t)_width * _height * 4);
+		parallelRows(_height, _threadNum, [&](int _first, int _last)
+		{
+			for (size_t i = (size_t)_first * _width * 4; i < (size_t)_last * _width * 4; i += 4)
+			{
+				level[i] = decode[_rgba[i]];
+				level[i + 1] = decode[_rgba[i + 1]];
+				level[i + 2] = decode[_rgba[i + 2]];
+				level[i + 3] = _rgba[i + 3] / 255.0f;
+			}
+		});
+
+		std::vector<Level> chain;
+		int width = _width, height = _height;
+		while (width > 1 || height > 1)
+		{
+			int toWidth = std::max(1, width / 2), toHeight = std::max(1, height / 2);
+			level = reduce(level, width, height, toWidth, toHeight, _filter, _threadNum);
+			width = toWidth;
+			height = toHeight;
+
+			Level out;
+			out.width = width;
+			out.height = height;
+			out.rgba.resize((size_t)width * height * 4);
+			parallelRows(height, _threadNum, [&](int _first, int _last)
+			{
+				for (size_t i = (size_t)_first * width * 4; i < (size_t)_last * width * 4; i += 4)
+				{
+					// the sinc lobes can overshoot
+					for (int c = 0; c < 3; c++)
+						out.rgba[i + c] = encode[(int)(std::min(1.0f, std::max(0.0f, level[i + c])) * (TEXTURE_MIPMAP_ENCODE_SIZE - 1) + 0.5f)];
+					out.rgba[i + 3] = (unsigned char)(std::min(1.0f, std::max(0.0f, level[i + 3])) * 255.0f + 0.5f);
+				}
+			});
+			chain.push_back(out);
+		}
+		return chain;
+	}
+
+	// Mean linear RGB of a level, to see how much brightness the filtering keeps
+	inline double brightness(const unsigned char * _rgba, int _width, int _height)
+	{
+		const float * decode = decodeTable();
+		double sum = 0.0;
+		for (size_t i = 0; i < (size_t)_width * _height * 4; i += 4)
+			sum += decode[_rgba[i]] + decode[_rgba[i + 1]] + decode[_rgba[i + 2]];
+		return sum / (3.0 * _width * _height);
+	}
+
+	// Time the box and Kaiser chains against glGenerateMipmap on one image (GL context needed),
+	// and report the largest brightness drift of a level from level 0 for each, and at which level
+	inline void benchmark(const std::string & _name, const unsigned char * _rgba, int _width, int _height, std::ostream & out)
+	{
+		double base = brightness(_rgba, _width, _height);
+		out << "Mipmaps of " << _name << " (" << _width << " x " << _height << "):" << std::endl;
+		for (int f = Box; f <= Kaiser; f++)
+		{
+			Clock::time_point start = Clock::now();
+			std::vector<Level> chain = generate(_rgba, _width, _height, Filter(f));
+			double time = std::chrono::duration<double>(Clock::now() - start).count();
+			double drift = 0.0;
+			int driftLevel = 0;
+			for (int i = 0; i < chain.size(); i++)
+			{
+				double levelDrift = std::fabs(brightness(chain[i].rgba.data(), chain[i].width, chain[i].height) / base - 1.0);
+				if (levelDrift > drift)
+				{
+					drift = levelDrift;
+					driftLevel = i + 1;
+				}
+			}
+			out << "  " << getFilterName(Filter(f)) << ": " << time * 1000.0 << " ms on the CPU, brightness drift up to "
+				<< drift * 100.0 << "% (level " << driftLevel << ")" << std::endl;
+		}
+
+		GLuint tex = 0;
+		glGenTextures(1, &tex);
+		glBindTexture(GL_TEXTURE_2D, tex);
+		// a first call may set the driver's blit path up; keep that out of the timing
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 4, 4, 0, GL_RGBA, GL_UNSIGNED_BYTE, _rgba);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _width, _height, 0, GL_RGBA, GL_UNSIGNED_BYTE, _rgba);
+		glFinish();
+		Clock::time_point start = Clock::now();
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glFinish();
+		double time = std::chrono::duration<double>(Clock::now() - start).count();
+		double drift = 0.0;
+		int driftLevel = 0;
+		std::vector<unsigned char> level;
+		for (int i = 1, width = _width, height = _height; width > 1 || height > 1; i++)
+		{
+			width = std::max(1, width / 2);
+			height = std::max(1, height / 2);
+			level.resize((size_t)width * height * 4);
+			glGetTexImage(GL_TEXTURE_2D, i, GL_RGBA, GL_UNSIGNED_BYTE, level.data());
+			double levelDrift = std::fabs(brightness(level.data(), width, height) / base - 1.0);
+			if (levelDrift > drift)
+			{
+				drift = levelDrift;
+				driftLevel = i;
+			}
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glDeleteTextures(1, &tex);
+		out << "  " << getFilterName(Driver) << ": " << time * 1000.0 << " ms in glGenerateMipmap, brightness drift up to "
+			<< drift * 100.0 << "% (level " << driftLevel << ")" << std::endl;
+	}
+}
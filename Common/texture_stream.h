@@ -0,0 +1,582 @@
+// Texture Streaming
+// Uploads texture data through a ring of pixel buffer memory, a few megabytes per frame
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TEXTURE_STREAM_SSSE3
+#else
+#define TEXTURE_STREAM_SSSE3 __attribute__((target("ssse3")))
+#endif
+#define TEXTURE_STREAM_SIMD 1
+#endif
+
+#include "gl_env.h"
+
+#define TEXTURE_STREAM_RING_SIZE (16 << 20)
+#define TEXTURE_STREAM_DEFAULT_BUDGET (4 << 20)
+
+/**********************************************************************************\
+*
+* Decoders hand over their pixels as they are (channel count, BGR or RGB order,
+* row order) in a Source. Uploads are queued and update(), once per frame,
+* converts the next rows straight into the ring with a SIMD swizzle that also
+* flips the rows where needed, then issues glTexSubImage2D from the ring offset.
+* Whole mip chains (block-compressed, or RGBA8 built on the CPU) are copied into
+* the ring level by level, smallest level first; GL_TEXTURE_BASE_LEVEL follows
+* the finest complete level, so the texture sharpens as the levels arrive.
+*
+* Each chunk is fenced. A frame moves at most its byte budget and never waits for
+* the GPU: when the ring space it needs is still being read, the rest is left for
+* the next frame. finish() uploads everything and waits where it has to. With
+* glBufferStorage the ring is mapped once, persistently; otherwise every chunk
+* maps its range unsynchronized. A budget of 0 uploads each texture whole when it
+* is queued, from client memory.
+*
+\**********************************************************************************/
+
+namespace TextureStream
+{
+	typedef std::chrono::steady_clock Clock;
+
+	// Decoded pixels in the decoder's own layout, kept alive until they are uploaded
+	struct Source
+	{
+		int width;
+		int height;
+		// 1 gray, 2 gray + alpha, 3 RGB, 4 RGBA
+		int channels;
+		// color channels stored blue first
+		bool bgr;
+		// rows stored in the opposite order to glTexImage2D's, bottom row first
+		bool flip;
+		const unsigned char * pixels;
+		size_t pitch;
+		// frees the pixels; run once they are not needed any more
+		std::function<void()> release;
+
+		Source() : width(0), height(0), channels(0), bgr(false), flip(false), pixels(NULL), pitch(0) {}
+
+		bool alpha() const { return channels == 2 || channels == 4; }
+
+		void free()
+		{
+			if (release) release();
+			release = std::function<void()>();
+			pixels = NULL;
+		}
+	};
+
+#ifdef TEXTURE_STREAM_SIMD
+	inline bool hasSSSE3()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+#else
+		return __builtin_cpu_supports("ssse3");
+#endif
+	}
+
+	// RGB or BGR to RGBA, 4 texels per shuffle; returns the texels done
+	TEXTURE_STREAM_SSSE3 inline int convertRow3(const unsigned char * _in, unsigned char * _out, int _width, bool _bgr)
+	{
+		const __m128i order = _bgr
+			? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+			: _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i opaque = _mm_set1_epi32((int)0xff000000);
+		int x = 0;
+		// a load takes 16 bytes for the 12 it uses, so it stops 6 texels short of the row end
+		for (; x + 6 <= _width; x += 4)
+		{
+			__m128i texels = _mm_loadu_si128((const __m128i *)(_in + x * 3));
+			_mm_storeu_si128((__m128i *)(_out + x * 4), _mm_or_si128(_mm_shuffle_epi8(texels, order), opaque));
+		}
+		return x;
+	}
+
+	// BGRA to RGBA, 4 texels per shuffle
+	TEXTURE_STREAM_SSSE3 inline int convertRow4(const unsigned char * _in, unsigned char * _out, int _width)
+	{
+		const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		int x = 0;
+		for (; x + 4 <= _width; x += 4)
+		{
+			__m128i texels = _mm_loadu_si128((const __m128i *)(_in + x * 4));
+			_mm_storeu_si128((__m128i *)(_out + x * 4), _mm_shuffle_epi8(texels, order));
+		}
+		return x;
+	}
+#endif
+
+	// One row of the source as RGBA8
+	inline void convertRow(const Source & _source, const unsigned char * _in, unsigned char * _out)
+	{
+		int width = _source.width, x = 0;
+		if (_source.channels == 4 && !_source.bgr)
+		{
+			memcpy(_out, _in, width * 4);
+			return;
+		}
+#ifdef TEXTURE_STREAM_SIMD
+		static const bool simd = hasSSSE3();
+		if (simd && _source.channels == 3)
+			x = convertRow3(_in, _out, width, _source.bgr);
+		else if (simd && _source.channels == 4)
+			x = convertRow4(_in, _out, width);
+#endif
+		int r = _source.bgr ? 2 : 0, b = _source.bgr ? 0 : 2;
+		for (; x < width; x++)
+		{
+			const unsigned char * in = _in + x * _source.channels;
+			unsigned char * out = _out + x * 4;
+			switch (_source.channels)
+			{
+			case 1: out[0] = out[1] = out[2] = in[0]; out[3] = 255; break;
+			case 2: out[0] = out[1] = out[2] = in[0]; out[3] = in[1]; break;
+			case 3: out[0] = in[r]; out[1] = in[1]; out[2] = in[b]; out[3] = 255; break;
+			default: out[0] = in[r]; out[1] = in[1]; out[2] = in[b]; out[3] = in[3]; break;
+			}
+		}
+	}
+
+	// Rows _first to _first + _count - 1, in glTexImage2D's order, as tightly packed RGBA8
+	inline void convertRows(const Source & _source, int _first, int _count, unsigned char * _out)
+	{
+		for (int y = _first; y < _first + _count; y++, _out += _source.width * 4)
+		{
+			int row = _source.flip ? _source.height - 1 - y : y;
+			convertRow(_source, _source.pixels + row * _source.pitch, _out);
+		}
+	}
+
+	// One mip level, block-compressed or RGBA8
+	struct Level
+	{
+		int level;
+		int width;
+		int height;
+		const unsigned char * data;
+		size_t size;
+	};
+
+	class Uploader
+	{
+	private:
+		struct Job
+		{
+			GLuint tex;
+			// a chain of levels rather than a source
+			bool chain;
+			Source source;
+			GLenum format;
+			// smallest level first
+			std::vector<Level> levels;
+			std::shared_ptr<const void> owner;
+			// next level and row (block row for block-compressed levels) to upload
+			int level;
+			int row;
+			Clock::time_point queued;
+		};
+
+		// ring bytes the GPU may still be reading
+		struct Span
+		{
+			size_t begin;
+			size_t end;
+			GLsync fence;
+		};
+
+		size_t budget;
+		bool initialized;
+		bool supported;
+		bool persistent;
+		GLuint buffer;
+		unsigned char * mapped;
+		size_t head;
+		std::deque<Span> spans;
+		std::deque<Job> jobs;
+
+		unsigned int textureNum;
+		unsigned long long byteNum;
+		unsigned long long chunkNum;
+		unsigned long long frameNum;
+		unsigned long long deferNum;
+		unsigned long long waitNum;
+		size_t maxFrameBytes;
+		double updateTime;
+		double maxUpdateTime;
+		double latency;
+		double maxLatency;
+
+		static double seconds(Clock::duration _duration)
+		{
+			return std::chrono::duration<double>(_duration).count();
+		}
+
+		void initialize()
+		{
+			initialized = true;
+			supported = glFenceSync && glClientWaitSync && glMapBufferRange;
+			if (!supported) return;
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+			persistent = glBufferStorage != NULL;
+			if (persistent)
+			{
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				glBufferStorage(GL_PIXEL_UNPACK_BUFFER, TEXTURE_STREAM_RING_SIZE, NULL, flags);
+				mapped = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TEXTURE_STREAM_RING_SIZE, flags);
+				persistent = mapped != NULL;
+			}
+			if (!persistent)
+			{
+				// a buffer made by glBufferStorage is immutable, so start over with a new one
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				glDeleteBuffers(1, &buffer);
+				glGenBuffers(1, &buffer);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, TEXTURE_STREAM_RING_SIZE, NULL, GL_STREAM_DRAW);
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+
+		bool signaled(GLsync _fence, bool _wait)
+		{
+			GLenum status = glClientWaitSync(_fence, 0, 0);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) return true;
+			if (!_wait) return false;
+			waitNum++;
+			while (glClientWaitSync(_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+				;
+			return true;
+		}
+
+		// Ring space for _size bytes; false if the GPU still reads it and _wait is off
+		bool allocate(size_t _size, bool _wait, size_t & _offset)
+		{
+			_size = (_size + 15) & ~(size_t)15;
+			size_t begin = head + _size > TEXTURE_STREAM_RING_SIZE ? 0 : head;
+			for (size_t i = 0; i < spans.size(); i++)
+				if (spans[i].begin < begin + _size && begin < spans[i].end && !signaled(spans[i].fence, _wait))
+					return false;
+			// fences complete in order, so everything up to the last overlapping span is done
+			while (!spans.empty() && signaled(spans.front().fence, false))
+			{
+				glDeleteSync(spans.front().fence);
+				spans.pop_front();
+			}
+			_offset = begin;
+			head = begin + _size;
+			return true;
+		}
+
+		unsigned char * map(size_t _offset, size_t _size)
+		{
+			if (persistent) return mapped + _offset;
+			return (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, _offset, _size,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		}
+
+		void unmap()
+		{
+			if (!persistent) glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+
+		void fence(size_t _offset, size_t _size)
+		{
+			Span span = { _offset, _offset + _size, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) };
+			spans.push_back(span);
+			chunkNum++;
+		}
+
+		static bool blocks(const Job & _job) { return _job.format != GL_RGBA; }
+
+		// Rows of the job's current level or image: texel rows, or block rows when block-compressed
+		static int rowNum(const Job & _job)
+		{
+			if (!_job.chain) return _job.source.height;
+			int height = _job.levels[_job.level].height;
+			return blocks(_job) ? (height + 3) / 4 : height;
+		}
+
+		// Send the next rows of a job that fit in _left bytes (at least one if _first); returns the bytes sent
+		size_t step(Job & _job, size_t _left, bool _first, bool _force)
+		{
+			const Level * level = _job.chain ? &_job.levels[_job.level] : NULL;
+			size_t rowBytes = level ? level->size / rowNum(_job) : (size_t)_job.source.width * 4;
+			int rows = rowNum(_job) - _job.row;
+			if (!_force) rows = (int)std::min<size_t>(rows, _left / rowBytes);
+			rows = (int)std::min<size_t>(rows, TEXTURE_STREAM_RING_SIZE / 4 / rowBytes);
+			// a row over the budget still goes, alone
+			if (rows == 0 && _first) rows = 1;
+			if (rows == 0) return 0;
+
+			size_t offset = 0, size = rows * rowBytes;
+			unsigned char * out = NULL;
+			if (!allocate(size, _force, offset) || !(out = map(offset, size)))
+			{
+				deferNum++;
+				return 0;
+			}
+			if (level)
+				memcpy(out, level->data + _job.row * rowBytes, size);
+			else
+				convertRows(_job.source, _job.row, rows, out);
+			unmap();
+			if (level && blocks(_job))
+			{
+				int y = _job.row * 4;
+				glCompressedTexSubImage2D(GL_TEXTURE_2D, level->level, 0, y, level->width, std::min(rows * 4, level->height - y),
+					_job.format, (GLsizei)size, (const void *)offset);
+			}
+			else if (level)
+				glTexSubImage2D(GL_TEXTURE_2D, level->level, 0, _job.row, level->width, rows, GL_RGBA, GL_UNSIGNED_BYTE, (const void *)offset);
+			else
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, _job.row, _job.source.width, rows, GL_RGBA, GL_UNSIGNED_BYTE, (const void *)offset);
+			fence(offset, size);
+			_job.row += rows;
+			return size;
+		}
+
+		bool done(const Job & _job) const
+		{
+			return _job.chain ? _job.level >= (int)_job.levels.size() : _job.row >= _job.source.height;
+		}
+
+		// Move up to _budget bytes; all of it, waiting for the ring, if _force
+		void pump(size_t _budget, bool _force)
+		{
+			Clock::time_point start = Clock::now();
+			size_t moved = 0;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+			while (!jobs.empty() && (_force || moved < _budget))
+			{
+				Job & job = jobs.front();
+				glBindTexture(GL_TEXTURE_2D, job.tex);
+				size_t sent = step(job, _budget - std::min(_budget, moved), moved == 0, _force);
+				if (sent == 0) break;
+				moved += sent;
+
+				if (job.chain && job.row >= rowNum(job))
+				{
+					// the level is complete: sample from it on
+					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, job.levels[job.level].level);
+					job.level++;
+					job.row = 0;
+				}
+				if (done(job))
+				{
+					if (!job.chain)
+					{
+						glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+						// back to the default, for the levels about to be generated
+						glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+						glGenerateMipmap(GL_TEXTURE_2D);
+						glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+						job.source.free();
+					}
+					double wait = seconds(Clock::now() - job.queued);
+					latency += wait;
+					maxLatency = std::max(maxLatency, wait);
+					jobs.pop_front();
+				}
+			}
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			if (moved > 0 && !_force)
+			{
+				frameNum++;
+				maxFrameBytes = std::max(maxFrameBytes, moved);
+				double time = seconds(Clock::now() - start);
+				updateTime += time;
+				maxUpdateTime = std::max(maxUpdateTime, time);
+			}
+		}
+
+	public:
+		Uploader()
+			: budget(TEXTURE_STREAM_DEFAULT_BUDGET)
+			, initialized(false)
+			, supported(false)
+			, persistent(false)
+			, buffer(0)
+			, mapped(NULL)
+			, head(0)
+		{
+			resetStatistics();
+		}
+
+		// Bytes moved per frame; 0 uploads every texture whole when it is queued
+		void setBudget(size_t _budget) { budget = _budget; }
+		bool isStreaming() const { return budget > 0 && supported; }
+
+		// Level 0 of _tex from _source, mipmaps generated once it is complete; takes the source over
+		void uploadImage(GLuint _tex, Source & _source)
+		{
+			if (!initialized) initialize();
+			glBindTexture(GL_TEXTURE_2D, _tex);
+			textureNum++;
+			byteNum += (unsigned long long)_source.width * _source.height * 4;
+			if (budget == 0 || !supported || (size_t)_source.width * 4 > TEXTURE_STREAM_RING_SIZE / 4)
+			{
+				std::vector<unsigned char> rgba((size_t)_source.width * _source.height * 4);
+				convertRows(_source, 0, _source.height, rgba.data());
+				_source.free();
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _source.width, _source.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+				glGenerateMipmap(GL_TEXTURE_2D);
+				glBindTexture(GL_TEXTURE_2D, 0);
+				return;
+			}
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _source.width, _source.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			// level 0 alone is mipmap-complete, so mipmap filters sample it until the chain is generated
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			Job job;
+			job.tex = _tex;
+			job.chain = false;
+			job.source = _source;
+			job.format = GL_RGBA;
+			job.level = job.row = 0;
+			job.queued = Clock::now();
+			_source.release = std::function<void()>();
+			jobs.push_back(job);
+		}
+
+		// Levels of _tex in a block-compressed _format, or GL_RGBA for RGBA8, in any order;
+		// _owner keeps their data alive until they are sent
+		void uploadLevels(GLuint _tex, GLenum _format, std::vector<Level> _levels, const std::shared_ptr<const void> & _owner)
+		{
+			if (!initialized) initialize();
+			std::sort(_levels.begin(), _levels.end(), [](const Level & _a, const Level & _b) { return _a.level > _b.level; });
+			glBindTexture(GL_TEXTURE_2D, _tex);
+			textureNum++;
+			for (int i = 0; i < _levels.size(); i++)
+			{
+				byteNum += _levels[i].size;
+				const void * data = budget == 0 || !supported ? _levels[i].data : NULL;
+				if (_format == GL_RGBA)
+					glTexImage2D(GL_TEXTURE_2D, _levels[i].level, GL_RGBA, _levels[i].width, _levels[i].height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+				else
+					glCompressedTexImage2D(GL_TEXTURE_2D, _levels[i].level, _format, _levels[i].width, _levels[i].height, 0,
+						(GLsizei)_levels[i].size, data);
+			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, _levels.empty() ? 0 : _levels.front().level);
+			if (budget == 0 || !supported || _levels.empty())
+			{
+				glBindTexture(GL_TEXTURE_2D, 0);
+				return;
+			}
+			// nothing to sample until the smallest level is in
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, _levels.front().level);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			Job job;
+			job.tex = _tex;
+			job.chain = true;
+			job.format = _format;
+			job.levels = _levels;
+			job.owner = _owner;
+			job.level = job.row = 0;
+			job.queued = Clock::now();
+			jobs.push_back(job);
+		}
+
+		// Once per frame, before drawing; returns the textures still streaming
+		size_t update()
+		{
+			if (!jobs.empty()) pump(budget, false);
+			return jobs.size();
+		}
+
+		// Upload everything queued, waiting for the ring where needed
+		void finish()
+		{
+			if (!jobs.empty()) pump(0, true);
+		}
+
+		size_t getPendingNum() const { return jobs.size(); }
+
+		// Drop the uploads still queued for _tex, before it is deleted
+		void cancel(GLuint _tex)
+		{
+			for (int i = (int)jobs.size() - 1; i >= 0; i--)
+				if (jobs[i].tex == _tex)
+				{
+					jobs[i].source.free();
+					jobs.erase(jobs.begin() + i);
+					textureNum--;
+				}
+		}
+
+		void resetStatistics()
+		{
+			textureNum = 0;
+			byteNum = chunkNum = frameNum = deferNum = waitNum = 0;
+			maxFrameBytes = 0;
+			updateTime = maxUpdateTime = latency = maxLatency = 0.0;
+		}
+
+		void report(std::ostream & out) const
+		{
+			if (textureNum == 0) return;
+			out << "Texture stream: " << textureNum << " textures, " << byteNum / 1024.0 << " KB";
+			if (!isStreaming())
+			{
+				out << " uploaded whole at load" << (supported ? "" : " (no fences or buffer mapping)") << std::endl;
+				return;
+			}
+			out << " in " << chunkNum << " chunks over " << frameNum << " frames (budget " << budget / 1024 << " KB, at most "
+				<< maxFrameBytes / 1024.0 << " KB and " << maxUpdateTime * 1000.0 << " ms in a frame";
+			if (frameNum > 0) out << ", " << updateTime / frameNum * 1000.0 << " ms on average";
+			out << "), " << deferNum << " chunks deferred on a busy ring, " << waitNum << " waits, "
+				<< (persistent ? "persistent" : "per-chunk") << " mapping";
+			unsigned int doneNum = textureNum - (unsigned int)jobs.size();
+			if (doneNum > 0) out << ", latency " << latency / doneNum * 1000.0 << " ms average, " << maxLatency * 1000.0 << " ms max";
+			if (!jobs.empty()) out << ", " << jobs.size() << " still streaming";
+			out << std::endl;
+		}
+
+		void destroy()
+		{
+			for (int i = 0; i < jobs.size(); i++)
+				jobs[i].source.free();
+			jobs.clear();
+			for (int i = 0; i < spans.size(); i++)
+				glDeleteSync(spans[i].fence);
+			spans.clear();
+			if (buffer)
+			{
+				if (persistent)
+				{
+					glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+					glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+					glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				}
+				glDeleteBuffers(1, &buffer);
+			}
+			buffer = 0;
+			mapped = NULL;
+			initialized = false;
+		}
+	};
+
+	// The uploader the application's textures go through
+	inline Uploader & shared()
+	{
+		static Uploader uploader;
+		return uploader;
+	}
+}
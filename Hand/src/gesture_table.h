@@ -0,0 +1,127 @@
+// Gesture Tables
+// Declarative gesture data baked into fixed-rate quaternion tables, sampled into a SkeletonModifier
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cmath>
+
+#include "skeletal_mesh.h"
+
+#include <glm\gtc\quaternion.hpp>
+
+#define GESTURE_CURVE_TRIANGLE 0	// 1 -> 0 -> 1 over the period
+#define GESTURE_CURVE_SINE 1		// 0 -> 1 -> 0 over the period, eased
+
+namespace GestureTable
+{
+	// Rotates one bone about axis by amplitude * curve(time / period + phase)
+	struct Channel
+	{
+		const char * bone;
+		float axis[3];
+		float amplitude;
+		int curve;
+		float phase;
+	};
+
+	struct Gesture
+	{
+		float period;
+		const Channel * channel;
+		int channelNum;
+	};
+
+	inline float evaluateCurve(int _curve, float _phase)
+	{
+		_phase -= std::floor(_phase);
+		switch (_curve)
+		{
+		case GESTURE_CURVE_SINE: return 0.5f - 0.5f * std::cos(_phase * 6.2831853f);
+		default: return std::fabs(2.0f * _phase - 1.0f);
+		}
+	}
+
+	class Table
+	{
+	private:
+		// mat4_cast of q / |q|, the normalization folded into the scale so no square root is needed
+		static void writeRotation(const glm::fquat & q, glm::fmat4 & m)
+		{
+			float s = 2.0f / (q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+			float xx = q.x * q.x * s, yy = q.y * q.y * s, zz = q.z * q.z * s;
+			float xy = q.x * q.y * s, xz = q.x * q.z * s, yz = q.y * q.z * s;
+			float wx = q.w * q.x * s, wy = q.w * q.y * s, wz = q.w * q.z * s;
+			m[0] = glm::fvec4(1.0f - yy - zz, xy + wz, xz - wy, 0.0f);
+			m[1] = glm::fvec4(xy - wz, 1.0f - xx - zz, yz + wx, 0.0f);
+			m[2] = glm::fvec4(xz + wy, yz - wx, 1.0f - xx - yy, 0.0f);
+			m[3] = glm::fvec4(0.0f, 0.0f, 0.0f, 1.0f);
+		}
+
+		float period;
+		unsigned int rowNum;
+		std::vector<std::string> bone;
+		// (rowNum + 1) rows of bone.size() rotations, the last row repeats the first
+		std::vector<glm::fquat> row;
+
+	public:
+		Table() : period(1.0f), rowNum(0) {}
+
+		float getPeriod() const { return period; }
+		unsigned int getChannelNum() const { return bone.size(); }
+
+		void bake(const Gesture & _gesture, float _rowsPerSecond)
+		{
+			period = _gesture.period > 0.0f ? _gesture.period : 1.0f;
+			rowNum = std::max(2, int(period * _rowsPerSecond + 0.5f));
+			bone.resize(_gesture.channelNum);
+			row.resize((rowNum + 1) * bone.size());
+			for (int c = 0; c < bone.size(); c++)
+			{
+				const Channel & cur = _gesture.channel[c];
+				bone[c] = cur.bone;
+				glm::fvec3 axis = glm::normalize(glm::fvec3(cur.axis[0], cur.axis[1], cur.axis[2]));
+				for (int r = 0; r <= rowNum; r++)
+				{
+					float angle = cur.amplitude * evaluateCurve(cur.curve, float(r % rowNum) / rowNum + cur.phase);
+					row[r * bone.size() + c] = glm::angleAxis(angle, axis);
+				}
+			}
+		}
+
+		// Resolve the bones in _modifier once; std::map keeps element addresses stable
+		void bind(SkeletalMesh::SkeletonModifier & _modifier, std::vector<glm::fmat4 *> & _target) const
+		{
+			_target.resize(bone.size());
+			for (int c = 0; c < bone.size(); c++)
+				_target[c] = &_modifier[bone[c]];
+		}
+
+		// Pose at _time, normalized lerp between the two nearest rows
+		void sample(float _time, glm::fmat4 * const * _target) const
+		{
+			if (rowNum == 0) return;
+			float position = _time / period;
+			position = (position - std::floor(position)) * rowNum;
+			unsigned int r = std::min((unsigned int)position, rowNum - 1);
+			float t = position - r;
+			const glm::fquat * a = &row[r * bone.size()];
+			const glm::fquat * b = a + bone.size();
+			for (int c = 0; c < bone.size(); c++)
+			{
+				// keep to the short arc between neighbouring rows
+				glm::fquat q = a[c] * (1.0f - t) + b[c] * (glm::dot(a[c], b[c]) < 0.0f ? -t : t);
+				writeRotation(q, *_target[c]);
+			}
+		}
+
+		void sample(float _time, SkeletalMesh::SkeletonModifier & _modifier) const
+		{
+			std::vector<glm::fmat4 *> target;
+			bind(_modifier, target);
+			sample(_time, target.data());
+		}
+	};
+}
@@ -0,0 +1,423 @@
+// Joint Stream Recorder & Player
+// Replays recorded hand-tracking data into a SkeletonModifier
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+#include "skeletal_mesh.h"
+
+#include <glm\gtc\quaternion.hpp>
+
+#define JOINT_STREAM_MAGIC 0x4D54534A
+#define JOINT_STREAM_VERSION 1
+#define JOINT_STREAM_MAX_JOINTS 32
+#define JOINT_STREAM_RING_SIZE 256
+#define JOINT_STREAM_DEFAULT_RATE 60.0f
+
+/**********************************************************************************\
+*
+* Joint stream file layout (little endian):
+*	header   : uint32 magic, uint32 version, uint32 joint_num, float32 sample_rate
+*	names    : joint_num x (uint32 length, char[length])
+*	samples  : until EOF, float64 timestamp (seconds),
+*	           then joint_num x float32[4] local rotation quaternion (x, y, z, w)
+*
+\**********************************************************************************/
+
+namespace JointStream
+{
+	typedef std::chrono::steady_clock Clock;
+
+	struct StreamHeader
+	{
+		unsigned int magic;
+		unsigned int version;
+		unsigned int jointNum;
+		float sampleRate;
+	};
+
+	// Times are seconds since the player started, on the render clock
+	struct Sample
+	{
+		double time;
+		double publishTime;
+		float rotation[JOINT_STREAM_MAX_JOINTS][4];
+	};
+
+	// Single producer / single consumer ring, neither side ever waits.
+	// A full ring drops its oldest value, so the consumer always catches up to the newest ones;
+	// each slot is a sequence lock, and a pop that raced with the producer overwriting its slot retries.
+	template <typename T, unsigned int N>
+	class SpscRing
+	{
+		static_assert((N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+	private:
+		struct Slot
+		{
+			// 2 * index + 1 while the value of that index is written, 2 * index + 2 once it is complete
+			std::atomic<unsigned int> sequence;
+			T value;
+		};
+
+		alignas(64) std::atomic<unsigned int> head;
+		alignas(64) std::atomic<unsigned int> tail;
+		Slot slot[N];
+
+	public:
+		SpscRing() : head(0), tail(0)
+		{
+			for (int i = 0; i < N; i++) slot[i].sequence.store(0);
+		}
+
+		void reset()
+		{
+			head.store(0);
+			tail.store(0);
+			for (int i = 0; i < N; i++) slot[i].sequence.store(0);
+		}
+
+		// Producer side; returns false when the oldest unread value was overwritten to make room
+		bool push(const T & _value)
+		{
+			unsigned int h = head.load(std::memory_order_relaxed);
+			unsigned int t = tail.load(std::memory_order_acquire);
+			// the consumer may take the oldest value first, then there is room anyway
+			bool dropped = h - t == N && tail.compare_exchange_strong(t, t + 1, std::memory_order_acq_rel);
+			Slot & cur = slot[h & (N - 1)];
+			cur.sequence.store(2 * h + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			cur.value = _value;
+			cur.sequence.store(2 * h + 2, std::memory_order_release);
+			head.store(h + 1, std::memory_order_release);
+			return !dropped;
+		}
+
+		// Consumer side
+		bool empty() const { return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire); }
+
+		// Consumer side, _value is untouched when the ring is empty
+		bool pop(T & _value)
+		{
+			while (true)
+			{
+				unsigned int t = tail.load(std::memory_order_acquire);
+				if (t == head.load(std::memory_order_acquire)) return false;
+				const Slot & cur = slot[t & (N - 1)];
+				unsigned int sequence = cur.sequence.load(std::memory_order_acquire);
+				// overwritten or being overwritten: the producer has moved the tail on
+				if (sequence != 2 * t + 2) continue;
+				_value = cur.value;
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (cur.sequence.load(std::memory_order_relaxed) != sequence) continue;
+				if (tail.compare_exchange_strong(t, t + 1, std::memory_order_acq_rel)) return true;
+			}
+		}
+	};
+
+	// Samples the modifier at the stream's rate, however often append() is called
+	class Recorder
+	{
+	private:
+		FILE * file;
+		std::vector<std::string> jointName;
+		float sampleRate;
+		double nextTime;
+
+	public:
+		Recorder() : file(NULL), sampleRate(JOINT_STREAM_DEFAULT_RATE), nextTime(0.0) {}
+		~Recorder() { close(); }
+
+		bool open(const std::string & _filename, const std::vector<std::string> & _jointName, float _sampleRate)
+		{
+			close();
+			if (_jointName.empty() || _jointName.size() > JOINT_STREAM_MAX_JOINTS || !(_sampleRate > 0.0f)) return false;
+			file = fopen(_filename.c_str(), "wb");
+			if (file == NULL) return false;
+
+			StreamHeader header = { JOINT_STREAM_MAGIC, JOINT_STREAM_VERSION, (unsigned int)_jointName.size(), _sampleRate };
+			fwrite(&header, sizeof(header), 1, file);
+			for (int i = 0; i < _jointName.size(); i++)
+			{
+				unsigned int length = _jointName[i].size();
+				fwrite(&length, sizeof(length), 1, file);
+				fwrite(_jointName[i].data(), 1, length, file);
+			}
+			jointName = _jointName;
+			sampleRate = _sampleRate;
+			nextTime = -1.0;
+			return true;
+		}
+
+		// Writes a sample when _timestamp reaches the next sample time; frames in between are skipped,
+		// a frame later than a whole period starts the schedule again from its timestamp
+		void append(double _timestamp, const SkeletalMesh::SkeletonModifier & _modifier)
+		{
+			if (file == NULL || _timestamp < nextTime) return;
+			double period = 1.0 / sampleRate;
+			nextTime = nextTime < 0.0 || _timestamp - nextTime >= period ? _timestamp + period : nextTime + period;
+			fwrite(&_timestamp, sizeof(_timestamp), 1, file);
+			for (int i = 0; i < jointName.size(); i++)
+			{
+				glm::fquat q;
+				SkeletalMesh::SkeletonModifier::const_iterator found = _modifier.find(jointName[i]);
+				if (found != _modifier.end())
+					q = glm::quat_cast(glm::fmat3(found->second));
+				float rotation[4] = { q.x, q.y, q.z, q.w };
+				fwrite(rotation, sizeof(rotation), 1, file);
+			}
+		}
+
+		void close()
+		{
+			if (file) fclose(file);
+			file = NULL;
+		}
+	};
+
+	class Player
+	{
+	public:
+		struct Statistics
+		{
+			unsigned long long applied;
+			unsigned long long consumed;
+			unsigned long long dropped;
+			double latencySum;
+			double latencyMin;
+			double latencyMax;
+			// from the producer publishing a sample to the frame applying it: the time it waits in the ring
+			double queueSum;
+			double queueMax;
+		};
+
+	private:
+		FILE * file;
+		long dataOffset;
+		bool loop;
+		float sampleRate;
+		double interpolationDelay;
+		std::vector<std::string> jointName;
+
+		Clock::time_point epoch;
+		std::thread producer;
+		std::atomic<bool> running;
+		// set by the producer when it leaves, at the end of a file it does not loop or on stop()
+		std::atomic<bool> finished;
+		std::atomic<unsigned long long> dropped;
+		SpscRing<Sample, JOINT_STREAM_RING_SIZE> ring;
+
+		// Only touched by the consumer
+		Sample history[2];
+		unsigned int newest;
+		unsigned int received;
+		Statistics stats;
+
+		// Forbid copying, the producer thread holds a pointer to this
+		Player(const Player & _copy);
+		Player & operator=(const Player & _copy);
+
+	public:
+		Player()
+			: file(NULL)
+			, dataOffset(0)
+			, loop(false)
+			, sampleRate(0.0f)
+			, interpolationDelay(0.0)
+			, running(false)
+			, finished(false)
+			, dropped(0)
+			, newest(0)
+			, received(0)
+		{
+			resetStatistics();
+		}
+		~Player() { stop(); }
+
+		// False once the producer has finished and the consumer has taken every sample it published
+		bool isRunning() const { return file != NULL && !(finished.load(std::memory_order_acquire) && ring.empty()); }
+
+		double now() const
+		{
+			return std::chrono::duration<double>(Clock::now() - epoch).count();
+		}
+
+		// Start replaying _filename in real time on a producer thread
+		bool start(const std::string & _filename, bool _loop = true)
+		{
+			stop();
+			file = fopen(_filename.c_str(), "rb");
+			if (file == NULL) return false;
+
+			StreamHeader header;
+			if (fread(&header, sizeof(header), 1, file) != 1
+				|| header.magic != JOINT_STREAM_MAGIC || header.version != JOINT_STREAM_VERSION
+				|| header.jointNum == 0 || header.jointNum > JOINT_STREAM_MAX_JOINTS
+				|| !(header.sampleRate > 0.0f))
+			{
+				std::cout << "Error: " << _filename << " is not a joint stream" << std::endl;
+				fclose(file);
+				file = NULL;
+				return false;
+			}
+			jointName.resize(header.jointNum);
+			for (int i = 0; i < jointName.size(); i++)
+			{
+				unsigned int length = 0;
+				if (fread(&length, sizeof(length), 1, file) != 1 || length > 256)
+				{
+					fclose(file);
+					file = NULL;
+					return false;
+				}
+				jointName[i].resize(length);
+				if (length && fread(&jointName[i][0], 1, length, file) != length)
+				{
+					fclose(file);
+					file = NULL;
+					return false;
+				}
+			}
+			dataOffset = ftell(file);
+			loop = _loop;
+			sampleRate = header.sampleRate;
+			// Render one sample period behind the newest data so there is a pair to interpolate
+			interpolationDelay = 1.0 / sampleRate;
+
+			ring.reset();
+			newest = 0;
+			received = 0;
+			dropped.store(0);
+			resetStatistics();
+
+			epoch = Clock::now();
+			finished.store(false);
+			running.store(true);
+			producer = std::thread(&Player::produce, this);
+			return true;
+		}
+
+		void stop()
+		{
+			running.store(false);
+			if (producer.joinable()) producer.join();
+			if (file) fclose(file);
+			file = NULL;
+		}
+
+		// Consumer side, called once per frame by the render thread; never blocks
+		bool apply(SkeletalMesh::SkeletonModifier & modifier)
+		{
+			if (!isRunning()) return false;
+
+			while (ring.pop(history[newest ^ 1]))
+			{
+				newest ^= 1;
+				if (received < 2) received++;
+				stats.consumed++;
+			}
+			if (received == 0) return false;
+
+			double applyTime = now();
+			double displayTime = applyTime - interpolationDelay;
+			const Sample & b = history[newest];
+			const Sample & a = received > 1 ? history[newest ^ 1] : b;
+			float t = 1.0f;
+			if (b.time > a.time)
+				t = (float)std::min(std::max((displayTime - a.time) / (b.time - a.time), 0.0), 1.0);
+
+			for (int i = 0; i < jointName.size(); i++)
+			{
+				const float * ra = a.rotation[i];
+				const float * rb = b.rotation[i];
+				glm::fquat q = glm::slerp(glm::fquat(ra[3], ra[0], ra[1], ra[2]), glm::fquat(rb[3], rb[0], rb[1], rb[2]), t);
+				modifier[jointName[i]] = glm::mat4_cast(q);
+			}
+
+			double latency = applyTime - b.time;
+			stats.applied++;
+			stats.latencySum += latency;
+			stats.latencyMin = std::min(stats.latencyMin, latency);
+			stats.latencyMax = std::max(stats.latencyMax, latency);
+			double queued = applyTime - b.publishTime;
+			stats.queueSum += queued;
+			stats.queueMax = std::max(stats.queueMax, queued);
+			return true;
+		}
+
+		Statistics getStatistics() const
+		{
+			Statistics result = stats;
+			result.dropped = dropped.load();
+			return result;
+		}
+
+		void resetStatistics()
+		{
+			stats.applied = 0;
+			stats.consumed = 0;
+			stats.dropped = 0;
+			stats.latencySum = 0.0;
+			stats.latencyMin = 1e30;
+			stats.latencyMax = 0.0;
+			stats.queueSum = 0.0;
+			stats.queueMax = 0.0;
+		}
+
+		void report(std::ostream & out) const
+		{
+			Statistics s = getStatistics();
+			out << "Joint stream: " << s.consumed << " samples consumed, " << s.dropped << " oldest dropped";
+			if (s.applied)
+				out << ", sample-to-pose latency avg " << s.latencySum / s.applied * 1000.0
+				<< " ms, min " << s.latencyMin * 1000.0
+				<< " ms, max " << s.latencyMax * 1000.0
+				<< " ms over " << s.applied << " frames; in the ring avg " << s.queueSum / s.applied * 1000.0
+				<< " ms, max " << s.queueMax * 1000.0 << " ms";
+			out << std::endl;
+		}
+
+	private:
+		// Producer thread: paces the file by its timestamps as a live sensor would
+		void produce()
+		{
+			Sample sample;
+			unsigned int jointNum = jointName.size();
+			bool passStart = true;
+			double passBase = 0.0, passOffset = 0.0;
+			while (running.load(std::memory_order_relaxed))
+			{
+				double timestamp;
+				if (fread(&timestamp, sizeof(timestamp), 1, file) != 1
+					|| fread(sample.rotation, sizeof(sample.rotation[0]), jointNum, file) != jointNum)
+				{
+					if (!loop || passStart) break;
+					fseek(file, dataOffset, SEEK_SET);
+					passOffset = sample.time + 1.0 / sampleRate;
+					passStart = true;
+					continue;
+				}
+				if (passStart)
+				{
+					passBase = timestamp;
+					passStart = false;
+				}
+				sample.time = passOffset + (timestamp - passBase);
+
+				std::this_thread::sleep_until(epoch + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(sample.time)));
+				sample.publishTime = now();
+				if (!ring.push(sample))
+					dropped.fetch_add(1, std::memory_order_relaxed);
+			}
+			finished.store(true, std::memory_order_release);
+		}
+	};
+}
@@ -1,5 +1,6 @@
 #define _CRT_SECURE_NO_WARNINGS
 
+// Start with the diffuse maps shown instead of the uvs (T toggles them)
 //#define DIFFUSE_TEXTURE_MAPPING
 
 #include "gl_env.h"
@@ -17,23 +18,44 @@
 #include <iostream>
 
 #include "skeletal_mesh.h"
+#include "joint_stream.h"
+#include "pose_database.h"
+#include "particle_field.h"
+#include "gesture_table.h"
+#include "timeline.h"
+#include "frame_pacer.h"
+#include "offscreen.h"
+#include "program_cache.h"
+#include "shader_feature.h"
 
+#include <map>
 #include <glm\gtc\matrix_transform.hpp>
 
+#define SKINNING_MAX_BONES 100
+#define SKINNING_FRAME_BINDING 0
+
 namespace SkeletalAnimation
 {
+	// Compiled once per permutation of SKINNING_FEATURES, after "#version 450", "#define MAX_BONES m"
+	// and the feature defines; BONE_INFLUENCE_NUM 0 is the generic path for vertices without bones.
+	// The per-frame block is filled once and shared by every bucket program.
 	const char * vertex_shader_450 =
-		"#version 450\n"
-		"const int MAX_BONES = 100;\n"
-		"uniform mat4 u_bone_transf[MAX_BONES];\n"
-		"uniform mat4 u_mvp;\n"
+		"layout(std140) uniform SkinningFrame {\n"
+		"    mat4 u_mvp;\n"
+		"    mat4 u_bone_transf[MAX_BONES];\n"
+		"};\n"
 		"layout(location = 0) in vec3 in_position;\n"
 		"layout(location = 1) in vec2 in_texcoord;\n"
 		"layout(location = 2) in vec3 in_normal;\n"
 		"layout(location = 3) in ivec4 in_bone_index;\n"
 		"layout(location = 4) in vec4 in_bone_weight;\n"
+		"layout(location = 5) in uint in_morph_slot;\n"
+		"layout(location = 6) in float in_diffuse_layer;\n"
+		"uniform samplerBuffer u_morph_offset;\n"
 		"out vec2 pass_texcoord;\n"
+		"flat out float pass_diffuse_layer;\n"
 		"void main() {\n"
+		"#if BONE_INFLUENCE_NUM == 0\n"
 		"    float adjust_factor = 0.0;\n"
 		"    for (int i = 0; i < 4; i++) adjust_factor += in_bone_weight[i] * 0.25;\n"
 		"    mat4 bone_transform = mat4(1.0);\n"
@@ -42,29 +64,168 @@ namespace SkeletalAnimation
 		"        for (int i = 0; i < 4; i++)\n"
 		"            bone_transform += u_bone_transf[in_bone_index[i]] * in_bone_weight[i] / adjust_factor;\n"
 		"	 }\n"
-		"    gl_Position = u_mvp * bone_transform * vec4(in_position, 1.0);\n"
+		"#else\n"
+		"    // weights are sorted and normalized at import\n"
+		"    mat4 bone_transform = u_bone_transf[in_bone_index[0]] * in_bone_weight[0];\n"
+		"    for (int i = 1; i < BONE_INFLUENCE_NUM; i++)\n"
+		"        bone_transform += u_bone_transf[in_bone_index[i]] * in_bone_weight[i];\n"
+		"#endif\n"
+		"    vec3 position = in_position;\n"
+		"    if (in_morph_slot != 0u) position += texelFetch(u_morph_offset, int(in_morph_slot) - 1).xyz;\n"
+		"    gl_Position = u_mvp * bone_transform * vec4(position, 1.0);\n"
 		"    pass_texcoord = in_texcoord;\n"
+		"    pass_diffuse_layer = in_diffuse_layer;\n"
 		"}\n";
 
+	// After "#version 450" and the feature defines, like the vertex shader
 	const char* fragment_shader_450 =
-		"#version 450\n"
 		"uniform sampler2D u_diffuse;\n"
+		"uniform sampler2DArray u_diffuse_array;\n"
 		"in vec2 pass_texcoord;\n"
+		"flat in float pass_diffuse_layer;\n"
 		"out vec4 out_color;\n"
 		"void main() {\n"
-#ifdef DIFFUSE_TEXTURE_MAPPING
-		"    out_color = vec4(texture(u_diffuse, pass_texcoord).xyz, 1.0);\n"
-#else
+		"#if DIFFUSE_TEXTURE_MAPPING\n"
+		"    // a negative layer: the material's diffuse is not packed into a texture array\n"
+		"    vec4 diffuse = pass_diffuse_layer < 0.0 ? texture(u_diffuse, pass_texcoord)\n"
+		"        : texture(u_diffuse_array, vec3(pass_texcoord, pass_diffuse_layer));\n"
+		"    out_color = vec4(diffuse.xyz, 1.0);\n"
+		"#else\n"
 		"    out_color = vec4(pass_texcoord, 0.0, 1.0);\n"
-#endif
+		"#endif\n"
+		"}\n";
+
+	const char * particle_vertex_shader_450 =
+		"#version 450\n"
+		"uniform mat4 u_mvp;\n"
+		"layout(location = 0) in vec3 in_position;\n"
+		"void main() {\n"
+		"    gl_Position = u_mvp * vec4(in_position, 1.0);\n"
+		"}\n";
+
+	const char * particle_fragment_shader_450 =
+		"#version 450\n"
+		"out vec4 out_color;\n"
+		"void main() {\n"
+		"    out_color = vec4(0.3, 0.6, 0.9, 1.0);\n"
 		"}\n";
 }
 
+// Skinning program permutations: bones blended per vertex, and the diffuse maps or the uvs shown
+const std::vector<ShaderFeature> SKINNING_FEATURES = {
+	{ "BONE_INFLUENCE_NUM", 0, 3 },
+	{ "DIFFUSE_TEXTURE_MAPPING", 3, 1 },
+};
+
+static GLuint build_skinning_program(unsigned int features)
+{
+	char max_bones_define[64];
+	sprintf(max_bones_define, "#define MAX_BONES %d\n", SKINNING_MAX_BONES);
+	std::string feature_defines = ShaderFeature::defines(SKINNING_FEATURES, features);
+	const char * vertex_source[4] = { "#version 450\n", max_bones_define, feature_defines.c_str(), SkeletalAnimation::vertex_shader_450 };
+	const char * fragment_source[3] = { "#version 450\n", feature_defines.c_str(), SkeletalAnimation::fragment_shader_450 };
+	std::vector<std::string> source(vertex_source, vertex_source + 4);
+	source.insert(source.end(), fragment_source, fragment_source + 3);
+
+	GLuint program = ProgramCache::shared().build(source, [&](GLuint program)
+	{
+		GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(vertex_shader, 4, vertex_source, NULL);
+		glCompileShader(vertex_shader);
+
+		GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(fragment_shader, 3, fragment_source, NULL);
+		glCompileShader(fragment_shader);
+
+		glAttachShader(program, vertex_shader);
+		glAttachShader(program, fragment_shader);
+		glLinkProgram(program);
+		glDeleteShader(vertex_shader);
+		glDeleteShader(fragment_shader);
+	});
+
+	int linkStatus;
+	if (glGetProgramiv(program, GL_LINK_STATUS, &linkStatus), linkStatus == GL_FALSE)
+		std::cout << "Error occured in glLinkProgram() with " << SKINNING_FEATURES[0].value(features) << " bone influences" << std::endl;
+	// Bindings are program state, so they are set once here rather than every frame
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, "SkinningFrame"), SKINNING_FRAME_BINDING);
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "u_diffuse"), SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL);
+	glUniform1i(glGetUniformLocation(program, "u_diffuse_array"), SCENE_RESOURCE_SHADER_DIFFUSE_ARRAY_CHANNEL);
+	glUniform1i(glGetUniformLocation(program, "u_morph_offset"), SCENE_RESOURCE_SHADER_MORPH_CHANNEL);
+	glUseProgram(0);
+	return program;
+}
+
+// Skinning programs by feature bitmask, each compiled the first time a frame draws with it
+static std::map<unsigned int, GLuint> skinning_programs;
+
+static GLuint skinning_program(unsigned int features)
+{
+	std::map<unsigned int, GLuint>::iterator it = skinning_programs.find(features);
+	if (it != skinning_programs.end())
+		return it->second;
+	GLuint program = build_skinning_program(features);
+	skinning_programs[features] = program;
+	return program;
+}
+
+static GLuint build_particle_program()
+{
+	std::vector<std::string> source;
+	source.push_back(SkeletalAnimation::particle_vertex_shader_450);
+	source.push_back(SkeletalAnimation::particle_fragment_shader_450);
+
+	GLuint program = ProgramCache::shared().build(source, [](GLuint program)
+	{
+		GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(vertex_shader, 1, &SkeletalAnimation::particle_vertex_shader_450, NULL);
+		glCompileShader(vertex_shader);
+
+		GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(fragment_shader, 1, &SkeletalAnimation::particle_fragment_shader_450, NULL);
+		glCompileShader(fragment_shader);
+
+		glAttachShader(program, vertex_shader);
+		glAttachShader(program, fragment_shader);
+		glLinkProgram(program);
+		glDeleteShader(vertex_shader);
+		glDeleteShader(fragment_shader);
+	});
+
+	int linkStatus;
+	if (glGetProgramiv(program, GL_LINK_STATUS, &linkStatus), linkStatus == GL_FALSE)
+		std::cout << "Error occured in glLinkProgram() of the particle program" << std::endl;
+	return program;
+}
+
 static void error_callback(int error, const char* description)
 {
 	fprintf(stderr, "Error: %s\n", description);
 }
 
+// Headless runs on an EGL context have no GLFW window, so the clock and the close flag live here
+static std::chrono::steady_clock::time_point app_start = std::chrono::steady_clock::now();
+static bool headless_close = false;
+
+static double app_time()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - app_start).count();
+}
+
+static void request_close(GLFWwindow * window)
+{
+	if (window)
+		glfwSetWindowShouldClose(window, GLFW_TRUE);
+	else
+		headless_close = true;
+}
+
+static bool close_requested(GLFWwindow * window)
+{
+	return window ? glfwWindowShouldClose(window) != 0 : headless_close;
+}
+
 #define pause 0
 #define victory 1
 #define fist 2
@@ -76,7 +237,7 @@ static void error_callback(int error, const char* description)
 #define initial_place 10
 
 float delta_time = 0.0f;
-float last_time = glfwGetTime();
+float last_time = app_time();
 
 typedef glm::vec3 v3;
 v3 camera_pos = v3(0.0f, 0.0f, 3.0f);
@@ -88,32 +249,93 @@ v3 camera_target = v3(0.0f, 0.0f, 0.0f);
 v3 camera_direction = glm::normalize(camera_pos - camera_target);
 
 
-int motion = 0, last_motion = 0;
+const char * hand_bone_name[] = {
+	"metacarpals",
+	"thumb_proximal_phalange", "thumb_intermediate_phalange", "thumb_distal_phalange", "thumb_fingertip",
+	"index_proximal_phalange", "index_intermediate_phalange", "index_distal_phalange", "index_fingertip",
+	"middle_proximal_phalange", "middle_intermediate_phalange", "middle_distal_phalange", "middle_fingertip",
+	"ring_proximal_phalange", "ring_intermediate_phalange", "ring_distal_phalange", "ring_fingertip",
+	"pinky_proximal_phalange", "pinky_intermediate_phalange", "pinky_distal_phalange", "pinky_fingertip"
+};
+const int hand_bone_num = sizeof(hand_bone_name) / sizeof(hand_bone_name[0]);
+
+// Pose database resolution, frames per second of gesture time
+const float gesture_sample_rate = 120.0f;
+
+// Collider capsules as pairs of hand_bone_name indices: palm to knuckle, then each phalange
+const int hand_capsule_segment[][2] = {
+	{ 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 4 },
+	{ 0, 5 }, { 5, 6 }, { 6, 7 }, { 7, 8 },
+	{ 0, 9 }, { 9, 10 }, { 10, 11 }, { 11, 12 },
+	{ 0, 13 }, { 13, 14 }, { 14, 15 }, { 15, 16 },
+	{ 0, 17 }, { 17, 18 }, { 18, 19 }, { 19, 20 }
+};
+const int hand_capsule_num = sizeof(hand_capsule_segment) / sizeof(hand_capsule_segment[0]);
+const float hand_capsule_radius_scale = 0.35f;
+
+// When a joint stream is playing it drives the pose instead of the gesture keys
+JointStream::Player joint_stream;
+JointStream::Recorder joint_recorder;
+
+// Animation time; Space pauses it, - and = halve and double its speed, 0 restores it
+AnimationClock::Timeline animation_timeline;
+
+// Render loop pacing; key presses count as a change for the adaptive mode
+FramePacing::Pacer frame_pacer;
+bool frame_input = false;
+
+#ifdef DIFFUSE_TEXTURE_MAPPING
+bool texture_mapping = true;
+#else
+bool texture_mapping = false;
+#endif
+// the wrist turns around every 4 seconds unless H holds it
+bool wrist_spin = true;
+
+int motion = 0;
 int look_up = initial_place;
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+	frame_input = true;
 	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, GLFW_TRUE);
+	else if (key == GLFW_KEY_T && action == GLFW_PRESS) //T:diffuse maps or uvs
+		texture_mapping = !texture_mapping;
+	else if (key == GLFW_KEY_H && action == GLFW_PRESS) //H:hold or turn the wrist
+		wrist_spin = !wrist_spin;
+	else if (joint_stream.isRunning())
+		return;
 	else if (key == GLFW_KEY_P && action == GLFW_PRESS) //P:victory
 	{
-		motion = victory; last_motion = motion;
+		motion = victory;
 	}
 	else if (key == GLFW_KEY_Q && action == GLFW_PRESS) //Q:thumb_up
 	{
-		motion = thumb_up; last_motion = motion;
+		motion = thumb_up;
 	}
 	else if (key == GLFW_KEY_R && action == GLFW_PRESS) //R:fist
 	{
-		motion = fist; last_motion = motion;
+		motion = fist;
 	}
 	else if (key == GLFW_KEY_E && action == GLFW_PRESS) //E:wave
 	{
-		motion = wave; last_motion = motion;
+		motion = wave;
 	}
 	else if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) //Space:pause
 	{
-		if (motion != pause) motion = pause;
-		else motion = last_motion;
+		animation_timeline.togglePause();
+	}
+	else if (key == GLFW_KEY_MINUS && action == GLFW_PRESS) //-:slower
+	{
+		animation_timeline.setTimeScale(animation_timeline.getTimeScale() * 0.5);
+	}
+	else if (key == GLFW_KEY_EQUAL && action == GLFW_PRESS) //=:faster
+	{
+		animation_timeline.setTimeScale(animation_timeline.getTimeScale() * 2.0);
+	}
+	else if (key == GLFW_KEY_0 && action == GLFW_PRESS) //0:normal speed
+	{
+		animation_timeline.setTimeScale(1.0);
 	}
 
 }
@@ -144,75 +366,549 @@ void camera_move(GLFWwindow* window) {
 }
 
 
+// Gesture data: each channel rotates a bone about an axis by amplitude * curve(phase).
+// The keyboard gestures bend by 1.3 * PI/3 at the ends of a triangle curve, the wave swings by 1.5 * PI/3.
+const float gesture_bend = 1.3 * M_PI / 3.0;
+const float gesture_swing = 1.5 * M_PI / 3.0;
+
+const GestureTable::Channel victory_channel[] = {
+	//Ĵָ
+	{ "thumb_intermediate_phalange", { -0.7f, 0.07f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_proximal_phalange", { 0.0f, 0.0f, 0.5f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_distal_phalange", { 0.0f, 0.0f, 0.1f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_fingertip", { 0.0f, 0.0f, 0.05f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ʳָ
+	{ "index_proximal_phalange", { -0.5f, -1.0f, -0.5f }, gesture_bend / 4, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_intermediate_phalange", { 0.0f, 0.0f, -1.0f }, gesture_bend / 6, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_distal_phalange", { 0.0f, 0.0f, -1.0f }, gesture_bend / 6, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_fingertip", { 0.0f, 0.0f, 1.0f }, gesture_bend / 1000, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ָ
+	{ "middle_proximal_phalange", { 0.0f, 1.0f, -0.1f }, gesture_bend / 4, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_intermediate_phalange", { 0.0f, 0.0f, -1.0f }, gesture_bend / 6, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_distal_phalange", { 0.0f, 0.0f, -1.0f }, gesture_bend / 6, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_fingertip", { 0.0f, 0.0f, 1.0f }, gesture_bend / 1000, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ָ
+	{ "ring_intermediate_phalange", { 0.0f, -0.05f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//Сָ
+	{ "pinky_intermediate_phalange", { 0.0f, -0.07f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+};
+
+const GestureTable::Channel fist_channel[] = {
+	//Ĵָ
+	{ "thumb_intermediate_phalange", { -0.7f, 0.07f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_proximal_phalange", { 0.0f, 0.0f, 0.5f }, gesture_bend / 2, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_distal_phalange", { 0.0f, 0.0f, 0.1f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_fingertip", { 0.0f, 0.0f, 0.05f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ʳָ
+	{ "index_intermediate_phalange", { 0.0f, 0.05f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ָ
+	{ "middle_proximal_phalange", { 0.0f, 0.0f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_intermediate_phalange", { 0.0f, 0.0f, 2.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_distal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_fingertip", { 0.0f, 0.0f, 4.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ָ
+	{ "ring_intermediate_phalange", { 0.0f, -0.05f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//Сָ
+	{ "pinky_intermediate_phalange", { 0.0f, -0.07f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+};
+
+const GestureTable::Channel thumb_up_channel[] = {
+	{ "metacarpals", { 0.0f, 1.0f, 0.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//Ĵָ
+	{ "thumb_intermediate_phalange", { 0.0f, 0.0f, -1.0f }, gesture_bend / 2, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_proximal_phalange", { 1.0f, 0.0f, -1.0f }, gesture_bend / 300, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_distal_phalange", { 0.0f, 0.0f, -1.0f }, gesture_bend / 3, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "thumb_fingertip", { 0.0f, 0.0f, 1.0f }, gesture_bend / 1000, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ʳָ
+	{ "index_intermediate_phalange", { 0.0f, 0.05f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "index_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ָ
+	{ "middle_proximal_phalange", { 0.0f, 0.0f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_intermediate_phalange", { 0.0f, 0.0f, 2.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_distal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "middle_fingertip", { 0.0f, 0.0f, 4.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//ָ
+	{ "ring_intermediate_phalange", { 0.0f, -0.05f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "ring_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	//Сָ
+	{ "pinky_intermediate_phalange", { 0.0f, -0.07f, 1.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_proximal_phalange", { 0.0f, 0.0f, 3.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_distal_phalange", { 0.0f, 0.0f, 9.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+	{ "pinky_fingertip", { 0.0f, 0.0f, 27.0f }, gesture_bend, GESTURE_CURVE_TRIANGLE, 0.0f },
+};
+
+const GestureTable::Channel wave_channel[] = {
+	{ "metacarpals", { 0.0f, 1.0f, 0.0f }, gesture_swing, GESTURE_CURVE_TRIANGLE, 0.0f },
+};
+
+// One entry per gesture key, in id order from victory
+const GestureTable::Gesture hand_gesture[] = {
+	{ 1.5f, victory_channel, sizeof(victory_channel) / sizeof(victory_channel[0]) },
+	{ 1.5f, fist_channel, sizeof(fist_channel) / sizeof(fist_channel[0]) },
+	{ 2.5f, thumb_up_channel, sizeof(thumb_up_channel) / sizeof(thumb_up_channel[0]) },
+	{ 1.2f, wave_channel, sizeof(wave_channel) / sizeof(wave_channel[0]) }
+};
+const int hand_gesture_num = sizeof(hand_gesture) / sizeof(hand_gesture[0]);
+const float gesture_table_rate = 240.0f;
+std::vector<GestureTable::Table> gesture_table;
+
+// Poses the hand for a gesture at the given time, returns the gesture's period in seconds
+static float apply_gesture(int gesture, float passed_time, SkeletalMesh::SkeletonModifier & modifier)
+{
+	if (gesture < victory || gesture - victory >= gesture_table.size()) return 1.0f;
+	const GestureTable::Table & table = gesture_table[gesture - victory];
+	table.sample(passed_time, modifier);
+	return table.getPeriod();
+}
+
+// Fingertip positions in the metacarpals frame, so the wrist rotation does not take part in matching
+static void fingertip_position(const SkeletalMesh::Scene & sr, const SkeletalMesh::SkeletonModifier & modifier, glm::fvec3 position[5])
+{
+	static const std::vector<std::string> joint = {
+		hand_bone_name[0], hand_bone_name[4], hand_bone_name[8], hand_bone_name[12], hand_bone_name[16], hand_bone_name[20] };
+	std::vector<glm::fmat4> transf;
+	if (!sr.getJointTransforms(transf, joint, modifier))
+		transf.assign(joint.size(), glm::fmat4());
+	glm::fmat4 inv_metacarpals = glm::inverse(transf[0]);
+	for (int i = 0; i < 5; i++)
+		position[i] = glm::fvec3(inv_metacarpals * transf[i + 1][3]);
+}
+
+static PoseDatabase::Feature pose_feature(const glm::fvec3 position[5], const glm::fvec3 velocity[5])
+{
+	PoseDatabase::Feature feature;
+	for (int i = 0; i < 5; i++)
+		for (int k = 0; k < 3; k++)
+		{
+			feature.value[i * 3 + k] = position[i][k];
+			feature.value[15 + i * 3 + k] = velocity[i][k];
+		}
+	return feature;
+}
+
+// One clip per gesture (clip = gesture - victory), covering one period at sample_rate
+static void sample_gesture_clips(const SkeletalMesh::Scene & sr, float sample_rate,
+	std::vector<std::vector<PoseDatabase::Feature> > & clip, std::vector<float> & clip_period)
+{
+	clip.clear();
+	clip_period.clear();
+	for (int gesture = victory; gesture <= wave; gesture++)
+	{
+		SkeletalMesh::SkeletonModifier modifier;
+		float period = apply_gesture(gesture, 0.0f, modifier);
+		int frame_num = std::max(2, int(period * sample_rate + 0.5f));
+		std::vector<glm::fvec3> position(frame_num * 5);
+		for (int k = 0; k < frame_num; k++)
+		{
+			modifier.clear();
+			apply_gesture(gesture, k * period / frame_num, modifier);
+			fingertip_position(sr, modifier, &position[k * 5]);
+		}
+		// gestures are cyclic, so velocities wrap around the period
+		std::vector<PoseDatabase::Feature> frame(frame_num);
+		for (int k = 0; k < frame_num; k++)
+		{
+			glm::fvec3 velocity[5];
+			const glm::fvec3 * next = &position[(k + 1) % frame_num * 5];
+			const glm::fvec3 * prev = &position[(k + frame_num - 1) % frame_num * 5];
+			for (int i = 0; i < 5; i++)
+				velocity[i] = (next[i] - prev[i]) * (frame_num / (2.0f * period));
+			frame[k] = pose_feature(&position[k * 5], velocity);
+		}
+		clip.push_back(frame);
+		clip_period.push_back(period);
+	}
+}
+
 int main(int argc, char *argv[])
 {
+	std::chrono::steady_clock::time_point startup_start = std::chrono::steady_clock::now();
 	GLFWwindow* window;
-	GLuint vertex_shader, fragment_shader, program;
+	GLuint program[SCENE_RESOURCE_BONE_PER_VERTEX + 1];
 
-	glfwSetErrorCallback(error_callback);
+	// --stream <file>        : drive the hand from a recorded joint stream
+	// --record-stream <file> : record the keyboard gestures as a joint stream
+	// --record-rate <hz>     : samples per second of the recorded stream, 60 by default
+	// --bench-pose-database  : time pose database build and queries at 100k frames, then exit
+	// --bench-gesture-tables : time 100k gesture table pose samples, then exit
+	// --particles <count>    : fill the space around the hand with a particle lattice it collides with
+	// --offline <fps>        : advance animation by exactly 1/fps per frame, for reproducible runs
+	// --frames <count>       : quit after rendering this many frames
+	// --pace <mode>          : off, vsync, target or adaptive (default; drops to 10 fps while nothing moves)
+	// --fps <rate>           : frame rate of the target and adaptive modes, 60 by default
+	// --headless <pattern>   : render offscreen into frame files named by a printf pattern, e.g. out/hand_%05d.ppm
+	// --size <w> <h>         : headless frame size, 800 x 800 by default
+	// --camera-path <path>   : camera keys "time px py pz tx ty tz", from a file or inline separated by ';'
+	// --no-program-cache     : compile every program from source instead of loading stored binaries
+	// --no-texture-cache     : decode every image and upload it uncompressed instead of loading stored BC files
+	// --upload-budget <KB>   : texture data streamed to the GPU per frame, 4096 by default; 0 uploads each texture whole at load
+	// --mip-filter <filter>  : kaiser (default) or box, built on the CPU in linear light, or gpu for glGenerateMipmap
+	// --bench-mipmaps <file> : time the CPU mip filters against glGenerateMipmap on an image, then exit
+	// --resource-budget <MB> : CPU and GPU memory of scenes and textures before unreferenced ones are evicted, 512 by default; 0 for none
+	// --morph-period <s>     : ease every morph target of the model in and out over this period, staggered; by default the imported weights are kept
+	// --texture-mapping      : start with the diffuse maps shown instead of the uvs, as T does
+	// --force-evict <frames> : every this many frames, evict the scene and its textures and load them back, timing the reload
+	std::string stream_filename, record_filename;
+	float record_rate = JOINT_STREAM_DEFAULT_RATE;
+	float morph_period = 0.0f;
+	std::string headless_pattern, camera_path_source, bench_mipmap_filename;
+	int headless_width = 800, headless_height = 800;
+	bool bench_pose_database = false, bench_gesture_tables = false;
+	unsigned int particle_num = 0;
+	double offline_fps = 0.0;
+	unsigned long long frame_limit = 0;
+	unsigned long long force_evict_frames = 0;
+	FramePacing::Mode pace_mode = FramePacing::Adaptive;
+	bool pace_given = false;
+	double pace_fps = FRAME_PACER_DEFAULT_RATE;
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) == "--stream" && i + 1 < argc)
+			stream_filename = argv[++i];
+		else if (std::string(argv[i]) == "--record-stream" && i + 1 < argc)
+			record_filename = argv[++i];
+		else if (std::string(argv[i]) == "--record-rate" && i + 1 < argc)
+			record_rate = std::max(1.0f, (float)atof(argv[++i]));
+		else if (std::string(argv[i]) == "--morph-period" && i + 1 < argc)
+			morph_period = std::max(0.0f, (float)atof(argv[++i]));
+		else if (std::string(argv[i]) == "--texture-mapping")
+			texture_mapping = true;
+		else if (std::string(argv[i]) == "--bench-pose-database")
+			bench_pose_database = true;
+		else if (std::string(argv[i]) == "--bench-gesture-tables")
+			bench_gesture_tables = true;
+		else if (std::string(argv[i]) == "--particles" && i + 1 < argc)
+			particle_num = atoi(argv[++i]);
+		else if (std::string(argv[i]) == "--offline" && i + 1 < argc)
+			offline_fps = atof(argv[++i]);
+		else if (std::string(argv[i]) == "--frames" && i + 1 < argc)
+			frame_limit = atoll(argv[++i]);
+		else if (std::string(argv[i]) == "--force-evict" && i + 1 < argc)
+			force_evict_frames = atoll(argv[++i]);
+		else if (std::string(argv[i]) == "--pace" && i + 1 < argc)
+		{
+			if (!FramePacing::parseMode(argv[++i], pace_mode))
+				std::cout << "Unknown pacing mode " << argv[i] << ", using adaptive" << std::endl;
+			pace_given = true;
+		}
+		else if (std::string(argv[i]) == "--fps" && i + 1 < argc)
+			pace_fps = atof(argv[++i]);
+		else if (std::string(argv[i]) == "--headless" && i + 1 < argc)
+			headless_pattern = argv[++i];
+		else if (std::string(argv[i]) == "--size" && i + 2 < argc)
+		{
+			headless_width = std::max(1, atoi(argv[++i]));
+			headless_height = std::max(1, atoi(argv[++i]));
+		}
+		else if (std::string(argv[i]) == "--camera-path" && i + 1 < argc)
+			camera_path_source = argv[++i];
+		else if (std::string(argv[i]) == "--no-program-cache")
+			ProgramCache::shared().setEnabled(false);
+		else if (std::string(argv[i]) == "--no-texture-cache")
+			TextureCache::shared().setEnabled(false);
+		else if (std::string(argv[i]) == "--upload-budget" && i + 1 < argc)
+			TextureStream::shared().setBudget((size_t)std::max(0, atoi(argv[++i])) * 1024);
+		else if (std::string(argv[i]) == "--mip-filter" && i + 1 < argc)
+		{
+			TextureMipmap::Filter filter;
+			if (TextureMipmap::parseFilter(argv[++i], filter))
+				TextureCache::shared().setMipmapFilter(filter);
+			else
+				std::cout << "Unknown mip filter " << argv[i] << ", using kaiser" << std::endl;
+		}
+		else if (std::string(argv[i]) == "--bench-mipmaps" && i + 1 < argc)
+			bench_mipmap_filename = argv[++i];
+		else if (std::string(argv[i]) == "--resource-budget" && i + 1 < argc)
+			ResourceRegistry::shared().setBudget((unsigned long long)std::max(0.0, atof(argv[++i])) * 1024 * 1024);
+	}
 
-	if (!glfwInit())
-		exit(EXIT_FAILURE);
+	// Headless runs are batch jobs: fixed animation steps, a frame count, no throttling
+	bool headless = !headless_pattern.empty();
+	if (headless)
+	{
+		if (offline_fps <= 0.0) offline_fps = 30.0;
+		if (frame_limit == 0) frame_limit = 120;
+		pace_mode = FramePacing::Unlimited;
+		pace_given = true;
+	}
 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+	Offscreen::CameraPath camera_path;
+	if (!camera_path_source.empty() && !camera_path.load(camera_path_source))
+		std::cout << "Error occured in loading the camera path " << camera_path_source << std::endl;
 
-	window = glfwCreateWindow(800, 800, "OpenGL output", NULL, NULL);
-	if (!window)
+	// Headless runs render through EGL without GLFW or a display server. GLEW resolves the
+	// entry points of the current context; a GLEW built for GLX loads them before it reports
+	// the missing GLX display, one built for WGL does not, and then a hidden window takes over.
+	Offscreen::Context headless_context;
+	window = NULL;
+	bool gl_loaded = false;
+	if (headless && headless_context.create(4, 5, false))
 	{
-		glfwTerminate();
-		exit(EXIT_FAILURE);
+		GLenum glew_status = glewInit();
+		gl_loaded = glew_status == GLEW_OK || glew_status == GLEW_ERROR_NO_GLX_DISPLAY;
+		if (!gl_loaded)
+			headless_context.destroy();
 	}
+	if (!gl_loaded)
+	{
+		if (headless)
+			std::cout << "Headless: no EGL context GLEW can load, falling back to a hidden window" << std::endl;
+		glfwSetErrorCallback(error_callback);
 
-	glfwSetKeyCallback(window, key_callback);
-
+		if (!glfwInit())
+			exit(EXIT_FAILURE);
 
-	glfwMakeContextCurrent(window);
-	glfwSwapInterval(0);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+		if (headless)
+			glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
-	if (glewInit() != GLEW_OK)
-		exit(EXIT_FAILURE);
+		window = glfwCreateWindow(800, 800, "OpenGL output", NULL, NULL);
+		if (!window)
+		{
+			glfwTerminate();
+			exit(EXIT_FAILURE);
+		}
 
-	vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertex_shader, 1, &SkeletalAnimation::vertex_shader_450, NULL);
-	glCompileShader(vertex_shader);
+		glfwSetKeyCallback(window, key_callback);
 
-	fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragment_shader, 1, &SkeletalAnimation::fragment_shader_450, NULL);
-	glCompileShader(fragment_shader);
+		glfwMakeContextCurrent(window);
+		if (glewInit() != GLEW_OK)
+			exit(EXIT_FAILURE);
+	}
+	// offline runs measure throughput, so they are unthrottled unless asked otherwise
+	if (offline_fps > 0.0 && !pace_given)
+		pace_mode = FramePacing::Unlimited;
+	frame_pacer.setMode(pace_mode, pace_fps);
+	if (window)
+		glfwSwapInterval(frame_pacer.getSwapInterval());
+	// a key press ends the wait between frames, so idle pacing does not delay the response
+	if (!headless)
+		frame_pacer.setEventWait([](double timeout) { glfwWaitEventsTimeout(timeout); return frame_input; });
 
-	program = glCreateProgram();
-	glAttachShader(program, vertex_shader);
-	glAttachShader(program, fragment_shader);
-	glLinkProgram(program);
+	if (!bench_mipmap_filename.empty())
+	{
+		TextureStream::Source source;
+		if (TextureImage::Texture::decodeFile(bench_mipmap_filename, source))
+		{
+			TextureCache::Image image(source);
+			source.free();
+			TextureMipmap::benchmark(bench_mipmap_filename, image.rgba.data(), image.width, image.height, std::cout);
+		}
+		else
+			std::cout << "Error occured in loading " << bench_mipmap_filename << std::endl;
+		if (window)
+		{
+			glfwDestroyWindow(window);
+			glfwTerminate();
+		}
+		exit(EXIT_SUCCESS);
+	}
 
-	int linkStatus;
-	if (glGetProgramiv(program, GL_LINK_STATUS, &linkStatus), linkStatus == GL_FALSE)
-		std::cout << "Error occured in glLinkProgram()" << std::endl;
+	// program[n] skins with exactly n bone influences, program[0] is the generic path;
+	// only the permutations of the current texture mapping are built, the others on the first T
+	for (int i = 0; i <= SCENE_RESOURCE_BONE_PER_VERTEX; i++)
+		program[i] = skinning_program(SKINNING_FEATURES[0].mask(i) | SKINNING_FEATURES[1].mask(texture_mapping));
+	// u_mvp followed by the bone matrices; std140 lays mat4 arrays out like glm::fmat4
+	GLuint skinning_frame_ubo;
+	glGenBuffers(1, &skinning_frame_ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, skinning_frame_ubo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(glm::fmat4) * (1 + SKINNING_MAX_BONES), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, SKINNING_FRAME_BINDING, skinning_frame_ubo);
 
 	SkeletalMesh::Scene & sr = SkeletalMesh::Scene::loadScene("Hand", "Hand.fbx");
 	if (&sr == &SkeletalMesh::Scene::error)
 		std::cout << "Error occured in loadMesh()" << std::endl;
+	// Held for the whole run, so the registry never evicts the scene or its textures; --force-evict lets go of it
+	ResourceRegistry::Handle<SkeletalMesh::Scene> scene_handle(&sr);
+	// Frames rendered for a fixed timeline must not depend on how fast textures stream in
+	if (offline_fps > 0.0)
+		TextureStream::shared().finish();
+	bool texture_streaming = TextureStream::shared().getPendingNum() > 0;
+	// Diffuse textures are copied into texture arrays once all of them are on the GPU
+	if (!texture_streaming && sr.packTextures())
+		sr.reportTexturePacking(std::cout);
+
+	// All programs share the attribute layout, so one VAO setup serves them all
+	sr.setShaderInput(program[0], "in_position", "in_texcoord", "in_normal", "in_bone_index", "in_bone_weight", "in_morph_slot", "in_diffuse_layer");
+	sr.reportInfluenceBuckets(std::cout);
+	sr.reportMemory(std::cout);
 
-	sr.setShaderInput(program, "in_position", "in_texcoord", "in_normal", "in_bone_index", "in_bone_weight");
+	gesture_table.resize(hand_gesture_num);
+	for (int i = 0; i < hand_gesture_num; i++)
+		gesture_table[i].bake(hand_gesture[i], gesture_table_rate);
+
+	// A gesture switch starts at the frame of the new gesture nearest to the current pose
+	std::vector<std::vector<PoseDatabase::Feature> > gesture_clip;
+	std::vector<float> gesture_period;
+	PoseDatabase::Database pose_database;
+	sample_gesture_clips(sr, gesture_sample_rate, gesture_clip, gesture_period);
+	for (int i = 0; i < gesture_clip.size(); i++)
+		pose_database.addClip(gesture_clip[i]);
+	pose_database.build();
+	if (bench_pose_database)
+	{
+		float total_period = 0.0f;
+		for (int i = 0; i < gesture_period.size(); i++)
+			total_period += gesture_period[i];
+		std::vector<std::vector<PoseDatabase::Feature> > dense_clip;
+		std::vector<float> dense_period;
+		sample_gesture_clips(sr, 100000.0f / total_period, dense_clip, dense_period);
+		PoseDatabase::benchmark(dense_clip, 10000, std::cout);
+		request_close(window);
+	}
+	int gesture = pause;
+	float gesture_start = 0.0f, gesture_phase = 0.0f;
+	glm::fvec3 tip_position[5], tip_velocity[5];
+	fingertip_position(sr, SkeletalMesh::SkeletonModifier(), tip_position);
+
+	// The lattice covers the sphere the spinning hand sweeps around the metacarpals
+	ParticleField::Field particle_field;
+	std::vector<std::string> hand_joint(hand_bone_name, hand_bone_name + hand_bone_num);
+	std::vector<glm::fmat4> hand_joint_transf;
+	std::vector<ParticleField::Capsule> hand_capsule;
+	GLuint particle_program = 0, particle_vao = 0, particle_vbo = 0;
+	if (particle_num > 0 && sr.getJointTransforms(hand_joint_transf, hand_joint, SkeletalMesh::SkeletonModifier()))
+	{
+		glm::fvec3 center = glm::fvec3(hand_joint_transf[0][3]);
+		float reach = 0.0f;
+		for (int i = 0; i < hand_bone_num; i++)
+			reach = std::max(reach, glm::length(glm::fvec3(hand_joint_transf[i][3]) - center));
+		particle_field.reset(center, reach * 1.2f, particle_num);
+
+		particle_program = build_particle_program();
+		glGenVertexArrays(1, &particle_vao);
+		glBindVertexArray(particle_vao);
+		glGenBuffers(1, &particle_vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, particle_vbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * particle_num, NULL, GL_STREAM_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
+		glBindVertexArray(0);
+		glPointSize(2.0f);
+	}
+
+	if (!stream_filename.empty() && !joint_stream.start(stream_filename))
+		std::cout << "Error occured in opening joint stream " << stream_filename << std::endl;
+	if (!record_filename.empty() && !joint_recorder.open(record_filename,
+		std::vector<std::string>(hand_bone_name, hand_bone_name + hand_bone_num), record_rate))
+		std::cout << "Error occured in creating joint stream " << record_filename << std::endl;
+	float last_report_time = app_time();
 
 	float passed_time;
 	SkeletalMesh::SkeletonModifier modifier;
 
-	glEnable(GL_DEPTH_TEST);
-	while (!glfwWindowShouldClose(window))
+	// Gesture channels write straight into their modifier entries, resolved once
+	std::vector<std::vector<glm::fmat4 *> > gesture_target(gesture_table.size());
+	for (int i = 0; i < gesture_table.size(); i++)
+		gesture_table[i].bind(modifier, gesture_target[i]);
+	if (bench_gesture_tables)
 	{
-		passed_time = clock() / double(CLOCKS_PER_SEC);
-		camera_move(window);
-		delta_time = glfwGetTime() - last_time;
-		last_time = glfwGetTime();
-
+		const int sample_num = 100000;
+		std::chrono::steady_clock::time_point sample_start = std::chrono::steady_clock::now();
+		for (int k = 0; k < sample_num; k++)
+			gesture_table[k % gesture_table.size()].sample(k * 0.001f, gesture_target[k % gesture_table.size()].data());
+		double sample_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - sample_start).count();
+		std::cout << "Gesture tables: " << sample_time / sample_num * 1e9 << " ns per pose sample" << std::endl;
+		request_close(window);
+	}
 
+	// Pose of the keyboard gestures at an animation time
+	// Time the wrist has turned for; held, it keeps its angle and resumes from there
+	float spin_time = 0.0f, spin_offset = 0.0f;
+	auto pose_hand = [&](float time)
+	{
+		if (wrist_spin)
+			spin_time = time - spin_offset;
+		else
+			spin_offset = time - spin_time;
 		// * turn around every 4 seconds
-		float metacarpals_angle = passed_time * (M_PI / 2.0);
+		float metacarpals_angle = spin_time * (M_PI / 2.0);
 		// * target = metacarpals
 		// * rotation axis = (1, 0, 0)
 		modifier["metacarpals"] = glm::rotate(glm::fmat4(), metacarpals_angle, glm::fvec3(1.0, 0.2, 0.1));
+		if (gesture != pause)
+			gesture_table[gesture - victory].sample(std::max(time - gesture_start, 0.0f) + gesture_phase, gesture_target[gesture - victory].data());
+	};
+
+	Offscreen::Target offscreen_target;
+	if (headless && !offscreen_target.create(headless_width, headless_height, headless_pattern))
+		request_close(window);
+
+	animation_timeline.setOffline(offline_fps);
+	animation_timeline.start();
+	double run_start = app_time();
+	v3 paced_camera_pos = camera_pos, paced_camera_front = camera_front;
+	int paced_width = 0, paced_height = 0;
+	// --force-evict cycles and what they cost; the reload is the acquire that loads the scene and its textures back
+	unsigned long long evict_frame = 0;
+	unsigned int evict_cycle_num = 0, evict_resource_num = 0;
+	double evict_time = 0.0, evict_reload_time = 0.0, evict_reload_max = 0.0;
+	frame_pacer.start();
+	glEnable(GL_DEPTH_TEST);
+	while (!close_requested(window))
+	{
+		if (window)
+			camera_move(window);
+		delta_time = app_time() - last_time;
+		last_time = app_time();
+
+		// Gesture switches, fingertip velocities and the particle field advance in fixed ticks
+		animation_timeline.beginFrame();
+		while (animation_timeline.nextTick())
+		{
+			float tick_time = animation_timeline.getTickTime();
+			float tick_step = animation_timeline.getTickStep();
+			if (joint_stream.isRunning())
+				gesture = pause;
+			else if (motion != pause && motion != gesture)
+			{
+				PoseDatabase::Match match = pose_database.query(motion - victory, pose_feature(tip_position, tip_velocity));
+				gesture_phase = match.frame * gesture_period[match.clip] / pose_database.getFrameNum(match.clip);
+				gesture_start = tick_time;
+				gesture = motion;
+			}
+			pose_hand(tick_time);
+
+			glm::fvec3 position[5];
+			fingertip_position(sr, modifier, position);
+			for (int i = 0; i < 5; i++)
+			{
+				tip_velocity[i] = (position[i] - tip_position[i]) / tick_step;
+				tip_position[i] = position[i];
+			}
+
+			if (particle_field.getParticleNum() > 0)
+			{
+				sr.getJointTransforms(hand_joint_transf, hand_joint, modifier);
+				ParticleField::buildCapsules(hand_capsule, hand_joint_transf, hand_capsule_segment, hand_capsule_num, hand_capsule_radius_scale);
+				particle_field.setColliders(hand_capsule);
+				particle_field.step(tick_step);
+			}
+		}
+		passed_time = animation_timeline.getTime();
+		if (!camera_path.empty())
+			camera_path.sample(passed_time, camera_pos, camera_target);
 
 		/**********************************************************************************\
 		*
@@ -259,148 +955,90 @@ int main(int argc, char *argv[])
 		*
 		\**********************************************************************************/
 
-		// Example: Animate the index finger
-		// * period = 2.4 seconds
-		float time_in_period = 0;
-		float period = 1;
-		if (motion == fist) {
-			period = 1.5f;
-			time_in_period = fmod(passed_time, period);
-			// * angle: 0 -> PI/3 -> 0
-			float thumb_angle = 1.3 * abs(time_in_period / (period * 0.5f) - 1.0f) * (M_PI / 3.0);
-			// * target = proximal phalange of the index
-			// * rotation axis = (0, 0, 1)
-
-			//Ĵָ
-			modifier["thumb_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(-0.7, 0.07, 1.0));
-			modifier["thumb_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/2, glm::fvec3(0.0, 0.0, 0.5));
-			modifier["thumb_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 0.1));
-			modifier["thumb_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 0.05));
-			//ʳָ
-			modifier["index_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.05, 1.0));
-			modifier["index_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["index_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["index_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
-			//ָ
-			modifier["middle_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 1.0));
-			modifier["middle_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 2.0));
-			modifier["middle_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["middle_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 4.0));
-			//ָ
-			modifier["ring_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, -0.05, 1.0));
-			modifier["ring_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["ring_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["ring_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
-			//Сָ
-			modifier["pinky_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, -0.07, 1.0));
-			modifier["pinky_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["pinky_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["pinky_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
-		}
-		else if (motion == thumb_up) {
-			// * turn around every 4 seconds
-			//printf("%.5f\n", metacarpals_angle);
-			// * target = metacarpals
-			// * rotation axis = (1, 0, 0)
-			period = 2.5f;
-			time_in_period = fmod(passed_time, period);
-			float metacarpals_angle = 1.3 * abs(time_in_period / (period * 0.5f) - 1.0f) * (M_PI / 3.0);
-			modifier["metacarpals"] = glm::rotate(glm::fmat4(), metacarpals_angle, glm::fvec3(0.0, 1.0, 0.0));
-			// * angle: 0 -> PI/3 -> 0
-			float thumb_angle = 1.3 * abs(time_in_period / (period * 0.5f) - 1.0f) * (M_PI / 3.0);
-			// * target = proximal phalange of the index
-			// * rotation axis = (0, 0, 1)
-
-			//Ĵָ
-			modifier["thumb_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/2, glm::fvec3(0.0, 0.0, -1.0));
-			modifier["thumb_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/300, glm::fvec3(1.0, 0.0, -1.0));
-			modifier["thumb_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/3, glm::fvec3(0.0, 0.0, -1.0));
-			modifier["thumb_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle/1000, glm::fvec3(0.0, 0.0,1.0));
-			//ʳָ
-			modifier["index_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.05, 1.0));
-			modifier["index_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["index_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["index_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
-			//ָ
-			modifier["middle_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 1.0));
-			modifier["middle_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 2.0));
-			modifier["middle_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["middle_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 4.0));
-			//ָ
-			modifier["ring_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, -0.05, 1.0));
-			modifier["ring_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["ring_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["ring_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
-			//Сָ
-			modifier["pinky_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, -0.07, 1.0));
-			modifier["pinky_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["pinky_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["pinky_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
+		pose_hand(passed_time);
+		if (joint_stream.isRunning())
+		{
+			joint_stream.apply(modifier);
+			// The stream has ended and its last samples are applied: the keyboard gestures take over again
+			if (!joint_stream.isRunning())
+			{
+				std::cout << "Joint stream ended" << std::endl;
+				joint_stream.report(std::cout);
+				joint_stream.stop();
+			}
 		}
-		else if (motion == wave) {
-			// * turn around every 4 seconds
-			//printf("%.5f\n", metacarpals_angle);
-			// * target = metacarpals
-			// * rotation axis = (1, 0, 0)
-			period = 1.2f;
-			time_in_period = fmod(passed_time, period);
-			float metacarpals_angle = 1.5 * abs(time_in_period / (period * 0.5f) - 1.0f) * (M_PI / 3.0);
-			//printf("%.3f %.3f\n", time_in_period, period);
-			modifier["metacarpals"] = glm::rotate(glm::fmat4(), metacarpals_angle, glm::fvec3(0.0, 1.0, 0.0));
-			// * angle: 0 -> PI/3 -> 0
-			float thumb_angle = 1.3 * abs(time_in_period / (period * 0.5f) - 1.0f) * (M_PI / 3.0);
-			// * target = proximal phalange of the index
-			// * rotation axis = (0, 0, 1)
-		}
-		else if (motion == victory) {
-
-			period = 1.5f;
-			time_in_period = fmod(passed_time, period);
-			// * angle: 0 -> PI/3 -> 0
-			float thumb_angle = 1.3 * abs(time_in_period / (period * 0.5f) - 1.0f) * (M_PI / 3.0);
-			// * target = proximal phalange of the index
-			// * rotation axis = (0, 0, 1)
-
-
-			//Ĵָ
-			modifier["thumb_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(-0.7, 0.07, 1.0));
-			modifier["thumb_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 0.5));
-			modifier["thumb_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 0.1));
-			modifier["thumb_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 0.05));
-			//ʳָ
-			modifier["index_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/4, glm::fvec3(-0.5, -1.0, -0.5));
-			modifier["index_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/6, glm::fvec3(0.0, 0.0, -1.0));
-			modifier["index_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/6, glm::fvec3(0.0, 0.0, -1.0));
-			modifier["index_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle/1000, glm::fvec3(0.0, 0.0, 1.0));
-			//ָ
-			modifier["middle_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/4, glm::fvec3(0.0, 1.0, -0.1));
-			modifier["middle_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/6, glm::fvec3(0.0, 0.0, -1.0));
-			modifier["middle_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle/6, glm::fvec3(0.0, 0.0, -1.0));
-			modifier["middle_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle/1000, glm::fvec3(0.0, 0.0, 1.0));
-			//ָ
-			modifier["ring_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, -0.05, 1.0));
-			modifier["ring_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["ring_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["ring_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
-			//Сָ
-			modifier["pinky_intermediate_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, -0.07, 1.0));
-			modifier["pinky_proximal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 3.0));
-			modifier["pinky_distal_phalange"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 9.0));
-			modifier["pinky_fingertip"] = glm::rotate(glm::fmat4(), thumb_angle, glm::fvec3(0.0, 0.0, 27.0));
+		else
+			joint_recorder.append(app_time(), modifier);
+
+		if (app_time() - last_report_time > 5.0f)
+		{
+			if (joint_stream.isRunning())
+			{
+				joint_stream.report(std::cout);
+				joint_stream.resetStatistics();
+			}
+			sr.reportCulling(std::cout);
+			sr.resetCullStatistics();
+			sr.reportRendering(std::cout);
+			sr.resetRenderStatistics();
+			particle_field.report(std::cout);
+			particle_field.resetStatistics();
+			frame_pacer.report(std::cout);
+			frame_pacer.resetStatistics();
+			last_report_time = app_time();
 		}
 		float ratio;
 		int width, height;
 
-		glfwGetFramebufferSize(window, &width, &height);
+		if (headless)
+		{
+			width = offscreen_target.getWidth();
+			height = offscreen_target.getHeight();
+			offscreen_target.bind();
+		}
+		else
+			glfwGetFramebufferSize(window, &width, &height);
 		ratio = width / (float)height;
 
+		// Drop the only reference as a second scene would, evict everything unreferenced and take the scene back
+		if (force_evict_frames > 0 && ++evict_frame == force_evict_frames)
+		{
+			evict_frame = 0;
+			std::chrono::steady_clock::time_point cycle_start = std::chrono::steady_clock::now();
+			scene_handle.reset();
+			evict_resource_num += ResourceRegistry::shared().evictUnreferenced();
+			std::chrono::steady_clock::time_point reload_start = std::chrono::steady_clock::now();
+			scene_handle = ResourceRegistry::Handle<SkeletalMesh::Scene>(&sr);
+			double reload_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - reload_start).count();
+			evict_time += std::chrono::duration<double>(reload_start - cycle_start).count();
+			evict_reload_time += reload_time;
+			evict_reload_max = std::max(evict_reload_max, reload_time);
+			evict_cycle_num++;
+			if (sr.isEvicted())
+				std::cout << "Error occured in reloading the scene" << std::endl;
+			// The reloaded textures stream in again and are packed once they are all on the GPU
+			if (offline_fps > 0.0)
+				TextureStream::shared().finish();
+			texture_streaming = TextureStream::shared().getPendingNum() > 0;
+			if (!texture_streaming)
+				sr.packTextures();
+		}
+
+		// Textures arrive a budget of bytes per frame instead of stalling the frames that load them
+		if (texture_streaming && TextureStream::shared().update() == 0)
+		{
+			texture_streaming = false;
+			TextureStream::shared().report(std::cout);
+			if (sr.packTextures())
+				sr.reportTexturePacking(std::cout);
+		}
+
 		glClearColor(0.5, 0.5, 0.5, 1.0);
 
 		glViewport(0, 0, width, height);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		//ӽǱ仯
-		glUseProgram(program);
 		/*
 		time_in_period = fmod(passed_time, period * 5);
 		printf("%.4f\n", look_at);
@@ -411,24 +1049,118 @@ int main(int argc, char *argv[])
 
 		mvp *= glm::lookAt(camera_pos, camera_target, camera_up);
 
-		glUniformMatrix4fv(glGetUniformLocation(program, "u_mvp"), 1, GL_FALSE, (const GLfloat*)&mvp);
-		glUniform1i(glGetUniformLocation(program, "u_diffuse"), SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL);
+		// Each target gets its own phase so the shapes blend into one another instead of pulsing together
+		if (morph_period > 0.0f)
+			for (unsigned int m = 0; m < sr.getMorphTargetNum(); m++)
+				sr.setMorphWeight(m, GestureTable::evaluateCurve(GESTURE_CURVE_SINE, passed_time / morph_period + float(m) / sr.getMorphTargetNum()));
+		sr.applyMorphTargets();
 		SkeletalMesh::Scene::SkeletonTransf bonesTransf;
 		sr.getSkeletonTransform(bonesTransf, modifier);
+		// One upload serves all bucket programs instead of a copy of the bones per program
+		glBindBuffer(GL_UNIFORM_BUFFER, skinning_frame_ubo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::fmat4), &mvp);
 		if (!bonesTransf.empty())
-			glUniformMatrix4fv(glGetUniformLocation(program, "u_bone_transf"), bonesTransf.size(), GL_FALSE, (float *)bonesTransf.data());
-		sr.render();
+			glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::fmat4), sizeof(glm::fmat4) * std::min<size_t>(bonesTransf.size(), SKINNING_MAX_BONES), bonesTransf.data());
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		for (int i = 0; i <= SCENE_RESOURCE_BONE_PER_VERTEX; i++)
+			program[i] = skinning_program(SKINNING_FEATURES[0].mask(i) | SKINNING_FEATURES[1].mask(texture_mapping));
+		sr.render(program, mvp, bonesTransf);
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		if (particle_field.getParticleNum() > 0)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, particle_vbo);
+			float * particle_position = (float *)glMapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(float) * 3 * particle_num,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			if (particle_position)
+			{
+				particle_field.writePositions(particle_position);
+				glUnmapBuffer(GL_ARRAY_BUFFER);
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+			glUseProgram(particle_program);
+			glUniformMatrix4fv(glGetUniformLocation(particle_program, "u_mvp"), 1, GL_FALSE, (const GLfloat*)&mvp);
+			glBindVertexArray(particle_vao);
+			glDrawArrays(GL_POINTS, 0, particle_num);
+			glBindVertexArray(0);
+		}
+
+		if (headless)
+			offscreen_target.capture();
+		else
+			glfwSwapBuffers(window);
+		// nothing changes on screen while the wrist is held with no gesture, no morph animation and the particles
+		// at rest (or the animation is paused), no stream plays, and the camera, window and keys are still
+		bool animating = !animation_timeline.isPaused() && (wrist_spin || gesture != pause
+			|| (morph_period > 0.0f && sr.getMorphTargetNum() > 0) || !particle_field.isAtRest());
+		bool changed = animating || joint_stream.isRunning() || frame_input
+			|| camera_pos != paced_camera_pos || camera_front != paced_camera_front || width != paced_width || height != paced_height;
+		paced_camera_pos = camera_pos;
+		paced_camera_front = camera_front;
+		paced_width = width;
+		paced_height = height;
+		frame_input = false;
+		frame_pacer.endFrame(changed);
+		if (window)
+			glfwPollEvents();
 
+		if (animation_timeline.getFrameCount() == 1)
+		{
+			std::cout << "Startup: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - startup_start).count() * 1000.0
+				<< " ms to the first frame" << std::endl;
+			ProgramCache::shared().report(std::cout);
+			TextureCache::shared().report(std::cout);
+			TextureStream::shared().report(std::cout);
+			ResourceRegistry::shared().report(std::cout);
+		}
+
+		if (frame_limit > 0 && animation_timeline.getFrameCount() >= frame_limit)
+			request_close(window);
 	}
 
+	double run_time = app_time() - run_start;
+	std::cout << "Rendered " << animation_timeline.getFrameCount() << " frames in " << run_time << " s ("
+		<< animation_timeline.getFrameCount() / std::max(run_time, 1e-9) << " fps), animation time "
+		<< animation_timeline.getTickTime() << " s in " << animation_timeline.getTickCount() << " ticks"
+		<< (animation_timeline.isOffline() ? " (offline)" : "") << std::endl;
+	if (headless)
+	{
+		offscreen_target.finish();
+		offscreen_target.report(std::cout);
+		offscreen_target.destroy();
+	}
+
+	if (evict_cycle_num > 0)
+	{
+		std::cout << "Forced eviction: " << evict_cycle_num << " cycles every " << force_evict_frames << " frames, "
+			<< evict_resource_num << " resources evicted, " << evict_time / evict_cycle_num * 1000.0 << " ms evicting and "
+			<< evict_reload_time / evict_cycle_num * 1000.0 << " ms reloading on average, " << evict_reload_max * 1000.0
+			<< " ms at most (texture uploads stream in afterwards, compression runs on the worker pool)" << std::endl;
+		ResourceRegistry::shared().report(std::cout);
+		TextureCache::shared().report(std::cout);
+	}
+
+	if (joint_stream.isRunning())
+		joint_stream.report(std::cout);
+	joint_stream.stop();
+	joint_recorder.close();
+
+	scene_handle.reset();
 	SkeletalMesh::Scene::unloadScene("Hand");
+	TextureStream::shared().destroy();
+	for (std::map<unsigned int, GLuint>::iterator it = skinning_programs.begin(); it != skinning_programs.end(); ++it)
+		glDeleteProgram(it->second);
+	glDeleteBuffers(1, &skinning_frame_ubo);
+	glDeleteProgram(particle_program);
+	glDeleteVertexArrays(1, &particle_vao);
+	glDeleteBuffers(1, &particle_vbo);
 
-	glfwDestroyWindow(window);
+	headless_context.destroy();
+	if (window)
+	{
+		glfwDestroyWindow(window);
 
-	glfwTerminate();
+		glfwTerminate();
+	}
 	exit(EXIT_SUCCESS);
 }
\ No newline at end of file
@@ -0,0 +1,330 @@
+// Meshlet Clustering & Culling
+// Splits triangle lists into small clusters with bounds for CPU culling
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <glm\glm.hpp>
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+#define MESHLET_NO_BONE 0xFFFFFFFFu
+
+namespace Meshlet
+{
+	struct Sphere
+	{
+		glm::fvec3 center;
+		float radius;
+	};
+
+	// Bind pose bound of the cluster vertices influenced by one bone (or by none)
+	struct BoneBound
+	{
+		unsigned int bone;
+		Sphere bound;
+	};
+
+	struct Cluster
+	{
+		unsigned int indexOffset;
+		unsigned int cornerNum;
+		Sphere bound;
+		glm::fvec3 coneAxis;
+		// Back-facing when the view is within this sine of the axis, >= 1 disables cone culling
+		float coneCutoff;
+		unsigned int boneBoundOffset;
+		unsigned int boneBoundNum;
+		// Farthest any morph target at weight 1 moves one of the cluster's vertices
+		float morphReach;
+	};
+
+	inline Sphere mergeSphere(const Sphere & a, const Sphere & b)
+	{
+		glm::fvec3 d = b.center - a.center;
+		float distance = glm::length(d);
+		if (distance + b.radius <= a.radius) return a;
+		if (distance + a.radius <= b.radius) return b;
+		Sphere result;
+		result.radius = (distance + a.radius + b.radius) * 0.5f;
+		result.center = a.center + d * ((result.radius - a.radius) / distance);
+		return result;
+	}
+
+	// Ritter's approximate bounding sphere
+	inline Sphere boundingSphere(const std::vector<glm::fvec3> & point)
+	{
+		Sphere result = { glm::fvec3(0.0f), 0.0f };
+		if (point.empty()) return result;
+		unsigned int a = 0, b = 0;
+		for (int i = 0; i < point.size(); i++)
+			if (glm::dot(point[i] - point[0], point[i] - point[0]) > glm::dot(point[a] - point[0], point[a] - point[0])) a = i;
+		for (int i = 0; i < point.size(); i++)
+			if (glm::dot(point[i] - point[a], point[i] - point[a]) > glm::dot(point[b] - point[a], point[b] - point[a])) b = i;
+		result.center = (point[a] + point[b]) * 0.5f;
+		result.radius = glm::length(point[b] - point[a]) * 0.5f;
+		for (int i = 0; i < point.size(); i++)
+		{
+			float distance = glm::length(point[i] - result.center);
+			if (distance > result.radius)
+			{
+				float grown = (result.radius + distance) * 0.5f;
+				result.center += (point[i] - result.center) * ((grown - result.radius) / distance);
+				result.radius = grown;
+			}
+		}
+		return result;
+	}
+
+	// Greedily grow clusters over shared vertices, reordering _triangle (3 local vertex ids each)
+	// so every cluster is a contiguous run. Cluster index offsets are relative to _triangle.
+	template <typename Vertex>
+	void build(const Vertex * _vertex, unsigned int _vertexNum, std::vector<unsigned int> & _triangle,
+		std::vector<Cluster> & _cluster, std::vector<BoneBound> & _boneBound)
+	{
+		const unsigned int noTriangle = 0xFFFFFFFFu;
+		const int bonePerVertex = sizeof(_vertex[0].boneWeight) / sizeof(_vertex[0].boneWeight[0]);
+		unsigned int triangleNum = _triangle.size() / 3;
+
+		std::vector<unsigned int> adjacencyOffset(_vertexNum + 1, 0);
+		std::vector<unsigned int> adjacency(triangleNum * 3);
+		for (int i = 0; i < triangleNum * 3; i++)
+			adjacencyOffset[_triangle[i] + 1]++;
+		for (int i = 0; i < _vertexNum; i++)
+			adjacencyOffset[i + 1] += adjacencyOffset[i];
+		{
+			std::vector<unsigned int> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+			for (int i = 0; i < triangleNum * 3; i++)
+				adjacency[fill[_triangle[i]]++] = i / 3;
+		}
+
+		std::vector<bool> emitted(triangleNum, false);
+		std::vector<unsigned int> vertexCluster(_vertexNum, 0xFFFFFFFFu);
+		std::vector<unsigned int> ordered;
+		ordered.reserve(_triangle.size());
+		unsigned int seed = 0;
+
+		while (ordered.size() < _triangle.size())
+		{
+			unsigned int clusterId = _cluster.size();
+			std::vector<unsigned int> clusterVertex;
+			std::vector<unsigned int> clusterTriangle;
+
+			while (emitted[seed]) seed++;
+			unsigned int candidate = seed;
+			while (candidate != noTriangle)
+			{
+				unsigned int newVertexNum = 0;
+				for (int k = 0; k < 3; k++)
+					if (vertexCluster[_triangle[candidate * 3 + k]] != clusterId) newVertexNum++;
+				if (clusterVertex.size() + newVertexNum > MESHLET_MAX_VERTICES || clusterTriangle.size() >= MESHLET_MAX_TRIANGLES)
+					break;
+
+				emitted[candidate] = true;
+				clusterTriangle.push_back(candidate);
+				for (int k = 0; k < 3; k++)
+				{
+					unsigned int v = _triangle[candidate * 3 + k];
+					if (vertexCluster[v] != clusterId)
+					{
+						vertexCluster[v] = clusterId;
+						clusterVertex.push_back(v);
+					}
+				}
+
+				// Prefer the neighbour of the last triangle adding the fewest new vertices
+				unsigned int last = candidate;
+				unsigned int bestScore = 4;
+				candidate = noTriangle;
+				for (int k = 0; k < 3 && bestScore > 0; k++)
+				{
+					unsigned int v = _triangle[last * 3 + k];
+					for (int a = adjacencyOffset[v]; a < adjacencyOffset[v + 1]; a++)
+					{
+						unsigned int t = adjacency[a];
+						if (emitted[t]) continue;
+						unsigned int score = 0;
+						for (int m = 0; m < 3; m++)
+							if (vertexCluster[_triangle[t * 3 + m]] != clusterId) score++;
+						if (score < bestScore)
+						{
+							bestScore = score;
+							candidate = t;
+						}
+					}
+				}
+				// Otherwise any triangle touching the cluster
+				for (int i = 0; candidate == noTriangle && i < clusterVertex.size(); i++)
+				{
+					unsigned int v = clusterVertex[i];
+					for (int a = adjacencyOffset[v]; a < adjacencyOffset[v + 1]; a++)
+					{
+						if (!emitted[adjacency[a]])
+						{
+							candidate = adjacency[a];
+							break;
+						}
+					}
+				}
+			}
+
+			Cluster cluster;
+			cluster.indexOffset = ordered.size();
+			cluster.cornerNum = clusterTriangle.size() * 3;
+			cluster.morphReach = 0.0f;
+
+			std::vector<glm::fvec3> position(clusterVertex.size());
+			for (int i = 0; i < clusterVertex.size(); i++)
+				position[i] = glm::fvec3(_vertex[clusterVertex[i]].position[0], _vertex[clusterVertex[i]].position[1], _vertex[clusterVertex[i]].position[2]);
+			cluster.bound = boundingSphere(position);
+
+			std::vector<glm::fvec3> normal;
+			glm::fvec3 normalSum(0.0f);
+			for (int i = 0; i < clusterTriangle.size(); i++)
+			{
+				const unsigned int * corner = &_triangle[clusterTriangle[i] * 3];
+				for (int k = 0; k < 3; k++)
+					ordered.push_back(corner[k]);
+				glm::fvec3 p0(_vertex[corner[0]].position[0], _vertex[corner[0]].position[1], _vertex[corner[0]].position[2]);
+				glm::fvec3 p1(_vertex[corner[1]].position[0], _vertex[corner[1]].position[1], _vertex[corner[1]].position[2]);
+				glm::fvec3 p2(_vertex[corner[2]].position[0], _vertex[corner[2]].position[1], _vertex[corner[2]].position[2]);
+				glm::fvec3 n = glm::cross(p1 - p0, p2 - p0);
+				float area = glm::length(n);
+				if (area < 1e-12f) continue;
+				normal.push_back(n / area);
+				normalSum += n / area;
+			}
+			cluster.coneAxis = glm::fvec3(0.0f, 0.0f, 1.0f);
+			cluster.coneCutoff = 2.0f;
+			if (!normal.empty() && glm::length(normalSum) > 1e-6f)
+			{
+				cluster.coneAxis = glm::normalize(normalSum);
+				float minDot = 1.0f;
+				for (int i = 0; i < normal.size(); i++)
+					minDot = std::min(minDot, glm::dot(normal[i], cluster.coneAxis));
+				// Cones wider than ~84 degrees almost never cull, skip them
+				if (minDot > 0.1f)
+					cluster.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+			}
+
+			cluster.boneBoundOffset = _boneBound.size();
+			std::vector<unsigned int> bone;
+			std::vector<std::vector<glm::fvec3> > bonePosition;
+			for (int i = 0; i < clusterVertex.size(); i++)
+			{
+				const Vertex & v = _vertex[clusterVertex[i]];
+				bool bound = false;
+				for (int k = 0; k <= bonePerVertex; k++)
+				{
+					unsigned int id;
+					if (k < bonePerVertex)
+					{
+						if (!(v.boneWeight[k] > 0.0f)) continue;
+						id = v.boneId[k];
+						bound = true;
+					}
+					else if (!bound)
+						id = MESHLET_NO_BONE;
+					else
+						break;
+					unsigned int slot = std::find(bone.begin(), bone.end(), id) - bone.begin();
+					if (slot == bone.size())
+					{
+						bone.push_back(id);
+						bonePosition.push_back(std::vector<glm::fvec3>());
+					}
+					bonePosition[slot].push_back(position[i]);
+				}
+			}
+			for (int i = 0; i < bone.size(); i++)
+			{
+				BoneBound boneBound;
+				boneBound.bone = bone[i];
+				boneBound.bound = boundingSphere(bonePosition[i]);
+				_boneBound.push_back(boneBound);
+			}
+			cluster.boneBoundNum = bone.size();
+
+			_cluster.push_back(cluster);
+		}
+		_triangle.swap(ordered);
+	}
+
+	// Frustum and view of one draw, extracted from its model-view-projection matrix
+	class CullView
+	{
+	private:
+		glm::fvec4 plane[6];
+		glm::fvec3 eye;
+		glm::fvec3 viewDirection;
+		bool orthographic;
+
+	public:
+		CullView(const glm::fmat4 & _mvp)
+		{
+			glm::fvec4 row[4];
+			for (int i = 0; i < 4; i++)
+				row[i] = glm::fvec4(_mvp[0][i], _mvp[1][i], _mvp[2][i], _mvp[3][i]);
+			for (int i = 0; i < 3; i++)
+			{
+				plane[i * 2] = row[3] + row[i];
+				plane[i * 2 + 1] = row[3] - row[i];
+			}
+			for (int i = 0; i < 6; i++)
+				plane[i] /= glm::length(glm::fvec3(plane[i]));
+
+			// The eye is the point clip space sends to (0, 0, z, 0); for an orthographic
+			// projection that point is at infinity along the view direction
+			glm::fvec4 h = glm::inverse(_mvp) * glm::fvec4(0.0f, 0.0f, 1.0f, 0.0f);
+			orthographic = std::fabs(h.w) < 1e-6f * glm::length(glm::fvec3(h));
+			if (orthographic)
+				viewDirection = glm::normalize(glm::fvec3(h));
+			else
+				eye = glm::fvec3(h) / h.w;
+		}
+
+		bool sphereVisible(const Sphere & _sphere) const
+		{
+			for (int i = 0; i < 6; i++)
+				if (glm::dot(glm::fvec3(plane[i]), _sphere.center) + plane[i].w < -_sphere.radius)
+					return false;
+			return true;
+		}
+
+		// True when every triangle in the cone faces away from the viewer
+		bool coneBackfacing(const Sphere & _sphere, const glm::fvec3 & _axis, float _cutoff) const
+		{
+			if (_cutoff >= 1.0f) return false;
+			if (orthographic)
+				return glm::dot(viewDirection, _axis) >= _cutoff;
+			glm::fvec3 toCenter = _sphere.center - eye;
+			return glm::dot(toCenter, _axis) >= _cutoff * glm::length(toCenter) + _sphere.radius;
+		}
+	};
+
+	// Conservative bound of a cluster after skinning: the union of each bone's posed bound,
+	// grown by how far the active morph targets can move its vertices
+	inline Sphere posedBound(const Cluster & _cluster, const BoneBound * _boneBound,
+		const glm::fmat4 * _boneTransf, unsigned int _boneNum, float _morphScale)
+	{
+		Sphere result = _cluster.bound;
+		for (int i = 0; i < _cluster.boneBoundNum; i++)
+		{
+			Sphere posed = _boneBound[i].bound;
+			if (_boneBound[i].bone < _boneNum)
+			{
+				const glm::fmat4 & m = _boneTransf[_boneBound[i].bone];
+				posed.center = glm::fvec3(m * glm::fvec4(posed.center, 1.0f));
+				float scale = std::max(glm::dot(glm::fvec3(m[0]), glm::fvec3(m[0])),
+					std::max(glm::dot(glm::fvec3(m[1]), glm::fvec3(m[1])), glm::dot(glm::fvec3(m[2]), glm::fvec3(m[2]))));
+				posed.radius *= std::sqrt(scale);
+			}
+			result = i ? mergeSphere(result, posed) : posed;
+		}
+		result.radius += _cluster.morphReach * _morphScale;
+		return result;
+	}
+}
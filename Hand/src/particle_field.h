@@ -0,0 +1,345 @@
+// Particle Field & Hand Colliders
+// A lattice of particles that the hand pushes, scatters and carries through capsule colliders
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <emmintrin.h>
+
+#include <glm\glm.hpp>
+
+#define PARTICLE_FIELD_MAX_GRID_DIM 128
+#define PARTICLE_FIELD_PARTICLES_PER_CELL 8
+// below this speed every particle counts as at rest, units per second
+#define PARTICLE_FIELD_REST_SPEED 1e-3f
+
+namespace ParticleField
+{
+	typedef std::chrono::steady_clock Clock;
+
+	struct Capsule
+	{
+		glm::fvec3 a;
+		glm::fvec3 b;
+		float radius;
+	};
+
+	struct Statistics
+	{
+		unsigned long long steps;
+		unsigned long long candidates;
+		unsigned long long contacts;
+		double integrateTime;
+		double broadphaseTime;
+		double narrowphaseTime;
+	};
+
+	// One capsule per joint pair, from the model space frames of the joints (see Scene::getJointTransforms)
+	inline void buildCapsules(std::vector<Capsule> & capsule, const std::vector<glm::fmat4> & jointTransf,
+		const int (*segment)[2], int segmentNum, float radiusScale)
+	{
+		capsule.resize(segmentNum);
+		for (int i = 0; i < segmentNum; i++)
+		{
+			capsule[i].a = glm::fvec3(jointTransf[segment[i][0]][3]);
+			capsule[i].b = glm::fvec3(jointTransf[segment[i][1]][3]);
+			capsule[i].radius = glm::length(capsule[i].b - capsule[i].a) * radiusScale;
+		}
+	}
+
+	// Particles live in structure-of-arrays form padded to a multiple of 4 for SSE.
+	// std::vector only guarantees the alignment of float, so the SIMD loops use unaligned loads.
+	// Each particle is sprung to its lattice home, capsules push it out of their volume
+	// and drag it along with their own velocity on contact.
+	class Field
+	{
+	private:
+		unsigned int particleNum;
+		std::vector<float> px, py, pz;
+		std::vector<float> vx, vy, vz;
+		std::vector<float> hx, hy, hz;
+
+		// Uniform grid, rebuilt every step by a counting sort of particle indices
+		glm::fvec3 gridMin;
+		float invCellSize;
+		int gridDim;
+		std::vector<unsigned int> particleCell;
+		std::vector<unsigned int> cellStart;
+		std::vector<unsigned int> sortedIndex;
+		std::vector<unsigned int> candidate;
+
+		std::vector<Capsule> capsule;
+		std::vector<Capsule> lastCapsule;
+
+		float stiffness;
+		float damping;
+		float friction;
+		// fastest particle of the last step, after its spring and damping
+		float maxSpeed;
+		Statistics stats;
+
+		int cellCoord(float _value, float _min) const
+		{
+			int coord = int((_value - _min) * invCellSize);
+			return std::min(std::max(coord, 0), gridDim - 1);
+		}
+
+		void integrate(float dt)
+		{
+			__m128 step = _mm_set1_ps(dt);
+			__m128 spring = _mm_set1_ps(stiffness * dt);
+			__m128 decay = _mm_set1_ps(std::exp(-damping * dt));
+			__m128 speed2 = _mm_setzero_ps();
+			for (unsigned int i = 0; i < px.size(); i += 4)
+			{
+				__m128 x = _mm_loadu_ps(&px[i]), y = _mm_loadu_ps(&py[i]), z = _mm_loadu_ps(&pz[i]);
+				__m128 u = _mm_loadu_ps(&vx[i]), v = _mm_loadu_ps(&vy[i]), w = _mm_loadu_ps(&vz[i]);
+				u = _mm_mul_ps(_mm_add_ps(u, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&hx[i]), x), spring)), decay);
+				v = _mm_mul_ps(_mm_add_ps(v, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&hy[i]), y), spring)), decay);
+				w = _mm_mul_ps(_mm_add_ps(w, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&hz[i]), z), spring)), decay);
+				_mm_storeu_ps(&vx[i], u);
+				_mm_storeu_ps(&vy[i], v);
+				_mm_storeu_ps(&vz[i], w);
+				_mm_storeu_ps(&px[i], _mm_add_ps(x, _mm_mul_ps(u, step)));
+				_mm_storeu_ps(&py[i], _mm_add_ps(y, _mm_mul_ps(v, step)));
+				_mm_storeu_ps(&pz[i], _mm_add_ps(z, _mm_mul_ps(w, step)));
+				speed2 = _mm_max_ps(speed2, _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v)), _mm_mul_ps(w, w)));
+			}
+			alignas(16) float lane[4];
+			_mm_store_ps(lane, speed2);
+			maxSpeed = std::sqrt(std::max(std::max(lane[0], lane[1]), std::max(lane[2], lane[3])));
+		}
+
+		void broadphase()
+		{
+			std::fill(cellStart.begin(), cellStart.end(), 0);
+			for (unsigned int i = 0; i < particleNum; i++)
+			{
+				unsigned int cell = (cellCoord(pz[i], gridMin.z) * gridDim + cellCoord(py[i], gridMin.y)) * gridDim + cellCoord(px[i], gridMin.x);
+				particleCell[i] = cell;
+				cellStart[cell + 1]++;
+			}
+			for (unsigned int c = 1; c < cellStart.size(); c++)
+				cellStart[c] += cellStart[c - 1];
+			// cellStart[c] is the write cursor of cell c and ends at the start of c + 1, shift it back after
+			for (unsigned int i = 0; i < particleNum; i++)
+				sortedIndex[cellStart[particleCell[i]]++] = i;
+			for (unsigned int c = cellStart.size() - 1; c > 0; c--)
+				cellStart[c] = cellStart[c - 1];
+			cellStart[0] = 0;
+		}
+
+		void collide(const Capsule & cur, const Capsule & last, float dt)
+		{
+			glm::fvec3 lo = glm::min(cur.a, cur.b) - glm::fvec3(cur.radius);
+			glm::fvec3 hi = glm::max(cur.a, cur.b) + glm::fvec3(cur.radius);
+			int x0 = cellCoord(lo.x, gridMin.x), x1 = cellCoord(hi.x, gridMin.x);
+			int y0 = cellCoord(lo.y, gridMin.y), y1 = cellCoord(hi.y, gridMin.y);
+			int z0 = cellCoord(lo.z, gridMin.z), z1 = cellCoord(hi.z, gridMin.z);
+			candidate.clear();
+			for (int z = z0; z <= z1; z++)
+				for (int y = y0; y <= y1; y++)
+				{
+					// cells along x are adjacent, so their particles form one run
+					unsigned int row = (z * gridDim + y) * gridDim;
+					candidate.insert(candidate.end(), sortedIndex.begin() + cellStart[row + x0], sortedIndex.begin() + cellStart[row + x1 + 1]);
+				}
+			stats.candidates += candidate.size();
+			if (candidate.empty()) return;
+
+			glm::fvec3 ab = cur.b - cur.a;
+			float abLength2 = glm::dot(ab, ab);
+			glm::fvec3 va = dt > 0.0f ? (cur.a - last.a) / dt : glm::fvec3();
+			glm::fvec3 vb = dt > 0.0f ? (cur.b - last.b) / dt : glm::fvec3();
+
+			const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+			const __m128 ax = _mm_set1_ps(cur.a.x), ay = _mm_set1_ps(cur.a.y), az = _mm_set1_ps(cur.a.z);
+			const __m128 dx = _mm_set1_ps(ab.x), dy = _mm_set1_ps(ab.y), dz = _mm_set1_ps(ab.z);
+			const __m128 invLength2 = _mm_set1_ps(abLength2 > 1e-12f ? 1.0f / abLength2 : 0.0f);
+			const __m128 radius = _mm_set1_ps(cur.radius), radius2 = _mm_set1_ps(cur.radius * cur.radius);
+			const __m128 vax = _mm_set1_ps(va.x), vay = _mm_set1_ps(va.y), vaz = _mm_set1_ps(va.z);
+			const __m128 dvx = _mm_set1_ps(vb.x - va.x), dvy = _mm_set1_ps(vb.y - va.y), dvz = _mm_set1_ps(vb.z - va.z);
+			const __m128 slip = _mm_set1_ps(1.0f - friction);
+
+			unsigned int candidateNum = candidate.size();
+			while (candidate.size() % 4) candidate.push_back(candidate[candidateNum - 1]);
+			for (unsigned int i = 0; i < candidateNum; i += 4)
+			{
+				const unsigned int * id = &candidate[i];
+				__m128 x = _mm_setr_ps(px[id[0]], px[id[1]], px[id[2]], px[id[3]]);
+				__m128 y = _mm_setr_ps(py[id[0]], py[id[1]], py[id[2]], py[id[3]]);
+				__m128 z = _mm_setr_ps(pz[id[0]], pz[id[1]], pz[id[2]], pz[id[3]]);
+
+				// closest point on the segment
+				__m128 rx = _mm_sub_ps(x, ax), ry = _mm_sub_ps(y, ay), rz = _mm_sub_ps(z, az);
+				__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, dx), _mm_mul_ps(ry, dy)), _mm_mul_ps(rz, dz)), invLength2);
+				t = _mm_min_ps(_mm_max_ps(t, zero), one);
+				__m128 cx = _mm_add_ps(ax, _mm_mul_ps(dx, t)), cy = _mm_add_ps(ay, _mm_mul_ps(dy, t)), cz = _mm_add_ps(az, _mm_mul_ps(dz, t));
+				__m128 nx = _mm_sub_ps(x, cx), ny = _mm_sub_ps(y, cy), nz = _mm_sub_ps(z, cz);
+				__m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+				int hit = _mm_movemask_ps(_mm_cmplt_ps(distance2, radius2));
+				if (candidateNum - i < 4) hit &= (1 << (candidateNum - i)) - 1;
+				if (hit == 0) continue;
+
+				// push out to the surface along the contact normal
+				__m128 invDistance = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(distance2, _mm_set1_ps(1e-12f))));
+				nx = _mm_mul_ps(nx, invDistance);
+				ny = _mm_mul_ps(ny, invDistance);
+				nz = _mm_mul_ps(nz, invDistance);
+				x = _mm_add_ps(cx, _mm_mul_ps(nx, radius));
+				y = _mm_add_ps(cy, _mm_mul_ps(ny, radius));
+				z = _mm_add_ps(cz, _mm_mul_ps(nz, radius));
+
+				// remove the approaching part of the velocity relative to the capsule surface, then apply friction
+				__m128 sx = _mm_add_ps(vax, _mm_mul_ps(dvx, t)), sy = _mm_add_ps(vay, _mm_mul_ps(dvy, t)), sz = _mm_add_ps(vaz, _mm_mul_ps(dvz, t));
+				__m128 u = _mm_sub_ps(_mm_setr_ps(vx[id[0]], vx[id[1]], vx[id[2]], vx[id[3]]), sx);
+				__m128 v = _mm_sub_ps(_mm_setr_ps(vy[id[0]], vy[id[1]], vy[id[2]], vy[id[3]]), sy);
+				__m128 w = _mm_sub_ps(_mm_setr_ps(vz[id[0]], vz[id[1]], vz[id[2]], vz[id[3]]), sz);
+				__m128 approach = _mm_min_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(u, nx), _mm_mul_ps(v, ny)), _mm_mul_ps(w, nz)), zero);
+				u = _mm_add_ps(sx, _mm_mul_ps(_mm_sub_ps(u, _mm_mul_ps(nx, approach)), slip));
+				v = _mm_add_ps(sy, _mm_mul_ps(_mm_sub_ps(v, _mm_mul_ps(ny, approach)), slip));
+				w = _mm_add_ps(sz, _mm_mul_ps(_mm_sub_ps(w, _mm_mul_ps(nz, approach)), slip));
+
+				alignas(16) float lane[6][4];
+				_mm_storeu_ps(lane[0], x);
+				_mm_storeu_ps(lane[1], y);
+				_mm_storeu_ps(lane[2], z);
+				_mm_storeu_ps(lane[3], u);
+				_mm_storeu_ps(lane[4], v);
+				_mm_storeu_ps(lane[5], w);
+				for (int k = 0; k < 4; k++)
+				{
+					if (!(hit & (1 << k))) continue;
+					px[id[k]] = lane[0][k];
+					py[id[k]] = lane[1][k];
+					pz[id[k]] = lane[2][k];
+					vx[id[k]] = lane[3][k];
+					vy[id[k]] = lane[4][k];
+					vz[id[k]] = lane[5][k];
+					stats.contacts++;
+				}
+			}
+		}
+
+	public:
+		Field()
+			: particleNum(0)
+			, invCellSize(1.0f)
+			, gridDim(1)
+			, stiffness(20.0f)
+			, damping(4.0f)
+			, friction(0.3f)
+			, maxSpeed(0.0f)
+		{
+			resetStatistics();
+		}
+
+		unsigned int getParticleNum() const { return particleNum; }
+
+		// True once no particle moves: every one has sprung back home or come to rest
+		bool isAtRest() const { return particleNum == 0 || maxSpeed < PARTICLE_FIELD_REST_SPEED; }
+
+		// Lay out _count particles as a cubic lattice of half size _halfExtent around _center
+		void reset(const glm::fvec3 & _center, float _halfExtent, unsigned int _count)
+		{
+			particleNum = _count;
+			unsigned int padded = (_count + 3) & ~3u;
+			int side = std::max(1, (int)std::ceil(std::cbrt((double)_count)));
+			float spacing = side > 1 ? 2.0f * _halfExtent / (side - 1) : 0.0f;
+			hx.assign(padded, _center.x);
+			hy.assign(padded, _center.y);
+			hz.assign(padded, _center.z);
+			for (unsigned int i = 0; i < _count; i++)
+			{
+				hx[i] = _center.x - _halfExtent + spacing * (i % side);
+				hy[i] = _center.y - _halfExtent + spacing * (i / side % side);
+				hz[i] = _center.z - _halfExtent + spacing * (i / side / side);
+			}
+			px = hx;
+			py = hy;
+			pz = hz;
+			vx.assign(padded, 0.0f);
+			vy.assign(padded, 0.0f);
+			vz.assign(padded, 0.0f);
+			maxSpeed = 0.0f;
+
+			// Leave room for scattered particles, those further out share the border cells
+			float gridExtent = _halfExtent * 1.5f;
+			gridDim = std::min(std::max(1, (int)std::cbrt((double)_count / PARTICLE_FIELD_PARTICLES_PER_CELL)), PARTICLE_FIELD_MAX_GRID_DIM);
+			gridMin = _center - glm::fvec3(gridExtent);
+			invCellSize = gridDim / (2.0f * gridExtent);
+			particleCell.resize(_count);
+			sortedIndex.resize(_count);
+			cellStart.assign(gridDim * gridDim * gridDim + 1, 0);
+
+			capsule.clear();
+			lastCapsule.clear();
+			resetStatistics();
+		}
+
+		// Colliders for this step; their motion since the last call gives the surface velocity
+		void setColliders(const std::vector<Capsule> & _capsule)
+		{
+			lastCapsule = capsule.size() == _capsule.size() ? capsule : _capsule;
+			capsule = _capsule;
+		}
+
+		void step(float dt)
+		{
+			if (particleNum == 0) return;
+
+			Clock::time_point start = Clock::now();
+			integrate(dt);
+			Clock::time_point integrated = Clock::now();
+			broadphase();
+			Clock::time_point binned = Clock::now();
+			for (int i = 0; i < capsule.size(); i++)
+				collide(capsule[i], lastCapsule[i], dt);
+			Clock::time_point collided = Clock::now();
+
+			stats.steps++;
+			stats.integrateTime += std::chrono::duration<double>(integrated - start).count();
+			stats.broadphaseTime += std::chrono::duration<double>(binned - integrated).count();
+			stats.narrowphaseTime += std::chrono::duration<double>(collided - binned).count();
+		}
+
+		// Interleaved xyz, e.g. into a mapped vertex buffer of getParticleNum() * 3 floats
+		void writePositions(float * _out) const
+		{
+			for (unsigned int i = 0; i < particleNum; i++)
+			{
+				_out[i * 3 + 0] = px[i];
+				_out[i * 3 + 1] = py[i];
+				_out[i * 3 + 2] = pz[i];
+			}
+		}
+
+		Statistics getStatistics() const { return stats; }
+
+		void resetStatistics()
+		{
+			stats.steps = 0;
+			stats.candidates = 0;
+			stats.contacts = 0;
+			stats.integrateTime = 0.0;
+			stats.broadphaseTime = 0.0;
+			stats.narrowphaseTime = 0.0;
+		}
+
+		void report(std::ostream & out) const
+		{
+			if (stats.steps == 0) return;
+			out << "Particle field: " << particleNum << " particles, " << capsule.size() << " capsules, per simulation tick integrate "
+				<< stats.integrateTime / stats.steps * 1000.0 << " ms, broadphase "
+				<< stats.broadphaseTime / stats.steps * 1000.0 << " ms, narrowphase "
+				<< stats.narrowphaseTime / stats.steps * 1000.0 << " ms ("
+				<< stats.candidates / stats.steps << " candidates, "
+				<< stats.contacts / stats.steps << " contacts)" << std::endl;
+		}
+	};
+}
@@ -0,0 +1,290 @@
+// Pose Database & Nearest Pose Search
+// Indexes sampled gesture clips by pose features so transitions can start at the closest frame
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <random>
+#include <cmath>
+
+#include <xmmintrin.h>
+
+// 5 fingertips x (position + velocity) = 30 values, padded to a multiple of 4 for SSE
+#define POSE_FEATURE_DIM 32
+#define POSE_DATABASE_LEAF_SIZE 16
+
+namespace PoseDatabase
+{
+	struct Feature
+	{
+		alignas(16) float value[POSE_FEATURE_DIM];
+
+		Feature() { std::fill(value, value + POSE_FEATURE_DIM, 0.0f); }
+	};
+
+	struct Match
+	{
+		unsigned int clip;
+		unsigned int frame;
+		float distance;
+	};
+
+	inline float squaredDistance(const Feature & a, const Feature & b)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (int i = 0; i < POSE_FEATURE_DIM; i += 4)
+		{
+			__m128 d = _mm_sub_ps(_mm_load_ps(a.value + i), _mm_load_ps(b.value + i));
+			sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+		}
+		float lane[4];
+		_mm_storeu_ps(lane, sum);
+		return lane[0] + lane[1] + lane[2] + lane[3];
+	}
+
+	// Exact nearest neighbour over the frames of one clip
+	class KdTree
+	{
+	private:
+		struct Node
+		{
+			float split;
+			unsigned int dim;
+			unsigned int begin;
+			unsigned int end;
+			unsigned int left;
+			unsigned int right;
+		};
+
+		std::vector<Node> node;
+		std::vector<Feature> point;
+		std::vector<unsigned int> frame;
+
+		unsigned int buildNode(std::vector<unsigned int> & order, const std::vector<Feature> & source, unsigned int begin, unsigned int end)
+		{
+			unsigned int index = node.size();
+			Node cur = { 0.0f, 0, begin, end, 0, 0 };
+			node.push_back(cur);
+			if (end - begin <= POSE_DATABASE_LEAF_SIZE) return index;
+
+			float bestSpread = -1.0f;
+			for (int d = 0; d < POSE_FEATURE_DIM; d++)
+			{
+				float lo = source[order[begin]].value[d], hi = lo;
+				for (int i = begin + 1; i < end; i++)
+				{
+					lo = std::min(lo, source[order[i]].value[d]);
+					hi = std::max(hi, source[order[i]].value[d]);
+				}
+				if (hi - lo > bestSpread)
+				{
+					bestSpread = hi - lo;
+					cur.dim = d;
+				}
+			}
+			if (!(bestSpread > 0.0f)) return index;
+
+			unsigned int mid = (begin + end) / 2;
+			unsigned int dim = cur.dim;
+			std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+				[&](unsigned int a, unsigned int b) { return source[a].value[dim] < source[b].value[dim]; });
+			cur.split = source[order[mid]].value[dim];
+			cur.left = buildNode(order, source, begin, mid);
+			cur.right = buildNode(order, source, mid, end);
+			node[index] = cur;
+			return index;
+		}
+
+		void search(unsigned int index, const Feature & query, Match & best) const
+		{
+			const Node & cur = node[index];
+			if (cur.left == 0)
+			{
+				for (int i = cur.begin; i < cur.end; i++)
+				{
+					float distance = squaredDistance(point[i], query);
+					if (distance < best.distance)
+					{
+						best.distance = distance;
+						best.frame = frame[i];
+					}
+				}
+				return;
+			}
+			float diff = query.value[cur.dim] - cur.split;
+			search(diff < 0.0f ? cur.left : cur.right, query, best);
+			if (diff * diff < best.distance)
+				search(diff < 0.0f ? cur.right : cur.left, query, best);
+		}
+
+	public:
+		void build(const std::vector<Feature> & _frame)
+		{
+			node.clear();
+			point.clear();
+			frame.resize(_frame.size());
+			std::iota(frame.begin(), frame.end(), 0);
+			if (_frame.empty()) return;
+			buildNode(frame, _frame, 0, _frame.size());
+			point.resize(_frame.size());
+			for (int i = 0; i < frame.size(); i++)
+				point[i] = _frame[frame[i]];
+		}
+
+		bool empty() const { return point.empty(); }
+
+		void nearest(const Feature & _query, Match & _best) const
+		{
+			if (!node.empty()) search(0, _query, _best);
+		}
+
+		void nearestBruteForce(const Feature & _query, Match & _best) const
+		{
+			for (int i = 0; i < point.size(); i++)
+			{
+				float distance = squaredDistance(point[i], _query);
+				if (distance < _best.distance)
+				{
+					_best.distance = distance;
+					_best.frame = frame[i];
+				}
+			}
+		}
+	};
+
+	class Database
+	{
+	private:
+		std::vector<std::vector<Feature> > clipFrame;
+		std::vector<KdTree> clipIndex;
+		Feature scale;
+
+		Feature normalized(const Feature & _feature) const
+		{
+			Feature result;
+			for (int d = 0; d < POSE_FEATURE_DIM; d++)
+				result.value[d] = _feature.value[d] * scale.value[d];
+			return result;
+		}
+
+	public:
+		void clear()
+		{
+			clipFrame.clear();
+			clipIndex.clear();
+		}
+
+		// Frames are kept until build(), returns the clip id used by query()
+		unsigned int addClip(const std::vector<Feature> & _frame)
+		{
+			clipFrame.push_back(_frame);
+			return clipFrame.size() - 1;
+		}
+
+		unsigned int getClipNum() const { return clipFrame.size(); }
+		unsigned int getFrameNum(unsigned int _clip) const { return _clip < clipFrame.size() ? clipFrame[_clip].size() : 0; }
+
+		unsigned int getFrameNum() const
+		{
+			unsigned int total = 0;
+			for (int i = 0; i < clipFrame.size(); i++)
+				total += clipFrame[i].size();
+			return total;
+		}
+
+		// Scale every dimension to unit deviation over the whole database, then index each clip
+		void build()
+		{
+			Feature mean, deviation;
+			unsigned int total = getFrameNum();
+			if (total == 0) return;
+			for (int c = 0; c < clipFrame.size(); c++)
+				for (int i = 0; i < clipFrame[c].size(); i++)
+					for (int d = 0; d < POSE_FEATURE_DIM; d++)
+						mean.value[d] += clipFrame[c][i].value[d] / total;
+			for (int c = 0; c < clipFrame.size(); c++)
+				for (int i = 0; i < clipFrame[c].size(); i++)
+					for (int d = 0; d < POSE_FEATURE_DIM; d++)
+						deviation.value[d] += (clipFrame[c][i].value[d] - mean.value[d]) * (clipFrame[c][i].value[d] - mean.value[d]) / total;
+			for (int d = 0; d < POSE_FEATURE_DIM; d++)
+				scale.value[d] = deviation.value[d] > 1e-12f ? 1.0f / std::sqrt(deviation.value[d]) : 1.0f;
+
+			clipIndex.resize(clipFrame.size());
+			for (int c = 0; c < clipFrame.size(); c++)
+			{
+				std::vector<Feature> frame(clipFrame[c].size());
+				for (int i = 0; i < frame.size(); i++)
+					frame[i] = normalized(clipFrame[c][i]);
+				clipIndex[c].build(frame);
+			}
+		}
+
+		Match query(unsigned int _clip, const Feature & _feature) const
+		{
+			Match best = { _clip, 0, 1e30f };
+			if (_clip < clipIndex.size())
+				clipIndex[_clip].nearest(normalized(_feature), best);
+			return best;
+		}
+
+		Match queryBruteForce(unsigned int _clip, const Feature & _feature) const
+		{
+			Match best = { _clip, 0, 1e30f };
+			if (_clip < clipIndex.size())
+				clipIndex[_clip].nearestBruteForce(normalized(_feature), best);
+			return best;
+		}
+	};
+
+	// Time index build and queries on the given clips, checking the tree against brute force.
+	// The clips are merged into one clip so a single tree holds every frame, the size the benchmark
+	// is meant to measure, rather than one smaller tree per clip.
+	// Probes are database frames with noise, as a live pose never lands exactly on a frame.
+	inline void benchmark(const std::vector<std::vector<Feature> > & _clip, unsigned int _queryNum, std::ostream & out)
+	{
+		typedef std::chrono::steady_clock Clock;
+		std::vector<Feature> merged;
+		for (int i = 0; i < _clip.size(); i++)
+			merged.insert(merged.end(), _clip[i].begin(), _clip[i].end());
+		if (merged.empty()) return;
+		Database database;
+		database.addClip(merged);
+
+		Clock::time_point buildStart = Clock::now();
+		database.build();
+		double buildTime = std::chrono::duration<double>(Clock::now() - buildStart).count();
+
+		std::mt19937 random(1);
+		std::normal_distribution<float> noise(0.0f, 0.01f);
+		std::vector<Feature> probe(_queryNum);
+		for (int i = 0; i < _queryNum; i++)
+		{
+			probe[i] = merged[random() % merged.size()];
+			for (int d = 0; d < POSE_FEATURE_DIM; d++)
+				probe[i].value[d] += noise(random) * (std::fabs(probe[i].value[d]) + 1.0f);
+		}
+
+		std::vector<Match> treeResult(_queryNum), bruteResult(_queryNum);
+		Clock::time_point treeStart = Clock::now();
+		for (int i = 0; i < _queryNum; i++)
+			treeResult[i] = database.query(0, probe[i]);
+		double treeTime = std::chrono::duration<double>(Clock::now() - treeStart).count();
+		Clock::time_point bruteStart = Clock::now();
+		for (int i = 0; i < _queryNum; i++)
+			bruteResult[i] = database.queryBruteForce(0, probe[i]);
+		double bruteTime = std::chrono::duration<double>(Clock::now() - bruteStart).count();
+
+		unsigned int mismatch = 0;
+		for (int i = 0; i < _queryNum; i++)
+			if (treeResult[i].distance != bruteResult[i].distance) mismatch++;
+
+		out << "Pose database: " << database.getFrameNum() << " frames from " << _clip.size() << " clips in one tree, build "
+			<< buildTime * 1000.0 << " ms" << std::endl;
+		out << "Pose database: kd-tree query " << treeTime / _queryNum * 1e6 << " us, brute force "
+			<< bruteTime / _queryNum * 1e6 << " us, " << mismatch << " of " << _queryNum << " results differ" << std::endl;
+	}
+}
@@ -0,0 +1,329 @@
+// Resource Registry
+// Reference counts, CPU and GPU memory per resource type, and LRU eviction under a budget
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+// bytes of CPU and GPU memory together the registered resources may hold before unreferenced ones are evicted
+#define RESOURCE_REGISTRY_DEFAULT_BUDGET (512ull << 20)
+
+/**********************************************************************************\
+*
+* Resources (textures, scenes) register themselves under a type and a key when
+* they are created and report the CPU and GPU bytes they hold. Handles count the
+* references to them. Whenever the total is over the budget, resources nobody
+* references are evicted, least recently used first: they free their memory but
+* keep what they need to load again, and stay where they are, so pointers into
+* the name maps remain valid. Acquiring an evicted resource reloads it in place
+* (a texture from its compressed copy in the texture cache when there is one).
+*
+* A resource is used when it is acquired, released or (re)loaded; handles do not
+* mark every access, so an unreferenced resource ages from its last release.
+*
+\**********************************************************************************/
+
+namespace ResourceRegistry
+{
+	typedef std::chrono::steady_clock Clock;
+
+	class Registry;
+
+	class Resource
+	{
+		friend class Registry;
+
+	private:
+		std::string type;
+		std::string key;
+		bool registered;
+		bool evicted;
+		unsigned int refNum;
+		unsigned long long lastUse;
+
+	public:
+		Resource()
+			: registered(false)
+			, evicted(false)
+			, refNum(0)
+			, lastUse(0)
+		{}
+		virtual ~Resource();
+
+		virtual size_t getCpuBytes() const = 0;
+		virtual size_t getGpuBytes() const = 0;
+		// Free the memory, keeping what reload() needs
+		virtual void evict() = 0;
+		virtual bool reload() = 0;
+
+		bool isEvicted() const { return evicted; }
+		unsigned int getRefNum() const { return refNum; }
+		const std::string & getResourceType() const { return type; }
+		const std::string & getResourceKey() const { return key; }
+	};
+
+	// What the resources of one type hold
+	struct Usage
+	{
+		unsigned int resourceNum;
+		unsigned int evictedNum;
+		unsigned int referencedNum;
+		size_t cpuBytes;
+		size_t gpuBytes;
+	};
+
+	class Registry
+	{
+	private:
+		std::vector<Resource *> resources;
+		unsigned long long budget;
+		unsigned long long useClock;
+		bool trimming;
+		bool reloading;
+
+		unsigned int evictNum;
+		unsigned int reloadNum;
+		unsigned long long evictBytes;
+		double reloadTime;
+
+		void use(Resource * _resource) { _resource->lastUse = ++useClock; }
+
+		void evictResource(Resource * _resource)
+		{
+			unsigned long long bytes = _resource->getCpuBytes() + _resource->getGpuBytes();
+			_resource->evict();
+			_resource->evicted = true;
+			evictNum++;
+			evictBytes += bytes;
+		}
+
+	public:
+		Registry()
+			: budget(RESOURCE_REGISTRY_DEFAULT_BUDGET)
+			, useClock(0)
+			, trimming(false)
+			, reloading(false)
+			, evictNum(0)
+			, reloadNum(0)
+			, evictBytes(0)
+			, reloadTime(0.0)
+		{
+		}
+
+		// 0: no budget, nothing is evicted
+		void setBudget(unsigned long long _bytes)
+		{
+			budget = _bytes;
+			trim();
+		}
+		unsigned long long getBudget() const { return budget; }
+
+		void add(Resource * _resource, const std::string & _type, const std::string & _key)
+		{
+			if (_resource->registered) remove(_resource);
+			_resource->type = _type;
+			_resource->key = _key;
+			_resource->registered = true;
+			_resource->evicted = false;
+			use(_resource);
+			resources.push_back(_resource);
+		}
+
+		void remove(Resource * _resource)
+		{
+			if (!_resource->registered) return;
+			resources.erase(std::remove(resources.begin(), resources.end(), _resource), resources.end());
+			_resource->registered = false;
+		}
+
+		// After a resource has (re)loaded its data; may evict others, never it, to make room
+		void loaded(Resource * _resource)
+		{
+			if (!_resource->registered) return;
+			if (_resource->evicted) reloadNum++;
+			_resource->evicted = false;
+			use(_resource);
+			trim(_resource);
+		}
+
+		// A new reference; an evicted resource is reloaded first
+		void acquire(Resource * _resource)
+		{
+			_resource->refNum++;
+			if (!_resource->registered) return;
+			use(_resource);
+			if (_resource->evicted)
+			{
+				// The textures a scene acquires while it reloads are timed with it, not again on their own
+				if (reloading)
+				{
+					_resource->reload();
+					return;
+				}
+				reloading = true;
+				Clock::time_point start = Clock::now();
+				_resource->reload();
+				reloadTime += std::chrono::duration<double>(Clock::now() - start).count();
+				reloading = false;
+			}
+		}
+
+		void release(Resource * _resource)
+		{
+			if (_resource->refNum > 0) _resource->refNum--;
+			if (!_resource->registered) return;
+			use(_resource);
+			if (_resource->refNum == 0) trim();
+		}
+
+		unsigned long long getTotalBytes() const
+		{
+			unsigned long long bytes = 0;
+			for (int i = 0; i < resources.size(); i++)
+				if (!resources[i]->evicted)
+					bytes += resources[i]->getCpuBytes() + resources[i]->getGpuBytes();
+			return bytes;
+		}
+
+		// Evict unreferenced resources but _keep, least recently used first, until the total is within the budget
+		void trim(const Resource * _keep = NULL)
+		{
+			if (budget == 0 || trimming) return;
+			trimming = true;
+			unsigned long long total = getTotalBytes();
+			while (total > budget)
+			{
+				Resource * oldest = NULL;
+				for (int i = 0; i < resources.size(); i++)
+				{
+					Resource * cur = resources[i];
+					if (cur != _keep && cur->refNum == 0 && !cur->evicted && (!oldest || cur->lastUse < oldest->lastUse))
+						oldest = cur;
+				}
+				if (!oldest) break;
+				unsigned long long bytes = oldest->getCpuBytes() + oldest->getGpuBytes();
+				evictResource(oldest);
+				total -= std::min(total, bytes);
+			}
+			trimming = false;
+		}
+
+		// Evict every unreferenced resource whatever the budget, until none is left; resources an
+		// eviction releases (the textures of a scene) go too. Returns how many were evicted
+		unsigned int evictUnreferenced()
+		{
+			if (trimming) return 0;
+			trimming = true;
+			unsigned int num = 0;
+			for (bool found = true; found;)
+			{
+				found = false;
+				for (int i = 0; i < resources.size(); i++)
+					if (resources[i]->refNum == 0 && !resources[i]->evicted)
+					{
+						evictResource(resources[i]);
+						num++;
+						found = true;
+					}
+			}
+			trimming = false;
+			return num;
+		}
+
+		Usage getUsage(const std::string & _type) const
+		{
+			Usage usage = { 0, 0, 0, 0, 0 };
+			for (int i = 0; i < resources.size(); i++)
+			{
+				const Resource * cur = resources[i];
+				if (cur->type != _type) continue;
+				usage.resourceNum++;
+				if (cur->refNum > 0) usage.referencedNum++;
+				if (cur->evicted)
+				{
+					usage.evictedNum++;
+					continue;
+				}
+				usage.cpuBytes += cur->getCpuBytes();
+				usage.gpuBytes += cur->getGpuBytes();
+			}
+			return usage;
+		}
+
+		// Types in the order they were first registered
+		std::vector<std::string> getTypes() const
+		{
+			std::vector<std::string> types;
+			for (int i = 0; i < resources.size(); i++)
+				if (std::find(types.begin(), types.end(), resources[i]->type) == types.end())
+					types.push_back(resources[i]->type);
+			return types;
+		}
+
+		void report(std::ostream & out) const
+		{
+			std::vector<std::string> types = getTypes();
+			if (types.empty()) return;
+			out << "Resources: " << getTotalBytes() / 1024.0 << " KB of ";
+			if (budget > 0) out << budget / 1024.0 << " KB budget";
+			else out << "no budget";
+			out << ", " << evictNum << " evicted (" << evictBytes / 1024.0 << " KB), " << reloadNum << " reloaded";
+			if (reloadNum > 0) out << " (" << reloadTime * 1000.0 << " ms on acquire)";
+			out << std::endl;
+			for (int i = 0; i < types.size(); i++)
+			{
+				Usage usage = getUsage(types[i]);
+				out << "  " << types[i] << ": " << usage.resourceNum << " (" << usage.referencedNum << " referenced, "
+					<< usage.evictedNum << " evicted), CPU " << usage.cpuBytes / 1024.0 << " KB, GPU " << usage.gpuBytes / 1024.0 << " KB" << std::endl;
+			}
+		}
+	};
+
+	// The registry every resource of the application goes through
+	inline Registry & shared()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	inline Resource::~Resource()
+	{
+		if (registered) shared().remove(this);
+	}
+
+	// Counted reference to a resource; empty handles point nowhere
+	template <class T>
+	class Handle
+	{
+	private:
+		T * resource;
+
+	public:
+		Handle() : resource(NULL) {}
+		explicit Handle(T * _resource) : resource(_resource) { if (resource) shared().acquire(resource); }
+		Handle(const Handle & _copy) : resource(_copy.resource) { if (resource) shared().acquire(resource); }
+		~Handle() { reset(); }
+
+		Handle & operator=(const Handle & _copy)
+		{
+			if (_copy.resource) shared().acquire(_copy.resource);
+			reset();
+			resource = _copy.resource;
+			return *this;
+		}
+
+		void reset()
+		{
+			if (resource) shared().release(resource);
+			resource = NULL;
+		}
+
+		T * get() const { return resource; }
+		T * operator->() const { return resource; }
+		explicit operator bool() const { return resource != NULL; }
+	};
+}
@@ -8,10 +8,14 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
 
 #include "gl_env.h"
 
 #include "texture_image.h"
+#include "texture_array.h"
+#include "resource_registry.h"
+#include "meshlet.h"
 
 #include <assimp\Importer.hpp>
 #include <assimp\scene.h>
@@ -20,17 +24,31 @@
 #pragma comment(lib, "assimp.lib")
 
 #include <glm\glm.hpp>
+#include <glm\gtc\type_ptr.hpp>
+
+#include <xmmintrin.h>
 
 #define SCENE_RESOURCE_SHADER_POSI_LOCATION 0
 #define SCENE_RESOURCE_SHADER_TEXC_LOCATION 1
 #define SCENE_RESOURCE_SHADER_NORM_LOCATION 2
 #define SCENE_RESOURCE_SHADER_BONE_LOCATION 3
 #define SCENE_RESOURCE_SHADER_BNWT_LOCATION 4
+#define SCENE_RESOURCE_SHADER_MRPH_LOCATION 5
+#define SCENE_RESOURCE_SHADER_LAYR_LOCATION 6
 
 #define SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL 0
+#define SCENE_RESOURCE_SHADER_MORPH_CHANNEL 1
+#define SCENE_RESOURCE_SHADER_DIFFUSE_ARRAY_CHANNEL 2
 
 #define SCENE_RESOURCE_BONE_PER_VERTEX 4
 
+#define SCENE_RESOURCE_MORPH_EPSILON 1e-12f
+// changed morph slots this close together share one upload instead of splitting it
+#define SCENE_RESOURCE_MORPH_UPLOAD_GAP 16
+
+// no texture bound yet, distinct from every texture object including 0
+#define SCENE_RESOURCE_UNBOUND 0xFFFFFFFFu
+
 namespace SkeletalMesh
 {
 	typedef std::map<std::string, glm::fmat4> SkeletonModifier;
@@ -42,6 +60,8 @@ namespace SkeletalMesh
 		float normal[3];
 		unsigned int boneId[SCENE_RESOURCE_BONE_PER_VERTEX];
 		float boneWeight[SCENE_RESOURCE_BONE_PER_VERTEX];
+		// 0 = not moved by any morph target, otherwise 1 + slot in the morph offset buffer
+		unsigned int morphSlot;
 
 		ParametricVertex() { memset(this, 0, sizeof(ParametricVertex)); }
 		ParametricVertex(aiVector3D _p, aiVector2D _tc, aiVector3D _n)
@@ -51,6 +71,7 @@ namespace SkeletalMesh
 			memcpy(normal, &_n, sizeof(normal));
 			memset(boneId, 0, sizeof(boneId));
 			memset(boneWeight, 0, sizeof(boneWeight));
+			morphSlot = 0;
 		}
 
 		bool addBone(unsigned int _id, float _weight)
@@ -70,38 +91,143 @@ namespace SkeletalMesh
 			}
 			return false;
 		}
+
+		// Sort influences by weight and make them sum to 1, returns the number of influences used
+		unsigned int normalizeBones()
+		{
+			for (int i = 1; i < SCENE_RESOURCE_BONE_PER_VERTEX; i++)
+			{
+				for (int j = i; j > 0 && boneWeight[j] > boneWeight[j - 1]; j--)
+				{
+					std::swap(boneWeight[j], boneWeight[j - 1]);
+					std::swap(boneId[j], boneId[j - 1]);
+				}
+			}
+			unsigned int influenceNum = 0;
+			float weightSum = 0.0f;
+			while (influenceNum < SCENE_RESOURCE_BONE_PER_VERTEX && boneWeight[influenceNum] > 0.0f)
+				weightSum += boneWeight[influenceNum++];
+			for (int i = 0; i < influenceNum; i++)
+				boneWeight[i] /= weightSum;
+			return influenceNum;
+		}
 	};
 
+	// Triangles of a mesh entry are grouped by how many bone influences their vertices need.
+	// Bucket n > 0 holds triangles whose vertices use at most n influences,
+	// bucket 0 holds the rest (triangles touching a vertex bound to no bone).
 	struct MeshEntry
 	{
 		unsigned int facetCornerNum;
 		unsigned int indexOffset;
 		unsigned int vertexOffset;
 		unsigned int materialIndex;
+		unsigned int bucketCornerNum[SCENE_RESOURCE_BONE_PER_VERTEX + 1];
+		unsigned int bucketIndexOffset[SCENE_RESOURCE_BONE_PER_VERTEX + 1];
+		unsigned int bucketVertexNum[SCENE_RESOURCE_BONE_PER_VERTEX + 1];
+		// vertices referenced by any bucket, each counted once though buckets may share it
+		unsigned int usedVertexNum;
+		unsigned int bucketClusterOffset[SCENE_RESOURCE_BONE_PER_VERTEX + 1];
+		unsigned int bucketClusterNum[SCENE_RESOURCE_BONE_PER_VERTEX + 1];
+	};
+
+	struct CullStatistics
+	{
+		unsigned long long frames;
+		unsigned long long clusters;
+		unsigned long long frustumCulled;
+		unsigned long long coneCulled;
+		unsigned long long draws;
+	};
+
+	struct RenderStatistics
+	{
+		unsigned long long frames;
+		unsigned long long drawCalls;
+		unsigned long long textureBinds;
+	};
+
+	// Layout fixed by GL_DRAW_INDIRECT_BUFFER
+	struct DrawElementsIndirectCommand
+	{
+		GLuint count;
+		GLuint instanceCount;
+		GLuint firstIndex;
+		GLint baseVertex;
+		GLuint baseInstance;
+	};
+
+	// Mesh entries are sorted by material at load, a group is the run sharing one
+	struct MaterialGroup
+	{
+		unsigned int materialIndex;
+		unsigned int entryBegin;
+		unsigned int entryEnd;
+	};
+
+	// A run of commands in an indirect buffer
+	struct IndirectRange
+	{
+		unsigned int offset;
+		unsigned int count;
 	};
 
 	struct Material
 	{
-		const TextureImage::Texture * diffuse;
+		// the error texture when there is none
+		ResourceRegistry::Handle<TextureImage::Texture> diffuse;
+		// the texture array holding the diffuse and its layer, once packed
+		GLuint diffuseArray;
+		int diffuseLayer;
 		Material()
 			: diffuse(&TextureImage::Texture::error)
+			, diffuseArray(0)
+			, diffuseLayer(-1)
 		{}
 		bool setDiffuse(std::string _name, std::string _filename = std::string())
 		{
-			return (diffuse = &TextureImage::Texture::loadTexture(_name, _filename))
-				!= &TextureImage::Texture::error;
+			diffuse = ResourceRegistry::Handle<TextureImage::Texture>(&TextureImage::Texture::loadTexture(_name, _filename));
+			return diffuse.get() != &TextureImage::Texture::error;
 		}
 	};
 
+	// Sparse position deltas of one blend shape, only for the vertices it moves
+	struct MorphTarget
+	{
+		std::vector<unsigned int> slot;
+		std::vector<glm::fvec4> delta;
+		float weight;
+		float appliedWeight;
+
+		MorphTarget() : weight(0.0f), appliedWeight(0.0f) {}
+	};
+
+	// Assimp stores rows, glm columns
+	inline glm::fmat4 toMat4(const aiMatrix4x4 & _m)
+	{
+		return glm::transpose(glm::make_mat4(&_m.a1));
+	}
+
 	struct Bone
 	{
-		aiMatrix4x4 localTransf;
+		glm::fmat4 localTransf;
 
 		//Bone() : localTransf() {}
-		Bone(const aiMatrix4x4 & _m) : localTransf(_m) {}
+		Bone(const aiMatrix4x4 & _m) : localTransf(toMat4(_m)) {}
+	};
+
+	// Runtime copy of the node hierarchy, a parent always precedes its children
+	struct Node
+	{
+		std::string name;
+		glm::fmat4 localTransf;
+		int parent;
+		int bone;
+
+		Node() : parent(-1), bone(-1) {}
 	};
 
-	class Scene
+	class Scene : public ResourceRegistry::Resource
 	{
 
 	public:
@@ -115,8 +241,9 @@ namespace SkeletalMesh
 		bool available;
 		std::string name;
 		std::string filename;
-		Assimp::Importer importer;
-		const aiScene * scene;
+		std::vector<Node> hierarchy;
+		glm::fmat4 invRootTransf;
+		size_t importerBytes;
 		GLuint vao;
 		GLuint vbo;
 		GLuint ebo;
@@ -124,6 +251,35 @@ namespace SkeletalMesh
 		std::vector<Material> material;
 		std::vector<Bone> skeleton;
 		Name2Bone nameBoneMap;
+		std::vector<Meshlet::Cluster> cluster;
+		std::vector<Meshlet::BoneBound> clusterBoneBound;
+		CullStatistics cullStats;
+		std::vector<MaterialGroup> materialGroup;
+		// Static commands: bucket b of group g at [b * groups + g], whole entries of group g after them
+		GLuint indirectBuffer;
+		std::vector<IndirectRange> bucketIndirect;
+		std::vector<IndirectRange> entryIndirect;
+		// Commands of the clusters surviving culling, rebuilt every frame, ranges laid out as bucketIndirect
+		GLuint cullIndirectBuffer;
+		std::vector<DrawElementsIndirectCommand> drawCommand;
+		std::vector<IndirectRange> drawRange;
+		mutable RenderStatistics renderStats;
+		std::vector<MorphTarget> morphTarget;
+		std::vector<glm::fvec4> morphOffset;
+		// Slots touched by this frame's weight changes, marked so shared slots are listed once
+		std::vector<unsigned char> morphSlotMark;
+		std::vector<unsigned int> morphDirtySlot;
+		GLuint morphBuffer;
+		GLuint morphTexture;
+		// Diffuse layer of every material, -1 while unpacked; an instanced attribute read at the draw's base instance
+		GLuint layerBuffer;
+		TextureArray::Packer diffusePacker;
+		unsigned int unpackedPassBinds;
+		// buffers made at load; the per-frame indirect buffer and texture arrays are added on top
+		size_t gpuBytes;
+		// the last setShaderInput(), applied again after a reload
+		GLuint inputProgram;
+		std::vector<std::string> inputName;
 
 		// Forbid calling any constructor outside
 		Scene(const Scene & _copy)
@@ -132,9 +288,19 @@ namespace SkeletalMesh
 		Scene()
 		{
 			available = false;
+			importerBytes = 0;
 			vao = 0;
 			vbo = 0;
 			ebo = 0;
+			morphBuffer = 0;
+			morphTexture = 0;
+			layerBuffer = 0;
+			unpackedPassBinds = 0;
+			gpuBytes = 0;
+			inputProgram = 0;
+			indirectBuffer = 0;
+			cullIndirectBuffer = 0;
+			resetRenderStatistics();
 		}
 		virtual ~Scene() { clear(); }
 
@@ -144,8 +310,9 @@ namespace SkeletalMesh
 			available = false;
 			name = std::string();
 			filename = std::string();
-			// importer..
-			scene = NULL;
+			hierarchy.clear();
+			invRootTransf = glm::fmat4();
+			importerBytes = 0;
 			glDeleteVertexArrays(1, &vao);
 			vao = 0;
 			glDeleteBuffers(1, &vbo);
@@ -156,6 +323,32 @@ namespace SkeletalMesh
 			material.clear();
 			skeleton.clear();
 			nameBoneMap.clear();
+			glDeleteTextures(1, &morphTexture);
+			morphTexture = 0;
+			glDeleteBuffers(1, &morphBuffer);
+			morphBuffer = 0;
+			morphTarget.clear();
+			morphOffset.clear();
+			morphSlotMark.clear();
+			morphDirtySlot.clear();
+			glDeleteBuffers(1, &layerBuffer);
+			layerBuffer = 0;
+			diffusePacker.destroy();
+			unpackedPassBinds = 0;
+			gpuBytes = 0;
+			cluster.clear();
+			clusterBoneBound.clear();
+			resetCullStatistics();
+			glDeleteBuffers(1, &indirectBuffer);
+			indirectBuffer = 0;
+			glDeleteBuffers(1, &cullIndirectBuffer);
+			cullIndirectBuffer = 0;
+			materialGroup.clear();
+			bucketIndirect.clear();
+			entryIndirect.clear();
+			drawCommand.clear();
+			drawRange.clear();
+			resetRenderStatistics();
 		}
 
 		static std::string testAllSuffix(std::string no_suffix_name)
@@ -191,34 +384,47 @@ namespace SkeletalMesh
 			if (fi == NULL) return error;
 			fclose(fi);
 
-			std::pair<Name2Scene::iterator, bool> insertion =
-				allScene.insert(Name2Scene::value_type(_name, new Scene()));
-			Scene & target = *(insertion.first->second);
-			if (!insertion.second)
+			Name2Scene::iterator found = allScene.find(_name);
+			bool inserted = found == allScene.end();
+			if (inserted)
+			{
+				found = allScene.insert(Name2Scene::value_type(_name, new Scene())).first;
+				ResourceRegistry::shared().add(found->second, "scene", _name);
+			}
+			Scene & target = *(found->second);
+			if (!inserted)
+			{
 				if (target.filename == _filename && target.available)
 					return target;
 				else
 					target.clear();
+			}
 
 			target.name = _name;
 			target.filename = _filename;
 
-			target.scene = target.importer.ReadFile(_filename,
+			// The importer only lives through loading, runtime data is copied out of it
+			Assimp::Importer importer;
+			const aiScene * scene = importer.ReadFile(_filename,
 				aiProcess_Triangulate | aiProcess_GenSmoothNormals |
 				aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices);
-			if (!target.scene) return error;
+			if (!scene) return error;
+			aiMemoryInfo importerMemory;
+			importer.GetMemoryRequirements(importerMemory);
+			target.importerBytes = importerMemory.total;
 
 			std::vector<ParametricVertex> vertexAssembly;
 			std::vector<unsigned int> indexAssembly;
+			std::vector<float> morphSlotReach;
 
-			int nTotalMeshes = target.scene->mNumMeshes;
+			int nTotalMeshes = scene->mNumMeshes;
 			target.meshEntry.resize(nTotalMeshes);
 
 			int nTotalVertices = 0;
 			int nTotalIndices = 0;
 			for (int i = 0; i < nTotalMeshes; i++)
 			{
-				const aiMesh * curMesh = target.scene->mMeshes[i];
+				const aiMesh * curMesh = scene->mMeshes[i];
 				int nMeshVertices = curMesh->mNumVertices;
 				int nMeshBones = curMesh->mNumBones;
 				int nMeshFaces = curMesh->mNumFaces;
@@ -238,6 +444,32 @@ namespace SkeletalMesh
 						curTexcoord = aiVector2D(curMesh->mTextureCoords[0][j].x, curMesh->mTextureCoords[0][j].y);
 					vertexAssembly.push_back(ParametricVertex(curMesh->mVertices[j], curTexcoord, curMesh->mNormals[j]));
 				}
+				// Anim mesh j of every mesh contributes to morph target j
+				for (int j = 0; j < curMesh->mNumAnimMeshes; j++)
+				{
+					const aiAnimMesh * curAnimMesh = curMesh->mAnimMeshes[j];
+					if (!curAnimMesh->HasPositions() || curAnimMesh->mNumVertices != nMeshVertices) continue;
+					if (target.morphTarget.size() <= j) target.morphTarget.resize(j + 1);
+					MorphTarget & curMorph = target.morphTarget[j];
+					curMorph.weight = curAnimMesh->mWeight;
+					for (int k = 0; k < nMeshVertices; k++)
+					{
+						aiVector3D delta = curAnimMesh->mVertices[k] - curMesh->mVertices[k];
+						if (delta.SquareLength() < SCENE_RESOURCE_MORPH_EPSILON) continue;
+						ParametricVertex & curVertex = vertexAssembly[target.meshEntry[i].vertexOffset + k];
+						if (curVertex.morphSlot == 0)
+						{
+							target.morphOffset.push_back(glm::fvec4(0.0f));
+							curVertex.morphSlot = target.morphOffset.size();
+						}
+						unsigned int slot = curVertex.morphSlot - 1;
+						morphSlotReach.resize(target.morphOffset.size(), 0.0f);
+						morphSlotReach[slot] = std::max(morphSlotReach[slot], delta.Length());
+
+						curMorph.slot.push_back(slot);
+						curMorph.delta.push_back(glm::fvec4(delta.x, delta.y, delta.z, 0.0f));
+					}
+				}
 				for (int j = 0; j < nMeshBones; j++)
 				{
 					std::string boneName = curMesh->mBones[j]->mName.data;
@@ -255,10 +487,62 @@ namespace SkeletalMesh
 						}
 					}
 				}
+				std::vector<unsigned int> influenceNum(nMeshVertices);
+				for (int j = 0; j < nMeshVertices; j++)
+					influenceNum[j] = vertexAssembly[target.meshEntry[i].vertexOffset + j].normalizeBones();
+				std::vector<unsigned int> bucketFace[SCENE_RESOURCE_BONE_PER_VERTEX + 1];
 				for (int j = 0; j < nMeshFaces; j++)
 				{
+					unsigned int bucket = 0;
 					for (int k = 0; k < 3; k++)
-						indexAssembly.push_back(curMesh->mFaces[j].mIndices[k]);
+					{
+						unsigned int curInfluenceNum = influenceNum[curMesh->mFaces[j].mIndices[k]];
+						if (curInfluenceNum == 0) { bucket = 0; break; }
+						if (curInfluenceNum > bucket) bucket = curInfluenceNum;
+					}
+					bucketFace[bucket].push_back(j);
+				}
+				const ParametricVertex * meshVertex = &vertexAssembly[target.meshEntry[i].vertexOffset];
+				std::vector<bool> entryVertexUsed(nMeshVertices, false);
+				target.meshEntry[i].usedVertexNum = 0;
+				for (int b = 0; b <= SCENE_RESOURCE_BONE_PER_VERTEX; b++)
+				{
+					std::vector<unsigned int> bucketIndex;
+					for (int j = 0; j < bucketFace[b].size(); j++)
+					{
+						for (int k = 0; k < 3; k++)
+							bucketIndex.push_back(curMesh->mFaces[bucketFace[b][j]].mIndices[k]);
+					}
+					target.meshEntry[i].bucketClusterOffset[b] = target.cluster.size();
+					Meshlet::build(meshVertex, nMeshVertices, bucketIndex, target.cluster, target.clusterBoneBound);
+					target.meshEntry[i].bucketClusterNum[b] = target.cluster.size() - target.meshEntry[i].bucketClusterOffset[b];
+
+					std::vector<bool> vertexUsed(nMeshVertices, false);
+					target.meshEntry[i].bucketIndexOffset[b] = indexAssembly.size();
+					target.meshEntry[i].bucketCornerNum[b] = bucketIndex.size();
+					target.meshEntry[i].bucketVertexNum[b] = 0;
+					for (int c = target.meshEntry[i].bucketClusterOffset[b]; c < target.cluster.size(); c++)
+					{
+						Meshlet::Cluster & curCluster = target.cluster[c];
+						for (int j = curCluster.indexOffset; j < curCluster.indexOffset + curCluster.cornerNum; j++)
+						{
+							unsigned int vertexId = bucketIndex[j];
+							if (meshVertex[vertexId].morphSlot)
+								curCluster.morphReach = std::max(curCluster.morphReach, morphSlotReach[meshVertex[vertexId].morphSlot - 1]);
+							if (!vertexUsed[vertexId])
+							{
+								vertexUsed[vertexId] = true;
+								target.meshEntry[i].bucketVertexNum[b]++;
+							}
+							if (!entryVertexUsed[vertexId])
+							{
+								entryVertexUsed[vertexId] = true;
+								target.meshEntry[i].usedVertexNum++;
+							}
+						}
+						curCluster.indexOffset += indexAssembly.size();
+					}
+					indexAssembly.insert(indexAssembly.end(), bucketIndex.begin(), bucketIndex.end());
 				}
 			}
 
@@ -276,11 +560,13 @@ namespace SkeletalMesh
 					filepath_prefix = _filename.substr(0, slashpos + 1);
 				}
 			}
-			int nTotalMaterials = target.scene->mNumMaterials;
+			// every diffuse texture is decoded in one batch first, the materials below then find them loaded
+			int nTotalMaterials = scene->mNumMaterials;
 			target.material.resize(nTotalMaterials);
+			std::vector<std::string> diffuseName(nTotalMaterials), diffusePath(nTotalMaterials);
 			for (int i = 0; i < nTotalMaterials; i++)
 			{
-				const aiMaterial* curMaterial = target.scene->mMaterials[i];
+				const aiMaterial* curMaterial = scene->mMaterials[i];
 
 				if (curMaterial->GetTextureCount(aiTextureType_DIFFUSE) > 0)
 				{
@@ -306,11 +592,25 @@ namespace SkeletalMesh
 							dirpath = std::string();
 							filename = filepath;
 						}
-						if (!target.material[i].setDiffuse(filename, dirpath + filename))
-							std::cout << "Error loading diffuse " << filepath << std::endl;
+						diffuseName[i] = filename;
+						diffusePath[i] = dirpath + filename;
 					}
 				}
 			}
+			std::vector<std::pair<std::string, std::string> > diffuseRequest;
+			for (int i = 0; i < nTotalMaterials; i++)
+				if (!diffuseName[i].empty())
+					diffuseRequest.push_back(std::make_pair(diffuseName[i], diffusePath[i]));
+			TextureImage::Texture::loadTextures(diffuseRequest);
+			for (int i = 0; i < nTotalMaterials; i++)
+				if (!diffuseName[i].empty() && !target.material[i].setDiffuse(diffuseName[i], diffusePath[i]))
+					std::cout << "Error loading diffuse " << diffusePath[i] << std::endl;
+
+			target.flattenHierarchy(scene->mRootNode, -1);
+			target.invRootTransf = glm::inverse(target.hierarchy[0].localTransf);
+			importer.FreeScene();
+
+			target.buildMaterialGroups();
 
 			glGenVertexArrays(1, &target.vao);
 			glBindVertexArray(target.vao);
@@ -325,13 +625,49 @@ namespace SkeletalMesh
 
 			glBindVertexArray(0);
 
+			std::vector<float> diffuseLayer(std::max<size_t>(1, target.material.size()), -1.0f);
+			glGenBuffers(1, &target.layerBuffer);
+			glBindBuffer(GL_ARRAY_BUFFER, target.layerBuffer);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * diffuseLayer.size(), diffuseLayer.data(), GL_STATIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			std::vector<DrawElementsIndirectCommand> indirectCommand;
+			target.buildIndirectCommands(indirectCommand);
+			glGenBuffers(1, &target.indirectBuffer);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, target.indirectBuffer);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * indirectCommand.size(), indirectCommand.data(), GL_STATIC_DRAW);
+			glGenBuffers(1, &target.cullIndirectBuffer);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+			if (!target.morphOffset.empty())
+			{
+				glGenBuffers(1, &target.morphBuffer);
+				glBindBuffer(GL_TEXTURE_BUFFER, target.morphBuffer);
+				glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::fvec4) * target.morphOffset.size(), target.morphOffset.data(), GL_DYNAMIC_DRAW);
+				glGenTextures(1, &target.morphTexture);
+				glBindTexture(GL_TEXTURE_BUFFER, target.morphTexture);
+				glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, target.morphBuffer);
+				glBindTexture(GL_TEXTURE_BUFFER, 0);
+				glBindBuffer(GL_TEXTURE_BUFFER, 0);
+			}
+
+			target.gpuBytes = sizeof(ParametricVertex) * vertexAssembly.size() + sizeof(unsigned int) * indexAssembly.size()
+				+ sizeof(DrawElementsIndirectCommand) * indirectCommand.size() + sizeof(glm::fvec4) * target.morphOffset.size()
+				+ sizeof(float) * diffuseLayer.size();
 			target.available = true;
+			ResourceRegistry::shared().loaded(&target);
+			target.applyMorphTargets();
 			return target;
 		}
 
+		// false if the scene is unknown or still referenced
 		static bool unloadScene(std::string _name)
 		{
-			return allScene.erase(_name) != 0;
+			Name2Scene::iterator find_result = allScene.find(_name);
+			if (find_result == allScene.end() || find_result->second->getRefNum() > 0) return false;
+			delete find_result->second;
+			allScene.erase(find_result);
+			return true;
 		}
 
 		static Scene & getScene(const std::string & _name)
@@ -341,26 +677,79 @@ namespace SkeletalMesh
 			return *(find_result->second);
 		}
 
-		void recursivelyGetTransf(SkeletonTransf & skTransf, SkeletonModifier & modifier, aiNode * node, aiMatrix4x4 parentTransf, const aiMatrix4x4 & invTransf) const
+		void flattenHierarchy(const aiNode * node, int parent)
 		{
-			aiMatrix4x4 globalTransf = parentTransf * node->mTransformation;
-			Name2Bone::const_iterator boneFound = nameBoneMap.find(std::string(node->mName.data));
+			Node cur;
+			cur.name = node->mName.data;
+			cur.localTransf = toMat4(node->mTransformation);
+			cur.parent = parent;
+			Name2Bone::const_iterator boneFound = nameBoneMap.find(cur.name);
 			if (boneFound != nameBoneMap.end())
+				cur.bone = boneFound->second;
+			int index = hierarchy.size();
+			hierarchy.push_back(cur);
+			for (int i = 0; i < node->mNumChildren; i++)
+				flattenHierarchy(node->mChildren[i], index);
+		}
+
+		// Sort mesh entries by material so each material's entries form one group
+		void buildMaterialGroups()
+		{
+			std::stable_sort(meshEntry.begin(), meshEntry.end(),
+				[](const MeshEntry & a, const MeshEntry & b) { return a.materialIndex < b.materialIndex; });
+			materialGroup.clear();
+			for (int i = 0; i < meshEntry.size(); i++)
 			{
-				SkeletonModifier::const_iterator boneModFound = modifier.find(std::string(node->mName.data));
-				aiMatrix4x4 boneMod;
-				if (boneModFound != modifier.end())
+				if (materialGroup.empty() || materialGroup.back().materialIndex != meshEntry[i].materialIndex)
 				{
-					auto x = glm::transpose(boneModFound->second);
-					memcpy(&boneMod, &x, 16 * sizeof(float));
-					globalTransf *= boneMod;
+					MaterialGroup group = { meshEntry[i].materialIndex, (unsigned int)i, (unsigned int)i };
+					materialGroup.push_back(group);
 				}
-				aiMatrix4x4 finalMtrx = invTransf * globalTransf * skeleton[boneFound->second].localTransf;
-				memcpy(&skTransf[boneFound->second], &finalMtrx.Transpose(), sizeof(skTransf[boneFound->second]));
+				materialGroup.back().entryEnd = i + 1;
 			}
-			for (int i = 0; i < node->mNumChildren; i++)
+		}
+
+		void buildIndirectCommands(std::vector<DrawElementsIndirectCommand> & command)
+		{
+			unsigned int groupNum = materialGroup.size();
+			bucketIndirect.resize((SCENE_RESOURCE_BONE_PER_VERTEX + 1) * groupNum);
+			entryIndirect.resize(groupNum);
+			for (int b = 0; b <= SCENE_RESOURCE_BONE_PER_VERTEX; b++)
+				for (int g = 0; g < groupNum; g++)
+				{
+					bucketIndirect[b * groupNum + g].offset = command.size();
+					for (int i = materialGroup[g].entryBegin; i < materialGroup[g].entryEnd; i++)
+					{
+						if (meshEntry[i].bucketCornerNum[b] == 0) continue;
+						DrawElementsIndirectCommand cur = { meshEntry[i].bucketCornerNum[b], 1, meshEntry[i].bucketIndexOffset[b], (GLint)meshEntry[i].vertexOffset, meshEntry[i].materialIndex };
+						command.push_back(cur);
+					}
+					bucketIndirect[b * groupNum + g].count = command.size() - bucketIndirect[b * groupNum + g].offset;
+				}
+			for (int g = 0; g < groupNum; g++)
+			{
+				entryIndirect[g].offset = command.size();
+				for (int i = materialGroup[g].entryBegin; i < materialGroup[g].entryEnd; i++)
+				{
+					DrawElementsIndirectCommand cur = { meshEntry[i].facetCornerNum, 1, meshEntry[i].indexOffset, (GLint)meshEntry[i].vertexOffset, meshEntry[i].materialIndex };
+					command.push_back(cur);
+				}
+				entryIndirect[g].count = command.size() - entryIndirect[g].offset;
+			}
+		}
+
+		// Model space transform of every node under the given pose, in hierarchy order
+		void getGlobalTransform(std::vector<glm::fmat4> & globalTransf, const SkeletonModifier & modifier) const
+		{
+			globalTransf.resize(hierarchy.size());
+			for (int i = 0; i < hierarchy.size(); i++)
 			{
-				recursivelyGetTransf(skTransf, modifier, node->mChildren[i], globalTransf, invTransf);
+				const Node & node = hierarchy[i];
+				globalTransf[i] = node.parent < 0 ? node.localTransf : globalTransf[node.parent] * node.localTransf;
+				if (node.bone < 0) continue;
+				SkeletonModifier::const_iterator boneModFound = modifier.find(node.name);
+				if (boneModFound != modifier.end())
+					globalTransf[i] *= boneModFound->second;
 			}
 		}
 
@@ -370,17 +759,165 @@ namespace SkeletalMesh
 
 			transf.resize(skeleton.size());
 
-			aiMatrix4x4 identityMtrx, invTransf = scene->mRootNode->mTransformation;
-			invTransf.Inverse();
-			recursivelyGetTransf(transf, modifier, scene->mRootNode, identityMtrx, invTransf);
+			std::vector<glm::fmat4> globalTransf;
+			getGlobalTransform(globalTransf, modifier);
+			for (int i = 0; i < hierarchy.size(); i++)
+			{
+				if (hierarchy[i].bone >= 0)
+					transf[hierarchy[i].bone] = invRootTransf * globalTransf[i] * skeleton[hierarchy[i].bone].localTransf;
+			}
 			return !transf.empty();
 		}
 
+		// Model space frames of the named joints under the given pose, identity for unknown names
+		bool getJointTransforms(std::vector<glm::fmat4> & transf, const std::vector<std::string> & jointName, const SkeletonModifier & modifier) const
+		{
+			if (!available) return false;
+
+			transf.assign(jointName.size(), glm::fmat4());
+
+			std::vector<glm::fmat4> globalTransf;
+			getGlobalTransform(globalTransf, modifier);
+			for (int i = 0; i < hierarchy.size(); i++)
+			{
+				std::vector<std::string>::const_iterator jointFound = std::find(jointName.begin(), jointName.end(), hierarchy[i].name);
+				if (jointFound != jointName.end())
+					transf[jointFound - jointName.begin()] = invRootTransf * globalTransf[i];
+			}
+			return true;
+		}
+
+		// CPU memory held by the scene object itself (GPU buffers and textures excluded)
+		size_t getResidentBytes() const
+		{
+			size_t bytes = sizeof(Scene) + name.capacity() + filename.capacity();
+			for (int i = 0; i < hierarchy.size(); i++)
+				bytes += sizeof(Node) + hierarchy[i].name.capacity();
+			bytes += meshEntry.capacity() * sizeof(MeshEntry);
+			bytes += material.capacity() * sizeof(Material);
+			bytes += skeleton.capacity() * sizeof(Bone);
+			for (Name2Bone::const_iterator it = nameBoneMap.begin(); it != nameBoneMap.end(); ++it)
+				bytes += sizeof(Name2Bone::value_type) + 4 * sizeof(void *) + it->first.capacity();
+			bytes += cluster.capacity() * sizeof(Meshlet::Cluster);
+			bytes += clusterBoneBound.capacity() * sizeof(Meshlet::BoneBound);
+			bytes += materialGroup.capacity() * sizeof(MaterialGroup);
+			bytes += (bucketIndirect.capacity() + entryIndirect.capacity() + drawRange.capacity()) * sizeof(IndirectRange);
+			bytes += drawCommand.capacity() * sizeof(DrawElementsIndirectCommand);
+			for (int i = 0; i < morphTarget.size(); i++)
+				bytes += sizeof(MorphTarget) + morphTarget[i].slot.capacity() * sizeof(unsigned int) + morphTarget[i].delta.capacity() * sizeof(glm::fvec4);
+			bytes += morphOffset.capacity() * sizeof(glm::fvec4);
+			return bytes;
+		}
+
+		// Before: what keeping the importer alive used to cost; after: the compact runtime scene
+		void reportMemory(std::ostream & out) const
+		{
+			size_t runtimeBytes = getResidentBytes();
+			out << "Scene " << name << ": resident " << (importerBytes + runtimeBytes) / 1024.0
+				<< " KB with importer, " << runtimeBytes / 1024.0 << " KB after releasing it ("
+				<< hierarchy.size() << " nodes, " << skeleton.size() << " bones)" << std::endl;
+		}
+
+		size_t getCpuBytes() const { return getResidentBytes(); }
+
+		size_t getGpuBytes() const
+		{
+			return gpuBytes + sizeof(DrawElementsIndirectCommand) * drawCommand.capacity() + diffusePacker.getByteNum();
+		}
+
+		// Evicted by the resource registry: everything goes but the name, the file and the shader input.
+		// The materials release their textures, which may then be evicted in turn.
+		void evict()
+		{
+			std::string keepName = name, keepFilename = filename;
+			clear();
+			name = keepName;
+			filename = keepFilename;
+		}
+
+		// Load the file again into this scene; its textures are packed again by the next packTextures()
+		bool reload()
+		{
+			if (&loadScene(name, filename) != this) return false;
+			if (inputName.size() == 7)
+				setShaderInput(inputProgram, inputName[0], inputName[1], inputName[2], inputName[3], inputName[4], inputName[5], inputName[6]);
+			return true;
+		}
+
+		unsigned int getMorphTargetNum() const { return morphTarget.size(); }
+
+		bool setMorphWeight(unsigned int _index, float _weight)
+		{
+			if (_index >= morphTarget.size()) return false;
+			morphTarget[_index].weight = _weight;
+			return true;
+		}
+
+		float getMorphWeight(unsigned int _index) const
+		{
+			if (_index >= morphTarget.size()) return 0.0f;
+			return morphTarget[_index].weight;
+		}
+
+		// Accumulate every weight change into the morph offsets and upload the touched slots.
+		// Cost is (vertices moved x targets whose weight changed); idle targets cost nothing.
+		void applyMorphTargets()
+		{
+			if (!available || morphOffset.empty()) return;
+
+			morphSlotMark.resize(morphOffset.size(), 0);
+			morphDirtySlot.clear();
+			bool anyActive = false;
+			for (int i = 0; i < morphTarget.size(); i++)
+			{
+				MorphTarget & curMorph = morphTarget[i];
+				if (curMorph.weight != 0.0f) anyActive = true;
+				float deltaWeight = curMorph.weight - curMorph.appliedWeight;
+				if (deltaWeight == 0.0f || curMorph.slot.empty()) continue;
+
+				__m128 w = _mm_set1_ps(deltaWeight);
+				for (int j = 0; j < curMorph.slot.size(); j++)
+				{
+					unsigned int s = curMorph.slot[j];
+					float * offset = &morphOffset[s].x;
+					_mm_storeu_ps(offset, _mm_add_ps(_mm_loadu_ps(offset), _mm_mul_ps(w, _mm_loadu_ps(&curMorph.delta[j].x))));
+					if (!morphSlotMark[s])
+					{
+						morphSlotMark[s] = 1;
+						morphDirtySlot.push_back(s);
+					}
+				}
+				curMorph.appliedWeight = curMorph.weight;
+			}
+			if (morphDirtySlot.empty()) return;
+			std::sort(morphDirtySlot.begin(), morphDirtySlot.end());
+
+			glBindBuffer(GL_TEXTURE_BUFFER, morphBuffer);
+			for (int i = 0; i < morphDirtySlot.size();)
+			{
+				// Grow the run over nearby changed slots; the untouched slots in its gaps are re-sent unchanged
+				unsigned int runBegin = morphDirtySlot[i], runEnd = runBegin + 1;
+				for (; i < morphDirtySlot.size() && morphDirtySlot[i] <= runEnd + SCENE_RESOURCE_MORPH_UPLOAD_GAP; i++)
+				{
+					runEnd = morphDirtySlot[i] + 1;
+					morphSlotMark[morphDirtySlot[i]] = 0;
+					// Back at the rest pose, drop the rounding left over from the incremental updates
+					if (!anyActive) morphOffset[morphDirtySlot[i]] = glm::fvec4(0.0f);
+				}
+				glBufferSubData(GL_TEXTURE_BUFFER, sizeof(glm::fvec4) * runBegin, sizeof(glm::fvec4) * (runEnd - runBegin), &morphOffset[runBegin]);
+			}
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		}
+
 		bool setShaderInput(GLuint program,
 			std::string posiName, std::string texcName, std::string normName,
-			std::string bnidName, std::string bnwtName)
+			std::string bnidName, std::string bnwtName, std::string mrphName = "in_morph_slot",
+			std::string layrName = "in_diffuse_layer")
 		{
 			if (!available) return false;
+			inputProgram = program;
+			std::string names[] = { posiName, texcName, normName, bnidName, bnwtName, mrphName, layrName };
+			inputName.assign(names, names + 7);
 
 			ParametricVertex example;
 
@@ -427,25 +964,323 @@ namespace SkeletalMesh
 					glVertexAttribPointer(bnwtLoc, SCENE_RESOURCE_BONE_PER_VERTEX, GL_FLOAT, GL_FALSE, sizeof(ParametricVertex), (const void *)((char *)example.boneWeight - (char *)&example));
 				}
 			}
+			{
+				GLint mrphLoc = glGetAttribLocation(program, mrphName.c_str());
+				if (mrphLoc >= 0)
+				{
+					glEnableVertexAttribArray(mrphLoc);
+					glVertexAttribIPointer(mrphLoc, 1, GL_UNSIGNED_INT, sizeof(ParametricVertex), (const void *)((char *)&example.morphSlot - (char *)&example));
+				}
+			}
+			{
+				// one value per material: draws carry their material index as base instance
+				GLint layrLoc = glGetAttribLocation(program, layrName.c_str());
+				if (layrLoc >= 0)
+				{
+					glBindBuffer(GL_ARRAY_BUFFER, layerBuffer);
+					glEnableVertexAttribArray(layrLoc);
+					glVertexAttribPointer(layrLoc, 1, GL_FLOAT, GL_FALSE, sizeof(float), (const void *)0);
+					glVertexAttribDivisor(layrLoc, 1);
+				}
+			}
 
 			glBindVertexArray(0);
 
 			return true;
 		}
 
+		// Print the influence buckets of every mesh entry and the bone blends they save,
+		// counting one blend per influence per vertex shader invocation
+		void reportInfluenceBuckets(std::ostream & out) const
+		{
+			if (!available) return;
+			unsigned long long blendBefore = 0, blendAfter = 0;
+			for (int i = 0; i < meshEntry.size(); i++)
+			{
+				out << name << " mesh " << i << " vertices per influence bucket:";
+				// a single four-influence program shaded every vertex once; each bucket shades the vertices it references
+				blendBefore += (unsigned long long)meshEntry[i].usedVertexNum * SCENE_RESOURCE_BONE_PER_VERTEX;
+				for (int b = 0; b <= SCENE_RESOURCE_BONE_PER_VERTEX; b++)
+				{
+					out << " [" << (b ? std::to_string(b) : std::string("unbound")) << "] "
+						<< meshEntry[i].bucketVertexNum[b] << " (" << meshEntry[i].bucketCornerNum[b] / 3 << " tris)";
+					blendAfter += meshEntry[i].bucketVertexNum[b] * (b ? b : SCENE_RESOURCE_BONE_PER_VERTEX);
+				}
+				out << std::endl;
+			}
+			out << name << " bone blends per frame: " << blendBefore << " -> " << blendAfter;
+			if (blendBefore)
+				out << " (" << 100.0 * ((double)blendBefore - (double)blendAfter) / blendBefore << "% saved)";
+			out << std::endl;
+		}
+
+		void resetCullStatistics()
+		{
+			memset(&cullStats, 0, sizeof(cullStats));
+		}
+
+		CullStatistics getCullStatistics() const { return cullStats; }
+
+		void reportCulling(std::ostream & out) const
+		{
+			if (cullStats.frames == 0) return;
+			double frames = cullStats.frames;
+			out << name << " clusters per frame: " << cullStats.clusters / frames
+				<< ", frustum culled " << cullStats.frustumCulled / frames
+				<< ", cone culled " << cullStats.coneCulled / frames
+				<< ", draws " << cullStats.draws / frames << std::endl;
+		}
+
+		void resetRenderStatistics()
+		{
+			memset(&renderStats, 0, sizeof(renderStats));
+		}
+
+		RenderStatistics getRenderStatistics() const { return renderStats; }
+
+		// Compare with one draw and one bind per mesh entry and bucket, as before batching
+		void reportRendering(std::ostream & out) const
+		{
+			if (renderStats.frames == 0) return;
+			double frames = renderStats.frames;
+			unsigned int entryDraws = 0;
+			for (int i = 0; i < meshEntry.size(); i++)
+				for (int b = 0; b <= SCENE_RESOURCE_BONE_PER_VERTEX; b++)
+					entryDraws += meshEntry[i].bucketCornerNum[b] ? 1 : 0;
+			out << name << " per frame: " << renderStats.drawCalls / frames << " draw calls, "
+				<< renderStats.textureBinds / frames << " texture binds ("
+				<< meshEntry.size() << " mesh entries in " << materialGroup.size() << " material groups, "
+				<< entryDraws << " draws and binds unbatched";
+			if (diffusePacker.isPacked())
+				out << ", diffuse textures in " << diffusePacker.getArrayNum() << " texture arrays";
+			out << ")" << std::endl;
+		}
+
+		// Copy the diffuse textures into texture arrays, so that materials sharing an array draw
+		// without a bind between them. Call once their uploads are complete; false if nothing was packed.
+		bool packTextures()
+		{
+			if (!available || diffusePacker.isPacked()) return false;
+			unpackedPassBinds = countPassBinds();
+			std::vector<int> slot(material.size(), -1);
+			for (int i = 0; i < material.size(); i++)
+				slot[i] = diffusePacker.add(material[i].diffuse->getObject());
+			if (!diffusePacker.pack()) return false;
+
+			std::vector<float> diffuseLayer(std::max<size_t>(1, material.size()), -1.0f);
+			for (int i = 0; i < material.size(); i++)
+			{
+				material[i].diffuseArray = diffusePacker.getArray(slot[i]);
+				material[i].diffuseLayer = diffusePacker.getLayer(slot[i]);
+				diffuseLayer[i] = (float)material[i].diffuseLayer;
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, layerBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * diffuseLayer.size(), diffuseLayer.data());
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			return true;
+		}
+
+		void reportTexturePacking(std::ostream & out) const
+		{
+			if (!diffusePacker.isPacked()) return;
+			diffusePacker.report(out);
+			out << name << " texture binds per pass: " << unpackedPassBinds << " unpacked, " << countPassBinds() << " packed" << std::endl;
+		}
+
+		// Cull clusters against the view and draw the survivors of every influence bucket
+		// with one indirect multi-draw per material group. Cluster bounds follow the skeleton pose.
+		void render(const GLuint _bucketProgram[SCENE_RESOURCE_BONE_PER_VERTEX + 1],
+			const glm::fmat4 & _mvp, const SkeletonTransf & _bonesTransf, bool _coneCulling = true)
+		{
+			if (!available) return;
+
+			Meshlet::CullView view(_mvp);
+			float morphScale = 0.0f;
+			for (int i = 0; i < morphTarget.size(); i++)
+				morphScale += std::fabs(morphTarget[i].weight);
+			cullStats.frames++;
+
+			unsigned int groupNum = materialGroup.size();
+			drawCommand.clear();
+			drawRange.resize((SCENE_RESOURCE_BONE_PER_VERTEX + 1) * groupNum);
+			for (int b = 0; b <= SCENE_RESOURCE_BONE_PER_VERTEX; b++)
+				for (int g = 0; g < groupNum; g++)
+				{
+					drawRange[b * groupNum + g].offset = drawCommand.size();
+					for (int i = materialGroup[g].entryBegin; i < materialGroup[g].entryEnd; i++)
+					{
+						unsigned int lastEnd = 0;
+						bool merging = false;
+						for (int c = meshEntry[i].bucketClusterOffset[b]; c < meshEntry[i].bucketClusterOffset[b] + meshEntry[i].bucketClusterNum[b]; c++)
+						{
+							const Meshlet::Cluster & curCluster = cluster[c];
+							const Meshlet::BoneBound * curBoneBound = &clusterBoneBound[curCluster.boneBoundOffset];
+							cullStats.clusters++;
+							Meshlet::Sphere bound = Meshlet::posedBound(curCluster, curBoneBound,
+								_bonesTransf.data(), _bonesTransf.size(), morphScale);
+							if (!view.sphereVisible(bound))
+							{
+								cullStats.frustumCulled++;
+								continue;
+							}
+							// Normal cones survive posing only when one bone moves the whole cluster rigidly
+							if (_coneCulling && curCluster.boneBoundNum == 1 && !(morphScale > 0.0f && curCluster.morphReach > 0.0f))
+							{
+								glm::fvec3 axis = curCluster.coneAxis;
+								if (curBoneBound->bone < _bonesTransf.size())
+									axis = glm::normalize(glm::fmat3(_bonesTransf[curBoneBound->bone]) * axis);
+								if (view.coneBackfacing(bound, axis, curCluster.coneCutoff))
+								{
+									cullStats.coneCulled++;
+									continue;
+								}
+							}
+							// Neighbouring survivors are contiguous in the index buffer, merge them
+							if (merging && lastEnd == curCluster.indexOffset)
+								drawCommand.back().count += curCluster.cornerNum;
+							else
+							{
+								DrawElementsIndirectCommand cur = { curCluster.cornerNum, 1, curCluster.indexOffset, (GLint)meshEntry[i].vertexOffset, meshEntry[i].materialIndex };
+								drawCommand.push_back(cur);
+								merging = true;
+							}
+							lastEnd = curCluster.indexOffset + curCluster.cornerNum;
+						}
+					}
+					drawRange[b * groupNum + g].count = drawCommand.size() - drawRange[b * groupNum + g].offset;
+				}
+			if (drawCommand.empty())
+			{
+				renderStats.frames++;
+				return;
+			}
+
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cullIndirectBuffer);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * drawCommand.size(), drawCommand.data(), GL_STREAM_DRAW);
+			unsigned long long drawCalls = renderStats.drawCalls;
+			drawBuckets(_bucketProgram, drawRange);
+			cullStats.draws += renderStats.drawCalls - drawCalls;
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		}
+
+		// Draw every influence bucket with the program specialized for it
+		void render(const GLuint _bucketProgram[SCENE_RESOURCE_BONE_PER_VERTEX + 1]) const
+		{
+			if (!available) return;
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+			drawBuckets(_bucketProgram, bucketIndirect);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		}
+
 		void render() const
 		{
 			if (!available) return;
+			renderStats.frames++;
 			glBindVertexArray(vao);
-			for (int i = 0; i < meshEntry.size(); i++)
+			bindMorphTexture();
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+			GLuint boundDiffuse = SCENE_RESOURCE_UNBOUND;
+			drawGroups(entryIndirect.data(), boundDiffuse);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+			glBindVertexArray(0);
+		}
+
+	private:
+		void bindMorphTexture() const
+		{
+			if (!morphTexture) return;
+			glActiveTexture(GL_TEXTURE0 + SCENE_RESOURCE_SHADER_MORPH_CHANNEL);
+			glBindTexture(GL_TEXTURE_BUFFER, morphTexture);
+			glActiveTexture(GL_TEXTURE0 + SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL);
+		}
+
+		// What a material draws with: its texture array once packed, else its diffuse texture (0 for none)
+		GLuint materialBinding(unsigned int _materialIndex) const
+		{
+			const Material & cur = material[_materialIndex];
+			return cur.diffuseArray ? cur.diffuseArray : cur.diffuse->getObject();
+		}
+
+		// Skips the bind when the material's texture is already the bound one
+		void bindMaterial(unsigned int _materialIndex, GLuint & _boundDiffuse) const
+		{
+			GLuint binding = materialBinding(_materialIndex);
+			if (binding == _boundDiffuse) return;
+			const Material & cur = material[_materialIndex];
+			if (cur.diffuseArray)
+			{
+				glActiveTexture(GL_TEXTURE0 + SCENE_RESOURCE_SHADER_DIFFUSE_ARRAY_CHANNEL);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, cur.diffuseArray);
+				glActiveTexture(GL_TEXTURE0 + SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL);
+			}
+			else if (!cur.diffuse->bind(SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL))
+				glBindTexture(GL_TEXTURE_2D, 0);
+			_boundDiffuse = binding;
+			renderStats.textureBinds++;
+		}
+
+		// Binds a pass over every material group takes
+		unsigned int countPassBinds() const
+		{
+			unsigned int binds = 0;
+			GLuint bound = SCENE_RESOURCE_UNBOUND;
+			for (int g = 0; g < materialGroup.size(); g++)
+			{
+				GLuint binding = materialBinding(materialGroup[g].materialIndex);
+				if (binding != bound) binds++;
+				bound = binding;
+			}
+			return binds;
+		}
+
+		// Issues the commands of _range from the bound GL_DRAW_INDIRECT_BUFFER
+		void drawIndirect(const IndirectRange & _range) const
+		{
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+				(void*)(sizeof(DrawElementsIndirectCommand) * _range.offset), _range.count, 0);
+			renderStats.drawCalls++;
+		}
+
+		// One multi-draw per run of non-empty material groups that draw with the same binding
+		// and whose commands are contiguous; _range holds one range per material group
+		void drawGroups(const IndirectRange * _range, GLuint & _boundDiffuse) const
+		{
+			IndirectRange run = { 0, 0 };
+			for (int g = 0; g < materialGroup.size(); g++)
 			{
-				if (!material[meshEntry[i].materialIndex].diffuse->bind(SCENE_RESOURCE_SHADER_DIFFUSE_CHANNEL)) glBindTexture(GL_TEXTURE_2D, 0);
+				if (_range[g].count == 0) continue;
+				unsigned int materialIndex = materialGroup[g].materialIndex;
+				if (run.count > 0 && (materialBinding(materialIndex) != _boundDiffuse || run.offset + run.count != _range[g].offset))
+				{
+					drawIndirect(run);
+					run.count = 0;
+				}
+				bindMaterial(materialIndex, _boundDiffuse);
+				if (run.count == 0)
+					run = _range[g];
+				else
+					run.count += _range[g].count;
+			}
+			if (run.count > 0) drawIndirect(run);
+		}
 
-				glDrawElementsBaseVertex(GL_TRIANGLES,
-					meshEntry[i].facetCornerNum,
-					GL_UNSIGNED_INT,
-					(void*)(sizeof(unsigned int) * meshEntry[i].indexOffset),
-					meshEntry[i].vertexOffset);
+		// One program per bucket, one multi-draw per run of material groups in it
+		void drawBuckets(const GLuint _bucketProgram[SCENE_RESOURCE_BONE_PER_VERTEX + 1], const std::vector<IndirectRange> & _range) const
+		{
+			renderStats.frames++;
+			glBindVertexArray(vao);
+			bindMorphTexture();
+			GLuint boundDiffuse = SCENE_RESOURCE_UNBOUND;
+			unsigned int groupNum = materialGroup.size();
+			for (int b = 0; b <= SCENE_RESOURCE_BONE_PER_VERTEX; b++)
+			{
+				const IndirectRange * range = _range.data() + b * groupNum;
+				bool empty = true;
+				for (int g = 0; g < groupNum && empty; g++)
+					empty = range[g].count == 0;
+				if (empty) continue;
+				glUseProgram(_bucketProgram[b]);
+				drawGroups(range, boundDiffuse);
 			}
 			glBindVertexArray(0);
 		}
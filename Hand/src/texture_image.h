@@ -9,15 +9,18 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
 
 #include "gl_env.h"
+#include "texture_cache.h"
+#include "resource_registry.h"
 
 #include <FreeImage.h>
 #pragma comment(lib, "FreeImage.lib")
 
 namespace TextureImage
 {
-	class Texture
+	class Texture : public ResourceRegistry::Resource
 	{
 	public:
 		typedef std::map<std::string, Texture *> Name2Texture;
@@ -31,6 +34,8 @@ namespace TextureImage
 		int width;
 		int height;
 		GLuint tex;
+		// every level, as the driver reports it
+		size_t gpuBytes;
 
 		// Forbid calling any constructor outside
 		Texture(const Texture & _copy)
@@ -43,17 +48,66 @@ namespace TextureImage
 			, width(0)
 			, height(0)
 			, tex(0)
+			, gpuBytes(0)
 		{}
 		virtual ~Texture() { clear(); }
 
+		// GPU memory of the levels of _tex
+		static size_t levelBytes(GLuint _tex)
+		{
+			size_t bytes = 0;
+			GLint compressed = 0;
+			glBindTexture(GL_TEXTURE_2D, _tex);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+			for (int level = 0; ; level++)
+			{
+				GLint levelWidth = 0, levelHeight = 0, size = 0;
+				glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &levelWidth);
+				glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &levelHeight);
+				if (levelWidth == 0 || levelHeight == 0) break;
+				if (compressed)
+					glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+				else
+					size = levelWidth * levelHeight * 4;
+				bytes += size;
+				if (levelWidth == 1 && levelHeight == 1) break;
+			}
+			glBindTexture(GL_TEXTURE_2D, 0);
+			return bytes;
+		}
+
+		void freeTexture()
+		{
+			available = false;
+			if (tex) TextureStream::shared().cancel(tex);
+			glDeleteTextures(1, &tex);
+			tex = 0;
+			gpuBytes = 0;
+		}
+
 	public:
 		void clear()
 		{
-			available = false;
+			freeTexture();
 			name = std::string();
 			filename = std::string();
-			glDeleteTextures(1, &tex);
-			tex = 0;
+		}
+
+		size_t getCpuBytes() const { return sizeof(Texture) + name.capacity() + filename.capacity(); }
+		size_t getGpuBytes() const { return gpuBytes; }
+
+		// Evicted by the resource registry: the name and file stay for reload()
+		void evict() { freeTexture(); }
+
+		bool reload()
+		{
+			freeTexture();
+			std::string file = filename;
+			tex = TextureCache::shared().load(file, [&](TextureStream::Source & _source)
+			{
+				return decodeFile(file, _source);
+			}, width, height);
+			return &finishTarget(*this) != &error;
 		}
 
 		static std::string testAllSuffix(std::string no_suffix_name)
@@ -79,108 +133,98 @@ namespace TextureImage
 			return std::string();
 		}
 
-		static Texture & loadTexture(std::string _name, std::string _filename = std::string())
+		// FreeImage decoder for the texture cache; the bitmap is kept until the texture stream has uploaded it
+		static bool decodeFile(const std::string & _filename, TextureStream::Source & _source)
 		{
-			GLenum gl_error_code = GL_NO_ERROR;
-			if ((gl_error_code = glGetError()) != GL_NO_ERROR)
-			{
-				const GLubyte * errString = gluErrorString(gl_error_code);
-				std::cout << "ERROR before loadTexture():" << std::endl;
-				std::cout << errString << std::endl;
-			}
-			std::cout << _name <<"<>"<<_filename << std::endl;
-			if (_filename.empty() || _filename == "")
-			{
-				_filename = testAllSuffix(_name);
-				if (_filename.empty()) return error;
-			}
-			FILE * fi = fopen(_filename.c_str(), "r");
-			if (fi == NULL) return error;
-			fclose(fi);
-
-			std::pair<Name2Texture::iterator, bool> insertion =
-				allTexture.insert(Name2Texture::value_type(_name, new Texture()));
-			Texture & target = *(insertion.first->second);
-			if (!insertion.second)
-				if (target.filename == _filename && target.available)
-					return target;
-				else
-					target.clear();
-
-			target.name = _name;
-			target.filename = _filename;
-
 			FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
 			FIBITMAP *dib(0);
-			BYTE* bits(0);
 
 			fif = FreeImage_GetFileType(_filename.c_str(), 0);
 			if (fif == FIF_UNKNOWN)
 				fif = FreeImage_GetFIFFromFilename(_filename.c_str());
 			if (fif == FIF_UNKNOWN)
-				return error;
+				return false;
 
 			if (FreeImage_FIFSupportsReading(fif))
 				dib = FreeImage_Load(fif, _filename.c_str());
 			if (!dib)
-				return error;
+				return false;
 
-			FreeImage_FlipVertical(dib);
-
-			bits = FreeImage_GetBits(dib);
-			target.width = FreeImage_GetWidth(dib);
-			target.height = FreeImage_GetHeight(dib);
-			if ((bits == 0) || (target.width == 0) || (target.height == 0))
+			_source.width = FreeImage_GetWidth(dib);
+			_source.height = FreeImage_GetHeight(dib);
+			FREE_IMAGE_TYPE image_type = FreeImage_GetImageType(dib);
+			FREE_IMAGE_COLOR_TYPE color_type = FreeImage_GetColorType(dib);
+			unsigned int pixel_bpp = FreeImage_GetBPP(dib);
+			if ((FreeImage_GetBits(dib) == 0) || (_source.width == 0) || (_source.height == 0) || (image_type != FIT_BITMAP)
+				|| !((color_type == FIC_RGB && pixel_bpp == 24) || (color_type == FIC_RGBALPHA && pixel_bpp == 32)))
 			{
 				FreeImage_Unload(dib);
-				return error;
+				return false;
 			}
 
-			GLenum image_color_format = GL_BGR;
-			GLenum image_channel_type = GL_UNSIGNED_BYTE;
-			FREE_IMAGE_TYPE image_type = FreeImage_GetImageType(dib);
-			FREE_IMAGE_COLOR_TYPE color_type = FreeImage_GetColorType(dib);
-			unsigned int pixel_bpp = FreeImage_GetBPP(dib);
+			// FreeImage scanlines are BGR(A) on little-endian machines, padded to 4 bytes and stored
+			// bottom-up; the stream flips them while it swizzles, instead of FreeImage_FlipVertical
+			_source.channels = pixel_bpp / 8;
+			_source.bgr = FI_RGBA_RED == 2;
+			_source.flip = true;
+			_source.pixels = FreeImage_GetBits(dib);
+			_source.pitch = FreeImage_GetPitch(dib);
+			_source.release = [dib]() { FreeImage_Unload(dib); };
+			return true;
+		}
 
-			if (image_type != FIT_BITMAP)
+		// The texture _name is loaded into, NULL if the file is missing; _loaded is set when it already holds the file
+		static Texture * findTarget(std::string _name, std::string & _filename, bool & _loaded)
+		{
+			std::cout << _name <<"<>"<<_filename << std::endl;
+			_loaded = false;
+			if (_filename.empty() || _filename == "")
 			{
-				FreeImage_Unload(dib);
-				return error;
+				_filename = testAllSuffix(_name);
+				if (_filename.empty()) return NULL;
 			}
-			switch (color_type)
+			FILE * fi = fopen(_filename.c_str(), "r");
+			if (fi == NULL) return NULL;
+			fclose(fi);
+
+			Name2Texture::iterator found = allTexture.find(_name);
+			bool inserted = found == allTexture.end();
+			if (inserted)
 			{
-			case FIC_RGB:
-				if (pixel_bpp != 24)
-				{
-					FreeImage_Unload(dib);
-					return error;
-				}
-				break;
-			case FIC_RGBALPHA:
-				image_color_format = GL_BGRA;
-				if (pixel_bpp != 32)
+				found = allTexture.insert(Name2Texture::value_type(_name, new Texture())).first;
+				ResourceRegistry::shared().add(found->second, "texture", _name);
+			}
+			Texture & target = *(found->second);
+			if (!inserted)
+			{
+				if (target.filename == _filename && target.available)
 				{
-					FreeImage_Unload(dib);
-					return error;
+					_loaded = true;
+					return &target;
 				}
-				break;
-			default:
-				return error;
+				else
+					target.clear();
 			}
 
-			glGenTextures(1, &target.tex);
-			glBindTexture(GL_TEXTURE_2D, target.tex);
+			target.name = _name;
+			target.filename = _filename;
+			return &target;
+		}
+
+		// Sampler state once the texture cache has made the texture object
+		static Texture & finishTarget(Texture & _target)
+		{
+			if (!_target.tex)
+				return error;
+
+			glBindTexture(GL_TEXTURE_2D, _target.tex);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, target.width, target.height,
-				0, image_color_format, image_channel_type, bits);
-			glGenerateMipmap(GL_TEXTURE_2D);
 			glBindTexture(GL_TEXTURE_2D, 0);
 
-			FreeImage_Unload(dib);
-
+			GLenum gl_error_code = GL_NO_ERROR;
 			if ((gl_error_code = glGetError()) != GL_NO_ERROR)
 			{
 				const GLubyte * errString = gluErrorString(gl_error_code);
@@ -189,13 +233,72 @@ namespace TextureImage
 				return error;
 			}
 
-			target.available = true;
-			return target;
+			_target.available = true;
+			_target.gpuBytes = levelBytes(_target.tex);
+			ResourceRegistry::shared().loaded(&_target);
+			return _target;
+		}
+
+		static Texture & loadTexture(std::string _name, std::string _filename = std::string())
+		{
+			GLenum gl_error_code = GL_NO_ERROR;
+			if ((gl_error_code = glGetError()) != GL_NO_ERROR)
+			{
+				const GLubyte * errString = gluErrorString(gl_error_code);
+				std::cout << "ERROR before loadTexture():" << std::endl;
+				std::cout << errString << std::endl;
+			}
+			bool loaded = false;
+			Texture * target = findTarget(_name, _filename, loaded);
+			if (!target) return error;
+			if (loaded) return *target;
+
+			// decoded only when the texture cache has no compressed copy of the file
+			target->tex = TextureCache::shared().load(_filename, [&](TextureStream::Source & _source)
+			{
+				return decodeFile(_filename, _source);
+			}, target->width, target->height);
+			return finishTarget(*target);
 		}
 
+		// Load textures given as (name, file name) pairs together, decoding them on worker
+		// threads; loadTexture() then finds them loaded
+		static void loadTextures(const std::vector<std::pair<std::string, std::string> > & _request)
+		{
+			TextureCache::Batch batch;
+			std::vector<std::string> names;
+			for (int i = 0; i < _request.size(); i++)
+			{
+				if (std::find(names.begin(), names.end(), _request[i].first) != names.end()) continue;
+				names.push_back(_request[i].first);
+				std::string filename = _request[i].second;
+				bool loaded = false;
+				Texture * target = findTarget(_request[i].first, filename, loaded);
+				if (!target || loaded) continue;
+				batch.add(filename, [filename](TextureStream::Source & _source)
+				{
+					return decodeFile(filename, _source);
+				}, [target](GLuint _tex, int _width, int _height)
+				{
+					target->tex = _tex;
+					target->width = _width;
+					target->height = _height;
+					finishTarget(*target);
+				});
+			}
+			if (batch.size() == 0) return;
+			batch.run();
+			batch.report(std::cout);
+		}
+
+		// false if the texture is unknown or still referenced
 		static bool unloadTexture(std::string _name)
 		{
-			return allTexture.erase(_name) != 0;
+			Name2Texture::iterator find_result = allTexture.find(_name);
+			if (find_result == allTexture.end() || find_result->second->getRefNum() > 0) return false;
+			delete find_result->second;
+			allTexture.erase(find_result);
+			return true;
 		}
 
 		static Texture & getTexture(const std::string & _name)
@@ -205,6 +308,9 @@ namespace TextureImage
 			return *(find_result->second);
 		}
 
+		// GL object of the texture, 0 while it is not available
+		GLuint getObject() const { return available ? tex : 0; }
+
 		bool bind(GLenum textureChannel) const
 		{
 			if (!available) return false;
@@ -0,0 +1,120 @@
+// Animation Timeline
+// Monotonic animation time with fixed-step ticks, render interpolation, scaling, pause and offline stepping
+
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+
+#define TIMELINE_DEFAULT_TICK_RATE 120.0
+// wall time one frame may add to the backlog; a longer stall (a breakpoint, a hitch) is dropped
+#define TIMELINE_MAX_FRAME_TIME 0.25
+
+/**********************************************************************************\
+*
+* Usage, once per rendered frame:
+*	timeline.beginFrame();
+*	while (timeline.nextTick())
+*		simulate(timeline.getTickTime(), timeline.getTickStep());
+*	draw(timeline.getTime());
+*
+* getTime() lies between the last two ticks (render interpolation), so animation
+* that is a function of time is drawn smoothly whatever the tick and frame rates.
+*
+\**********************************************************************************/
+
+namespace AnimationClock
+{
+	typedef std::chrono::steady_clock Clock;
+
+	class Timeline
+	{
+	private:
+		double tickStep;
+		double timeScale;
+		bool paused;
+		// 0 follows the wall clock, otherwise every frame advances by exactly this much
+		double offlineStep;
+
+		Clock::time_point lastFrame;
+		double accumulator;
+		unsigned long long tickCount;
+		unsigned long long frameCount;
+
+	public:
+		Timeline(double _tickRate = TIMELINE_DEFAULT_TICK_RATE)
+			: tickStep(1.0 / _tickRate)
+			, timeScale(1.0)
+			, paused(false)
+			, offlineStep(0.0)
+		{
+			start();
+		}
+
+		// Rewind to time zero
+		void start()
+		{
+			lastFrame = Clock::now();
+			accumulator = 0.0;
+			tickCount = 0;
+			frameCount = 0;
+		}
+
+		// Advance by exactly 1 / _frameRate per frame regardless of wall time, 0 goes back to real time
+		void setOffline(double _frameRate)
+		{
+			offlineStep = _frameRate > 0.0 ? 1.0 / _frameRate : 0.0;
+			lastFrame = Clock::now();
+		}
+
+		bool isOffline() const { return offlineStep > 0.0; }
+
+		void setTimeScale(double _scale) { timeScale = _scale > 0.0 ? _scale : 0.0; }
+		double getTimeScale() const { return timeScale; }
+
+		// Time stands still while paused, so resuming continues at the same phase
+		void pause() { paused = true; }
+		void resume() { paused = false; }
+		void togglePause() { paused = !paused; }
+		bool isPaused() const { return paused; }
+
+		void beginFrame()
+		{
+			Clock::time_point now = Clock::now();
+			double elapsed = offlineStep > 0.0 ? offlineStep
+				: std::min(std::chrono::duration<double>(now - lastFrame).count(), TIMELINE_MAX_FRAME_TIME);
+			lastFrame = now;
+			if (!paused)
+				accumulator += elapsed * timeScale;
+			frameCount++;
+		}
+
+		// True while another fixed tick is due this frame. The backlog is bounded in wall time
+		// by beginFrame() rather than in ticks, so slow frames and a high time scale still play
+		// at real speed; only a stall is dropped instead of spiralling into ever longer frames.
+		bool nextTick()
+		{
+			if (accumulator < tickStep) return false;
+			accumulator -= tickStep;
+			tickCount++;
+			return true;
+		}
+
+		double getTickStep() const { return tickStep; }
+		unsigned long long getTickCount() const { return tickCount; }
+		unsigned long long getFrameCount() const { return frameCount; }
+
+		// Time of the latest tick
+		double getTickTime() const { return tickCount * tickStep; }
+
+		// Render time, interpolated between the previous and the latest tick
+		double getTime() const
+		{
+			if (tickCount == 0) return 0.0;
+			return (tickCount - 1) * tickStep + accumulator;
+		}
+
+		// Interpolation factor between the previous and the latest tick
+		double getAlpha() const { return accumulator / tickStep; }
+	};
+}
@@ -0,0 +1,7 @@
+// per-frame camera state, written once a frame into the uniform ring (CameraBlock in main.cpp)
+layout (std140) uniform Camera
+{
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
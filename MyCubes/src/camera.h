@@ -138,6 +138,19 @@ public:
             Zoom = 45.0f;
     }
 
+    // places the camera at position looking at target, keeping the Euler angles in sync
+    void LookAt(glm::vec3 position, glm::vec3 target)
+    {
+        Position = position;
+        glm::vec3 direction = target - position;
+        if (glm::length(direction) < 1e-6f)
+            return;
+        direction = glm::normalize(direction);
+        Yaw = glm::degrees(atan2(direction.z, direction.x));
+        Pitch = glm::degrees(asin(glm::clamp(direction.y, -1.0f, 1.0f)));
+        updateCameraVectors();
+    }
+
 private:
     // calculates the front vector from the Camera's (updated) Euler Angles
     void updateCameraVectors()
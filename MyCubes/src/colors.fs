@@ -7,56 +7,26 @@ struct Material {
     float shininess;
 }; 
 
-struct DirLight {
-    vec3 direction;
-	
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
-struct PointLight {
-    vec3 position;
-    
-    float constant;
-    float linear;
-    float quadratic;
-	
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
-struct SpotLight {
-    vec3 position;
-    vec3 direction;
-    float cutOff;
-    float outerCutOff;
-  
-    float constant;
-    float linear;
-    float quadratic;
-  
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;       
-};
+#include "lights.glsl"
+#include "camera.glsl"
 
-#define NR_POINT_LIGHTS 4
+// light permutation, defined by the application after #version:
+// the enabled point lights are packed into pointLights[0 .. POINT_LIGHT_NUM - 1]
+#ifndef DIR_LIGHT
+#define DIR_LIGHT 1
+#endif
+#ifndef SPOT_LIGHT
+#define SPOT_LIGHT 0
+#endif
+#ifndef POINT_LIGHT_NUM
+#define POINT_LIGHT_NUM NR_POINT_LIGHTS
+#endif
 
 in vec3 FragPos;
 in vec3 Normal;
 
-uniform vec3 viewPos;
-uniform DirLight dirLight;
-uniform PointLight pointLights[NR_POINT_LIGHTS];
-uniform SpotLight spotLight;
 uniform Material material;
 
-uniform bool available_pointLight[NR_POINT_LIGHTS];
-uniform bool available_dirLight;
-uniform bool available_spotLight;
-
 // function prototypes
 vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir);
 vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir);
@@ -75,25 +45,19 @@ void main()
     // this fragment's final color.
     // == =====================================================
     // phase 1: directional lighting
-    int available_light_num = 0;
-    if(available_dirLight)
-        result += CalcDirLight(dirLight, norm, viewDir);
+#if DIR_LIGHT
+    result += CalcDirLight(dirLight, norm, viewDir);
+#endif
     // phase 2: point lights
-    for(int i = 0; i < NR_POINT_LIGHTS; i++)
-        if(available_pointLight[i])
-        {
-            available_light_num++;
-            result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);    
-        }
+    for(int i = 0; i < POINT_LIGHT_NUM; i++)
+        result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);    
     // phase 3: spot light
-    if(available_spotLight)
-        result += CalcSpotLight(spotLight, norm, FragPos, viewDir);    
-    if( (!available_dirLight)
-        &&(available_light_num==0)
-        &&(!available_spotLight)
-        &&(result==vec3(0.0, 0.0, 0.0))
-        )
-        result=0.05*material.diffuse;
+#if SPOT_LIGHT
+    result += CalcSpotLight(spotLight, norm, FragPos, viewDir);    
+#endif
+#if !DIR_LIGHT && POINT_LIGHT_NUM == 0 && !SPOT_LIGHT
+    result=0.05*material.diffuse;
+#endif
     FragColor = vec4(result, 1.0);
 }
 
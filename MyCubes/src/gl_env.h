@@ -0,0 +1,5 @@
+#pragma once
+
+// GL loader of the headers shared with Hand in ..\Common, which includes its own gl_env.h for GLEW
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
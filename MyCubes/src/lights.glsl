@@ -0,0 +1,45 @@
+// light structs and the per-frame light block shared by the lighting shaders (LightsBlock in main.cpp);
+// each vec3 is followed by a float so the std140 layout has no padding the C++ side must repeat
+#define NR_POINT_LIGHTS 4
+
+struct DirLight {
+    vec3 direction;
+    float directionPad;
+    vec3 ambient;
+    float ambientPad;
+    vec3 diffuse;
+    float diffusePad;
+    vec3 specular;
+    float specularPad;
+};
+
+struct PointLight {
+    vec3 position;
+    float constant;
+    vec3 ambient;
+    float linear;
+    vec3 diffuse;
+    float quadratic;
+    vec3 specular;
+    float specularPad;
+};
+
+struct SpotLight {
+    vec3 position;
+    float cutOff;
+    vec3 direction;
+    float outerCutOff;
+    vec3 ambient;
+    float constant;
+    vec3 diffuse;
+    float linear;
+    vec3 specular;
+    float quadratic;
+};
+
+layout (std140) uniform Lights
+{
+    DirLight dirLight;
+    PointLight pointLights[NR_POINT_LIGHTS];
+    SpotLight spotLight;
+};
@@ -8,6 +8,13 @@
 
 #include "shader.h"
 #include "camera.h"
+#include "frame_pacer.h"
+#include "offscreen.h"
+#include "uniform_ring.h"
+#include "texture_cache.h"
+#include "texture_stream.h"
+#include "texture_array.h"
+#include "tiled_texture.h"
 
 #include <iostream>
 #include <fstream>
@@ -19,14 +26,49 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void processInput(GLFWwindow* window);
+GLFWwindow* createWindow(bool hidden);
+// headless runs on an EGL context have no GLFW window, so the clock and the close flag live here
+double appTime();
+void setAppTime(double time);
+void requestClose(GLFWwindow* window);
+bool closeRequested(GLFWwindow* window);
 
 unsigned int loadTexture(const char* path);
-void setShaderLight(Shader& shader, glm::vec3 pointLightPositions[]);
+std::vector<unsigned int> loadTextures(const std::vector<std::string>& paths);
+// a texture the room binds each frame, and the unit it goes on
+struct TextureBinding
+{
+    unsigned int unit;
+    GLenum target;
+    unsigned int texture;
+};
+std::vector<TextureBinding> roomBindings(unsigned int roomArray, unsigned int diffuseMap, unsigned int specularMap);
+unsigned int packRoomTextures(TextureArray::Packer& packer, unsigned int& diffuseMap, unsigned int& specularMap, unsigned int layerVBO);
+bool buildTiles(const std::string& source, const std::string& path);
+void setTileUniforms(Shader& shader, const TiledTexture::Texture& texture, float lodBias);
+struct LightsBlock;
+void setLightsBlock(LightsBlock& block, glm::vec3 pointLightPositions[]);
+unsigned int lightFeatures();
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
 
+// uniform names set every frame; constexpr, so their hashes are computed at compile time
+constexpr UniformName UNIFORM_MODEL("model");
+constexpr UniformName UNIFORM_LIGHT_COLOR("lightColor");
+constexpr UniformName UNIFORM_MATERIAL_DIFFUSE("material.diffuse");
+constexpr UniformName UNIFORM_MATERIAL_SPECULAR("material.specular");
+constexpr UniformName UNIFORM_MATERIAL_SHININESS("material.shininess");
+constexpr UniformName UNIFORM_MATERIAL_MAPS("material.maps");
+constexpr UniformName UNIFORM_TILE_POOL("tilePool");
+constexpr UniformName UNIFORM_TILE_PAGE_TABLE("tilePageTable");
+constexpr UniformName UNIFORM_TILED_DIFFUSE("tiledDiffuse");
+constexpr UniformName UNIFORM_TILE_IMAGE_SIZE("tileImageSize");
+constexpr UniformName UNIFORM_TILE_SIZE("tileSize");
+constexpr UniformName UNIFORM_TILE_LEVEL_NUM("tileLevelNum");
+constexpr UniformName UNIFORM_TILE_LOD_BIAS("tileLodBias");
+
 #define ROOM_BOARDER 25.f
 // camera
 static Camera init_camera(glm::vec3(20.0f, -20.0f, 20.0f), glm::vec3(0.0f, 1.0f, 0.0f), -135.0f, 30.0f, ROOM_BOARDER);
@@ -40,6 +82,10 @@ bool firstMouse = true;
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
+// frame pacing; any input counts as a change for the adaptive mode
+FramePacing::Pacer framePacer;
+bool frameInput = false;
+
 // lighting
 glm::vec3 lightPos(1.2f, 1.0f, 2.0f);
 
@@ -47,6 +93,13 @@ bool available_dirLight = true;
 bool available_spotLight = false;
 bool available_pointLight[4] = { true,false,false,false };
 short lightnum = 0;
+// the lighting shaders are compiled per combination of enabled lights,
+// the bitmask fields are injected as #defines (see lightFeatures())
+const std::vector<ShaderFeature> LIGHT_FEATURES = {
+    { "DIR_LIGHT", 0, 1 },
+    { "SPOT_LIGHT", 1, 1 },
+    { "POINT_LIGHT_NUM", 2, 3 },
+};
 glm::vec3 lightColor[4] = {
     glm::vec3(1.f, 1.f, 1.f),
     glm::vec3(1.f, 0.f, 0.f),
@@ -54,6 +107,59 @@ glm::vec3 lightColor[4] = {
     glm::vec3(0.f, 0.f, 1.f),
 };
 
+// std140 mirrors of the uniform blocks in camera.glsl and lights.glsl;
+// the block index is also its binding point in the uniform ring
+enum UniformBlock { CAMERA_BLOCK, LIGHTS_BLOCK };
+struct CameraBlock
+{
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec3 viewPos;
+    float viewPosPad;
+};
+struct DirLightBlock
+{
+    glm::vec3 direction;
+    float directionPad;
+    glm::vec3 ambient;
+    float ambientPad;
+    glm::vec3 diffuse;
+    float diffusePad;
+    glm::vec3 specular;
+    float specularPad;
+};
+struct PointLightBlock
+{
+    glm::vec3 position;
+    float constant;
+    glm::vec3 ambient;
+    float linear;
+    glm::vec3 diffuse;
+    float quadratic;
+    glm::vec3 specular;
+    float specularPad;
+};
+struct SpotLightBlock
+{
+    glm::vec3 position;
+    float cutOff;
+    glm::vec3 direction;
+    float outerCutOff;
+    glm::vec3 ambient;
+    float constant;
+    glm::vec3 diffuse;
+    float linear;
+    glm::vec3 specular;
+    float quadratic;
+};
+struct LightsBlock
+{
+    DirLightBlock dirLight;
+    PointLightBlock pointLights[4];
+    SpotLightBlock spotLight;
+};
+static_assert(sizeof(CameraBlock) == 144 && sizeof(LightsBlock) == 400, "uniform blocks must match their std140 layout");
+
 
 //direction of cube's V, E, F
 static glm::vec3 V[8] = {
@@ -74,8 +180,8 @@ static glm::vec2 E[4] = {
 };
 static float F[2] = { 1,-1 };
 #define LENGTH_OF_CUBE 22
-void draw_Cube(Shader shader, int length);
-void draw_Cube_with_inner(Shader shader, int length);
+void draw_Cube(const Shader& shader, int length);
+void draw_Cube_with_inner(const Shader& shader, int length);
 
 
 
@@ -85,8 +191,8 @@ void draw_Cube_with_inner(Shader shader, int length);
 static glm::vec2 ball_thph[BALL_PARTICLE_NUM];
 #define RADIUS_OF_BALL 17
 void generate_ball_particles();
-void draw_Ball(Shader shader, int radius);
-void draw_Ball_with_inner(Shader shader, int radius);
+void draw_Ball(const Shader& shader, int radius);
+void draw_Ball_with_inner(const Shader& shader, int radius);
 
 
 
@@ -117,45 +223,165 @@ bool is_rotating = false;
 float rotatingtime = 0.f;
 float rotatingoffset = 0.f;
 
-int main()
+int main(int argc, char* argv[])
 {
-    // glfw: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    std::chrono::steady_clock::time_point startupStart = std::chrono::steady_clock::now();
+
+    // command line
+    // --pace <mode>  : off, vsync, target or adaptive (default; drops to 10 fps while nothing moves)
+    // --fps <rate>   : frame rate of the target and adaptive modes, 60 by default
+    // --headless <pattern>  : render offscreen into frame files named by a printf pattern, e.g. out/cubes_%05d.ppm
+    // --size <w> <h>        : headless frame size, SCR_WIDTH x SCR_HEIGHT by default
+    // --camera-path <path>  : camera keys "time px py pz tx ty tz", from a file or inline separated by ';'
+    // --offline <fps>       : advance time by exactly 1/fps per frame (30 when headless)
+    // --frames <count>      : quit after rendering this many frames (120 when headless)
+    // --rotate              : start with the cubes rotating
+    // --shape <cube|ball>   : start with this shape
+    // --no-program-cache    : compile every shader from source instead of loading stored program binaries
+    // --no-texture-cache    : decode every image and upload it uncompressed instead of loading stored BC files
+    // --upload-budget <KB>  : texture data streamed to the GPU per frame, 4096 by default; 0 uploads each texture whole at load
+    // --mip-filter <filter> : kaiser (default) or box, built on the CPU in linear light, or gpu for glGenerateMipmap
+    // --bench-mipmaps <image> : time the CPU mip filters against glGenerateMipmap on an image, then exit
+    // --build-tiles <image> <out.tiles> : cut an image (any size as binary PPM) into a tiled texture file, then exit
+    // --tiled <file.tiles>  : stream the room's diffuse map from a tiled texture file, tile by tile as it is seen
+    // --tile-pool <pages>   : pages per side of the tile pool, 16 by default (256 tiles of 128 x 128)
+    FramePacing::Mode paceMode = FramePacing::Adaptive;
+    double paceFps = FRAME_PACER_DEFAULT_RATE;
+    std::string headlessPattern, cameraPathSource, benchMipmapPath;
+    std::string buildTilesSource, buildTilesPath, tiledPath;
+    int tilePoolSide = TILED_TEXTURE_POOL_SIDE;
+    int headlessWidth = SCR_WIDTH, headlessHeight = SCR_HEIGHT;
+    double offlineFps = 0.0;
+    unsigned long long frameLimit = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--pace" && i + 1 < argc)
+        {
+            if (!FramePacing::parseMode(argv[++i], paceMode))
+                std::cout << "Unknown pacing mode " << argv[i] << ", using adaptive" << std::endl;
+        }
+        else if (std::string(argv[i]) == "--fps" && i + 1 < argc)
+            paceFps = atof(argv[++i]);
+        else if (std::string(argv[i]) == "--headless" && i + 1 < argc)
+            headlessPattern = argv[++i];
+        else if (std::string(argv[i]) == "--size" && i + 2 < argc)
+        {
+            headlessWidth = std::max(1, atoi(argv[++i]));
+            headlessHeight = std::max(1, atoi(argv[++i]));
+        }
+        else if (std::string(argv[i]) == "--camera-path" && i + 1 < argc)
+            cameraPathSource = argv[++i];
+        else if (std::string(argv[i]) == "--offline" && i + 1 < argc)
+            offlineFps = atof(argv[++i]);
+        else if (std::string(argv[i]) == "--frames" && i + 1 < argc)
+            frameLimit = atoll(argv[++i]);
+        else if (std::string(argv[i]) == "--rotate")
+            is_rotating = true;
+        else if (std::string(argv[i]) == "--no-program-cache")
+            ProgramCache::shared().setEnabled(false);
+        else if (std::string(argv[i]) == "--no-texture-cache")
+            TextureCache::shared().setEnabled(false);
+        else if (std::string(argv[i]) == "--upload-budget" && i + 1 < argc)
+            TextureStream::shared().setBudget((size_t)std::max(0, atoi(argv[++i])) * 1024);
+        else if (std::string(argv[i]) == "--mip-filter" && i + 1 < argc)
+        {
+            TextureMipmap::Filter filter;
+            if (TextureMipmap::parseFilter(argv[++i], filter))
+                TextureCache::shared().setMipmapFilter(filter);
+            else
+                std::cout << "Unknown mip filter " << argv[i] << ", using kaiser" << std::endl;
+        }
+        else if (std::string(argv[i]) == "--bench-mipmaps" && i + 1 < argc)
+            benchMipmapPath = argv[++i];
+        else if (std::string(argv[i]) == "--build-tiles" && i + 2 < argc)
+        {
+            buildTilesSource = argv[++i];
+            buildTilesPath = argv[++i];
+        }
+        else if (std::string(argv[i]) == "--tiled" && i + 1 < argc)
+            tiledPath = argv[++i];
+        else if (std::string(argv[i]) == "--tile-pool" && i + 1 < argc)
+            tilePoolSide = std::max(1, atoi(argv[++i]));
+        else if (std::string(argv[i]) == "--shape" && i + 1 < argc)
+        {
+            if (std::string(argv[++i]) == "ball")
+            {
+                generate_ball_particles();
+                past_shape = current_shape = should_shape = BALL;
+            }
+        }
+    }
 
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-#endif
+    // converting a tiled texture needs no window
+    if (!buildTilesSource.empty())
+        return buildTiles(buildTilesSource, buildTilesPath) ? 0 : -1;
 
-    // glfw window creation
-    // --------------------
-    GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
-    if (window == NULL)
+    // headless runs are batch jobs: fixed time steps, a frame count, no throttling
+    bool headless = !headlessPattern.empty();
+    if (headless)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
+        if (offlineFps <= 0.0) offlineFps = 30.0;
+        if (frameLimit == 0) frameLimit = 120;
+        paceMode = FramePacing::Unlimited;
     }
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetKeyCallback(window, key_callback);
-    glfwSetScrollCallback(window, scroll_callback);
-    glfwSetWindowFocusCallback(window, window_focus_callback);
 
-    // tell GLFW to capture our mouse
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    Offscreen::CameraPath cameraPath;
+    if (!cameraPathSource.empty() && !cameraPath.load(cameraPathSource))
+        std::cout << "Failed to load camera path " << cameraPathSource << std::endl;
+
+    // headless runs render through EGL without GLFW or a display server;
+    // a hidden GLFW window is the fallback where no EGL with desktop OpenGL is installed
+    // ---------------------------------------------------------------------------------
+    Offscreen::Context headlessContext;
+    GLFWwindow* window = NULL;
+    GLADloadproc loader = (GLADloadproc)glfwGetProcAddress;
+    if (headless && headlessContext.create(3, 3, true))
+        loader = (GLADloadproc)Offscreen::Context::getProcAddress;
+    else
+    {
+        if (headless)
+            std::cout << "Headless: no EGL context, falling back to a hidden window" << std::endl;
+        window = createWindow(headless);
+        if (window == NULL)
+        {
+            std::cout << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return -1;
+        }
+    }
+    framePacer.setMode(paceMode, paceFps);
+    if (window)
+        glfwSwapInterval(framePacer.getSwapInterval());
+    // input ends the wait between frames, so the idle rate does not delay the response to it
+    if (!headless)
+        framePacer.setEventWait([](double timeout) { glfwWaitEventsTimeout(timeout); return frameInput; });
 
     // glad: load all OpenGL function pointers
     // ---------------------------------------
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    if (!gladLoadGLLoader(loader))
     {
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
+    if (!benchMipmapPath.empty())
+    {
+        int width, height, channels;
+        unsigned char* data = stbi_load(benchMipmapPath.c_str(), &width, &height, &channels, 4);
+        if (data)
+        {
+            TextureMipmap::benchmark(benchMipmapPath, data, width, height, std::cout);
+            stbi_image_free(data);
+        }
+        else
+            std::cout << "Failed to load image " << benchMipmapPath << std::endl;
+        headlessContext.destroy();
+        if (window)
+            glfwTerminate();
+        return 0;
+    }
+    // let the driver compile the shader permutations in the background while the first frames render
+    if (!enableParallelShaderCompile(loader))
+        std::cout << "Shader: no parallel shader compile, programs are linked when first used" << std::endl;
 
     // configure global opengl state
     // -----------------------------
@@ -163,9 +389,17 @@ int main()
 
     // build and compile our shader zprogram
     // ------------------------------------
-    Shader littleCubeShader("src/colors.vs", "src/colors.fs");
+    Shader littleCubeShader("src/colors.vs", "src/colors.fs", LIGHT_FEATURES);
     Shader lightCubeShader("src/light_cube.vs", "src/light_cube.fs");
-    Shader roomShader("src/room.vs", "src/room.fs");
+    Shader roomShader("src/room.vs", "src/room.fs", LIGHT_FEATURES);
+    littleCubeShader.bindBlock("Camera", CAMERA_BLOCK);
+    littleCubeShader.bindBlock("Lights", LIGHTS_BLOCK);
+    lightCubeShader.bindBlock("Camera", CAMERA_BLOCK);
+    roomShader.bindBlock("Camera", CAMERA_BLOCK);
+    roomShader.bindBlock("Lights", LIGHTS_BLOCK);
+    // writes the tiles of the tiled texture the room's fragments need
+    Shader tileFeedbackShader("src/room.vs", "src/tile_feedback.fs");
+    tileFeedbackShader.bindBlock("Camera", CAMERA_BLOCK);
 
     // set up vertex data (and buffer(s)) and configure vertex attributes
     // ------------------------------------------------------------------
@@ -243,6 +477,23 @@ int main()
     for (int i = 0; i < lightnum; i++)
         pointLightPositions[i] = glm::vec3(points[3 * i], points[3 * i + 1], points[3 * i + 2]);
 
+    // queue every light permutation the keys can reach, the one the first frame needs first
+    littleCubeShader.prepare(lightFeatures());
+    roomShader.prepare(lightFeatures());
+    for (unsigned int pointNum = 0; pointNum <= (unsigned int)lightnum; pointNum++)
+        for (unsigned int lights = 0; lights < 4; lights++)
+        {
+            littleCubeShader.prepare(lights | (pointNum << 2));
+            roomShader.prepare(lights | (pointNum << 2));
+        }
+    // frames rendered for a fixed timeline must not depend on how fast the driver compiles
+    if (offlineFps > 0.0)
+    {
+        littleCubeShader.wait();
+        roomShader.wait();
+    }
+    bool compiling = true;
+
     // first, configure the cube's VAO (and VBO)
     unsigned int VBO, cubeVAO;
     glGenVertexArrays(1, &cubeVAO);
@@ -279,56 +530,121 @@ int main()
     glEnableVertexAttribArray(1);
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
     glEnableVertexAttribArray(2);
+    // texture array layers of the diffuse and specular maps, one pair per instance; -1 until they are packed
+    float roomLayers[2] = { -1.0f, -1.0f };
+    unsigned int roomLayerVBO;
+    glGenBuffers(1, &roomLayerVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, roomLayerVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(roomLayers), roomLayers, GL_STATIC_DRAW);
+    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
 
     // load textures (we now use a utility function to keep the code more organized)
     // -----------------------------------------------------------------------------
 
-    unsigned int RoomTexture = loadTexture("src/container.jpg");
+    // the room's diffuse and specular maps, decoded side by side on the texture worker pool
+    std::vector<unsigned int> roomMaps = loadTextures({ "resource/container2.png", "resource/container2_specular.png" });
+    unsigned int roomDiffuseMap = roomMaps[0];
+    unsigned int roomSpecularMap = roomMaps[1];
+    // frames rendered for a fixed timeline must not depend on how fast textures stream in
+    if (offlineFps > 0.0)
+        TextureStream::shared().finish();
+    bool streaming = TextureStream::shared().getPendingNum() > 0;
+    // the room's maps are copied into one texture array once they are on the GPU
+    TextureArray::Packer roomPacker;
+    unsigned int roomArray = streaming ? 0 : packRoomTextures(roomPacker, roomDiffuseMap, roomSpecularMap, roomLayerVBO);
+    // a tiled diffuse map replaces the room's own one; only the tiles in view are loaded
+    TiledTexture::Texture tiledTexture;
+    bool tiled = !tiledPath.empty() && tiledTexture.open(tiledPath, headless ? headlessWidth : SCR_WIDTH, headless ? headlessHeight : SCR_HEIGHT, tilePoolSide);
+
+    // camera and lights are shared by every program through uniform blocks
+    UniformRing::Ring uniformRing;
+    uniformRing.create({ sizeof(CameraBlock), sizeof(LightsBlock) });
     
-    // shader configuration
-    // --------------------
-    roomShader.use();
-    roomShader.setInt("material.diffuse", 0);
+
+    Offscreen::Target offscreenTarget;
+    if (headless && !offscreenTarget.create(headlessWidth, headlessHeight, headlessPattern))
+        requestClose(window);
+    float aspect = headless ? (float)headlessWidth / (float)headlessHeight : (float)SCR_WIDTH / (float)SCR_HEIGHT;
 
     // render loop
     // -----------
-    while (!glfwWindowShouldClose(window))
+    unsigned long long frameCount = 0;
+    if (offlineFps > 0.0)
+        setAppTime(0.0);
+    glm::vec3 pacedPosition = camera.Position;
+    float lastReport = static_cast<float>(appTime());
+    unsigned long long reportFrame = 0;
+    framePacer.start();
+    while (!closeRequested(window))
     {
         // per-frame time logic
         // --------------------
-        float currentFrame = static_cast<float>(glfwGetTime());
+        if (offlineFps > 0.0)
+            setAppTime(frameCount / offlineFps);
+        float currentFrame = static_cast<float>(appTime());
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
 
         // input
         // -----
-        processInput(window);
+        if (window)
+            processInput(window);
+
+        if (!cameraPath.empty())
+        {
+            glm::vec3 position, target;
+            cameraPath.sample(currentFrame, position, target);
+            camera.LookAt(position, target);
+        }
 
         // render
         // ------
+        if (headless)
+            offscreenTarget.bind();
         glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+        // textures arrive a budget of bytes per frame instead of stalling the frames that load them
+        if (streaming && TextureStream::shared().update() == 0)
+        {
+            streaming = false;
+            TextureStream::shared().report(std::cout);
+            roomArray = packRoomTextures(roomPacker, roomDiffuseMap, roomSpecularMap, roomLayerVBO);
+        }
+        // tiles asked for by the feedback of earlier frames, uploaded as they arrive from the loader threads
+        if (tiled)
+            tiledTexture.update();
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), aspect, 0.1f, 100.0f);
         glm::mat4 view = camera.GetViewMatrix();
 
 
-        // be sure to activate shader when setting uniforms/drawing objects
-        littleCubeShader.use();
-        littleCubeShader.setVec3("viewPos", camera.Position);
-        littleCubeShader.setVec3("material.diffuse", 1., 1., 1.);
-        littleCubeShader.setVec3("material.specular", 1., 1., 1.);
-        littleCubeShader.setFloat("material.shininess", 32.0f);
-        /*
-           Here we set all the uniforms for the 5/6 types of lights we have. We have to set them manually and index
-           the proper PointLight struct in the array to set each uniform variable. This can be done more code-friendly
-           by defining light types as classes and set their values in there, or by using a more efficient uniform approach
-           by using 'Uniform buffer objects', but that is something we'll discuss in the 'Advanced GLSL' tutorial.
-        */
-        setShaderLight(littleCubeShader, pointLightPositions);
-        
-        // view/projection transformations
-        littleCubeShader.setMat4("projection", projection);
-        littleCubeShader.setMat4("view", view);
+        // view/projection transformations and all lights, written once for every program
+        CameraBlock cameraBlock = { projection, view, camera.Position, 0.0f };
+        LightsBlock lightsBlock = {};
+        setLightsBlock(lightsBlock, pointLightPositions);
+        uniformRing.begin();
+        uniformRing.write(CAMERA_BLOCK, cameraBlock);
+        uniformRing.write(LIGHTS_BLOCK, lightsBlock);
+        uniformRing.commit();
+
+        // be sure to activate shader when setting uniforms/drawing objects;
+        // toggling a light switches to the permutation without it
+        if (compiling && littleCubeShader.poll() + roomShader.poll() == 0)
+        {
+            compiling = false;
+            std::cout << "Shader: all " << littleCubeShader.getPermutationNum() + roomShader.getPermutationNum() << " light permutations ready after "
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - startupStart).count() * 1000.0 << " ms" << std::endl;
+            ProgramCache::shared().report(std::cout);
+        }
+        unsigned int lights = littleCubeShader.use(lightFeatures());
+        littleCubeShader.setVec3(UNIFORM_MATERIAL_DIFFUSE, 1., 1., 1.);
+        if (lights)
+        {
+            // without any light only the dimmed diffuse color is left
+            littleCubeShader.setVec3(UNIFORM_MATERIAL_SPECULAR, 1., 1., 1.);
+            littleCubeShader.setFloat(UNIFORM_MATERIAL_SHININESS, 32.0f);
+        }
 
         // render containers
         glBindVertexArray(cubeVAO);
@@ -340,8 +656,6 @@ int main()
 
         // also draw the lamp object(s)
         lightCubeShader.use();
-        lightCubeShader.setMat4("projection", projection);
-        lightCubeShader.setMat4("view", view);
 
         // we now draw as many light bulbs as we have point lights.
         glBindVertexArray(lightCubeVAO);
@@ -352,8 +666,8 @@ int main()
                 glm::mat4 model = glm::mat4(1.0f);
                 model = glm::translate(model, pointLightPositions[i]);
                 model = glm::scale(model, glm::vec3(0.1f)); // Make it a smaller cube
-                lightCubeShader.setMat4("model", model);
-                lightCubeShader.setVec3("lightColor", lightColor[i]);
+                lightCubeShader.setMat4(UNIFORM_MODEL, model);
+                lightCubeShader.setVec3(UNIFORM_LIGHT_COLOR, lightColor[i]);
                 glDrawArrays(GL_TRIANGLES, 0, 36);
             }
         }
@@ -361,53 +675,183 @@ int main()
 
 
         // draw the room
-        roomShader.use();
-        roomShader.setVec3("viewPos", camera.Position);
-        roomShader.setFloat("material.shininess", 32.0f);
-
-        /*
-           Here we set all the uniforms for the 5/6 types of lights we have. We have to set them manually and index
-           the proper PointLight struct in the array to set each uniform variable. This can be done more code-friendly
-           by defining light types as classes and set their values in there, or by using a more efficient uniform approach
-           by using 'Uniform buffer objects', but that is something we'll discuss in the 'Advanced GLSL' tutorial.
-        */
-        setShaderLight(roomShader, pointLightPositions);
-
-        // view/projection transformations
-        roomShader.setMat4("projection", projection);
-        roomShader.setMat4("view", view);
-
-        // bind map
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, RoomTexture);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, RoomTexture);
-
-        roomShader.setMat4("model", glm::scale(glm::mat4(1.0f), glm::vec3(2 * ROOM_BOARDER)));
+        lights = roomShader.use(lightFeatures());
+        roomShader.setInt(UNIFORM_MATERIAL_DIFFUSE, 0);
+        roomShader.setInt(UNIFORM_MATERIAL_MAPS, 2);
+        // samplers of different types may not share a unit, so the tile samplers get theirs even when unused
+        roomShader.setInt(UNIFORM_TILE_POOL, 3);
+        roomShader.setInt(UNIFORM_TILE_PAGE_TABLE, 4);
+        roomShader.setBool(UNIFORM_TILED_DIFFUSE, tiled);
+        if (tiled)
+        {
+            setTileUniforms(roomShader, tiledTexture, 0.0f);
+            tiledTexture.bind(3, 4);
+        }
+        if (lights)
+        {
+            roomShader.setInt(UNIFORM_MATERIAL_SPECULAR, 1);
+            roomShader.setFloat(UNIFORM_MATERIAL_SHININESS, 32.0f);
+        }
+
+        // bind map: the texture array holding both maps once packed, else each map on its own unit
+        for (const TextureBinding& binding : roomBindings(roomArray, roomDiffuseMap, roomSpecularMap))
+        {
+            glActiveTexture(GL_TEXTURE0 + binding.unit);
+            glBindTexture(binding.target, binding.texture);
+        }
+
+        roomShader.setMat4(UNIFORM_MODEL, glm::scale(glm::mat4(1.0f), glm::vec3(2 * ROOM_BOARDER)));
 
         // render containers
         glBindVertexArray(roomCubeVAO);
         glDrawArrays(GL_TRIANGLES, 0, 30);
 
+        // the room again, at a fraction of the size, into the tile feedback target
+        if (tiled)
+        {
+            tiledTexture.beginFeedback();
+            tileFeedbackShader.use();
+            setTileUniforms(tileFeedbackShader, tiledTexture, tiledTexture.getFeedbackBias());
+            tileFeedbackShader.setMat4(UNIFORM_MODEL, glm::scale(glm::mat4(1.0f), glm::vec3(2 * ROOM_BOARDER)));
+            glDrawArrays(GL_TRIANGLES, 0, 30);
+            tiledTexture.endFeedback();
+        }
+
 
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        if (headless)
+            offscreenTarget.capture();
+        else
+            glfwSwapBuffers(window);
+        // the scene only changes while it rotates, changes shape, the camera moves or input arrives
+        bool changed = frameInput || is_rotating || should_shape != past_shape || camera.Position != pacedPosition;
+        pacedPosition = camera.Position;
+        frameInput = false;
+        framePacer.endFrame(changed);
+        if (window)
+            glfwPollEvents();
+
+        frameCount++;
+        if (currentFrame - lastReport > 5.0f)
+        {
+            framePacer.report(std::cout);
+            framePacer.resetStatistics();
+            std::cout << "Uniforms: " << (double)uniformCallCount() / (frameCount - reportFrame) << " glUniform calls per frame, "
+                << (double)skippedUniformCount() / (frameCount - reportFrame) << " redundant sets skipped per frame" << std::endl;
+            uniformRing.report(std::cout);
+            tiledTexture.report(std::cout);
+            tiledTexture.resetStatistics();
+            uniformCallCount() = 0;
+            skippedUniformCount() = 0;
+            uniformRing.resetStatistics();
+            reportFrame = frameCount;
+            lastReport = currentFrame;
+        }
+        if (frameCount == 1)
+        {
+            std::cout << "Startup: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - startupStart).count() * 1000.0
+                << " ms to the first frame, " << littleCubeShader.getPendingNum() + roomShader.getPendingNum() << " light permutations still compiling" << std::endl;
+            ProgramCache::shared().report(std::cout);
+            TextureCache::shared().report(std::cout);
+            TextureStream::shared().report(std::cout);
+        }
+        if (frameLimit > 0 && frameCount >= frameLimit)
+            requestClose(window);
+    }
+    if (headless)
+    {
+        offscreenTarget.finish();
+        offscreenTarget.report(std::cout);
+        offscreenTarget.destroy();
     }
+    uniformRing.destroy();
+    roomPacker.destroy();
+    tiledTexture.destroy();
+    TextureStream::shared().destroy();
 
     // optional: de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
     glDeleteVertexArrays(1, &cubeVAO);
     glDeleteVertexArrays(1, &lightCubeVAO);
+    glDeleteVertexArrays(1, &roomCubeVAO);
     glDeleteBuffers(1, &VBO);
+    glDeleteBuffers(1, &roomLayerVBO);
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
-    glfwTerminate();
+    headlessContext.destroy();
+    if (window)
+        glfwTerminate();
     return 0;
 }
 
+// glfw: initialize, configure and create the window, hidden for headless runs without EGL
+// -----------------------------------------------------------------------------------------
+GLFWwindow* createWindow(bool hidden)
+{
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+    if (hidden)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+    if (window == NULL)
+        return NULL;
+    glfwMakeContextCurrent(window);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetCursorPosCallback(window, mouse_callback);
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    glfwSetWindowFocusCallback(window, window_focus_callback);
+
+    // tell GLFW to capture our mouse
+    if (!hidden)
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    return window;
+}
+
+// clock of the app, in seconds since it started unless set otherwise
+// -------------------------------------------------------------------
+static std::chrono::steady_clock::time_point& timeOrigin()
+{
+    static std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    return origin;
+}
+
+double appTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - timeOrigin()).count();
+}
+
+void setAppTime(double time)
+{
+    timeOrigin() = std::chrono::steady_clock::now() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time));
+}
+
+// the close flag of the window, or of the headless run when there is none
+// -------------------------------------------------------------------------
+static bool headlessClose = false;
+
+void requestClose(GLFWwindow* window)
+{
+    if (window)
+        glfwSetWindowShouldClose(window, true);
+    else
+        headlessClose = true;
+}
+
+bool closeRequested(GLFWwindow* window)
+{
+    return window ? glfwWindowShouldClose(window) != 0 : headlessClose;
+}
+
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 // ---------------------------------------------------------------------------------------------------------
 void processInput(GLFWwindow* window)
@@ -432,6 +876,7 @@ void processInput(GLFWwindow* window)
 // ---------------------------------------------------------------------------------------------
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    frameInput = true;
     if (glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS)
         camera = init_camera;
     if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
@@ -463,9 +908,9 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     {
         is_rotating = !is_rotating;
         if (is_rotating)
-            rotatingtime = glfwGetTime();
+            rotatingtime = appTime();
         else
-            rotatingoffset = glfwGetTime() - rotatingtime + rotatingoffset;
+            rotatingoffset = appTime() - rotatingtime + rotatingoffset;
     }
 
 }
@@ -476,6 +921,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     // make sure the viewport matches the new window dimensions; note that width and 
     // height will be significantly larger than specified on retina displays.
     glViewport(0, 0, width, height);
+    frameInput = true;
 }
 
 
@@ -483,6 +929,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 // -------------------------------------------------------
 void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
 {
+    frameInput = true;
     float xpos = static_cast<float>(xposIn);
     float ypos = static_cast<float>(yposIn);
 
@@ -506,6 +953,7 @@ void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
 // ----------------------------------------------------------------------
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
+    frameInput = true;
     camera.ProcessMouseScroll(static_cast<float>(yoffset));
 }
 
@@ -523,103 +971,189 @@ void window_focus_callback(GLFWwindow* window, int focused)
 // ---------------------------------------------------
 unsigned int loadTexture(char const* path)
 {
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
+    return loadTextures({ path })[0];
+}
 
-    int width, height, nrComponents;
-    unsigned char* data = stbi_load(path, &width, &height, &nrComponents, 0);
-    if (data)
+// loads several textures at once, decoding them on worker threads; ids in the order of the paths
+// -----------------------------------------------------------------------------------------------
+std::vector<unsigned int> loadTextures(const std::vector<std::string>& paths)
+{
+    // an image is only decoded when the texture cache has no compressed copy of it;
+    // stb_image's buffer is expanded to RGBA and freed by the texture stream as it uploads
+    std::vector<unsigned int> textureIDs(paths.size(), 0);
+    TextureCache::Batch batch;
+    for (size_t i = 0; i < paths.size(); i++)
     {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
+        std::string path = paths[i];
+        batch.add(path, [path](TextureStream::Source& source)
+        {
+            unsigned char* data = stbi_load(path.c_str(), &source.width, &source.height, &source.channels, 0);
+            if (!data)
+                return false;
+            source.pixels = data;
+            source.pitch = (size_t)source.width * source.channels;
+            source.release = [data]() { stbi_image_free(data); };
+            return true;
+        }, [&textureIDs, i, path](GLuint textureID, int width, int height)
+        {
+            textureIDs[i] = textureID;
+            if (textureID)
+            {
+                glBindTexture(GL_TEXTURE_2D, textureID);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glBindTexture(GL_TEXTURE_2D, 0);
+            }
+            else
+                std::cout << "Texture failed to load at path: " << path << std::endl;
+        });
+    }
+    batch.run();
+    if (paths.size() > 1)
+        batch.report(std::cout);
+    return textureIDs;
+}
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+// the textures the room binds per frame: the array holding both maps once packed, else each map on its own unit
+// ----------------------------------------------------------------------------------------------------------------
+std::vector<TextureBinding> roomBindings(unsigned int roomArray, unsigned int diffuseMap, unsigned int specularMap)
+{
+    if (roomArray)
+        return { { 2, GL_TEXTURE_2D_ARRAY, roomArray } };
+    return { { 0, GL_TEXTURE_2D, diffuseMap }, { 1, GL_TEXTURE_2D, specularMap } };
+}
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// copies the room's maps into one texture array once they are uploaded, so that the room draws
+// with a single binding, and writes their layers into the room's layer attribute; 0 if they don't fit one array.
+// The maps are deleted once packed and their names set to 0, so that their texels are not held twice
+// ----------------------------------------------------------------------------------------------------------------
+unsigned int packRoomTextures(TextureArray::Packer& packer, unsigned int& diffuseMap, unsigned int& specularMap, unsigned int layerVBO)
+{
+    size_t unpackedBinds = roomBindings(0, diffuseMap, specularMap).size();
+    int diffuseSlot = packer.add(diffuseMap);
+    int specularSlot = packer.add(specularMap);
+    if (!packer.pack())
+        return 0;
+    if (packer.getArray(diffuseSlot) != packer.getArray(specularSlot))
+    {
+        packer.destroy();
+        return 0;
+    }
+    float layers[2] = { (float)packer.getLayer(diffuseSlot), (float)packer.getLayer(specularSlot) };
+    glBindBuffer(GL_ARRAY_BUFFER, layerVBO);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(layers), layers);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    unsigned int roomArray = packer.getArray(diffuseSlot);
+    packer.releaseSources();
+    diffuseMap = 0;
+    specularMap = 0;
+    packer.report(std::cout);
+    std::cout << "Room texture binds per frame: " << unpackedBinds << " unpacked, "
+              << roomBindings(roomArray, diffuseMap, specularMap).size() << " packed" << std::endl;
+    return roomArray;
+}
+// converts an image into a tiled texture file; binary PPM is read a row at a time, whatever its size,
+// other formats are decoded whole by stb_image first
+// ----------------------------------------------------------------------------------------------------
+bool buildTiles(const std::string& source, const std::string& path)
+{
+    std::string extension = source.size() > 4 ? source.substr(source.size() - 4) : "";
+    if (extension == ".ppm" || extension == ".PPM")
+        return TiledTexture::buildFromPPM(source, path, std::cout);
 
-        stbi_image_free(data);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int width, height, nrComponents;
+    unsigned char* data = stbi_load(source.c_str(), &width, &height, &nrComponents, 4);
+    if (!data)
+    {
+        std::cout << "Failed to load image " << source << std::endl;
+        return false;
     }
-    else
+    TiledTexture::Builder builder;
+    bool built = builder.begin(path, width, height);
+    unsigned int levelNum = builder.getLevelNum();
+    for (int y = 0; built && y < height; y++)
+        builder.addRow(data + (size_t)y * width * 4);
+    unsigned long long tileNum = builder.getTileNum();
+    built = built && builder.finish();
+    stbi_image_free(data);
+    if (!built)
     {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
+        std::cout << "Tiled texture: failed to write " << path << std::endl;
+        return false;
     }
-
-    return textureID;
+    std::cout << "Tiled texture: " << source << " (" << width << " x " << height << ") -> " << path << ", " << levelNum << " levels, "
+        << tileNum << " tiles in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    return true;
 }
-void setShaderLight(Shader& shader, glm::vec3 pointLightPositions[])
+// page table lookup parameters of a tiled texture, for the room and the feedback program
+void setTileUniforms(Shader& shader, const TiledTexture::Texture& texture, float lodBias)
+{
+    shader.setVec2(UNIFORM_TILE_IMAGE_SIZE, (float)texture.getWidth(), (float)texture.getHeight());
+    shader.setFloat(UNIFORM_TILE_SIZE, (float)texture.getTileSize());
+    shader.setFloat(UNIFORM_TILE_LEVEL_NUM, (float)texture.getLevelNum());
+    shader.setFloat(UNIFORM_TILE_LOD_BIAS, lodBias);
+}
+// feature bitmask of the lights that are on, see LIGHT_FEATURES
+unsigned int lightFeatures()
+{
+    unsigned int pointNum = 0;
+    for (int i = 0; i < lightnum; i++)
+        if (available_pointLight[i])
+            pointNum++;
+    return (available_dirLight ? 1u : 0u) | (available_spotLight ? 2u : 0u) | (pointNum << 2);
+}
+// light parameters for the Lights block; the permutations only read the lights that are on
+void setLightsBlock(LightsBlock& block, glm::vec3 pointLightPositions[])
 {
     // directional light
-    shader.setVec3("dirLight.direction", -0.2f, -1.0f, -0.3f);
-    shader.setVec3("dirLight.ambient", 0.05f, 0.05f, 0.05f);
-    shader.setVec3("dirLight.diffuse", 0.4f, 0.4f, 0.4f);
-    shader.setVec3("dirLight.specular", 0.5f, 0.5f, 0.5f);
-
-    shader.setBool("available_pointLight[0]", available_pointLight[0]);
-    shader.setBool("available_pointLight[1]", available_pointLight[1]);
-    shader.setBool("available_pointLight[2]", available_pointLight[2]);
-    shader.setBool("available_pointLight[3]", available_pointLight[3]);
-    shader.setBool("available_dirLight", available_dirLight);
-    shader.setBool("available_spotLight", available_spotLight);
-
-    std::string names[7] = {
-        "pointLights[0].position",
-        "pointLights[0].ambient",
-        "pointLights[0].diffuse",
-        "pointLights[0].specular",
-        "pointLights[0].constant",
-        "pointLights[0].linear",
-        "pointLights[0].quadratic"
-    };
+    block.dirLight.direction = glm::vec3(-0.2f, -1.0f, -0.3f);
+    block.dirLight.ambient = glm::vec3(0.05f, 0.05f, 0.05f);
+    block.dirLight.diffuse = glm::vec3(0.4f, 0.4f, 0.4f);
+    block.dirLight.specular = glm::vec3(0.5f, 0.5f, 0.5f);
+
+    // the enabled point lights are packed into the first slots
+    int slot = 0;
     for (int i = 0; i < lightnum; i++)
     {
+        if (!available_pointLight[i])
+            continue;
         // point light i
-        shader.setVec3(names[0], pointLightPositions[i]);
-        shader.setVec3(names[1], 0.05f * lightColor[i]);
-        shader.setVec3(names[2], 0.8f * lightColor[i]);
-        shader.setVec3(names[3], 1.0f * lightColor[i]);
-        shader.setFloat(names[4], 1.0f);
-        shader.setFloat(names[5], 0.09f);
-        shader.setFloat(names[6], 0.032f);
-        for (int j = 0; j < 7; j++)
-        {
-            names[j][12]++;
-        }
+        PointLightBlock& light = block.pointLights[slot++];
+        light.position = pointLightPositions[i];
+        light.ambient = 0.05f * lightColor[i];
+        light.diffuse = 0.8f * lightColor[i];
+        light.specular = 1.0f * lightColor[i];
+        light.constant = 1.0f;
+        light.linear = 0.09f;
+        light.quadratic = 0.032f;
     }
     // spotLight
-    shader.setVec3("spotLight.position", camera.Position);
-    shader.setVec3("spotLight.direction", camera.Front);
-    shader.setVec3("spotLight.ambient", 0.0f, 0.0f, 0.0f);
-    shader.setVec3("spotLight.diffuse", 1.0f, 1.0f, 1.0f);
-    shader.setVec3("spotLight.specular", 1.0f, 1.0f, 1.0f);
-    shader.setFloat("spotLight.constant", 1.0f);
-    shader.setFloat("spotLight.linear", 0.09f);
-    shader.setFloat("spotLight.quadratic", 0.032f);
-    shader.setFloat("spotLight.cutOff", glm::cos(glm::radians(12.5f)));
-    shader.setFloat("spotLight.outerCutOff", glm::cos(glm::radians(15.0f)));
-
+    block.spotLight.position = camera.Position;
+    block.spotLight.direction = camera.Front;
+    block.spotLight.ambient = glm::vec3(0.0f, 0.0f, 0.0f);
+    block.spotLight.diffuse = glm::vec3(1.0f, 1.0f, 1.0f);
+    block.spotLight.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+    block.spotLight.constant = 1.0f;
+    block.spotLight.linear = 0.09f;
+    block.spotLight.quadratic = 0.032f;
+    block.spotLight.cutOff = glm::cos(glm::radians(12.5f));
+    block.spotLight.outerCutOff = glm::cos(glm::radians(15.0f));
 }
 
 float getRotateDegree()
 {
     if (is_rotating)
-        return glfwGetTime() - rotatingtime + rotatingoffset;
+        return appTime() - rotatingtime + rotatingoffset;
     else
         return rotatingoffset;
 }
 
-void draw_Cube(Shader shader, int length)
+void draw_Cube(const Shader& shader, int length)
 {
+    UniformHandle<glm::mat4> modelUniform = shader.uniform<glm::mat4>(UNIFORM_MODEL);
     // calculate the model matrix for each object and pass it to shader before drawing
     for (int i = 0; i < 8; i++)
     {
@@ -630,7 +1164,7 @@ void draw_Cube(Shader shader, int length)
         //float angle = 20.0f * (i % 10);
         //model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
         model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-        shader.setMat4("model", model);
+        modelUniform.set(model);
 
         glDrawArrays(GL_TRIANGLES, 0, 36);
     }
@@ -645,7 +1179,7 @@ void draw_Cube(Shader shader, int length)
         model = glm::rotate(model, getRotateDegree(), glm::vec3(0.5f, 1.0f, 0.0f));
         model = glm::translate(model, place);
         model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-        shader.setMat4("model", model);
+        modelUniform.set(model);
         glDrawArrays(GL_TRIANGLES, 0, 36);
 
         model = glm::mat4(1.0f);
@@ -653,7 +1187,7 @@ void draw_Cube(Shader shader, int length)
         model = glm::rotate(model, getRotateDegree(), glm::vec3(0.5f, 1.0f, 0.0f));
         model = glm::translate(model, place);
         model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-        shader.setMat4("model", model);
+        modelUniform.set(model);
         glDrawArrays(GL_TRIANGLES, 0, 36);
 
         model = glm::mat4(1.0f);
@@ -661,7 +1195,7 @@ void draw_Cube(Shader shader, int length)
         model = glm::rotate(model, getRotateDegree(), glm::vec3(0.5f, 1.0f, 0.0f));
         model = glm::translate(model, place);
         model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-        shader.setMat4("model", model);
+        modelUniform.set(model);
         glDrawArrays(GL_TRIANGLES, 0, 36);
         }
     }
@@ -682,7 +1216,7 @@ void draw_Cube(Shader shader, int length)
                 model = glm::rotate(model, getRotateDegree(), glm::vec3(0.5f, 1.0f, 0.0f));
                 model = glm::translate(model, place);
                 model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-                shader.setMat4("model", model);
+                modelUniform.set(model);
                 glDrawArrays(GL_TRIANGLES, 0, 36);
 
                 model = glm::mat4(1.0f);
@@ -694,7 +1228,7 @@ void draw_Cube(Shader shader, int length)
                 model = glm::rotate(model, getRotateDegree(), glm::vec3(0.5f, 1.0f, 0.0f));
                 model = glm::translate(model, place);
                 model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-                shader.setMat4("model", model);
+                modelUniform.set(model);
                 glDrawArrays(GL_TRIANGLES, 0, 36);
 
                 model = glm::mat4(1.0f);
@@ -706,14 +1240,14 @@ void draw_Cube(Shader shader, int length)
                 model = glm::rotate(model, getRotateDegree(), glm::vec3(0.5f, 1.0f, 0.0f));
                 model = glm::translate(model, place);
                 model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-                shader.setMat4("model", model);
+                modelUniform.set(model);
                 glDrawArrays(GL_TRIANGLES, 0, 36);
             }
         }
     }
 
 }
-void draw_Cube_with_inner(Shader shader, int length)
+void draw_Cube_with_inner(const Shader& shader, int length)
 {
     for (unsigned int i = 1; i <= length; i++)
     {
@@ -784,8 +1318,9 @@ void generate_ball_particles()
         ball_thph[i] = glm::vec2(glm::radians(360.f) * floatrand(), glm::radians(180.f) * floatrand());
     }
 }
-void draw_Ball(Shader shader, int radius)
+void draw_Ball(const Shader& shader, int radius)
 {
+    UniformHandle<glm::mat4> modelUniform = shader.uniform<glm::mat4>(UNIFORM_MODEL);
     int startnum = PARTICLE_IN_RADIUS(radius - 1);//actual-1
     int finalnum = PARTICLE_IN_RADIUS(radius);
     for (int i = startnum; i < finalnum; i++)
@@ -802,11 +1337,11 @@ void draw_Ball(Shader shader, int radius)
         model = glm::rotate(model, ball_thph[i].x, glm::vec3(0.0f, 1.0f, 0.0f));
         model = glm::rotate(model, ball_thph[i].y, glm::vec3(1.0f, 0.0f, 0.0f));
         model = glm::scale(model, glm::vec3(CUBE_SCALE)); // Make it a smaller cube
-        shader.setMat4("model", model);
+        modelUniform.set(model);
         glDrawArrays(GL_TRIANGLES, 0, 36);
     }
 }
-void draw_Ball_with_inner(Shader shader, int radius)
+void draw_Ball_with_inner(const Shader& shader, int radius)
 {
     for (unsigned int i = 1; i <= radius; i++)
     {
@@ -4,61 +4,40 @@ out vec4 FragColor;
 struct Material {
     sampler2D diffuse;
     sampler2D specular;
+    // both maps as layers of one texture array, once packed
+    sampler2DArray maps;
     float shininess;
 }; 
 
-struct DirLight {
-    vec3 direction;
-	
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
+#include "lights.glsl"
+#include "camera.glsl"
+#include "tiled.glsl"
 
-struct PointLight {
-    vec3 position;
-    
-    float constant;
-    float linear;
-    float quadratic;
-	
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
-struct SpotLight {
-    vec3 position;
-    vec3 direction;
-    float cutOff;
-    float outerCutOff;
-  
-    float constant;
-    float linear;
-    float quadratic;
-  
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;       
-};
-
-#define NR_POINT_LIGHTS 4
+// light permutation, defined by the application after #version:
+// the enabled point lights are packed into pointLights[0 .. POINT_LIGHT_NUM - 1]
+#ifndef DIR_LIGHT
+#define DIR_LIGHT 1
+#endif
+#ifndef SPOT_LIGHT
+#define SPOT_LIGHT 0
+#endif
+#ifndef POINT_LIGHT_NUM
+#define POINT_LIGHT_NUM NR_POINT_LIGHTS
+#endif
 
 in vec3 FragPos;
 in vec3 Normal;
 in vec2 TexCoords;
+// array layers of the diffuse and specular maps, negative while they are not packed
+flat in vec2 Layers;
 
-uniform vec3 viewPos;
-uniform DirLight dirLight;
-uniform PointLight pointLights[NR_POINT_LIGHTS];
-uniform SpotLight spotLight;
 uniform Material material;
-
-uniform bool available_pointlight[NR_POINT_LIGHTS];
-uniform bool available_dirLight;
-uniform bool available_spotLight;
+// the diffuse map is a tiled texture streamed in as the feedback pass asks for its tiles
+uniform bool tiledDiffuse;
 
 // function prototypes
+vec3 DiffuseTexel();
+vec3 SpecularTexel();
 vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir);
 vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir);
 vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir);
@@ -77,28 +56,34 @@ void main()
     // this fragment's final color.
     // == =====================================================
     // phase 1: directional lighting
-    int available_light_num = 0;
-    if(available_dirLight)
-        result += CalcDirLight(dirLight, norm, viewDir);
+#if DIR_LIGHT
+    result += CalcDirLight(dirLight, norm, viewDir);
+#endif
     // phase 2: point lights
-    for(int i = 0; i < NR_POINT_LIGHTS; i++)
-        if(available_pointlight[i])
-        {
-            available_light_num++;
-            result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);    
-        }
+    for(int i = 0; i < POINT_LIGHT_NUM; i++)
+        result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);    
     // phase 3: spot light
-    if(available_spotLight)
-        result += CalcSpotLight(spotLight, norm, FragPos, viewDir);    
-    if( (!available_dirLight)
-        &&(available_light_num==0)
-        &&(!available_spotLight)
-        &&(result==vec3(0.0, 0.0, 0.0))
-        )
-        result=0.05*vec3(texture(material.diffuse, TexCoords));
+#if SPOT_LIGHT
+    result += CalcSpotLight(spotLight, norm, FragPos, viewDir);    
+#endif
+#if !DIR_LIGHT && POINT_LIGHT_NUM == 0 && !SPOT_LIGHT
+    result=0.05*DiffuseTexel();
+#endif
     FragColor = vec4(result, 1.0);
 }
 
+vec3 DiffuseTexel()
+{
+    if (tiledDiffuse)
+        return TiledTexel(TexCoords);
+    return Layers.x < 0.0 ? texture(material.diffuse, TexCoords).rgb : texture(material.maps, vec3(TexCoords, Layers.x)).rgb;
+}
+
+vec3 SpecularTexel()
+{
+    return Layers.y < 0.0 ? texture(material.specular, TexCoords).rgb : texture(material.maps, vec3(TexCoords, Layers.y)).rgb;
+}
+
 // calculates the color when using a directional light.
 vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir)
 {
@@ -109,9 +94,9 @@ vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir)
     vec3 reflectDir = reflect(-lightDir, normal);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
     // combine results
-    vec3 ambient = light.ambient * vec3(texture(material.diffuse, TexCoords));
-    vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, TexCoords));
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, TexCoords));
+    vec3 ambient = light.ambient * DiffuseTexel();
+    vec3 diffuse = light.diffuse * diff * DiffuseTexel();
+    vec3 specular = light.specular * spec * SpecularTexel();
     return (ambient + diffuse + specular);
 }
 
@@ -128,9 +113,9 @@ vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
     float distance = length(light.position - fragPos);
     float attenuation = 1.0 / (light.constant + light.linear * distance + light.quadratic * (distance * distance));    
     // combine results
-    vec3 ambient = light.ambient * vec3(texture(material.diffuse, TexCoords));
-    vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, TexCoords));
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, TexCoords));
+    vec3 ambient = light.ambient * DiffuseTexel();
+    vec3 diffuse = light.diffuse * diff * DiffuseTexel();
+    vec3 specular = light.specular * spec * SpecularTexel();
     ambient *= attenuation;
     diffuse *= attenuation;
     specular *= attenuation;
@@ -154,9 +139,9 @@ vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
     float epsilon = light.cutOff - light.outerCutOff;
     float intensity = clamp((theta - light.outerCutOff) / epsilon, 0.0, 1.0);
     // combine results
-    vec3 ambient = light.ambient * vec3(texture(material.diffuse, TexCoords));
-    vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, TexCoords));
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, TexCoords));
+    vec3 ambient = light.ambient * DiffuseTexel();
+    vec3 diffuse = light.diffuse * diff * DiffuseTexel();
+    vec3 specular = light.specular * spec * SpecularTexel();
     ambient *= attenuation * intensity;
     diffuse *= attenuation * intensity;
     specular *= attenuation * intensity;
@@ -2,20 +2,23 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
+layout (location = 3) in vec2 aLayers;
 
 out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
+flat out vec2 Layers;
+
+#include "camera.glsl"
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 
 void main()
 {
     FragPos = vec3(model * vec4(aPos, 1.0));
     Normal = aNormal;  
     TexCoords = aTexCoords;
+    Layers = aLayers;
     
     gl_Position = projection * view * vec4(FragPos, 1.0);
 }
\ No newline at end of file
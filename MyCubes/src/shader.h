@@ -8,19 +8,427 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <chrono>
+#include <cstring>
+
+#include "program_cache.h"
+#include "shader_feature.h"
+
+// 32-bit FNV-1a; constexpr, so a constexpr UniformName is hashed at compile time
+// ------------------------------------------------------------------------
+constexpr unsigned int uniformHash(const char* name)
+{
+    unsigned int hash = 2166136261u;
+    while (*name)
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+// a uniform name with its hash; constexpr UniformName MODEL("model") hashes at compile time,
+// a plain literal argument is hashed on every call
+struct UniformName
+{
+    const char* str;
+    unsigned int hash;
+    constexpr UniformName(const char* name) : str(name), hash(uniformHash(name)) {}
+    UniformName(const std::string& name) : str(name.c_str()), hash(uniformHash(name.c_str())) {}
+};
+
+// glUniform* calls made through Shader and UniformHandle, for the per-frame statistics
+inline unsigned long long& uniformCallCount()
+{
+    static unsigned long long count = 0;
+    return count;
+}
+
+// sets skipped because the uniform already held the value, for the per-frame statistics
+inline unsigned long long& skippedUniformCount()
+{
+    static unsigned long long count = 0;
+    return count;
+}
+
+// glUniform* by value type, for the program in use
+inline void uploadUniform(GLint location, bool value) { uniformCallCount()++; glUniform1i(location, (int)value); }
+inline void uploadUniform(GLint location, int value) { uniformCallCount()++; glUniform1i(location, value); }
+inline void uploadUniform(GLint location, float value) { uniformCallCount()++; glUniform1f(location, value); }
+inline void uploadUniform(GLint location, const glm::vec2& value) { uniformCallCount()++; glUniform2fv(location, 1, &value[0]); }
+inline void uploadUniform(GLint location, const glm::vec3& value) { uniformCallCount()++; glUniform3fv(location, 1, &value[0]); }
+inline void uploadUniform(GLint location, const glm::vec4& value) { uniformCallCount()++; glUniform4fv(location, 1, &value[0]); }
+inline void uploadUniform(GLint location, const glm::mat2& mat) { uniformCallCount()++; glUniformMatrix2fv(location, 1, GL_FALSE, &mat[0][0]); }
+inline void uploadUniform(GLint location, const glm::mat3& mat) { uniformCallCount()++; glUniformMatrix3fv(location, 1, GL_FALSE, &mat[0][0]); }
+inline void uploadUniform(GLint location, const glm::mat4& mat) { uniformCallCount()++; glUniformMatrix4fv(location, 1, GL_FALSE, &mat[0][0]); }
+
+// GL types a value type may be uploaded to
+inline bool uniformTypeMatches(GLenum type, bool*) { return type == GL_BOOL || type == GL_INT; }
+inline bool uniformTypeMatches(GLenum type, int*) { return type == GL_INT || type == GL_BOOL || type == GL_SAMPLER_2D || type == GL_SAMPLER_3D || type == GL_SAMPLER_CUBE || type == GL_SAMPLER_2D_ARRAY; }
+inline bool uniformTypeMatches(GLenum type, float*) { return type == GL_FLOAT; }
+inline bool uniformTypeMatches(GLenum type, glm::vec2*) { return type == GL_FLOAT_VEC2; }
+inline bool uniformTypeMatches(GLenum type, glm::vec3*) { return type == GL_FLOAT_VEC3; }
+inline bool uniformTypeMatches(GLenum type, glm::vec4*) { return type == GL_FLOAT_VEC4; }
+inline bool uniformTypeMatches(GLenum type, glm::mat2*) { return type == GL_FLOAT_MAT2; }
+inline bool uniformTypeMatches(GLenum type, glm::mat3*) { return type == GL_FLOAT_MAT3; }
+inline bool uniformTypeMatches(GLenum type, glm::mat4*) { return type == GL_FLOAT_MAT4; }
+
+// CPU copy of the value a uniform last received; uniforms keep their values in the program,
+// so setting an unchanged value again needs no GL call
+struct UniformShadow
+{
+    unsigned char bytes[sizeof(glm::mat4)];
+    bool valid;
+    UniformShadow() : valid(false) {}
+    // true if the value differs from the shadow, which then holds it
+    template <typename T>
+    bool update(const T& value)
+    {
+        static_assert(sizeof(T) <= sizeof(bytes), "uniform value larger than its shadow");
+        if (valid && memcmp(bytes, &value, sizeof(T)) == 0)
+        {
+            skippedUniformCount()++;
+            return false;
+        }
+        memcpy(bytes, &value, sizeof(T));
+        valid = true;
+        return true;
+    }
+};
+
+// a uniform location resolved once; set() uploads with no lookup, to the program in use
+template <typename T>
+struct UniformHandle
+{
+    GLint location;
+    UniformShadow* shadow;
+    UniformHandle(GLint location = -1, UniformShadow* shadow = nullptr) : location(location), shadow(shadow) {}
+    bool valid() const { return location >= 0; }
+    void set(const T& value) const
+    {
+        if (location >= 0 && (!shadow || shadow->update(value)))
+            uploadUniform(location, value);
+    }
+};
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// whether the driver compiles in the background and answers GL_COMPLETION_STATUS_KHR without blocking
+inline bool& parallelShaderCompile()
+{
+    static bool supported = false;
+    return supported;
+}
+
+// turn on GL_KHR_parallel_shader_compile (or its ARB twin) if the driver has it;
+// call once after loading GL, with the same loader
+inline bool enableParallelShaderCompile(GLADloadproc load)
+{
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count && !parallelShaderCompile(); i++)
+    {
+        const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        parallelShaderCompile() = name && (strcmp(name, "GL_KHR_parallel_shader_compile") == 0 || strcmp(name, "GL_ARB_parallel_shader_compile") == 0);
+    }
+    if (!parallelShaderCompile())
+        return false;
+    typedef void (APIENTRYP MaxShaderCompilerThreadsProc)(GLuint count);
+    MaxShaderCompilerThreadsProc maxThreads = (MaxShaderCompilerThreadsProc)load("glMaxShaderCompilerThreadsKHR");
+    if (!maxThreads)
+        maxThreads = (MaxShaderCompilerThreadsProc)load("glMaxShaderCompilerThreadsARB");
+    // as many compiler threads as the driver wants
+    if (maxThreads)
+        maxThreads(0xFFFFFFFFu);
+    return true;
+}
+
 
 class Shader
 {
 public:
+    // program of the permutation in use
     unsigned int ID;
     // constructor generates the shader on the fly
     // ------------------------------------------------------------------------
     Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr)
     {
+        load(vertexPath, fragmentPath, geometryPath);
+    }
+    // a shader family specialized by feature bitmask (see shader_feature.h); each permutation
+    // is compiled on first use or prepare(), none before
+    // ------------------------------------------------------------------------
+    Shader(const char* vertexPath, const char* fragmentPath, const std::vector<ShaderFeature>& features, const char* geometryPath = nullptr)
+        : features(features)
+    {
+        load(vertexPath, fragmentPath, geometryPath);
+    }
+    // permutations own their uniform tables, which a copy would have to duplicate
+    Shader(const Shader&) = delete;
+    Shader& operator=(const Shader&) = delete;
+    // activate the shader
+    // ------------------------------------------------------------------------
+    void use()
+    {
+        use(current ? current->features : 0u);
+    }
+    // activate the permutation for a feature bitmask, compiling it if this is its first use.
+    // While it is still compiling in the background the last linked permutation stays in use,
+    // or the flat-shaded fallback if none is linked yet (with features 0, so no uniforms beyond
+    // those of the plain vertex shader are worth setting); returns the features of the permutation in use.
+    // Uniform handles belong to the permutation that was in use when they were resolved.
+    // ------------------------------------------------------------------------
+    unsigned int use(unsigned int featureMask)
+    {
+        select(featureMask);
+        glUseProgram(ID);
+        return current->features;
+    }
+    // start compiling a permutation without waiting for it
+    // ------------------------------------------------------------------------
+    void prepare(unsigned int featureMask)
+    {
+        queue(featureMask);
+    }
+    // take over the permutations the driver has finished linking; returns how many are still compiling
+    // ------------------------------------------------------------------------
+    unsigned int poll()
+    {
+        unsigned int pendingNum = 0;
+        for (std::unordered_map<unsigned int, Permutation>::iterator it = permutations.begin(); it != permutations.end(); ++it)
+            if (!finish(it->second, false))
+                pendingNum++;
+        return pendingNum;
+    }
+    // block until every permutation asked for so far is linked
+    // ------------------------------------------------------------------------
+    void wait()
+    {
+        for (std::unordered_map<unsigned int, Permutation>::iterator it = permutations.begin(); it != permutations.end(); ++it)
+            finish(it->second, true);
+    }
+    unsigned int getPermutationNum() const
+    {
+        return (unsigned int)permutations.size();
+    }
+    unsigned int getPendingNum() const
+    {
+        unsigned int pendingNum = 0;
+        for (std::unordered_map<unsigned int, Permutation>::const_iterator it = permutations.begin(); it != permutations.end(); ++it)
+            if (!it->second.ready)
+                pendingNum++;
+        return pendingNum;
+    }
+    // attach a uniform block to a binding point, in every permutation compiled now or later
+    // ------------------------------------------------------------------------
+    void bindBlock(const std::string& name, unsigned int binding)
+    {
+        blockBindings.push_back(std::make_pair(name, binding));
+        if (fallback.ready)
+            bindBlock(fallback.ID, name, binding);
+        for (std::unordered_map<unsigned int, Permutation>::iterator it = permutations.begin(); it != permutations.end(); ++it)
+            if (it->second.ready)
+                bindBlock(it->second.ID, name, binding);
+    }
+    // location of an active uniform, -1 (reported once) for names the program does not use
+    // ------------------------------------------------------------------------
+    GLint getLocation(UniformName name) const
+    {
+        Uniform* uniform = findUniform(name);
+        return uniform ? uniform->location : -1;
+    }
+    // resolve a uniform once, then set it through the handle with no lookup
+    // ------------------------------------------------------------------------
+    template <typename T>
+    UniformHandle<T> uniform(UniformName name) const
+    {
+        Uniform* uniform = findUniform(name);
+        if (!uniform)
+            return UniformHandle<T>();
+        if (!uniformTypeMatches(uniform->type, (T*)nullptr))
+        {
+            if (current->reported.insert(name.hash).second)
+                std::cout << "WARNING::SHADER::UNIFORM_TYPE_MISMATCH: " << name.str << " of program " << ID << " has GL type 0x" << std::hex << uniform->type << std::dec << std::endl;
+            return UniformHandle<T>();
+        }
+        return UniformHandle<T>(uniform->location, uniform->shadow);
+    }
+    // utility uniform functions
+    // ------------------------------------------------------------------------
+    void setBool(UniformName name, bool value) const
+    {
+        upload(name, value);
+    }
+    // ------------------------------------------------------------------------
+    void setInt(UniformName name, int value) const
+    {
+        upload(name, value);
+    }
+    // ------------------------------------------------------------------------
+    void setFloat(UniformName name, float value) const
+    {
+        upload(name, value);
+    }
+    // ------------------------------------------------------------------------
+    void setVec2(UniformName name, const glm::vec2& value) const
+    {
+        upload(name, value);
+    }
+    void setVec2(UniformName name, float x, float y) const
+    {
+        upload(name, glm::vec2(x, y));
+    }
+    // ------------------------------------------------------------------------
+    void setVec3(UniformName name, const glm::vec3& value) const
+    {
+        upload(name, value);
+    }
+    void setVec3(UniformName name, float x, float y, float z) const
+    {
+        upload(name, glm::vec3(x, y, z));
+    }
+    // ------------------------------------------------------------------------
+    void setVec4(UniformName name, const glm::vec4& value) const
+    {
+        upload(name, value);
+    }
+    void setVec4(UniformName name, float x, float y, float z, float w)
+    {
+        upload(name, glm::vec4(x, y, z, w));
+    }
+    // ------------------------------------------------------------------------
+    void setMat2(UniformName name, const glm::mat2& mat) const
+    {
+        upload(name, mat);
+    }
+    // ------------------------------------------------------------------------
+    void setMat3(UniformName name, const glm::mat3& mat) const
+    {
+        upload(name, mat);
+    }
+    // ------------------------------------------------------------------------
+    void setMat4(UniformName name, const glm::mat4& mat) const
+    {
+        upload(name, mat);
+    }
+
+private:
+    struct Uniform
+    {
+        // compared on a hash hit, as two names may share a 32-bit hash
+        std::string name;
+        GLint location;
+        GLenum type;
+        // shared by the names of one location ("lights" and "lights[0]")
+        UniformShadow* shadow;
+    };
+    struct Permutation
+    {
+        unsigned int features;
+        unsigned int ID;
+        // linked and reflected; until then the program may still be compiling
+        bool ready;
+        // shader objects kept until the link is done, for their logs; 0 for a program loaded from a binary
+        unsigned int stages[3];
+        std::chrono::steady_clock::time_point start;
+        // active uniforms by name hash, filled once after linking
+        std::unordered_multimap<unsigned int, Uniform> uniforms;
+        // hashes of unknown names already reported
+        std::unordered_set<unsigned int> reported;
+        // last uploaded values by location
+        std::unordered_map<GLint, UniformShadow> shadows;
+    };
+    std::vector<ShaderFeature> features;
+    std::string vertexCode;
+    std::string fragmentCode;
+    std::string geometryCode;
+    bool hasGeometry;
+    // compiled permutations by feature bitmask; elements keep their address as the map grows
+    std::unordered_map<unsigned int, Permutation> permutations;
+    // drawn with until the first permutation of a family is linked: its vertex shader without features
+    // and a flat fragment shader, linked in the constructor as it takes a fraction of a permutation
+    Permutation fallback;
+    Permutation* current;
+    // active uniform of the current permutation, nullptr (reported once) for names the program does not use
+    // ------------------------------------------------------------------------
+    Uniform* findUniform(UniformName name) const
+    {
+        if (!current)
+            return nullptr;
+        typedef std::unordered_multimap<unsigned int, Uniform>::iterator Iterator;
+        std::pair<Iterator, Iterator> range = current->uniforms.equal_range(name.hash);
+        for (Iterator it = range.first; it != range.second; ++it)
+            if (it->second.name == name.str)
+                return &it->second;
+        // the fallback lacks the uniforms of the fragment shaders it stands in for
+        if (current->reported.insert(name.hash).second && current != &fallback)
+            std::cout << "WARNING::SHADER::UNKNOWN_UNIFORM: " << name.str << " is not an active uniform of program " << ID << std::endl;
+        return nullptr;
+    }
+    // upload a value unless the uniform already holds it
+    // ------------------------------------------------------------------------
+    template <typename T>
+    void upload(UniformName name, const T& value) const
+    {
+        Uniform* uniform = findUniform(name);
+        if (uniform && uniform->shadow->update(value))
+            uploadUniform(uniform->location, value);
+    }
+    // uniform block name and binding point pairs
+    std::vector<std::pair<std::string, unsigned int> > blockBindings;
+
+    static void bindBlock(unsigned int program, const std::string& name, unsigned int binding)
+    {
+        GLuint index = glGetUniformBlockIndex(program, name.c_str());
+        // blocks a permutation does not use are optimized out
+        if (index != GL_INVALID_INDEX)
+            glUniformBlockBinding(program, index, binding);
+    }
+    // GLSL has no #include; a line #include "file" is replaced by that file, read from the directory of the including file
+    // ------------------------------------------------------------------------
+    static std::string resolveIncludes(const std::string& code, const std::string& path, int depth = 0)
+    {
+        size_t slash = path.find_last_of("/\\");
+        std::string directory = slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+        std::istringstream lines(code);
+        std::string line, result;
+        while (std::getline(lines, line))
+        {
+            size_t first = line.find_first_not_of(" \t");
+            size_t open = line.find('"');
+            size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+            if (first == std::string::npos || line.compare(first, 8, "#include") != 0 || close == std::string::npos || depth > 8)
+            {
+                result += line + "\n";
+                continue;
+            }
+            std::string includePath = directory + line.substr(open + 1, close - open - 1);
+            std::ifstream file(includePath);
+            if (!file.is_open())
+            {
+                std::cout << "ERROR::SHADER::INCLUDE_NOT_FOUND: " << includePath << std::endl;
+                continue;
+            }
+            std::stringstream included;
+            included << file.rdbuf();
+            result += resolveIncludes(included.str(), includePath, depth + 1);
+            if (!result.empty() && result.back() != '\n')
+                result += "\n";
+        }
+        return result;
+    }
+
+    // read the sources; a plain shader is built right away
+    // ------------------------------------------------------------------------
+    void load(const char* vertexPath, const char* fragmentPath, const char* geometryPath)
+    {
+        ID = 0;
+        current = nullptr;
+        fallback.ready = false;
+        hasGeometry = geometryPath != nullptr;
         // 1. retrieve the vertex/fragment source code from filePath
-        std::string vertexCode;
-        std::string fragmentCode;
-        std::string geometryCode;
         std::ifstream vShaderFile;
         std::ifstream fShaderFile;
         std::ifstream gShaderFile;
@@ -57,111 +465,203 @@ public:
         {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ: " << e.what() << std::endl;
         }
-        const char* vShaderCode = vertexCode.c_str();
-        const char* fShaderCode = fragmentCode.c_str();
-        // 2. compile shaders
-        unsigned int vertex, fragment;
-        // vertex shader
-        vertex = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertex, 1, &vShaderCode, NULL);
-        glCompileShader(vertex);
-        checkCompileErrors(vertex, "VERTEX");
-        // fragment Shader
-        fragment = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragment, 1, &fShaderCode, NULL);
-        glCompileShader(fragment);
-        checkCompileErrors(fragment, "FRAGMENT");
-        // if geometry shader is given, compile geometry shader
-        unsigned int geometry;
-        if (geometryPath != nullptr)
-        {
-            const char* gShaderCode = geometryCode.c_str();
-            geometry = glCreateShader(GL_GEOMETRY_SHADER);
-            glShaderSource(geometry, 1, &gShaderCode, NULL);
-            glCompileShader(geometry);
-            checkCompileErrors(geometry, "GEOMETRY");
-        }
-        // shader Program
-        ID = glCreateProgram();
-        glAttachShader(ID, vertex);
-        glAttachShader(ID, fragment);
-        if (geometryPath != nullptr)
-            glAttachShader(ID, geometry);
-        glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
-        // delete the shaders as they're linked into our program now and no longer necessery
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
-        if (geometryPath != nullptr)
-            glDeleteShader(geometry);
-
-    }
-    // activate the shader
-    // ------------------------------------------------------------------------
-    void use()
-    {
-        glUseProgram(ID);
-    }
-    // utility uniform functions
-    // ------------------------------------------------------------------------
-    void setBool(const std::string& name, bool value) const
-    {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+        vertexCode = resolveIncludes(vertexCode, vertexPath);
+        fragmentCode = resolveIncludes(fragmentCode, fragmentPath);
+        if (hasGeometry)
+            geometryCode = resolveIncludes(geometryCode, geometryPath);
+        // 2. a family compiles the permutations it is asked for; a plain shader has only the one
+        if (features.empty())
+            queue(0);
+        else
+            buildFallback();
     }
+    // link the fallback of a family, blocking; see fallback
     // ------------------------------------------------------------------------
-    void setInt(const std::string& name, int value) const
+    void buildFallback()
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        static const char* fallbackFragment =
+            "#version 330 core\n"
+            "out vec4 FragColor;\n"
+            "void main()\n"
+            "{\n"
+            "    FragColor = vec4(0.5, 0.5, 0.5, 1.0);\n"
+            "}\n";
+        fallback.features = 0;
+        fallback.stages[0] = fallback.stages[1] = fallback.stages[2] = 0;
+        fallback.start = std::chrono::steady_clock::now();
+        compile(fallback, inject(vertexCode, 0), fallbackFragment, std::string());
+        finish(fallback, true);
     }
+    // issue the compile and link of one permutation without waiting for them,
+    // or load the binary a previous run stored for its sources
     // ------------------------------------------------------------------------
-    void setFloat(const std::string& name, float value) const
+    void compile(Permutation& permutation, const std::string& vertexCode, const std::string& fragmentCode, const std::string& geometryCode)
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        std::vector<std::string> source = { vertexCode, fragmentCode, geometryCode };
+        permutation.ID = ProgramCache::shared().begin(source, [&](unsigned int program)
+        {
+            const char* vShaderCode = vertexCode.c_str();
+            const char* fShaderCode = fragmentCode.c_str();
+            unsigned int vertex, fragment;
+            // vertex shader
+            vertex = glCreateShader(GL_VERTEX_SHADER);
+            glShaderSource(vertex, 1, &vShaderCode, NULL);
+            glCompileShader(vertex);
+            // fragment Shader
+            fragment = glCreateShader(GL_FRAGMENT_SHADER);
+            glShaderSource(fragment, 1, &fShaderCode, NULL);
+            glCompileShader(fragment);
+            // if geometry shader is given, compile geometry shader
+            unsigned int geometry = 0;
+            if (!geometryCode.empty())
+            {
+                const char* gShaderCode = geometryCode.c_str();
+                geometry = glCreateShader(GL_GEOMETRY_SHADER);
+                glShaderSource(geometry, 1, &gShaderCode, NULL);
+                glCompileShader(geometry);
+            }
+            // shader Program; compile and link status are only asked for in finish(),
+            // so the driver can work on several programs at once
+            glAttachShader(program, vertex);
+            glAttachShader(program, fragment);
+            if (geometry)
+                glAttachShader(program, geometry);
+            glLinkProgram(program);
+            permutation.stages[0] = vertex;
+            permutation.stages[1] = fragment;
+            permutation.stages[2] = geometry;
+        });
     }
+    // check, reflect and hand out a permutation once its link is done; without wait,
+    // returns false while the driver is still working on it (or could only tell by blocking)
     // ------------------------------------------------------------------------
-    void setVec2(const std::string& name, const glm::vec2& value) const
+    bool finish(Permutation& permutation, bool wait)
     {
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
-    }
-    void setVec2(const std::string& name, float x, float y) const
-    {
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+        if (permutation.ready)
+            return true;
+        if (!wait)
+        {
+            if (!parallelShaderCompile())
+                return false;
+            GLint done = GL_FALSE;
+            glGetProgramiv(permutation.ID, GL_COMPLETION_STATUS_KHR, &done);
+            if (!done)
+                return false;
+        }
+        ProgramCache::shared().finish(permutation.ID);
+        const char* stageNames[3] = { "VERTEX", "FRAGMENT", "GEOMETRY" };
+        for (int i = 0; i < 3; i++)
+            if (permutation.stages[i])
+            {
+                checkCompileErrors(permutation.stages[i], stageNames[i]);
+                // delete the shaders as they're linked into our program now and no longer necessery
+                glDeleteShader(permutation.stages[i]);
+                permutation.stages[i] = 0;
+            }
+        checkCompileErrors(permutation.ID, "PROGRAM");
+        reflectUniforms(permutation);
+        for (size_t i = 0; i < blockBindings.size(); i++)
+            bindBlock(permutation.ID, blockBindings[i].first, blockBindings[i].second);
+        permutation.ready = true;
+        if (!features.empty() && &permutation != &fallback)
+        {
+            std::cout << "Shader: permutation";
+            for (size_t i = 0; i < features.size(); i++)
+                std::cout << " " << features[i].name << "=" << features[i].value(permutation.features);
+            std::cout << " ready in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - permutation.start).count() * 1000.0
+                << " ms, " << permutations.size() - getPendingNum() << " of " << permutations.size() << " permutations ready" << std::endl;
+        }
+        return true;
     }
+    // "#define name value" for every feature field, placed after the #version line
     // ------------------------------------------------------------------------
-    void setVec3(const std::string& name, const glm::vec3& value) const
+    std::string inject(const std::string& code, unsigned int featureMask) const
     {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
-    }
-    void setVec3(const std::string& name, float x, float y, float z) const
-    {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+        return ShaderFeature::inject(features, code, featureMask);
     }
+    // the permutation for a feature bitmask, its compile started if this is the first time it is asked for
     // ------------------------------------------------------------------------
-    void setVec4(const std::string& name, const glm::vec4& value) const
-    {
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
-    }
-    void setVec4(const std::string& name, float x, float y, float z, float w)
+    Permutation& queue(unsigned int featureMask)
     {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+        std::unordered_map<unsigned int, Permutation>::iterator it = permutations.find(featureMask);
+        if (it != permutations.end())
+            return it->second;
+        Permutation& permutation = permutations[featureMask];
+        permutation.features = featureMask;
+        permutation.ready = false;
+        permutation.stages[0] = permutation.stages[1] = permutation.stages[2] = 0;
+        permutation.start = std::chrono::steady_clock::now();
+        compile(permutation, inject(vertexCode, featureMask), inject(fragmentCode, featureMask), inject(geometryCode, featureMask));
+        // a program loaded from a binary is linked already
+        if (!ProgramCache::shared().isPending(permutation.ID))
+            finish(permutation, true);
+        return permutation;
     }
+    // make the permutation for a feature bitmask current if it is linked
     // ------------------------------------------------------------------------
-    void setMat2(const std::string& name, const glm::mat2& mat) const
+    void select(unsigned int featureMask)
     {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        if (current && current != &fallback && current->features == featureMask)
+            return;
+        Permutation* permutation = &queue(featureMask);
+        // without parallel compile there is no asking the driver without blocking, so wait for the program
+        if (!finish(*permutation, !parallelShaderCompile()))
+        {
+            if (current && current->ready)
+                permutation = current;
+            else if (fallback.ready)
+                permutation = &fallback;
+            else
+                finish(*permutation, true);
+        }
+        current = permutation;
+        ID = current->ID;
     }
-    // ------------------------------------------------------------------------
-    void setMat3(const std::string& name, const glm::mat3& mat) const
+
+    void addUniform(Permutation& permutation, const std::string& name, GLenum type)
     {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        GLint location = glGetUniformLocation(permutation.ID, name.c_str());
+        if (location < 0)
+            return;
+        Uniform uniform;
+        uniform.name = name;
+        uniform.location = location;
+        uniform.type = type;
+        uniform.shadow = &permutation.shadows[location];
+        unsigned int hash = uniformHash(name.c_str());
+        typedef std::unordered_multimap<unsigned int, Uniform>::iterator Iterator;
+        std::pair<Iterator, Iterator> range = permutation.uniforms.equal_range(hash);
+        for (Iterator it = range.first; it != range.second; ++it)
+            if (it->second.name == name)
+                return;
+        permutation.uniforms.insert(std::make_pair(hash, uniform));
     }
+    // record every active uniform; arrays of basic types also get each element "name[i]" and their bare name
     // ------------------------------------------------------------------------
-    void setMat4(const std::string& name, const glm::mat4& mat) const
+    void reflectUniforms(Permutation& permutation)
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(permutation.ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(permutation.ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::string buffer(maxLength > 0 ? maxLength : 1, '\0');
+        for (GLint i = 0; i < count; i++)
+        {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(permutation.ID, i, (GLsizei)buffer.size(), &length, &size, &type, &buffer[0]);
+            std::string name(buffer.c_str(), length);
+            addUniform(permutation, name, type);
+            if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+            {
+                std::string base = name.substr(0, name.size() - 3);
+                addUniform(permutation, base, type);
+                for (GLint e = 1; e < size; e++)
+                    addUniform(permutation, base + "[" + std::to_string(e) + "]", type);
+            }
+        }
     }
 
-private:
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
     void checkCompileErrors(GLuint shader, std::string type)
@@ -0,0 +1,13 @@
+#version 330 core
+// tiles the visible fragments of a tiled surface need: tile x, tile y, level, 1
+out uvec4 FragColor;
+
+in vec2 TexCoords;
+
+#include "tiled.glsl"
+
+void main()
+{
+    int level = TileLevel(TexCoords);
+    FragColor = uvec4(uvec2(TileAt(TexCoords, level)), uint(level), 1u);
+}
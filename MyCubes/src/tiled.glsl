@@ -0,0 +1,34 @@
+// tiled texture lookup through the page table into the page pool (TiledTexture in tiled_texture.h)
+uniform usampler2D tilePageTable;
+uniform sampler2D tilePool;
+// texels of level 0, texels per tile without the border, levels, level of detail bias
+uniform vec2 tileImageSize;
+uniform float tileSize;
+uniform float tileLevelNum;
+uniform float tileLodBias;
+
+// level the texture coordinates would sample at this fragment's footprint
+int TileLevel(vec2 uv)
+{
+    vec2 texel = uv * tileImageSize;
+    vec2 dx = dFdx(texel), dy = dFdy(texel);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) + tileLodBias;
+    return int(clamp(floor(lod), 0.0, tileLevelNum - 1.0));
+}
+
+// tile of a level covering the texture coordinates, which repeat
+ivec2 TileAt(vec2 uv, int level)
+{
+    return ivec2(fract(uv) * tileImageSize / exp2(float(level)) / tileSize);
+}
+
+vec3 TiledTexel(vec2 uv)
+{
+    int level = TileLevel(uv);
+    uvec4 entry = texelFetch(tilePageTable, TileAt(uv, level), level);
+    // the finest resident level, entry.z, may be coarser than the one asked for
+    vec2 pos = fract(uv) * tileImageSize / exp2(float(entry.z));
+    vec2 local = pos - floor(pos / tileSize) * tileSize;
+    vec2 texel = vec2(entry.xy) * (tileSize + 2.0) + 1.0 + local;
+    return textureLod(tilePool, texel / vec2(textureSize(tilePool, 0)), 0.0).rgb;
+}
@@ -0,0 +1,946 @@
+// Tiled Textures
+// Streams very large textures in fixed-size tiles into a page pool, driven by the tiles the visible fragments need
+
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include "texture_mipmap.h"
+
+// texels per tile side, without the border of one texel around every tile
+#define TILED_TEXTURE_TILE_SIZE 128
+// pages per side of the pool; at most 255, the page table holds 8-bit page coordinates
+#define TILED_TEXTURE_POOL_SIDE 16
+// the feedback pass renders at 1 / TILED_TEXTURE_FEEDBACK_SCALE of the frame size
+#define TILED_TEXTURE_FEEDBACK_SCALE 8
+#define TILED_TEXTURE_MAX_IN_FLIGHT 64
+#define TILED_TEXTURE_UPLOADS_PER_FRAME 16
+#define TILED_TEXTURE_LOADER_THREADS 2
+#define TILED_TEXTURE_MAGIC 0x53454C54u
+#define TILED_TEXTURE_VERSION 1
+
+/**********************************************************************************\
+*
+* A .tiles file holds a header and every mip level of an image cut into tiles of
+* TILED_TEXTURE_TILE_SIZE texels, each stored with a one-texel border copied from
+* its neighbours (clamped at the image edge) as (size + 2)^2 RGBA8 texels. Levels
+* halve, rounding up, until a level fits in one tile. Tiles are stored level by
+* level, rows top to bottom as in the source, so a tile's offset is its index.
+* The builder takes the source one row at a time and keeps a band of one tile
+* row per level, each level filtered from the rows of the level above in linear
+* light, so a binary PPM of any size is converted without being held in memory.
+*
+* At run time the resident tiles live in the pages of one pool texture and a
+* page table, one RGBA8UI texel per tile and a mip level per level, maps each
+* tile to the page of the finest resident tile covering it: its own, or an
+* ancestor's with the level in z. The single tile of the last level is loaded
+* when the file is opened and never evicted, so every lookup finds a page and
+* the texture sharpens as the finer tiles arrive.
+*
+* A feedback pass renders the tiled surfaces at a fraction of the frame size and
+* writes the tile and level each fragment would sample; it is read back through
+* pixel buffers a frame later without stalling. The requested tiles that are not
+* resident, with the ancestors they fall back to, are queued coarsest level
+* first, then by how many fragments asked for them; requests not yet started are
+* replaced by the next feedback. Loader threads read the tiles from the file and
+* update() uploads a few per frame into free pages, or else into the page used
+* least recently that the last feedback did not ask for; no more tiles are read
+* than there are such pages, so a pool smaller than the view does not thrash.
+*
+* Memory stays at the pool, the page table (4 bytes a tile) and the tiles in
+* flight, whatever the size of the source.
+*
+\**********************************************************************************/
+
+namespace TiledTexture
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Header
+    {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int width;
+        unsigned int height;
+        unsigned int tileSize;
+        unsigned int levelNum;
+    };
+
+    // One level of the tile pyramid; tiles are counted from the first tile of level 0
+    struct Level
+    {
+        int width;
+        int height;
+        int tilesX;
+        int tilesY;
+        int firstTile;
+    };
+
+    inline std::vector<Level> levelsOf(int _width, int _height, int _tileSize)
+    {
+        std::vector<Level> levels;
+        int firstTile = 0;
+        while (true)
+        {
+            Level level = { _width, _height, (_width + _tileSize - 1) / _tileSize, (_height + _tileSize - 1) / _tileSize, firstTile };
+            levels.push_back(level);
+            firstTile += level.tilesX * level.tilesY;
+            if (level.tilesX == 1 && level.tilesY == 1) break;
+            _width = (_width + 1) / 2;
+            _height = (_height + 1) / 2;
+        }
+        return levels;
+    }
+
+    inline size_t tileBytes(int _tileSize) { return (size_t)(_tileSize + 2) * (_tileSize + 2) * 4; }
+
+    inline std::streamoff tileOffset(int _tile, int _tileSize) { return (std::streamoff)sizeof(Header) + (std::streamoff)_tile * tileBytes(_tileSize); }
+
+    // Writes a .tiles file from rows of RGBA8 texels given top to bottom
+    class Builder
+    {
+    private:
+        struct LevelState
+        {
+            Level level;
+            // rows bandStart - 1 .. bandStart + tileSize, the rows the tiles of one tile row cover with their borders
+            std::vector<unsigned char> band;
+            int bandStart;
+            int rowNum;
+            // linear row waiting for the row below it, to be filtered into the next level
+            std::vector<float> pending;
+        };
+
+        std::ofstream file;
+        int tileSize;
+        std::vector<LevelState> state;
+        std::vector<unsigned char> tile;
+        unsigned long long tileNum;
+
+        unsigned char * bandRow(LevelState & _state, int _slot) { return &_state.band[(size_t)_slot * _state.level.width * 4]; }
+
+        void writeBand(LevelState & _state)
+        {
+            const Level & level = _state.level;
+            int ty = _state.bandStart / tileSize;
+            int side = tileSize + 2;
+            for (int tx = 0; tx < level.tilesX; tx++)
+            {
+                for (int row = 0; row < side; row++)
+                {
+                    const unsigned char * src = bandRow(_state, row);
+                    unsigned char * dst = &tile[(size_t)row * side * 4];
+                    for (int col = 0; col < side; col++)
+                    {
+                        int x = std::min(std::max(tx * tileSize - 1 + col, 0), level.width - 1);
+                        memcpy(dst + col * 4, src + x * 4, 4);
+                    }
+                }
+                file.seekp(tileOffset(level.firstTile + ty * level.tilesX + tx, tileSize));
+                file.write((const char *)tile.data(), tile.size());
+                tileNum++;
+            }
+        }
+
+        // 2x2 box in linear light; the last row and column of an odd level are repeated
+        void reduce(int _levelIndex, const std::vector<float> & _upper, const std::vector<float> & _lower)
+        {
+            int width = state[_levelIndex].level.width;
+            int toWidth = state[_levelIndex + 1].level.width;
+            const unsigned char * encode = TextureMipmap::encodeTable();
+            std::vector<unsigned char> row((size_t)toWidth * 4);
+            for (int x = 0; x < toWidth; x++)
+            {
+                int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                for (int c = 0; c < 4; c++)
+                {
+                    float value = 0.25f * (_upper[x0 * 4 + c] + _upper[x1 * 4 + c] + _lower[x0 * 4 + c] + _lower[x1 * 4 + c]);
+                    value = std::min(1.0f, std::max(0.0f, value));
+                    row[x * 4 + c] = c == 3 ? (unsigned char)(value * 255.0f + 0.5f) : encode[(int)(value * (TEXTURE_MIPMAP_ENCODE_SIZE - 1) + 0.5f)];
+                }
+            }
+            addRow(_levelIndex + 1, row.data());
+        }
+
+        void addRow(int _levelIndex, const unsigned char * _rgba)
+        {
+            LevelState & cur = state[_levelIndex];
+            const Level & level = cur.level;
+            int y = cur.rowNum++;
+            size_t pitch = (size_t)level.width * 4;
+            memcpy(bandRow(cur, y - cur.bandStart + 1), _rgba, pitch);
+            if (y == 0) memcpy(bandRow(cur, 0), _rgba, pitch);
+            // a band is complete with the first row of the next one, or at the last row, repeated below
+            while (cur.bandStart < level.height && (y == cur.bandStart + tileSize || y == level.height - 1))
+            {
+                for (int slot = y - cur.bandStart + 2; slot <= tileSize + 1; slot++)
+                    memcpy(bandRow(cur, slot), bandRow(cur, y - cur.bandStart + 1), pitch);
+                writeBand(cur);
+                memcpy(bandRow(cur, 0), bandRow(cur, tileSize), pitch);
+                memcpy(bandRow(cur, 1), bandRow(cur, tileSize + 1), pitch);
+                cur.bandStart += tileSize;
+                if (y < cur.bandStart) break;
+            }
+
+            if (_levelIndex + 1 == state.size()) return;
+            const float * decode = TextureMipmap::decodeTable();
+            std::vector<float> linear(pitch);
+            for (size_t i = 0; i < pitch; i++)
+                linear[i] = (i & 3) == 3 ? _rgba[i] / 255.0f : decode[_rgba[i]];
+            if (cur.pending.empty() && y < level.height - 1)
+                cur.pending.swap(linear);
+            else if (cur.pending.empty())
+                reduce(_levelIndex, linear, linear);
+            else
+            {
+                std::vector<float> upper;
+                upper.swap(cur.pending);
+                reduce(_levelIndex, upper, linear);
+            }
+        }
+
+    public:
+        Builder() : tileSize(TILED_TEXTURE_TILE_SIZE), tileNum(0) {}
+
+        bool begin(const std::string & _path, int _width, int _height, int _tileSize = TILED_TEXTURE_TILE_SIZE)
+        {
+            if (_width <= 0 || _height <= 0 || _tileSize <= 0) return false;
+            file.open(_path, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) return false;
+            tileSize = _tileSize;
+            tileNum = 0;
+            std::vector<Level> levels = levelsOf(_width, _height, tileSize);
+            state.clear();
+            for (int i = 0; i < levels.size(); i++)
+            {
+                LevelState cur;
+                cur.level = levels[i];
+                cur.band.resize((size_t)(tileSize + 2) * levels[i].width * 4);
+                cur.bandStart = 0;
+                cur.rowNum = 0;
+                state.push_back(cur);
+            }
+            tile.resize(tileBytes(tileSize));
+            Header header = { TILED_TEXTURE_MAGIC, TILED_TEXTURE_VERSION, (unsigned int)_width, (unsigned int)_height, (unsigned int)tileSize, (unsigned int)levels.size() };
+            file.write((const char *)&header, sizeof(header));
+            return file.good();
+        }
+
+        // The next row of level 0, width RGBA8 texels
+        void addRow(const unsigned char * _rgba)
+        {
+            if (!state.empty() && state[0].rowNum < state[0].level.height)
+                addRow(0, _rgba);
+        }
+
+        // True once every row was given and every tile written
+        bool finish()
+        {
+            bool complete = !state.empty();
+            for (int i = 0; i < state.size(); i++)
+                complete = complete && state[i].rowNum == state[i].level.height;
+            file.close();
+            state.clear();
+            return complete && !file.fail();
+        }
+
+        unsigned int getLevelNum() const { return state.size(); }
+        unsigned long long getTileNum() const { return tileNum; }
+    };
+
+    // Converts a binary PPM (P6, 8 bits) a row at a time, for sources too large to decode whole
+    inline bool buildFromPPM(const std::string & _source, const std::string & _path, std::ostream & out, int _tileSize = TILED_TEXTURE_TILE_SIZE)
+    {
+        Clock::time_point start = Clock::now();
+        std::ifstream in(_source, std::ios::binary);
+        std::string magic;
+        int width = 0, height = 0, maxValue = 0;
+        in >> magic;
+        // comments may follow any field of the header
+        for (int field = 0; field < 3 && in; field++)
+        {
+            in >> std::ws;
+            while (in.peek() == '#')
+            {
+                std::string comment;
+                std::getline(in, comment);
+                in >> std::ws;
+            }
+            in >> (field == 0 ? width : field == 1 ? height : maxValue);
+        }
+        in.get();
+        if (!in || magic != "P6" || maxValue != 255)
+        {
+            out << "Tiled texture: " << _source << " is not an 8-bit binary PPM" << std::endl;
+            return false;
+        }
+        Builder builder;
+        if (!builder.begin(_path, width, height, _tileSize))
+        {
+            out << "Tiled texture: failed to write " << _path << std::endl;
+            return false;
+        }
+        unsigned int levelNum = builder.getLevelNum();
+        std::vector<unsigned char> rgb((size_t)width * 3), rgba((size_t)width * 4);
+        for (int y = 0; y < height && in.read((char *)rgb.data(), rgb.size()); y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                rgba[x * 4 + 0] = rgb[x * 3 + 0];
+                rgba[x * 4 + 1] = rgb[x * 3 + 1];
+                rgba[x * 4 + 2] = rgb[x * 3 + 2];
+                rgba[x * 4 + 3] = 255;
+            }
+            builder.addRow(rgba.data());
+        }
+        unsigned long long tileNum = builder.getTileNum();
+        if (!builder.finish())
+        {
+            out << "Tiled texture: " << _source << " ended early or " << _path << " could not be written" << std::endl;
+            return false;
+        }
+        out << "Tiled texture: " << _source << " (" << width << " x " << height << ") -> " << _path << ", " << levelNum << " levels, "
+            << tileNum << " tiles in " << std::chrono::duration<double>(Clock::now() - start).count() << " s" << std::endl;
+        return true;
+    }
+
+    class Texture
+    {
+    private:
+        struct Page
+        {
+            // tile held, -1 for a free page
+            int tile;
+            unsigned long long lastUse;
+            // the last level's tile, which every lookup falls back to and is never evicted
+            bool pinned;
+        };
+
+        struct Loaded
+        {
+            int tile;
+            std::vector<unsigned char> texels;
+        };
+
+        std::string path;
+        Header header;
+        std::vector<Level> level;
+        // page of each tile, -1 when it is not resident
+        std::vector<int> tilePage;
+        // CPU copy of the page table, RGBA8 per tile: page x, page y, level mapped, 255
+        std::vector<std::vector<unsigned char> > table;
+        std::vector<glm::ivec4> dirty;
+        std::vector<Page> page;
+        int poolSide;
+        GLuint pool;
+        GLuint pageTable;
+
+        // feedback target, read back through pixel buffers a frame later
+        GLuint feedbackFramebuffer;
+        GLuint feedbackColor;
+        GLuint feedbackDepth;
+        GLuint feedbackBuffer[2];
+        GLsync feedbackFence[2];
+        int feedbackWidth;
+        int feedbackHeight;
+        int feedbackNext;
+        GLint savedFramebuffer;
+        GLint savedViewport[4];
+        unsigned long long frame;
+
+        // loader threads; the queue holds the requests not started yet
+        std::vector<std::thread> loader;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<int> queue;
+        std::vector<Loaded> done;
+        bool stopping;
+        // tiles queued or being read, with the time they were requested
+        std::unordered_map<int, Clock::time_point> inFlight;
+
+        unsigned long long feedbackNum;
+        unsigned long long requestNum;
+        unsigned long long missNum;
+        unsigned long long loadNum;
+        unsigned long long evictNum;
+        unsigned long long dropNum;
+        // feedbacks that asked for more tiles than the pool could take
+        unsigned long long saturatedNum;
+        unsigned long long readBytes;
+        double latencySum;
+        double latencyMax;
+        double feedbackTime;
+
+        int tileOf(int _level, int _x, int _y) const { return level[_level].firstTile + _y * level[_level].tilesX + _x; }
+
+        void levelOf(int _tile, int & _level, int & _x, int & _y) const
+        {
+            _level = level.size() - 1;
+            while (_level > 0 && level[_level].firstTile > _tile) _level--;
+            int index = _tile - level[_level].firstTile;
+            _x = index % level[_level].tilesX;
+            _y = index / level[_level].tilesX;
+        }
+
+        // Page table entries under a tile whose residency changed, from the tile down to level 0
+        void remap(int _level, int _x, int _y)
+        {
+            for (int l = _level; l >= 0; l--)
+            {
+                int shift = _level - l;
+                int x0 = _x << shift, y0 = _y << shift;
+                int x1 = std::min(level[l].tilesX, (_x + 1) << shift), y1 = std::min(level[l].tilesY, (_y + 1) << shift);
+                for (int y = y0; y < y1; y++)
+                    for (int x = x0; x < x1; x++)
+                    {
+                        unsigned char * entry = &table[l][((size_t)y * level[l].tilesX + x) * 4];
+                        int p = tilePage[tileOf(l, x, y)];
+                        if (p >= 0)
+                        {
+                            entry[0] = (unsigned char)(p % poolSide);
+                            entry[1] = (unsigned char)(p / poolSide);
+                            entry[2] = (unsigned char)l;
+                            entry[3] = 255;
+                        }
+                        else if (l + 1 < level.size())
+                            memcpy(entry, &table[l + 1][((size_t)(y / 2) * level[l + 1].tilesX + x / 2) * 4], 4);
+                    }
+                glm::ivec4 & rect = dirty[l];
+                if (rect.z <= rect.x)
+                    rect = glm::ivec4(x0, y0, x1, y1);
+                else
+                    rect = glm::ivec4(std::min(rect.x, x0), std::min(rect.y, y0), std::max(rect.z, x1), std::max(rect.w, y1));
+            }
+        }
+
+        void uploadTable()
+        {
+            glBindTexture(GL_TEXTURE_2D, pageTable);
+            for (int l = 0; l < level.size(); l++)
+            {
+                glm::ivec4 & rect = dirty[l];
+                if (rect.z <= rect.x) continue;
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, level[l].tilesX);
+                glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect.x);
+                glPixelStorei(GL_UNPACK_SKIP_ROWS, rect.y);
+                glTexSubImage2D(GL_TEXTURE_2D, l, rect.x, rect.y, rect.z - rect.x, rect.w - rect.y, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, table[l].data());
+                rect = glm::ivec4(0);
+            }
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        bool readTile(std::ifstream & _file, int _tile, std::vector<unsigned char> & _texels) const
+        {
+            _texels.resize(tileBytes(header.tileSize));
+            _file.seekg(tileOffset(_tile, header.tileSize));
+            return (bool)_file.read((char *)_texels.data(), _texels.size());
+        }
+
+        void load()
+        {
+            std::ifstream file(path, std::ios::binary);
+            while (true)
+            {
+                int tile;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&]() { return stopping || !queue.empty(); });
+                    if (stopping) return;
+                    tile = queue.front();
+                    queue.pop_front();
+                }
+                Loaded loaded;
+                loaded.tile = tile;
+                if (!readTile(file, tile, loaded.texels))
+                {
+                    file.clear();
+                    loaded.texels.clear();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                done.push_back(std::move(loaded));
+            }
+        }
+
+        // Place a tile in a free page, else in the least recently used one the last feedback did not ask for
+        bool place(int _tile, const std::vector<unsigned char> & _texels)
+        {
+            int best = -1;
+            for (int p = 0; p < page.size(); p++)
+            {
+                if (page[p].tile < 0)
+                {
+                    best = p;
+                    break;
+                }
+                if (!page[p].pinned && page[p].lastUse < frame && (best < 0 || page[p].lastUse < page[best].lastUse))
+                    best = p;
+            }
+            if (best < 0) return false;
+
+            int l, x, y;
+            if (page[best].tile >= 0)
+            {
+                int evicted = page[best].tile;
+                tilePage[evicted] = -1;
+                levelOf(evicted, l, x, y);
+                remap(l, x, y);
+                evictNum++;
+            }
+            int side = header.tileSize + 2;
+            glBindTexture(GL_TEXTURE_2D, pool);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, (best % poolSide) * side, (best / poolSide) * side, side, side, GL_RGBA, GL_UNSIGNED_BYTE, _texels.data());
+            glBindTexture(GL_TEXTURE_2D, 0);
+            page[best].tile = _tile;
+            page[best].lastUse = frame;
+            tilePage[_tile] = best;
+            levelOf(_tile, l, x, y);
+            remap(l, x, y);
+            return true;
+        }
+
+        // Turn one frame of feedback into requests for the missing tiles
+        void request(const unsigned short * _texels)
+        {
+            std::unordered_map<int, unsigned int> count;
+            for (int i = 0; i < feedbackWidth * feedbackHeight; i++)
+            {
+                const unsigned short * texel = _texels + i * 4;
+                if (texel[3] == 0) continue;
+                int l = std::min<int>(texel[2], level.size() - 1);
+                int x = std::min<int>(texel[0], level[l].tilesX - 1);
+                int y = std::min<int>(texel[1], level[l].tilesY - 1);
+                count[tileOf(l, x, y)]++;
+            }
+            std::unordered_map<int, unsigned int> wanted;
+            for (std::unordered_map<int, unsigned int>::iterator it = count.begin(); it != count.end(); ++it)
+            {
+                requestNum++;
+                if (tilePage[it->first] < 0) missNum++;
+                // a tile's ancestors are what it falls back to until it arrives
+                int l, x, y;
+                levelOf(it->first, l, x, y);
+                for (; l < level.size(); l++, x /= 2, y /= 2)
+                    wanted[tileOf(l, x, y)] += it->second;
+            }
+
+            std::vector<std::pair<int, unsigned int> > missing;
+            for (std::unordered_map<int, unsigned int>::iterator it = wanted.begin(); it != wanted.end(); ++it)
+            {
+                int p = tilePage[it->first];
+                if (p >= 0)
+                {
+                    if (!page[p].pinned) page[p].lastUse = frame;
+                }
+                else
+                    missing.push_back(*it);
+            }
+            // coarsest level first, then the most fragments
+            std::sort(missing.begin(), missing.end(), [this](const std::pair<int, unsigned int> & a, const std::pair<int, unsigned int> & b)
+            {
+                int la, lb, x, y;
+                levelOf(a.first, la, x, y);
+                levelOf(b.first, lb, x, y);
+                if (la != lb) return la > lb;
+                return a.second > b.second;
+            });
+
+            // a tile is only worth reading if a page can take it: free, or not asked for by this feedback
+            int replaceable = 0;
+            for (int p = 0; p < page.size(); p++)
+                if (page[p].tile < 0 || (!page[p].pinned && page[p].lastUse < frame))
+                    replaceable++;
+            if (missing.size() > replaceable) saturatedNum++;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            // requests still waiting give way to what this frame needs
+            for (int i = 0; i < queue.size(); i++)
+                inFlight.erase(queue[i]);
+            queue.clear();
+            size_t limit = std::min<size_t>(TILED_TEXTURE_MAX_IN_FLIGHT, replaceable);
+            for (int i = 0; i < missing.size() && inFlight.size() < limit; i++)
+                if (inFlight.find(missing[i].first) == inFlight.end())
+                {
+                    inFlight[missing[i].first] = Clock::now();
+                    queue.push_back(missing[i].first);
+                }
+            wake.notify_all();
+        }
+
+    public:
+        Texture()
+            : poolSide(0)
+            , pool(0)
+            , pageTable(0)
+            , feedbackFramebuffer(0)
+            , feedbackColor(0)
+            , feedbackDepth(0)
+            , feedbackWidth(0)
+            , feedbackHeight(0)
+            , feedbackNext(0)
+            , savedFramebuffer(0)
+            , frame(0)
+            , stopping(false)
+        {
+            feedbackBuffer[0] = feedbackBuffer[1] = 0;
+            feedbackFence[0] = feedbackFence[1] = 0;
+            savedViewport[0] = savedViewport[1] = savedViewport[2] = savedViewport[3] = 0;
+            resetStatistics();
+        }
+        ~Texture() { destroy(); }
+
+        // Open a .tiles file, create the pool, page table and feedback target, and load the last level
+        bool open(const std::string & _path, int _frameWidth, int _frameHeight, int _poolSide = TILED_TEXTURE_POOL_SIDE)
+        {
+            destroy();
+            std::ifstream file(_path, std::ios::binary);
+            if (!file.read((char *)&header, sizeof(header)) || header.magic != TILED_TEXTURE_MAGIC || header.version != TILED_TEXTURE_VERSION
+                || header.width == 0 || header.height == 0 || header.tileSize == 0)
+            {
+                std::cout << "Tiled texture: " << _path << " is not a tiled texture file" << std::endl;
+                return false;
+            }
+            path = _path;
+            level = levelsOf(header.width, header.height, header.tileSize);
+            if (level.size() != header.levelNum)
+            {
+                std::cout << "Tiled texture: " << _path << " has " << header.levelNum << " levels, expected " << level.size() << std::endl;
+                return false;
+            }
+            GLint maxSize = 0;
+            glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+            int side = header.tileSize + 2;
+            poolSide = std::max(1, std::min(std::min(_poolSide, 255), (int)maxSize / side));
+
+            int tileNum = level.back().firstTile + 1;
+            tilePage.assign(tileNum, -1);
+            page.assign(poolSide * poolSide, Page());
+            for (int p = 0; p < page.size(); p++)
+            {
+                page[p].tile = -1;
+                page[p].lastUse = 0;
+                page[p].pinned = false;
+            }
+            table.resize(level.size());
+            dirty.assign(level.size(), glm::ivec4(0));
+            for (int l = 0; l < level.size(); l++)
+                table[l].assign((size_t)level[l].tilesX * level[l].tilesY * 4, 0);
+
+            glGenTextures(1, &pool);
+            glBindTexture(GL_TEXTURE_2D, pool);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, poolSide * side, poolSide * side, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+            // level l has ceil(tilesX / 2^l) tiles; a power of two wide level 0 gives GL's mip chain room for every one
+            int tableWidth = 1, tableHeight = 1;
+            while (tableWidth < level[0].tilesX) tableWidth *= 2;
+            while (tableHeight < level[0].tilesY) tableHeight *= 2;
+            glGenTextures(1, &pageTable);
+            glBindTexture(GL_TEXTURE_2D, pageTable);
+            for (int l = 0; l < level.size(); l++)
+                glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA8UI, std::max(1, tableWidth >> l), std::max(1, tableHeight >> l), 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level.size() - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glBindTexture(GL_TEXTURE_2D, 0);
+
+            // pixel buffers stay bound across frames elsewhere (the texture stream), not while the pool is written
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            std::vector<unsigned char> texels;
+            if (!readTile(file, level.back().firstTile, texels))
+            {
+                std::cout << "Tiled texture: " << _path << " is truncated" << std::endl;
+                destroy();
+                return false;
+            }
+            frame = 1;
+            place(level.back().firstTile, texels);
+            page[tilePage[level.back().firstTile]].pinned = true;
+            loadNum++;
+            readBytes += texels.size();
+            for (int l = 0; l < level.size(); l++)
+                dirty[l] = glm::ivec4(0, 0, level[l].tilesX, level[l].tilesY);
+            uploadTable();
+
+            feedbackWidth = std::max(1, _frameWidth / TILED_TEXTURE_FEEDBACK_SCALE);
+            // the bias is checked against the first frame size beginFeedback() sees
+            savedViewport[2] = savedViewport[3] = 0;
+            feedbackHeight = std::max(1, _frameHeight / TILED_TEXTURE_FEEDBACK_SCALE);
+            glGenRenderbuffers(1, &feedbackColor);
+            glBindRenderbuffer(GL_RENDERBUFFER, feedbackColor);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA16UI, feedbackWidth, feedbackHeight);
+            glGenRenderbuffers(1, &feedbackDepth);
+            glBindRenderbuffer(GL_RENDERBUFFER, feedbackDepth);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight);
+            glBindRenderbuffer(GL_RENDERBUFFER, 0);
+            glGetIntegerv(GL_FRAMEBUFFER_BINDING, &savedFramebuffer);
+            glGenFramebuffers(1, &feedbackFramebuffer);
+            glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedbackColor);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth);
+            bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+            glBindFramebuffer(GL_FRAMEBUFFER, savedFramebuffer);
+            if (!complete)
+            {
+                std::cout << "Tiled texture: feedback framebuffer is not complete" << std::endl;
+                destroy();
+                return false;
+            }
+            glGenBuffers(2, feedbackBuffer);
+            for (int i = 0; i < 2; i++)
+            {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffer[i]);
+                glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)feedbackWidth * feedbackHeight * 8, NULL, GL_STREAM_READ);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+            stopping = false;
+            for (int t = 0; t < TILED_TEXTURE_LOADER_THREADS; t++)
+                loader.push_back(std::thread(&Texture::load, this));
+            std::cout << "Tiled texture: " << _path << " (" << header.width << " x " << header.height << "), " << level.size() << " levels, "
+                << tileNum << " tiles; pool of " << page.size() << " pages (" << getPoolBytes() / 1024.0 << " KB)" << std::endl;
+            return true;
+        }
+
+        bool isOpen() const { return pool != 0; }
+
+        // Render the tiled surfaces with the feedback program between these two
+        void beginFeedback()
+        {
+            glGetIntegerv(GL_FRAMEBUFFER_BINDING, &savedFramebuffer);
+            GLint frameWidth = savedViewport[2], frameHeight = savedViewport[3];
+            glGetIntegerv(GL_VIEWPORT, savedViewport);
+            if (savedViewport[2] != frameWidth || savedViewport[3] != frameHeight)
+                checkFeedbackBias();
+            glBindFramebuffer(GL_FRAMEBUFFER, feedbackFramebuffer);
+            glViewport(0, 0, feedbackWidth, feedbackHeight);
+            const GLuint none[4] = { 0, 0, 0, 0 };
+            glClearBufferuiv(GL_COLOR, 0, none);
+            glClear(GL_DEPTH_BUFFER_BIT);
+        }
+
+        void endFeedback()
+        {
+            // both buffers still waiting to be read: skip this frame's feedback rather than wait
+            if (!feedbackFence[feedbackNext])
+            {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffer[feedbackNext]);
+                glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, 0);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                feedbackFence[feedbackNext] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                feedbackNext = 1 - feedbackNext;
+            }
+            glBindFramebuffer(GL_FRAMEBUFFER, savedFramebuffer);
+            glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+        }
+
+        // Level of detail bias of the feedback pass: its pixels cover frame / feedback times as many texels,
+        // which puts its level that many binary steps above the frame's, so the bias takes them off again
+        float getFeedbackBias() const
+        {
+            return savedViewport[2] > 0 ? -std::log2((float)savedViewport[2] / feedbackWidth) : -std::log2((float)TILED_TEXTURE_FEEDBACK_SCALE);
+        }
+
+        // Level TileLevel() in tiled.glsl picks for a footprint of this many texels per pixel
+        static int footprintLevel(float _texelsPerPixel, float _bias, int _levelNum)
+        {
+            float lod = std::log2(std::max(_texelsPerPixel, 1e-4f)) + _bias;
+            return std::min(std::max((int)std::floor(lod), 0), _levelNum - 1);
+        }
+
+        // Whether the feedback pass, with its bias, asks for the levels the frame samples; false and a warning
+        // for footprints where the two differ (a frame size that is not a multiple of the feedback size)
+        bool checkFeedbackBias() const
+        {
+            if (savedViewport[2] <= 0 || savedViewport[3] <= 0) return true;
+            float scale[2] = { (float)savedViewport[2] / feedbackWidth, (float)savedViewport[3] / feedbackHeight };
+            float bias = getFeedbackBias();
+            int mismatchNum = 0, footprintNum = 0;
+            // footprints between level boundaries, from well inside level 0 to past the last level
+            for (int step = -16; step < 4 * ((int)level.size() + 2); step++)
+            {
+                float footprint = std::exp2((step + 0.5f) / 4.0f);
+                int frameLevel = footprintLevel(footprint, 0.0f, level.size());
+                for (int axis = 0; axis < 2; axis++, footprintNum++)
+                    if (footprintLevel(footprint * scale[axis], bias, level.size()) != frameLevel)
+                        mismatchNum++;
+            }
+            if (mismatchNum > 0)
+                std::cout << "Tiled texture: feedback at " << feedbackWidth << " x " << feedbackHeight << " for a " << savedViewport[2] << " x " << savedViewport[3]
+                    << " frame asks for another level than the frame samples for " << mismatchNum << " of " << footprintNum << " footprints" << std::endl;
+            return mismatchNum == 0;
+        }
+
+        // Once a frame: read the feedback that is ready, queue its tiles, upload the tiles that arrived
+        void update()
+        {
+            if (!pool) return;
+            frame++;
+            Clock::time_point start = Clock::now();
+            // the older of the two readbacks, if the GPU is done with it
+            for (int i = 0; i < 2; i++)
+            {
+                int index = (feedbackNext + i) % 2;
+                if (!feedbackFence[index]) continue;
+                if (glClientWaitSync(feedbackFence[index], 0, 0) == GL_TIMEOUT_EXPIRED) break;
+                glDeleteSync(feedbackFence[index]);
+                feedbackFence[index] = 0;
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffer[index]);
+                const unsigned short * texels = (const unsigned short *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                    (GLsizeiptr)feedbackWidth * feedbackHeight * 8, GL_MAP_READ_BIT);
+                if (texels)
+                {
+                    request(texels);
+                    feedbackNum++;
+                }
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            }
+            feedbackTime += std::chrono::duration<double>(Clock::now() - start).count();
+
+            std::vector<Loaded> arrived;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                int num = std::min<int>(done.size(), TILED_TEXTURE_UPLOADS_PER_FRAME);
+                for (int i = 0; i < num; i++)
+                    arrived.push_back(std::move(done[i]));
+                done.erase(done.begin(), done.begin() + num);
+            }
+            if (arrived.empty()) return;
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            Clock::time_point now = Clock::now();
+            for (int i = 0; i < arrived.size(); i++)
+            {
+                Loaded & cur = arrived[i];
+                Clock::time_point requested = now;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::unordered_map<int, Clock::time_point>::iterator it = inFlight.find(cur.tile);
+                    if (it != inFlight.end())
+                    {
+                        requested = it->second;
+                        inFlight.erase(it);
+                    }
+                }
+                if (cur.texels.empty() || tilePage[cur.tile] >= 0 || !place(cur.tile, cur.texels))
+                {
+                    dropNum++;
+                    continue;
+                }
+                double latency = std::chrono::duration<double>(now - requested).count();
+                latencySum += latency;
+                latencyMax = std::max(latencyMax, latency);
+                loadNum++;
+                readBytes += cur.texels.size();
+            }
+            uploadTable();
+        }
+
+        // Pool and page table on two texture units
+        void bind(int _poolUnit, int _tableUnit) const
+        {
+            glActiveTexture(GL_TEXTURE0 + _poolUnit);
+            glBindTexture(GL_TEXTURE_2D, pool);
+            glActiveTexture(GL_TEXTURE0 + _tableUnit);
+            glBindTexture(GL_TEXTURE_2D, pageTable);
+        }
+
+        int getWidth() const { return header.width; }
+        int getHeight() const { return header.height; }
+        int getTileSize() const { return header.tileSize; }
+        int getLevelNum() const { return level.size(); }
+        size_t getPoolBytes() const { return (size_t)page.size() * tileBytes(header.tileSize); }
+        size_t getTableBytes() const { return (size_t)tilePage.size() * 4; }
+
+        int getResidentNum() const
+        {
+            int num = 0;
+            for (int p = 0; p < page.size(); p++)
+                if (page[p].tile >= 0) num++;
+            return num;
+        }
+
+        void resetStatistics()
+        {
+            feedbackNum = 0;
+            requestNum = 0;
+            missNum = 0;
+            loadNum = 0;
+            evictNum = 0;
+            dropNum = 0;
+            saturatedNum = 0;
+            readBytes = 0;
+            latencySum = 0.0;
+            latencyMax = 0.0;
+            feedbackTime = 0.0;
+        }
+
+        void report(std::ostream & out) const
+        {
+            if (!pool) return;
+            out << "Tiled texture: " << feedbackNum << " feedback frames (" << (feedbackNum ? feedbackTime * 1000.0 / feedbackNum : 0.0) << " ms each), "
+                << requestNum << " tile requests, " << missNum << " misses (" << (requestNum ? 100.0 * missNum / requestNum : 0.0) << "%), "
+                << loadNum << " loaded (" << readBytes / 1024.0 << " KB), " << evictNum << " evicted";
+            if (dropNum > 0) out << ", " << dropNum << " dropped";
+            if (saturatedNum > 0) out << ", pool too small for " << saturatedNum << " feedback frames";
+            out << std::endl << "  latency " << (loadNum ? latencySum * 1000.0 / loadNum : 0.0) << " ms average, " << latencyMax * 1000.0 << " ms max; "
+                << getResidentNum() << " / " << page.size() << " pages resident, " << (getPoolBytes() + getTableBytes()) / 1024.0 << " KB for pool and page table" << std::endl;
+        }
+
+        void destroy()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                queue.clear();
+            }
+            wake.notify_all();
+            for (int t = 0; t < loader.size(); t++)
+                loader[t].join();
+            loader.clear();
+            done.clear();
+            inFlight.clear();
+            for (int i = 0; i < 2; i++)
+                if (feedbackFence[i])
+                {
+                    glDeleteSync(feedbackFence[i]);
+                    feedbackFence[i] = 0;
+                }
+            if (feedbackBuffer[0]) glDeleteBuffers(2, feedbackBuffer);
+            if (feedbackFramebuffer) glDeleteFramebuffers(1, &feedbackFramebuffer);
+            if (feedbackColor) glDeleteRenderbuffers(1, &feedbackColor);
+            if (feedbackDepth) glDeleteRenderbuffers(1, &feedbackDepth);
+            if (pool) glDeleteTextures(1, &pool);
+            if (pageTable) glDeleteTextures(1, &pageTable);
+            feedbackBuffer[0] = feedbackBuffer[1] = 0;
+            feedbackFramebuffer = feedbackColor = feedbackDepth = 0;
+            pool = pageTable = 0;
+            tilePage.clear();
+            table.clear();
+            page.clear();
+            level.clear();
+        }
+    };
+}
@@ -0,0 +1,142 @@
+// Uniform Buffer Ring
+// Per-frame uniform blocks written once into a ring of buffer slices and bound for every program
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <glad/glad.h>
+
+#define UNIFORM_RING_FRAMES 3
+
+/**********************************************************************************\
+*
+* One buffer holds UNIFORM_RING_FRAMES slices; a slice holds every block, each at
+* an offset aligned to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT. Block i is bound to
+* binding point i, so programs attach their blocks with Shader::bindBlock.
+*
+* begin() fences the slice the previous frame used and maps the next one
+* unsynchronized, waiting only if the GPU still reads that slice from
+* UNIFORM_RING_FRAMES frames ago. write() copies a block into the mapping and
+* commit() unmaps the slice and binds its ranges; draws issued after commit()
+* read that frame's blocks.
+*
+\**********************************************************************************/
+
+namespace UniformRing
+{
+    class Ring
+    {
+    private:
+        GLuint buffer;
+        std::vector<GLsizeiptr> size;
+        std::vector<GLintptr> offset;
+        GLsizeiptr sliceSize;
+        GLsync fence[UNIFORM_RING_FRAMES];
+        int slice;
+        unsigned char* mapped;
+
+        unsigned long long frames;
+        unsigned long long waits;
+        unsigned long long byteNum;
+        unsigned long long callNum;
+
+    public:
+        Ring() : buffer(0), sliceSize(0), slice(0), mapped(nullptr)
+        {
+            std::fill(fence, fence + UNIFORM_RING_FRAMES, (GLsync)0);
+            resetStatistics();
+        }
+
+        // _size[i] is the std140 size of block i
+        void create(const std::vector<GLsizeiptr>& _size)
+        {
+            GLint alignment = 256;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+            size = _size;
+            offset.resize(size.size());
+            sliceSize = 0;
+            for (size_t i = 0; i < size.size(); i++)
+            {
+                offset[i] = sliceSize;
+                sliceSize += (size[i] + alignment - 1) / alignment * alignment;
+            }
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            glBufferData(GL_UNIFORM_BUFFER, sliceSize * UNIFORM_RING_FRAMES, NULL, GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            slice = UNIFORM_RING_FRAMES - 1;
+        }
+
+        void begin()
+        {
+            fence[slice] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            slice = (slice + 1) % UNIFORM_RING_FRAMES;
+            if (fence[slice])
+            {
+                if (glClientWaitSync(fence[slice], 0, 0) == GL_TIMEOUT_EXPIRED)
+                {
+                    waits++;
+                    while (glClientWaitSync(fence[slice], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+                        ;
+                }
+                glDeleteSync(fence[slice]);
+                fence[slice] = 0;
+            }
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, sliceSize * slice, sliceSize,
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            callNum += 2;
+        }
+
+        template <typename T>
+        void write(unsigned int block, const T& value)
+        {
+            if (!mapped || block >= size.size())
+                return;
+            memcpy(mapped + offset[block], &value, std::min<size_t>(sizeof(T), size[block]));
+            byteNum += sizeof(T);
+        }
+
+        void commit()
+        {
+            if (mapped)
+                glUnmapBuffer(GL_UNIFORM_BUFFER);
+            mapped = nullptr;
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            for (size_t i = 0; i < size.size(); i++)
+                glBindBufferRange(GL_UNIFORM_BUFFER, (GLuint)i, buffer, sliceSize * slice + offset[i], size[i]);
+            callNum += 2 + size.size();
+            frames++;
+        }
+
+        // buffer API calls made by the ring, for comparison with glUniform* calls
+        unsigned long long getCallNum() const { return callNum; }
+
+        void resetStatistics()
+        {
+            frames = waits = byteNum = callNum = 0;
+        }
+
+        void report(std::ostream& out) const
+        {
+            if (frames == 0)
+                return;
+            out << "Uniform ring: " << size.size() << " blocks, " << byteNum / frames << " bytes and "
+                << (double)callNum / frames << " buffer calls per frame, waited for the GPU in " << waits << " of " << frames << " frames" << std::endl;
+        }
+
+        void destroy()
+        {
+            for (int i = 0; i < UNIFORM_RING_FRAMES; i++)
+                if (fence[i])
+                    glDeleteSync(fence[i]);
+            std::fill(fence, fence + UNIFORM_RING_FRAMES, (GLsync)0);
+            glDeleteBuffers(1, &buffer);
+            buffer = 0;
+        }
+    };
+}